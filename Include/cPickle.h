@@ -0,0 +1,58 @@
+#ifndef Py_CPICKLE_H
+#define Py_CPICKLE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+/*
+
+  This header provides access to the cPickle pickler from C, so that
+  C code can consume the byte stream of a pickle as it's produced
+  (e.g., to hash it or to compress it) without building a Python
+  string or calling a write() method for every chunk.
+
+  Before calling any of the functions, you must initialize the
+  routines with:
+
+    PycPickle_IMPORT
+
+  This would typically be done in your init function.
+
+*/
+#define PycPickle_IMPORT \
+  PycPickle = (struct PycPickle_CAPI*)PyCObject_Import("cPickle", \
+                                                       "cPickle_CAPI")
+
+/* A sink receives the bytes of a pickle, in order, in chunks of
+   arbitrary size.  write must return 0 on success, or set an exception
+   and return -1 to abort pickling.
+
+   Sinks can be chained through next, in which case every chunk is
+   passed to each sink in the chain in turn (e.g., to feed a hash and
+   a compressor in a single pass).  Embed a sink as the first member of
+   a larger struct to keep per-sink state. */
+typedef struct PycPickle_Sink {
+  int (*write)(struct PycPickle_Sink *, const char *, Py_ssize_t);
+  struct PycPickle_Sink *next;
+} PycPickle_Sink;
+
+struct PycPickle_CAPI {
+
+ /* Pickle obj with the given protocol (-1 for the highest one) into
+    the chain of sinks starting at sink, producing exactly the same
+    bytes as cPickle.dumps(obj, protocol).  Returns 0 on success, or
+    -1 with an exception set.
+    */
+  int (*dump_to_sink)(PyObject *, int, PycPickle_Sink *);
+
+};
+
+/* cPickle.c itself defines Py_CPICKLE_MODULE before including this
+   header, since it has no use for the pointer */
+#ifndef Py_CPICKLE_MODULE
+static struct PycPickle_CAPI *PycPickle;
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_CPICKLE_H */
@@ -34,6 +34,9 @@ typedef struct {
     char pg_is_module; /* pgbovine - non-zero if this code's name is '<module>' */
     char pg_force_memoization; /* pgbovine - non-zero if we want to memoize its calls no matter what */
     char pg_no_stdout_stderr; /* pgbovine - non-zero if we don't want to record stdout/stderr buffers*/
+    PyObject *pg_global_varnames; /* pgbovine - tuple parallel to co_names of the interned global
+                                     variable names that LOAD_GLOBAL and LOAD_NAME read (see
+                                     pg_LOAD_GLOBAL_event), filled in lazily; NULL until needed */
 
     int co_firstlineno;		/* first source line number */
     PyObject *co_lnotab;	/* string (encoding addr<->lineno mapping) */
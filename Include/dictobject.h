@@ -86,6 +86,10 @@ struct _dictobject {
 	PyDictEntry *ma_table;
 	PyDictEntry *(*ma_lookup)(PyDictObject *mp, PyObject *key, long hash);
 	PyDictEntry ma_smalltable[PyDict_MINSIZE];
+
+	/* pgbovine - num_executed_func_calls when this dict was created,
+	   or 0 if unknown (see pg_about_to_MUTATE_event) */
+	unsigned PY_LONG_LONG pg_birth_time;
 };
 
 PyAPI_DATA(PyTypeObject) PyDict_Type;
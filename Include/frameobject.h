@@ -72,7 +72,7 @@ typedef struct _frame {
 
     // the 'time' when this frame started executing
     // (measured in num_executed_func_calls)
-    unsigned int start_func_call_time;
+    unsigned PY_LONG_LONG start_func_call_time;
 
     // cStringIO objects representing stdout and stderr output
     // printed by this invocation of f or any of its callees
@@ -112,6 +112,12 @@ typedef struct _frame {
     // (Optimization: remain NULL when stored_args_lst is null)
     PyObject* stored_args_lst_hash;
 
+    // non-zero if we skipped probing the on-disk cache for this call
+    // because lookups for its function have been bypassed (see
+    // should_probe_cache()), in which case we don't know whether the
+    // cache already has an entry for these arguments
+    char lookup_bypassed;
+
     /* END   - pgbovine new fields */
 
     PyTryBlock f_blockstack[CO_MAXBLOCKS]; /* for try and loop blocks */
@@ -36,6 +36,10 @@ typedef struct {
      * the list is not yet visible outside the function that builds it.
      */
     Py_ssize_t allocated;
+
+    /* pgbovine - num_executed_func_calls when PyList_New() created this
+       list, or 0 if unknown (see pg_about_to_MUTATE_event) */
+    unsigned PY_LONG_LONG pg_birth_time;
 } PyListObject;
 
 PyAPI_DATA(PyTypeObject) PyList_Type;
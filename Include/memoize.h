@@ -20,6 +20,7 @@ extern "C" {
 
 #include "Python.h"
 #include "frameobject.h"
+#include "memoize_typeclass.h"
 
 
 #define PYPRINT(obj) do {PyObject_Print(obj, stdout, 0); printf("\n");} while(0)
@@ -42,19 +43,10 @@ extern "C" {
 
 // don't try to pickle values of these types for return values and
 // global vars since it's hard to restore their state on a future
-// execution
-//
-// ORDER MATTERS for short-circuiting ... put the most commonly-occuring
-// ones first ...
+// execution (modules, code, types, files and sqlite3 cursors; see
+// compute_type_class() in memoize_typeclass.c)
 #define NEVER_PICKLE(val) \
-  (PyModule_CheckExact(val) || \
-   PyFunction_Check(val) || \
-   PyCFunction_Check(val) || \
-   PyMethod_Check(val) || \
-   PyType_CheckExact(val) || \
-   PyClass_Check(val) || \
-   PyFile_CheckExact(val) || \
-   (strcmp(Py_TYPE(val)->tp_name, "sqlite3.Cursor") == 0))
+  (TYPE_CLASS(Py_TYPE(val)) & TYPECLASS_NEVER_PICKLE)
 
 
 // initialize in pg_initialize(), destroy in pg_finalize()
@@ -64,8 +56,17 @@ PyObject* func_name_to_code_dependency;
 PyObject* cPickle_dumpstr_func;
 PyObject* cPickle_dump_func;
 PyObject* cPickle_load_func;
+PyObject* cPickle_loadstr_func;
+
+// the directory that holds all cache files (a PyString, which is
+// "incpy-cache" unless incpy.config says 'cache_dir = <path>')
+PyObject* incpy_cache_dir;
+#define INCPY_CACHE_DIR PyString_AS_STRING(incpy_cache_dir)
+
+PyObject* portable_cache_path(PyObject* path);
 
 PyObject* hexdigest_str(PyObject* s);
+PyObject* hexdigest_pickled(PyObject* obj);
 
 int obj_equals(PyObject* obj1, PyObject* obj2);
 
@@ -83,8 +84,9 @@ void pg_finalize(void);
 PyObject* pg_enter_frame(PyFrameObject* f);
 void pg_exit_frame(PyFrameObject* f, PyObject* retval);
 
-// handler for LOAD_GLOBAL(varname) --> value
-void pg_LOAD_GLOBAL_event(PyObject *varname, PyObject *value);
+// handler for LOAD_GLOBAL(varname) --> value, where varname is
+// co_names[name_index] of the code that's executing
+void pg_LOAD_GLOBAL_event(PyObject *varname, int name_index, PyObject *value);
 // handler for LOAD(object.attrname) --> value
 void pg_GetAttr_event(PyObject *object, PyObject *attrname, PyObject *value);
 
@@ -100,6 +102,15 @@ void pg_STORE_DEL_GLOBAL_event(PyObject *varname);
 // in a sequence)
 void pg_about_to_MUTATE_event(PyObject *object);
 
+// incremented every time a non-ignored function is called, and used to
+// set each frame's start_func_call_time
+extern unsigned PY_LONG_LONG num_executed_func_calls;
+
+// lists and dicts remember when they were created, so that
+// pg_about_to_MUTATE_event can tell objects created by the function
+// that's mutating them apart from ones that it might have received
+#define PG_SET_BIRTH_TIME(op) ((op)->pg_birth_time = num_executed_func_calls)
+
 // handler for BUILD_CLASS opcode
 void pg_BUILD_CLASS_event(PyObject* name, PyObject* methods_dict);
 
@@ -129,6 +140,7 @@ void pg_intercept_file_truncate(PyFileObject *f, PyObject *args);
 // intercept in Objects/codeobject.c:PyCode_New()
 int pg_ignore_code(PyCodeObject* co);
 PyObject* pg_create_canonical_code_name(PyCodeObject* co);
+PyObject* pg_relocatable_path(PyObject* filename);
 
 PyObject* canonical_name_to_filename(PyObject* func_name);
 
@@ -206,7 +218,7 @@ typedef struct {
      arg_reachable_func_start_time for x should be set to the
      start_func_call_time of foo, NOT bar, since foo is farther
      'outwards' than bar */
-  unsigned int arg_reachable_func_start_time;
+  unsigned PY_LONG_LONG arg_reachable_func_start_time;
 } obj_metadata;
 
 #ifdef HOST_IS_64BIT
@@ -239,8 +251,8 @@ level_2_map - lazy-allocate to 65536 obj_metadata elements, address with obj[15:
 void set_global_container(PyObject* obj, PyObject* global_container);
 PyObject* get_global_container(PyObject* obj);
 
-void set_arg_reachable_func_start_time(PyObject* obj, unsigned int start_func_call_time);
-unsigned int get_arg_reachable_func_start_time(PyObject* obj);
+void set_arg_reachable_func_start_time(PyObject* obj, unsigned PY_LONG_LONG start_func_call_time);
+unsigned PY_LONG_LONG get_arg_reachable_func_start_time(PyObject* obj);
 
 
 #ifdef __cplusplus
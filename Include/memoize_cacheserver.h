@@ -0,0 +1,55 @@
+/* Client for the incpy-cached cache server daemon
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+#ifndef Py_MEMOIZE_CACHESERVER_H
+#define Py_MEMOIZE_CACHESERVER_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "Python.h"
+
+
+// path of the Unix domain socket of the cache server (NULL if we
+// should always access the directory store directly)
+//
+// set from incpy.config in pg_initialize(), destroy in pg_finalize()
+extern PyObject* cache_server_socket_path;
+
+// return values of cache_server_GET()
+#define CACHE_SERVER_ERROR -1
+#define CACHE_SERVER_MISS 0
+#define CACHE_SERVER_HIT 1
+
+
+int connect_cache_server(void);
+void disconnect_cache_server(void);
+
+int cache_server_available(void);
+
+// each path is the relative path of a cache entry file, and each
+// value is the contents of that file (a pickled list of memo table
+// entries)
+int cache_server_GET(PyObject* path, PyObject** data);
+PyObject* cache_server_MGET(PyObject* paths);
+int cache_server_PUT(PyObject* path, PyObject* data);
+int cache_server_DEL(PyObject* path);
+
+// (see "Prefetching" in Python/memoize_cacheserver.c)
+void cache_server_PREFETCH(PyObject* paths);
+void cache_server_FORGET_PREFETCHED(PyObject* path);
+PyObject* cache_server_STAT(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_MEMOIZE_CACHESERVER_H */
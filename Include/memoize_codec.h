@@ -0,0 +1,62 @@
+/* Encoding of cache entries (serialization and compression)
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+#ifndef Py_MEMOIZE_CODEC_H
+#define Py_MEMOIZE_CODEC_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "Python.h"
+
+
+// values of 'compression = <mode>' in incpy.config
+#define COMPRESSION_OFF 0
+#define COMPRESSION_AUTO 1 // pick a codec for each entry (see choose_codec())
+#define COMPRESSION_LZ 2
+#define COMPRESSION_ZLIB 3
+
+extern int entry_compression_mode;
+
+int select_entry_compression(char* name);
+const char* entry_compression_name(void);
+
+#define SERIALIZER_PICKLE 0
+#define SERIALIZER_MARSHAL 1
+#define SERIALIZER_RECORD 2 // a record list (see memoize_record.c)
+#define NUM_SERIALIZERS 3
+
+// 0 if 'serializer = pickle' in incpy.config
+extern int use_marshal_serializer;
+
+int select_entry_serializer(char* name);
+
+// marshals or pickles obj (returning a new reference, or NULL with an
+// exception set), and sets *serializer to the one it used
+PyObject* serialize_value(PyObject* obj, int* serializer);
+
+// serializes a list of memo table entries (as a record list if
+// possible) in the same manner
+PyObject* serialize_cache_entry(PyObject* contents, int* serializer);
+PyObject* deserialize_cache_entry(PyObject* serialized_str, int serializer);
+
+// both return a new reference (or NULL if data can't be decoded)
+PyObject* encode_cache_entry(PyObject* serialized_str, int serializer);
+PyObject* decode_cache_entry(PyObject* data, int* serializer);
+
+// adds serialization and compression statistics to stats_dict
+void add_codec_stats(PyObject* stats_dict);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_MEMOIZE_CODEC_H */
@@ -17,9 +17,14 @@ extern "C" {
 
 #include "Python.h"
 
+// ignore docstrings and the names of locals in code dependencies?
+// (see "Normalized code dependencies" in Python/memoize_codedep.c)
+extern char normalize_code_dependencies;
+
 
 PyObject* CREATE_NEW_code_dependency(PyCodeObject* codeobj);
 int code_dependency_EQ(PyObject* codedep1, PyObject* codedep2);
+PyObject* code_dependency_digest(PyObject* codedep);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,93 @@
+/* Cost model for deciding which calls are worth memoizing
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+#ifndef Py_MEMOIZE_COSTMODEL_H
+#define Py_MEMOIZE_COSTMODEL_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "Python.h"
+#include "memoize_fmi.h"
+
+
+/* Functions that run for less than memoize_time_limit_ms are normally
+   not memoized, EXCEPT if they have been called at least
+   FREQUENT_CALL_THRESHOLD times (counting calls from previous
+   executions with the same code) and each call takes at least
+   FREQUENT_CALL_MIN_RUNTIME_MS, since then the savings can add up.
+   They still have to pass the cost model in admit_memo_table_entry().
+
+   (FREQUENT_CALL_MIN_RUNTIME_MS must be at least FAST_THRESHOLD_MS in
+    memoize.c, or else the functions that we want to admit here will
+    first get marked as likely_nothing_to_memoize.) */
+#define FREQUENT_CALL_THRESHOLD 10
+#define FREQUENT_CALL_MIN_RUNTIME_MS 50
+
+
+/* Stop probing the on-disk cache for a function once it has been
+   probed at least MIN_LOOKUPS_BEFORE_BYPASS times after its fill phase
+   (see below), a probe costs more than LOOKUP_COST_FRACTION of the
+   function's average runtime, and the expected time saved by a probe
+   (recent hit rate times average runtime) is less than the average
+   time that a probe costs.  While bypassed, still re-probe once every
+   REPROBE_INTERVAL calls.
+
+   The fill phase is made up of the probes before the first hit during
+   this execution.  They miss because the function hasn't been called
+   on those arguments yet, so they don't show whether probes will pay
+   off later.  The phase ends after at most MAX_FILL_LOOKUPS probes, for
+   functions that are never called on the same arguments twice.  The
+   recent hit rate starts out at HIT_RATE_PRIOR rather than at the
+   outcome of the first probe. */
+#define MIN_LOOKUPS_BEFORE_BYPASS 8
+#define REPROBE_INTERVAL 32
+#define LOOKUP_COST_FRACTION 0.1
+#define MAX_FILL_LOOKUPS 64
+#define HIT_RATE_PRIOR 0.5
+
+
+// The cost model's predictions for storing one memo table entry
+typedef struct {
+  Py_ssize_t est_bytes;      // estimated size of the pickled entry
+  long predicted_write_us;   // predicted time to pickle + write it
+  long predicted_read_us;    // predicted time to read + unpickle it
+  double expected_reuses;    // how many times we expect to load it
+  long predicted_savings_us; // net time saved over all expected reuses
+} MemoCostEstimate;
+
+
+int is_frequently_called(FuncMemoInfo* fmi, long runtime_ms);
+
+int admit_memo_table_entry(FuncMemoInfo* fmi, PyObject* memo_table_entry,
+                           long runtime_ms, MemoCostEstimate* est);
+
+Py_ssize_t estimate_pickled_size(PyObject* obj);
+
+int should_probe_cache(FuncMemoInfo* fmi);
+void record_lookup_cost(FuncMemoInfo* fmi, long lookup_us, int hit);
+
+// called by the on-disk cache to keep the throughput model up-to-date
+void record_cache_write_cost(Py_ssize_t nbytes, long elapsed_us);
+void record_cache_read_cost(Py_ssize_t nbytes, long elapsed_us);
+
+// called by the on-disk cache with the time that it took the storage
+// backend alone to store nbytes (already-encoded) bytes
+void record_cache_store_cost(Py_ssize_t nbytes, long elapsed_us);
+
+double cache_store_us_per_byte(void);
+double cache_read_us_per_byte(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_MEMOIZE_COSTMODEL_H */
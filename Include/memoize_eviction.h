@@ -0,0 +1,49 @@
+/* Cache size budget and cost-aware eviction
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+#ifndef Py_MEMOIZE_EVICTION_H
+#define Py_MEMOIZE_EVICTION_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "Python.h"
+#include "memoize_fmi.h"
+
+
+#define CACHE_INDEX_FILENAME "cache_index.pickle"
+
+// byte budgets for the entire incpy-cache/ directory and for each
+// individual function's entries (0 means unlimited)
+//
+// set from incpy.config in pg_initialize()
+extern PY_LONG_LONG cache_budget_bytes;
+extern PY_LONG_LONG func_cache_budget_bytes;
+
+
+void load_cache_index(void);
+void save_cache_index(void);
+
+void cache_index_note_put(FuncMemoInfo* fmi, PyObject* hash_key,
+                          Py_ssize_t nbytes, long runtime_ms);
+void cache_index_enforce_budgets(void);
+void cache_index_note_migrated(FuncMemoInfo* fmi, PyObject* version, PyObject* hash_key,
+                               Py_ssize_t nbytes, long runtime_ms);
+void cache_index_note_hit(FuncMemoInfo* fmi, PyObject* hash_key);
+void cache_index_note_del(FuncMemoInfo* fmi, PyObject* hash_key);
+void cache_index_forget_version(FuncMemoInfo* fmi, PyObject* version);
+PyObject* cache_index_popular_keys(FuncMemoInfo* fmi, Py_ssize_t max_keys);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_MEMOIZE_EVICTION_H */
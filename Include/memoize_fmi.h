@@ -17,6 +17,15 @@ extern "C" {
 
 #include "Python.h"
 
+// the file in each cache version sub-directory that holds the code
+// dependencies of all of its entries (see "Cache versions" in
+// Python/memoize_fmi.c)
+#define CODE_DEPS_FILENAME "code_dependencies.pickle"
+
+// number of buckets in FuncMemoInfo.runtime_histogram
+// (< 1 ms, < 10 ms, < 100 ms, < 1 sec, < 10 sec, >= 10 sec)
+#define NUM_RUNTIME_BUCKETS 6
+
 // Object that contains the code dependencies and profiling
 // metadata for one function
 typedef struct {
@@ -32,6 +41,14 @@ typedef struct {
   // this function's cache entries reside
   PyObject* cache_subdirectory_path;
 
+  // the version of this function's on-disk cache whose code
+  // dependencies match the code of this execution (the name of a
+  // sub-directory of cache_subdirectory_path), and the code
+  // dependencies of that version, or both NULL if there's no such
+  // version yet (see resolve_cache_version() in memoize_fmi.c)
+  PyObject* cache_version;      // PyString
+  PyObject* cache_version_deps; // Dict
+
   // booleans
   char is_impure;    // is this function impure during THIS execution?
 
@@ -41,8 +58,9 @@ typedef struct {
   char likely_nothing_to_memoize;
 
   // if the incpy-cache/<hash of function name>.cache/ sub-directory doesn't
-  // exist, then the on-disk cache for this function is currently empty,
-  // so no need to check it
+  // exist or has no version that matches the current code, then the
+  // on-disk cache for this function is currently empty, so no need to
+  // check it
   char on_disk_cache_empty;
 
   // how many times has this function been executed and terminated
@@ -56,6 +74,40 @@ typedef struct {
   // (NULL unless initialized, is_impure implies it's non-null)
   PyObject* impure_status_msg;
 
+
+  /* Profiling statistics, accumulated ACROSS executions as long as the
+     code of this function (and of everything it calls) stays the same.
+     They are loaded from and saved to the persisted profile file
+     (see load_func_profiles() and save_func_profiles()), along with
+     is_impure, impure_status_msg, likely_nothing_to_memoize, and
+     num_fast_calls_with_no_memoized_vals, so that we don't have to
+     re-discover the same facts about the same code on every run */
+  unsigned long num_calls;
+  unsigned long total_runtime_ms;
+  unsigned long max_runtime_ms;
+  unsigned long runtime_histogram[NUM_RUNTIME_BUCKETS];
+
+  unsigned long num_lookups; // number of probes of the on-disk cache
+  unsigned long num_hits;    // number of probes that let us skip a call
+  unsigned long total_lookup_us; // total time spent on all probes
+
+  /* Lookup bypass (see should_probe_cache() in memoize_costmodel.c):
+     running averages of the cost and hit rate of recent probes during
+     THIS execution, and whether we've stopped probing because the
+     probes cost more than they save (except for a re-probe once every
+     REPROBE_INTERVAL calls, to notice when that changes) */
+  double recent_lookup_us;
+  double recent_hit_rate;
+  unsigned int num_fill_lookups; // probes during the fill phase
+  char fill_phase_done;
+  unsigned int num_recent_lookups; // probes since the fill phase
+  char lookups_bypassed;
+  unsigned int calls_until_reprobe;
+
+  // the most recently-written version of this function's cache that
+  // we've seen in the shared memo index (see memoize_shmindex.c)
+  unsigned PY_LONG_LONG shared_index_seen_version;
+
 } FuncMemoInfo;
 
 #define GET_CANONICAL_NAME(fmi) ((PyCodeObject*)fmi->f_code)->pg_canonical_name
@@ -64,6 +116,29 @@ typedef struct {
 PyObject* on_disk_cache_GET(FuncMemoInfo* fmi, PyObject* hash_key);
 PyObject* on_disk_cache_PUT(FuncMemoInfo* fmi, PyObject* hash_key, PyObject* contents);
 void on_disk_cache_DEL(FuncMemoInfo* fmi, PyObject* hash_key);
+PyObject* on_disk_cache_APPEND(FuncMemoInfo* fmi, PyObject* hash_key,
+                               PyObject* memo_table_entry);
+void on_disk_cache_DISCARD(FuncMemoInfo* fmi, PyObject* hash_key,
+                           PyObject* stale_entry);
+
+// exclusive lock around the read-merge-write of
+// incpy-cache/cache_index.pickle (see memoize_eviction.c)
+void lock_cache_index(void);
+void unlock_cache_index(void);
+
+// lock around deleting the entry with hash_key (without its version)
+// from the cache sub-directory at subdir_path (see memoize_eviction.c)
+void lock_cache_entry(PyObject* subdir_path, PyObject* hash_key);
+void unlock_cache_entry(PyObject* subdir_path, PyObject* hash_key);
+
+// lock around reading (shared) or changing (exclusive) the cache
+// manifest (see memoize_manifest.c)
+void lock_cache_manifest(int exclusive);
+void unlock_cache_manifest(void);
+
+void refresh_cache_version(FuncMemoInfo* fmi);
+int remove_cache_version_if_empty(FuncMemoInfo* fmi, PyObject* subdir_path,
+                                  PyObject* version);
 
 
 #ifdef __cplusplus
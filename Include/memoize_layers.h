@@ -0,0 +1,42 @@
+/* Read-only base cache layers underneath incpy-cache/
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+#ifndef Py_MEMOIZE_LAYERS_H
+#define Py_MEMOIZE_LAYERS_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "Python.h"
+
+
+// list of the roots of base cache layers in the order in which they
+// should be searched (NULL if there are none)
+//
+// set from incpy.config in pg_initialize(), destroy in pg_finalize()
+extern PyObject* base_cache_paths;
+
+void open_base_cache_layers(PyObject* failed_paths);
+void close_base_cache_layers(void);
+int have_base_cache_layers(void);
+
+// each path is a path in the local cache directory, e.g.,
+// incpy-cache/<hash of function name>.cache/<version>/<hash of key>.pickle
+// (which is looked up in the same place inside of each base layer)
+PyObject* base_cache_READ(PyObject* path);
+int base_cache_CONTAINS(PyObject* path);
+void base_cache_LISTDIR(PyObject* dir_path, PyObject* names);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_MEMOIZE_LAYERS_H */
@@ -0,0 +1,49 @@
+/* Persistent manifest of the versions in the on-disk cache
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+#ifndef Py_MEMOIZE_MANIFEST_H
+#define Py_MEMOIZE_MANIFEST_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "Python.h"
+
+
+void open_cache_manifest(void);
+void close_cache_manifest(void);
+
+// re-read whatever other processes have added to the manifest since we
+// last looked (lookups below also do that, but at most once a second)
+void cache_manifest_REFRESH(void);
+
+// each subdir_basename is the md5 hexdigest of a function's canonical
+// name (i.e., the name of its cache sub-directory minus ".cache")
+int cache_manifest_HAS_FUNC(PyObject* subdir_basename);
+PyObject* cache_manifest_VERSIONS(PyObject* subdir_basename);
+int cache_manifest_HAS_LEGACY_ENTRIES(PyObject* subdir_basename);
+int cache_manifest_IN_BASE_LAYERS(PyObject* subdir_basename);
+
+// the digests of a version's code dependencies (in a value returned by
+// cache_manifest_VERSIONS()) vs. the code of this execution
+int cache_manifest_digests_unchanged(PyObject* digests);
+PyObject* cache_manifest_current_deps(PyObject* digests);
+
+// called by memoize_fmi.c whenever it changes a local version
+void cache_manifest_note_version(PyObject* version_path, PyObject* deps);
+void cache_manifest_note_version_gone(PyObject* version_path);
+void cache_manifest_note_legacy_migrated(PyObject* subdir_basename);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_MEMOIZE_MANIFEST_H */
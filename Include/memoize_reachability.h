@@ -16,36 +16,13 @@ extern "C" {
 #endif
 
 #include "Python.h"
+#include "memoize_typeclass.h"
 
 
-// ORDER MATTERS for short-circuiting ... put the most commonly-occuring
-// ones first ...
-//
-// kinda gross that we have to hard-code the NumPy basic data types,
-// hmmm ... http://docs.scipy.org/doc/numpy/user/basics.types.html
-// (try to speed up by short-circuiting with a 'numpy' prefix check)
+// None, strings, numbers, code, types, files and NumPy scalars
+// (see compute_type_class() in memoize_typeclass.c)
 #define DEFINITELY_IMMUTABLE(obj) \
-  ((obj == Py_None) ||            \
-   PyString_CheckExact(obj) ||    \
-   PyInt_CheckExact(obj) ||       \
-   PyLong_CheckExact(obj) ||      \
-   PyBool_Check(obj) ||           \
-   PyComplex_CheckExact(obj) ||   \
-   PyFloat_CheckExact(obj) ||     \
-   PyUnicode_CheckExact(obj) ||   \
-   PyFunction_Check(obj) ||       \
-   PyCFunction_Check(obj) ||      \
-   PyMethod_Check(obj) ||         \
-   PyType_CheckExact(obj) ||      \
-   PyClass_Check(obj) ||          \
-   PyFile_CheckExact(obj) || \
-   ((strncmp(Py_TYPE(obj)->tp_name, "numpy", 5) == 0) && \
-    ((strcmp(Py_TYPE(obj)->tp_name,  "numpy.bool") == 0) || \
-     (strncmp(Py_TYPE(obj)->tp_name, "numpy.int", 9) == 0) || \
-     (strncmp(Py_TYPE(obj)->tp_name, "numpy.uint", 10) == 0) || \
-     (strncmp(Py_TYPE(obj)->tp_name, "numpy.float", 11) == 0) || \
-     (strncmp(Py_TYPE(obj)->tp_name, "numpy.complex", 13) == 0))) \
-  )
+  (TYPE_CLASS(Py_TYPE(obj)) & TYPECLASS_DEFINITELY_IMMUTABLE)
 
 
 PyObject* find_globally_reachable_obj_by_name(PyObject* varname_tuple,
@@ -61,6 +38,8 @@ int contains_externally_aliased_mutable_obj(PyObject* obj, PyFrameObject* f);
 
 // initialize in pg_initialize(), destroy in pg_finalize()
 PyObject* global_containment_intern_cache;
+void init_reachability_caches(void);
+void free_reachability_caches(void);
 
 
 #ifdef __cplusplus
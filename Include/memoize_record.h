@@ -0,0 +1,43 @@
+/* Binary records for memo table entries
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+#ifndef Py_MEMOIZE_RECORD_H
+#define Py_MEMOIZE_RECORD_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "Python.h"
+
+
+// encodes a list of memo table entries as a record list (returning a
+// new reference), or returns NULL without setting an exception if
+// entries doesn't fit into the format (so that the caller can fall
+// back on serializing it as a whole)
+PyObject* encode_memo_records(PyObject* entries);
+
+// decodes a record list into a new list of memo table entries (or
+// returns NULL with an exception set if it's corrupted)
+PyObject* decode_memo_records(PyObject* data);
+
+// returns a borrowed reference to the value of field_name in a memo
+// table entry (or NULL if it has no such field), decoding it first if
+// decode_memo_records() left it encoded
+PyObject* memo_table_entry_GET(PyObject* entry, const char* field_name);
+
+// number of record lists whose checksums didn't match
+extern unsigned long num_corrupt_records;
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_MEMOIZE_RECORD_H */
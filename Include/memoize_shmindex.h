@@ -0,0 +1,47 @@
+/* Host-wide shared-memory index of cache entries
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+#ifndef Py_MEMOIZE_SHMINDEX_H
+#define Py_MEMOIZE_SHMINDEX_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "Python.h"
+#include "memoize_fmi.h"
+
+
+// size of the shared memo index file (0 means don't use one)
+//
+// set from incpy.config in pg_initialize()
+extern PY_LONG_LONG shared_memo_index_bytes;
+
+
+void open_shared_memo_index(void);
+void close_shared_memo_index(void);
+
+int shared_memo_index_may_contain(FuncMemoInfo* fmi, PyObject* hash_key);
+void shared_memo_index_refresh(FuncMemoInfo* fmi);
+
+// called by the on-disk cache whenever it adds or removes an entry
+void shared_memo_index_note_put(PyObject* subdir_path, PyObject* version,
+                                PyObject* hash_key);
+void shared_memo_index_note_del(PyObject* subdir_path, PyObject* version,
+                                PyObject* hash_key);
+
+// called by save_cache_index() around re-writing cache_index.pickle
+void shared_memo_index_note_cache_index_saved(int after_write);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_MEMOIZE_SHMINDEX_H */
@@ -0,0 +1,95 @@
+/* Pluggable storage backends for cache entries
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+#ifndef Py_MEMOIZE_STORAGE_H
+#define Py_MEMOIZE_STORAGE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "Python.h"
+
+
+// return values of get
+#define MEMO_STORAGE_ERROR -1
+#define MEMO_STORAGE_MISS 0
+#define MEMO_STORAGE_HIT 1
+
+/* A storage backend maps the path of each cache entry file, e.g.,
+
+     incpy-cache/<hash of function name>.cache/<version>/<hash of key>.pickle
+
+   to the contents of that file (a PyString with a pickled list of memo
+   table entries).  With a persistent backend, each version
+   sub-directory always exists on disk with its code_dependencies.pickle,
+   no matter where the backend actually keeps the entries in it (with a
+   non-persistent one, versions only exist in memory, too; see
+   memoize_fmi.c). */
+typedef struct {
+  const char* name; // as selected by 'storage = <name>' in incpy.config
+
+  // do entries live inside of their version sub-directories on disk,
+  // so that tombstoning a version gets rid of them as well?
+  char entries_live_in_version_dirs;
+
+  // do entries outlive this execution?  (if not, then nothing else
+  // about them, like the cache index, gets written to disk either)
+  char is_persistent;
+
+  // returns 1 on success (called before any other operation)
+  int (*open)(void);
+
+  // returns MEMO_STORAGE_HIT with a new reference in *data,
+  // MEMO_STORAGE_MISS, or MEMO_STORAGE_ERROR
+  int (*get)(PyObject* path, PyObject** data);
+
+  // returns 1 on success
+  int (*put)(PyObject* path, PyObject* data);
+
+  // deleting a path that doesn't exist isn't an error
+  void (*del)(PyObject* path);
+
+  // returns the size in bytes of the entry at path, or -1 if there's
+  // none (without reading it, if possible)
+  Py_ssize_t (*size)(PyObject* path);
+
+  // appends the names (hash keys, without the .pickle extension) of up
+  // to max_names entries in the version sub-directory at dir_path to
+  // the list names (or all of them if max_names is 0)
+  void (*scan)(PyObject* dir_path, PyObject* names, Py_ssize_t max_names);
+
+  // adds backend-specific statistics to stats_dict
+  void (*stats)(PyObject* stats_dict);
+
+  void (*close)(void);
+} MemoStorageBackend;
+
+
+// the current backend (set in select_memo_storage())
+extern MemoStorageBackend* memo_storage;
+
+int select_memo_storage(char* name);
+int open_memo_storage(void);
+void close_memo_storage(void);
+
+int memo_storage_GET(PyObject* path, PyObject** data);
+int memo_storage_PUT(PyObject* path, PyObject* data);
+void memo_storage_DEL(PyObject* path);
+Py_ssize_t memo_storage_SIZE(PyObject* path);
+PyObject* memo_storage_SCAN(PyObject* dir_path, Py_ssize_t max_names);
+void memo_storage_DROP_DIR(PyObject* dir_path);
+PyObject* memo_storage_STATS(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_MEMOIZE_STORAGE_H */
@@ -0,0 +1,67 @@
+/* Per-type classification cache
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+#ifndef Py_MEMOIZE_TYPECLASS_H
+#define Py_MEMOIZE_TYPECLASS_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "Python.h"
+
+
+// Whether a value is immutable, picklable, etc. depends only on its
+// type, but working it out takes a dozen type checks and strcmp()s on
+// tp_name, and we ask for EVERY reachability event and argument.  So
+// we classify each type once and remember the answer in a small
+// direct-mapped cache keyed by type address (like the method cache in
+// Objects/typeobject.c).
+
+// bits returned by TYPE_CLASS():
+#define TYPECLASS_DEFINITELY_IMMUTABLE 0x1 // see DEFINITELY_IMMUTABLE
+#define TYPECLASS_NEVER_PICKLE 0x2 // see NEVER_PICKLE
+#define TYPECLASS_HAS_COMPARISON 0x4 // see has_comparison_method()
+// old-style instances, which have a comparison method iff their class
+// defines __eq__, so that has to be checked per object
+#define TYPECLASS_INSTANCE 0x8
+
+typedef struct {
+  PyTypeObject* type;
+  unsigned int version; // type's tp_version_tag when it was classified
+  unsigned int bits;
+} TypeClassEntry;
+
+#define TYPE_CLASS_CACHE_SIZE 512 // must be a power of 2
+
+extern TypeClassEntry type_class_cache[TYPE_CLASS_CACHE_SIZE];
+
+// classifies t and caches the result
+unsigned int classify_type(PyTypeObject* t);
+
+#define TYPE_CLASS_ENTRY(t) \
+  (type_class_cache[((Py_uintptr_t)(t) >> 4) & (TYPE_CLASS_CACHE_SIZE - 1)])
+
+// Heap types (classes) can be modified or freed (and their address
+// reused by a new class), both of which invalidate their version tag,
+// so an entry for one is only good while its tag is still valid and
+// the same.  Static types can't change and never go away.
+#define TYPE_CLASS(t) \
+  ((TYPE_CLASS_ENTRY(t).type == (t) && \
+    TYPE_CLASS_ENTRY(t).version == (t)->tp_version_tag && \
+    ((t)->tp_flags & (Py_TPFLAGS_HEAPTYPE | Py_TPFLAGS_VALID_VERSION_TAG)) != \
+      Py_TPFLAGS_HEAPTYPE) ? \
+   TYPE_CLASS_ENTRY(t).bits : classify_type(t))
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !Py_MEMOIZE_TYPECLASS_H */
@@ -117,6 +117,66 @@ class cPickleDeepRecursive(unittest.TestCase):
             res.append(dict(doc=x, similar=[]))
         cPickle.dumps(res)
 
+class cPickleMemoTests(unittest.TestCase):
+
+    def test_pickler_memo_is_mutable(self):
+        obj = [1, 2]
+        f = StringIO()
+        p = cPickle.Pickler(f, 2)
+        p.dump(obj)
+        memo = p.memo
+        self.assertTrue(memo is p.memo)
+        self.assertEqual(memo.values(), [(1, obj)])
+
+        # the memo stays up to date, and a GET now refers to obj
+        p.dump(obj)
+        self.assertEqual(len(memo), 1)
+        u = cPickle.Unpickler(StringIO(f.getvalue()))
+        self.assertTrue(u.load() is u.load())
+
+        # clearing it in place means obj gets pickled again
+        memo.clear()
+        f.truncate(0)
+        p.dump(obj)
+        self.assertEqual(cPickle.loads(f.getvalue()), obj)
+
+        f.truncate(0)
+        p.memo[id(obj)] = (5, obj)
+        p.dump(obj)
+        self.assertEqual(f.getvalue(), '\x80\x02h\x05.')
+
+    def test_pickler_memo_assignment(self):
+        obj = [1, 2]
+        p1 = cPickle.Pickler(StringIO(), 2)
+        p1.dump(obj)
+        p2 = cPickle.Pickler(StringIO(), 2)
+        p2.memo = p1.memo
+        self.assertTrue(p2.memo is p1.memo)
+        p1.clear_memo()
+        self.assertEqual(p2.memo, {})
+        self.assertRaises(TypeError, setattr, p1, 'memo', [])
+        self.assertRaises(TypeError, setattr, p1, 'memo', {1: obj})
+
+    def test_unpickler_memo_is_mutable(self):
+        obj = [1, 2]
+        u = cPickle.Unpickler(StringIO('\x80\x02h\x01.'))
+        u.memo[1] = obj
+        self.assertTrue(u.load() is obj)
+
+        u = cPickle.Unpickler(StringIO(cPickle.dumps(obj, 2)))
+        u.load()
+        self.assertEqual(u.memo, {1: obj})
+
+    def test_unpickler_memo_keys(self):
+        obj = [1, 2]
+        for memo in ({'1': obj}, {1: obj}, {1L: obj},
+                     {'1': obj, 'x': None, (): None, 2.5: None}):
+            u = cPickle.Unpickler(StringIO('g1\n.'))
+            u.memo = memo
+            self.assertTrue(u.memo is memo)
+            self.assertTrue(u.load() is obj)
+        self.assertRaises(TypeError, setattr, u, 'memo', [])
+
 
 def test_main():
     test_support.run_unittest(
@@ -125,6 +185,7 @@ def test_main():
         cPickleListPicklerTests,
         cPickleFastPicklerTests,
         cPickleDeepRecursive,
+        cPickleMemoTests,
     )
 
 if __name__ == "__main__":
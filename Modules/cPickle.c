@@ -1,5 +1,8 @@
 #include "Python.h"
 #include "cStringIO.h"
+#define Py_CPICKLE_MODULE
+#include "cPickle.h"
+#undef Py_CPICKLE_MODULE
 #include "structmember.h"
 
 PyDoc_STRVAR(cPickle_module_documentation,
@@ -14,6 +17,10 @@ PyDoc_STRVAR(cPickle_module_documentation,
 
 #define WRITE_BUF_SIZE 256
 
+/* Chunks passed to sinks (see cPickle.h) are at least this big, except
+   for the last one. */
+#define SINK_BUF_SIZE 8192
+
 /* Bump this when new opcodes are added to the pickle protocol. */
 #define HIGHEST_PROTOCOL 2
 
@@ -311,6 +318,195 @@ Pdata_popList(Pdata *self, int start)
 	return r;
 }
 
+/*************************************************************************
+ Internal hash table for the memos of Picklers and Unpicklers.
+
+ Each entry maps a key to an object (which the table holds a reference
+ to) and a memo index.  Picklers key entries by object address and
+ Unpicklers by memo index, so, unlike with a dict, no int or long object
+ needs to be created to look something up.  It uses open addressing with
+ the same probe sequence as dicts, and entries are only ever removed all
+ at once (by MemoTable_Clear).                                           */
+
+typedef struct {
+	Py_uintptr_t key;
+	PyObject *obj;	/* NULL if the slot is unused */
+	long index;
+} MemoEntry;
+
+typedef struct {
+	Py_ssize_t used;	/* number of slots in use */
+	Py_ssize_t mask;	/* number of slots - 1 (a power of 2) */
+	MemoEntry *table;
+} MemoTable;
+
+#define MEMOTABLE_MINSIZE 8
+
+static MemoTable *
+MemoTable_New(void)
+{
+	MemoTable *self;
+
+	if (!( self = PyMem_New(MemoTable, 1)))
+		return (MemoTable *)PyErr_NoMemory();
+	self->used = 0;
+	self->mask = MEMOTABLE_MINSIZE - 1;
+	self->table = PyMem_New(MemoEntry, MEMOTABLE_MINSIZE);
+	if (self->table == NULL) {
+		PyMem_Free(self);
+		return (MemoTable *)PyErr_NoMemory();
+	}
+	memset(self->table, 0, MEMOTABLE_MINSIZE * sizeof(MemoEntry));
+	return self;
+}
+
+/* Return the slot for key: either the one holding it, or the unused
+ * one where it belongs. */
+static MemoEntry *
+MemoTable_Lookup(MemoTable *self, Py_uintptr_t key)
+{
+	MemoEntry *entry;
+	size_t mask = (size_t)self->mask;
+	/* object addresses are aligned, so mix in the higher bits */
+	size_t perturb = (size_t)(key ^ (key >> 4));
+	size_t i = perturb & mask;
+
+	for (;;) {
+		entry = &self->table[i];
+		if (entry->obj == NULL || entry->key == key)
+			return entry;
+		i = ((i << 2) + i + perturb + 1) & mask;
+		perturb >>= 5;
+	}
+}
+
+/* Return the entry for key, or NULL if there isn't one (without
+ * setting an exception). */
+static MemoEntry *
+MemoTable_Get(MemoTable *self, Py_uintptr_t key)
+{
+	MemoEntry *entry = MemoTable_Lookup(self, key);
+
+	return entry->obj ? entry : NULL;
+}
+
+static int
+MemoTable_Resize(MemoTable *self, Py_ssize_t min_size)
+{
+	MemoEntry *old_table = self->table, *old_entry, *entry;
+	Py_ssize_t new_size = MEMOTABLE_MINSIZE, i;
+
+	while (new_size <= min_size) {
+		if (new_size > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(MemoEntry) / 2) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		new_size <<= 1;
+	}
+
+	if (!( self->table = PyMem_New(MemoEntry, new_size))) {
+		self->table = old_table;
+		PyErr_NoMemory();
+		return -1;
+	}
+	memset(self->table, 0, new_size * sizeof(MemoEntry));
+
+	i = self->mask + 1;
+	self->mask = new_size - 1;
+	for (old_entry = old_table; --i >= 0; old_entry++) {
+		if (old_entry->obj) {
+			entry = MemoTable_Lookup(self, old_entry->key);
+			*entry = *old_entry;
+		}
+	}
+	PyMem_Free(old_table);
+	return 0;
+}
+
+/* Map key to (obj, index), replacing any existing entry for key. */
+static int
+MemoTable_Set(MemoTable *self, Py_uintptr_t key, PyObject *obj, long index)
+{
+	MemoEntry *entry = MemoTable_Lookup(self, key);
+	PyObject *old_obj;
+
+	if ((old_obj = entry->obj)) {
+		Py_INCREF(obj);
+		entry->obj = obj;
+		entry->index = index;
+		Py_DECREF(old_obj);
+		return 0;
+	}
+
+	/* keep the table at most 2/3 full */
+	if ((self->used + 1) * 3 >= (self->mask + 1) * 2) {
+		if (MemoTable_Resize(self, self->used * 2 + 2) < 0)
+			return -1;
+		entry = MemoTable_Lookup(self, key);
+	}
+
+	Py_INCREF(obj);
+	entry->key = key;
+	entry->obj = obj;
+	entry->index = index;
+	self->used++;
+	return 0;
+}
+
+static void
+MemoTable_Clear(MemoTable *self)
+{
+	MemoEntry *old_table = self->table, *entry;
+	Py_ssize_t i = self->mask + 1;
+
+	if (self->used == 0)
+		return;
+
+	/* Start over with an empty table before releasing anything, since
+	 * that can run arbitrary code that uses the memo. */
+	if (!( self->table = PyMem_New(MemoEntry, MEMOTABLE_MINSIZE))) {
+		/* clear it in place instead */
+		self->table = old_table;
+		for (entry = old_table; --i >= 0; entry++) {
+			Py_CLEAR(entry->obj);
+		}
+		self->used = 0;
+		return;
+	}
+	memset(self->table, 0, MEMOTABLE_MINSIZE * sizeof(MemoEntry));
+	self->mask = MEMOTABLE_MINSIZE - 1;
+	self->used = 0;
+
+	for (entry = old_table; --i >= 0; entry++) {
+		Py_XDECREF(entry->obj);
+	}
+	PyMem_Free(old_table);
+}
+
+static void
+MemoTable_Del(MemoTable *self)
+{
+	if (self == NULL)
+		return;
+	MemoTable_Clear(self);
+	PyMem_Free(self->table);
+	PyMem_Free(self);
+}
+
+static int
+MemoTable_Traverse(MemoTable *self, visitproc visit, void *arg)
+{
+	MemoEntry *entry;
+	Py_ssize_t i;
+
+	if (self == NULL)
+		return 0;
+	for (i = self->mask + 1, entry = self->table; --i >= 0; entry++) {
+		Py_VISIT(entry->obj);
+	}
+	return 0;
+}
+
 /*************************************************************************/
 
 #define ARG_TUP(self, o) {                          \
@@ -335,7 +531,8 @@ typedef struct Picklerobject {
 	FILE *fp;
 	PyObject *write;
 	PyObject *file;
-	PyObject *memo;
+	MemoTable *memo; /* keyed by object address */
+	PyObject *memo_dict; /* the memo attribute, if it was ever used */
 	PyObject *arg;
 	PyObject *pers_func;
 	PyObject *inst_pers_func;
@@ -353,6 +550,7 @@ typedef struct Picklerobject {
 	PyObject *dispatch_table;
 	int fast_container; /* count nested container dumps */
 	PyObject *fast_memo;
+	PycPickle_Sink *sink; /* for write_sink() */
 } Picklerobject;
 
 #ifndef PY_CPICKLE_FAST_LIMIT
@@ -367,7 +565,8 @@ typedef struct Unpicklerobject {
 	PyObject *file;
 	PyObject *readline;
 	PyObject *read;
-	PyObject *memo;
+	MemoTable *memo; /* keyed by memo index */
+	PyObject *memo_dict; /* the memo attribute, if it was ever used */
 	PyObject *arg;
 	Pdata *stack;
 	PyObject *mark;
@@ -524,6 +723,51 @@ write_other(Picklerobject *self, const char *s, Py_ssize_t  _n)
 	return n;
 }
 
+static int
+flush_sink(Picklerobject *self, const char *s, Py_ssize_t n)
+{
+	PycPickle_Sink *sink;
+
+	for (sink = self->sink; sink; sink = sink->next) {
+		if (sink->write(sink, s, n) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+write_sink(Picklerobject *self, const char *s, Py_ssize_t n)
+{
+	if (s == NULL) {
+		if (self->buf_size) {
+			if (flush_sink(self, self->write_buf,
+				       self->buf_size) < 0)
+				return -1;
+			self->buf_size = 0;
+		}
+		return 0;
+	}
+
+	if (n > INT_MAX)
+		return -1;
+
+	if (self->buf_size && (n + self->buf_size) > SINK_BUF_SIZE) {
+		if (write_sink(self, NULL, 0) < 0)
+			return -1;
+	}
+
+	if (n > SINK_BUF_SIZE) {
+		/* pass big chunks straight through */
+		if (flush_sink(self, s, n) < 0)
+			return -1;
+	}
+	else {
+		memcpy(self->write_buf + self->buf_size, s, n);
+		self->buf_size += n;
+	}
+	return (int)n;
+}
+
 
 static Py_ssize_t
 read_file(Unpicklerobject *self, char **s, Py_ssize_t n)
@@ -712,26 +956,24 @@ pystrndup(const char *s, int n)
 
 
 static int
-get(Picklerobject *self, PyObject *id)
+get(Picklerobject *self, PyObject *ob)
 {
-	PyObject *value, *mv;
+	MemoEntry *entry;
+	PyObject *mv;
 	long c_value;
 	char s[30];
 	size_t len;
 
-	if (!( mv = PyDict_GetItem(self->memo, id)))  {
-		PyErr_SetObject(PyExc_KeyError, id);
+	if (!( entry = MemoTable_Get(self->memo, (Py_uintptr_t)ob)))  {
+		PyObject *py_ob_id = PyLong_FromVoidPtr(ob);
+		if (py_ob_id) {
+			PyErr_SetObject(PyExc_KeyError, py_ob_id);
+			Py_DECREF(py_ob_id);
+		}
 		return -1;
 	}
 
-	if (!( value = PyTuple_GetItem(mv, 0)))
-		return -1;
-
-	if (!( PyInt_Check(value)))  {
-		PyErr_SetString(PicklingError, "no int where int expected in memo");
-		return -1;
-	}
-	c_value = PyInt_AS_LONG((PyIntObject*)value);
+	c_value = entry->index;
 
 	if (!self->bin) {
 		s[0] = GET;
@@ -740,7 +982,10 @@ get(Picklerobject *self, PyObject *id)
 	}
 	else if (Pdata_Check(self->file)) {
 		if (write_other(self, NULL, 0) < 0) return -1;
-		PDATA_APPEND(self->file, mv, -1);
+		/* Pickle_getvalue() tells gets from puts by the tuple */
+		if (!( mv = Py_BuildValue("(lO)", c_value, ob)))
+			return -1;
+		PDATA_PUSH(self->file, mv, -1);
 		return 0;
 	}
 	else {
@@ -783,13 +1028,16 @@ put2(Picklerobject *self, PyObject *ob)
 	int p;
 	size_t len;
 	int res = -1;
-	PyObject *py_ob_id = 0, *memo_len = 0, *t = 0;
+	PyObject *memo_len = 0;
 
 	if (self->fast)
 		return 0;
 
-	if ((p = PyDict_Size(self->memo)) < 0)
+	if (self->memo->used >= INT_MAX) {
+		PyErr_SetString(PicklingError, "memo is too large");
 		goto finally;
+	}
+	p = (int)self->memo->used;
 
 	/* Make sure memo keys are positive! */
 	/* XXX Why?
@@ -799,21 +1047,7 @@ put2(Picklerobject *self, PyObject *ob)
 	 */
 	p++;
 
-	if (!( py_ob_id = PyLong_FromVoidPtr(ob)))
-		goto finally;
-
-	if (!( memo_len = PyInt_FromLong(p)))
-		goto finally;
-
-	if (!( t = PyTuple_New(2)))
-		goto finally;
-
-	PyTuple_SET_ITEM(t, 0, memo_len);
-	Py_INCREF(memo_len);
-	PyTuple_SET_ITEM(t, 1, ob);
-	Py_INCREF(ob);
-
-	if (PyDict_SetItem(self->memo, py_ob_id, t) < 0)
+	if (MemoTable_Set(self->memo, (Py_uintptr_t)ob, ob, p) < 0)
 		goto finally;
 
 	if (!self->bin) {
@@ -823,7 +1057,10 @@ put2(Picklerobject *self, PyObject *ob)
 	}
 	else if (Pdata_Check(self->file)) {
 		if (write_other(self, NULL, 0) < 0) return -1;
-		PDATA_APPEND(self->file, memo_len, -1);
+		if (!( memo_len = PyInt_FromLong(p)))
+			goto finally;
+		PDATA_PUSH(self->file, memo_len, -1);
+		memo_len = 0;
 		res=0;          /* Job well done ;) */
 		goto finally;
 	}
@@ -849,9 +1086,7 @@ put2(Picklerobject *self, PyObject *ob)
 	res = 0;
 
   finally:
-	Py_XDECREF(py_ob_id);
 	Py_XDECREF(memo_len);
-	Py_XDECREF(t);
 
 	return res;
 }
@@ -1465,7 +1700,6 @@ store_tuple_elements(Picklerobject *self, PyObject *t, int len)
 static int
 save_tuple(Picklerobject *self, PyObject *args)
 {
-	PyObject *py_tuple_id = NULL;
 	int len, i;
 	int res = -1;
 
@@ -1502,21 +1736,17 @@ save_tuple(Picklerobject *self, PyObject *args)
 	 * which case we'll pop everything we put on the stack, and fetch
 	 * its value from the memo.
 	 */
-	py_tuple_id = PyLong_FromVoidPtr(args);
-	if (py_tuple_id == NULL)
-		goto finally;
-
 	if (len <= 3 && self->proto >= 2) {
 		/* Use TUPLE{1,2,3} opcodes. */
 		if (store_tuple_elements(self, args, len) < 0)
 			goto finally;
-		if (PyDict_GetItem(self->memo, py_tuple_id)) {
+		if (MemoTable_Get(self->memo, (Py_uintptr_t)args)) {
 			/* pop the len elements */
 			for (i = 0; i < len; ++i)
 				if (self->write_func(self, &pop, 1) < 0)
 					goto finally;
 			/* fetch from memo */
-			if (get(self, py_tuple_id) < 0)
+			if (get(self, args) < 0)
 				goto finally;
 			res = 0;
 			goto finally;
@@ -1536,7 +1766,7 @@ save_tuple(Picklerobject *self, PyObject *args)
 	if (store_tuple_elements(self, args, len) < 0)
 		goto finally;
 
-	if (PyDict_GetItem(self->memo, py_tuple_id)) {
+	if (MemoTable_Get(self->memo, (Py_uintptr_t)args)) {
 		/* pop the stack stuff we pushed */
 		if (self->bin) {
 			if (self->write_func(self, &pop_mark, 1) < 0)
@@ -1551,7 +1781,7 @@ save_tuple(Picklerobject *self, PyObject *args)
 					goto finally;
 		}
 		/* fetch from memo */
-		if (get(self, py_tuple_id) >= 0)
+		if (get(self, args) >= 0)
 			res = 0;
 		goto finally;
 	}
@@ -1565,7 +1795,6 @@ save_tuple(Picklerobject *self, PyObject *args)
 		res = 0;
 
   finally:
-	Py_XDECREF(py_tuple_id);
 	return res;
 }
 
@@ -2449,7 +2678,7 @@ static int
 save(Picklerobject *self, PyObject *args, int pers_save)
 {
 	PyTypeObject *type;
-	PyObject *py_ob_id = 0, *__reduce__ = 0, *t = 0;
+	PyObject *__reduce__ = 0, *t = 0;
 	int res = -1;
 	int tmp;
 
@@ -2523,11 +2752,8 @@ save(Picklerobject *self, PyObject *args, int pers_save)
 	}
 
 	if (Py_REFCNT(args) > 1) {
-		if (!( py_ob_id = PyLong_FromVoidPtr(args)))
-			goto finally;
-
-		if (PyDict_GetItem(self->memo, py_ob_id)) {
-			if (get(self, py_ob_id) < 0)
+		if (MemoTable_Get(self->memo, (Py_uintptr_t)args)) {
+			if (get(self, args) < 0)
 				goto finally;
 
 			res = 0;
@@ -2688,7 +2914,6 @@ save(Picklerobject *self, PyObject *args, int pers_save)
 
   finally:
 	Py_LeaveRecursiveCall();
-	Py_XDECREF(py_ob_id);
 	Py_XDECREF(__reduce__);
 	Py_XDECREF(t);
 
@@ -2727,7 +2952,9 @@ static PyObject *
 Pickle_clear_memo(Picklerobject *self, PyObject *args)
 {
 	if (self->memo)
-		PyDict_Clear(self->memo);
+		MemoTable_Clear(self->memo);
+	if (self->memo_dict)
+		PyDict_Clear(self->memo_dict);
 	Py_INCREF(Py_None);
 	return Py_None;
 }
@@ -2759,9 +2986,9 @@ Pickle_getvalue(Picklerobject *self, PyObject *args)
 	l=data->length;
 
 	/* set up an array to hold get/put status */
-	lm = PyDict_Size(self->memo);
-	if (lm < 0) return NULL;
-	lm++;
+	if (self->memo->used >= INT_MAX)
+		return PyErr_NoMemory();
+	lm = (int)self->memo->used + 1;
 	have_get = malloc(lm);
 	if (have_get == NULL) return PyErr_NoMemory();
 	memset(have_get, 0, lm);
@@ -2858,7 +3085,9 @@ Pickle_getvalue(Picklerobject *self, PyObject *args)
 	}
 
 	if (clear) {
-		PyDict_Clear(self->memo);
+		MemoTable_Clear(self->memo);
+		if (self->memo_dict)
+			PyDict_Clear(self->memo_dict);
 		Pdata_clear(data, 0);
 	}
 
@@ -2869,6 +3098,9 @@ Pickle_getvalue(Picklerobject *self, PyObject *args)
 	return NULL;
 }
 
+static int Pickler_set_memo(Picklerobject *, PyObject *);
+static int Pickler_update_memo_dict(Picklerobject *);
+
 static PyObject *
 Pickler_dump(Picklerobject *self, PyObject *args)
 {
@@ -2878,9 +3110,16 @@ Pickler_dump(Picklerobject *self, PyObject *args)
 	if (!( PyArg_ParseTuple(args, "O|i:dump", &ob, &get)))
 		return NULL;
 
+	/* See Pickler_get_memo(). */
+	if (self->memo_dict && Pickler_set_memo(self, self->memo_dict) < 0)
+		return NULL;
+
 	if (dump(self, ob) < 0)
 		return NULL;
 
+	if (self->memo_dict && Pickler_update_memo_dict(self) < 0)
+		return NULL;
+
 	if (get) return Pickle_getvalue(self, NULL);
 
 	/* XXX Why does dump() return self? */
@@ -2924,6 +3163,7 @@ newPicklerobject(PyObject *file, int proto)
 	self->fp = NULL;
 	self->write = NULL;
 	self->memo = NULL;
+	self->memo_dict = NULL;
 	self->arg = NULL;
 	self->pers_func = NULL;
 	self->inst_pers_func = NULL;
@@ -2933,6 +3173,7 @@ newPicklerobject(PyObject *file, int proto)
 	self->fast_memo = NULL;
 	self->buf_size = 0;
 	self->dispatch_table = NULL;
+	self->sink = NULL;
 
 	self->file = NULL;
 	if (file)
@@ -2944,7 +3185,7 @@ newPicklerobject(PyObject *file, int proto)
 	}
 	self->file = file;
 
-	if (!( self->memo = PyDict_New()))
+	if (!( self->memo = MemoTable_New()))
 		goto err;
 
 	if (PyFile_Check(file)) {
@@ -3038,7 +3279,8 @@ Pickler_dealloc(Picklerobject *self)
 {
 	PyObject_GC_UnTrack(self);
 	Py_XDECREF(self->write);
-	Py_XDECREF(self->memo);
+	MemoTable_Del(self->memo);
+	Py_XDECREF(self->memo_dict);
 	Py_XDECREF(self->fast_memo);
 	Py_XDECREF(self->arg);
 	Py_XDECREF(self->file);
@@ -3052,8 +3294,12 @@ Pickler_dealloc(Picklerobject *self)
 static int
 Pickler_traverse(Picklerobject *self, visitproc visit, void *arg)
 {
+	int vret;
+
 	Py_VISIT(self->write);
-	Py_VISIT(self->memo);
+	if ((vret = MemoTable_Traverse(self->memo, visit, arg)))
+		return vret;
+	Py_VISIT(self->memo_dict);
 	Py_VISIT(self->fast_memo);
 	Py_VISIT(self->arg);
 	Py_VISIT(self->file);
@@ -3067,7 +3313,9 @@ static int
 Pickler_clear(Picklerobject *self)
 {
 	Py_CLEAR(self->write);
-	Py_CLEAR(self->memo);
+	if (self->memo)
+		MemoTable_Clear(self->memo);
+	Py_CLEAR(self->memo_dict);
 	Py_CLEAR(self->fast_memo);
 	Py_CLEAR(self->arg);
 	Py_CLEAR(self->file);
@@ -3115,19 +3363,67 @@ Pickler_set_inst_pers_func(Picklerobject *p, PyObject *v)
 	return 0;
 }
 
+/* Store every entry of the memo table into the memo dict, in the shape
+ * that pickle.py uses, mapping id(obj) to (index, obj). */
+static int
+Pickler_update_memo_dict(Picklerobject *p)
+{
+	PyObject *py_ob_id, *t;
+	MemoEntry *entry;
+	Py_ssize_t i;
+	int res;
+
+	for (i = p->memo->mask + 1, entry = p->memo->table; --i >= 0; entry++) {
+		if (!entry->obj)
+			continue;
+		if (!( py_ob_id = PyLong_FromVoidPtr(entry->obj)))
+			return -1;
+		if (!( t = Py_BuildValue("(lO)", entry->index, entry->obj))) {
+			Py_DECREF(py_ob_id);
+			return -1;
+		}
+		res = PyDict_SetItem(p->memo_dict, py_ob_id, t);
+		Py_DECREF(py_ob_id);
+		Py_DECREF(t);
+		if (res < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* The memo attribute is a real dict, which the Pickler creates the first
+ * time it's read (or gets assigned) and keeps from then on, so it can be
+ * modified in place as before the memo became a MemoTable.  Since
+ * pickling only looks at the table, dump() loads the table from the dict
+ * first and stores its new entries back into the dict afterwards.
+ * Picklers whose memo is never touched don't pay for any of this. */
 static PyObject *
 Pickler_get_memo(Picklerobject *p)
 {
-	if (p->memo == NULL)
+	if (p->memo == NULL) {
 		PyErr_SetString(PyExc_AttributeError, "memo");
-	else
-		Py_INCREF(p->memo);
-	return p->memo;
+		return NULL;
+	}
+
+	if (!p->memo_dict) {
+		if (!( p->memo_dict = PyDict_New()))
+			return NULL;
+		if (Pickler_update_memo_dict(p) < 0) {
+			Py_CLEAR(p->memo_dict);
+			return NULL;
+		}
+	}
+	Py_INCREF(p->memo_dict);
+	return p->memo_dict;
 }
 
 static int
 Pickler_set_memo(Picklerobject *p, PyObject *v)
 {
+	MemoTable *new_memo, *old_memo;
+	PyObject *key, *value, *ob, *old_dict;
+	Py_ssize_t i;
+
 	if (v == NULL) {
 		PyErr_SetString(PyExc_TypeError,
 				"attribute deletion is not supported");
@@ -3137,10 +3433,38 @@ Pickler_set_memo(Picklerobject *p, PyObject *v)
 		PyErr_SetString(PyExc_TypeError, "memo must be a dictionary");
 		return -1;
 	}
-	Py_XDECREF(p->memo);
+
+	if (!( new_memo = MemoTable_New()))
+		return -1;
+
+	i = 0;
+	while (PyDict_Next(v, &i, &key, &value)) {
+		if (!(PyTuple_Check(value) &&
+		      PyTuple_GET_SIZE(value) == 2 &&
+		      PyInt_Check(PyTuple_GET_ITEM(value, 0)))) {
+			PyErr_SetString(PyExc_TypeError, "memo values must be "
+					"(int, object) tuples");
+			goto err;
+		}
+		ob = PyTuple_GET_ITEM(value, 1);
+		if (MemoTable_Set(new_memo, (Py_uintptr_t)ob, ob,
+			PyInt_AS_LONG(PyTuple_GET_ITEM(value, 0))) < 0)
+			goto err;
+	}
+
+	old_memo = p->memo;
+	p->memo = new_memo;
+	MemoTable_Del(old_memo);
+
+	old_dict = p->memo_dict;
 	Py_INCREF(v);
-	p->memo = v;
+	p->memo_dict = v;
+	Py_XDECREF(old_dict);
 	return 0;
+
+  err:
+	MemoTable_Del(new_memo);
+	return -1;
 }
 
 static PyObject *
@@ -4072,70 +4396,89 @@ load_dup(Unpicklerobject *self)
 }
 
 
+/* Parse the text memo key of a GET or PUT (the first len - 1 bytes
+ * of s, ignoring the \r of a pickle with \r\n line endings).  Returns
+ * 0 on success, or -1 if it isn't an integer. */
+static int
+parse_memo_key(char *s, int len, long *key)
+{
+	char buf[32], *end;
+
+	len--;
+	if (len > 0 && s[len - 1] == '\r')
+		len--;
+	if (len < 1 || len >= (int)sizeof(buf))
+		return -1;
+	memcpy(buf, s, len);
+	buf[len] = 0;
+
+	errno = 0;
+	*key = strtol(buf, &end, 10);
+	if (errno || *end)
+		return -1;
+	return 0;
+}
+
+
+static int
+push_memo_value(Unpicklerobject *self, long key)
+{
+	MemoEntry *entry;
+	PyObject *py_key;
+
+	if (!( entry = MemoTable_Get(self->memo, (Py_uintptr_t)key))) {
+		if ((py_key = PyInt_FromLong(key))) {
+			PyErr_SetObject(BadPickleGet, py_key);
+			Py_DECREF(py_key);
+		}
+		return -1;
+	}
+
+	PDATA_APPEND(self->stack, entry->obj, -1);
+	return 0;
+}
+
+
 static int
 load_get(Unpicklerobject *self)
 {
-	PyObject *py_str = 0, *value = 0;
+	PyObject *py_str = 0;
 	int len;
 	char *s;
-	int rc;
+	long key;
 
 	if ((len = self->readline_func(self, &s)) < 0) return -1;
 	if (len < 2) return bad_readline();
 
-	if (!( py_str = PyString_FromStringAndSize(s, len - 1)))  return -1;
-
-	value = PyDict_GetItem(self->memo, py_str);
-	if (! value) {
-		PyErr_SetObject(BadPickleGet, py_str);
-		rc = -1;
-	}
-	else {
-		PDATA_APPEND(self->stack, value, -1);
-		rc = 0;
+	if (parse_memo_key(s, len, &key) < 0) {
+		if ((py_str = PyString_FromStringAndSize(s, len - 1))) {
+			PyErr_SetObject(BadPickleGet, py_str);
+			Py_DECREF(py_str);
+		}
+		return -1;
 	}
 
-	Py_DECREF(py_str);
-	return rc;
+	return push_memo_value(self, key);
 }
 
 
 static int
 load_binget(Unpicklerobject *self)
 {
-	PyObject *py_key = 0, *value = 0;
-	unsigned char key;
 	char *s;
-	int rc;
 
 	if (self->read_func(self, &s, 1) < 0) return -1;
 
-	key = (unsigned char)s[0];
-	if (!( py_key = PyInt_FromLong((long)key)))  return -1;
-
-	value = PyDict_GetItem(self->memo, py_key);
-	if (! value) {
-		PyErr_SetObject(BadPickleGet, py_key);
-		rc = -1;
-	}
-	else {
-		PDATA_APPEND(self->stack, value, -1);
-		rc = 0;
-	}
-
-	Py_DECREF(py_key);
-	return rc;
+	return push_memo_value(self, (long)(unsigned char)s[0]);
 }
 
 
 static int
 load_long_binget(Unpicklerobject *self)
 {
-	PyObject *py_key = 0, *value = 0;
 	unsigned char c;
 	char *s;
 	long key;
-	int rc;
 
 	if (self->read_func(self, &s, 4) < 0) return -1;
 
@@ -4148,20 +4491,7 @@ load_long_binget(Unpicklerobject *self)
 	c = (unsigned char)s[3];
 	key |= (long)c << 24;
 
-	if (!( py_key = PyInt_FromLong((long)key)))  return -1;
-
-	value = PyDict_GetItem(self->memo, py_key);
-	if (! value) {
-		PyErr_SetObject(BadPickleGet, py_key);
-		rc = -1;
-	}
-	else {
-		PDATA_APPEND(self->stack, value, -1);
-		rc = 0;
-	}
-
-	Py_DECREF(py_key);
-	return rc;
+	return push_memo_value(self, key);
 }
 
 /* Push an object from the extension registry (EXT[124]).  nbytes is
@@ -4236,26 +4566,28 @@ load_extension(Unpicklerobject *self, int nbytes)
 static int
 load_put(Unpicklerobject *self)
 {
-	PyObject *py_str = 0, *value = 0;
+	PyObject *value = 0;
 	int len, l;
 	char *s;
+	long key;
 
 	if ((l = self->readline_func(self, &s)) < 0) return -1;
 	if (l < 2) return bad_readline();
 	if (!( len=self->stack->length ))  return stackUnderflow();
-	if (!( py_str = PyString_FromStringAndSize(s, l - 1)))  return -1;
+	if (parse_memo_key(s, l, &key) < 0) {
+		PyErr_SetString(UnpicklingError, "invalid PUT key");
+		return -1;
+	}
 	value=self->stack->data[len-1];
-	l=PyDict_SetItem(self->memo, py_str, value);
-	Py_DECREF(py_str);
-	return l;
+	return MemoTable_Set(self->memo, (Py_uintptr_t)key, value, key);
 }
 
 
 static int
 load_binput(Unpicklerobject *self)
 {
-	PyObject *py_key = 0, *value = 0;
-	unsigned char key;
+	PyObject *value = 0;
+	long key;
 	char *s;
 	int len;
 
@@ -4264,18 +4596,15 @@ load_binput(Unpicklerobject *self)
 
 	key = (unsigned char)s[0];
 
-	if (!( py_key = PyInt_FromLong((long)key)))  return -1;
 	value=self->stack->data[len-1];
-	len=PyDict_SetItem(self->memo, py_key, value);
-	Py_DECREF(py_key);
-	return len;
+	return MemoTable_Set(self->memo, (Py_uintptr_t)key, value, key);
 }
 
 
 static int
 load_long_binput(Unpicklerobject *self)
 {
-	PyObject *py_key = 0, *value = 0;
+	PyObject *value = 0;
 	long key;
 	unsigned char c;
 	char *s;
@@ -4293,11 +4622,8 @@ load_long_binput(Unpicklerobject *self)
 	c = (unsigned char)s[3];
 	key |= (long)c << 24;
 
-	if (!( py_key = PyInt_FromLong(key)))  return -1;
 	value=self->stack->data[len-1];
-	len=PyDict_SetItem(self->memo, py_key, value);
-	Py_DECREF(py_key);
-	return len;
+	return MemoTable_Set(self->memo, (Py_uintptr_t)key, value, key);
 }
 
 
@@ -5272,16 +5598,41 @@ noload(Unpicklerobject *self)
 }
 
 
+static int Unpickler_set_memo(Unpicklerobject *, PyObject *);
+static int Unpickler_update_memo_dict(Unpicklerobject *);
+
+/* Run load() or noload(), keeping the memo dict (if any) in sync with
+ * the memo table.  See Unpickler_get_memo(). */
+static PyObject *
+Unpickler_load_with_memo_dict(Unpicklerobject *self,
+			      PyObject *(*load_func)(Unpicklerobject *))
+{
+	PyObject *res;
+
+	if (!self->memo_dict)
+		return load_func(self);
+
+	if (Unpickler_set_memo(self, self->memo_dict) < 0)
+		return NULL;
+	if (!( res = load_func(self)))
+		return NULL;
+	if (Unpickler_update_memo_dict(self) < 0) {
+		Py_DECREF(res);
+		return NULL;
+	}
+	return res;
+}
+
 static PyObject *
 Unpickler_load(Unpicklerobject *self, PyObject *unused)
 {
-	return load(self);
+	return Unpickler_load_with_memo_dict(self, load);
 }
 
 static PyObject *
 Unpickler_noload(Unpicklerobject *self, PyObject *unused)
 {
-	return noload(self);
+	return Unpickler_load_with_memo_dict(self, noload);
 }
 
 
@@ -5322,8 +5673,9 @@ newUnpicklerobject(PyObject *f)
 	self->read = NULL;
 	self->readline = NULL;
 	self->find_class = NULL;
+	self->memo_dict = NULL;
 
-	if (!( self->memo = PyDict_New()))
+	if (!( self->memo = MemoTable_New()))
 		goto err;
 
 	if (!self->stack)
@@ -5387,7 +5739,8 @@ Unpickler_dealloc(Unpicklerobject *self)
 	Py_XDECREF(self->readline);
 	Py_XDECREF(self->read);
 	Py_XDECREF(self->file);
-	Py_XDECREF(self->memo);
+	MemoTable_Del(self->memo);
+	Py_XDECREF(self->memo_dict);
 	Py_XDECREF(self->stack);
 	Py_XDECREF(self->pers_func);
 	Py_XDECREF(self->arg);
@@ -5408,10 +5761,14 @@ Unpickler_dealloc(Unpicklerobject *self)
 static int
 Unpickler_traverse(Unpicklerobject *self, visitproc visit, void *arg)
 {
+	int vret;
+
 	Py_VISIT(self->readline);
 	Py_VISIT(self->read);
 	Py_VISIT(self->file);
-	Py_VISIT(self->memo);
+	if ((vret = MemoTable_Traverse(self->memo, visit, arg)))
+		return vret;
+	Py_VISIT(self->memo_dict);
 	Py_VISIT(self->stack);
 	Py_VISIT(self->pers_func);
 	Py_VISIT(self->arg);
@@ -5426,7 +5783,9 @@ Unpickler_clear(Unpicklerobject *self)
 	Py_CLEAR(self->readline);
 	Py_CLEAR(self->read);
 	Py_CLEAR(self->file);
-	Py_CLEAR(self->memo);
+	if (self->memo)
+		MemoTable_Clear(self->memo);
+	Py_CLEAR(self->memo_dict);
 	Py_CLEAR(self->stack);
 	Py_CLEAR(self->pers_func);
 	Py_CLEAR(self->arg);
@@ -5435,6 +5794,113 @@ Unpickler_clear(Unpicklerobject *self)
 	return 0;
 }
 
+/* Store every entry of the memo table into the memo dict, keyed by
+ * memo index. */
+static int
+Unpickler_update_memo_dict(Unpicklerobject *self)
+{
+	PyObject *py_key;
+	MemoEntry *entry;
+	Py_ssize_t i;
+	int res;
+
+	for (i = self->memo->mask + 1, entry = self->memo->table;
+	     --i >= 0; entry++) {
+		if (!entry->obj)
+			continue;
+		if (!( py_key = PyInt_FromLong(entry->index)))
+			return -1;
+		res = PyDict_SetItem(self->memo_dict, py_key, entry->obj);
+		Py_DECREF(py_key);
+		if (res < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Like the Pickler's memo, the memo attribute is a real dict that
+ * load() and noload() synchronize the memo table with.  Its keys are
+ * ints even for text pickles, whose memo keys used to be the strings
+ * from their PUT lines. */
+static PyObject *
+Unpickler_get_memo(Unpicklerobject *self)
+{
+	if (!self->memo_dict) {
+		if (!( self->memo_dict = PyDict_New()))
+			return NULL;
+		if (Unpickler_update_memo_dict(self) < 0) {
+			Py_CLEAR(self->memo_dict);
+			return NULL;
+		}
+	}
+	Py_INCREF(self->memo_dict);
+	return self->memo_dict;
+}
+
+/* Set the memo table from the entries of value whose keys are ints,
+ * longs, or the string keys of text pickles (which come first, so that
+ * an int key that load() stored later wins).  The memo used to be a
+ * dict that took any key, so other keys are silently ignored, since no
+ * pickle could refer to them anyways. */
+static int
+Unpickler_set_memo(Unpicklerobject *self, PyObject *value)
+{
+	MemoTable *new_memo, *old_memo;
+	PyObject *py_key, *obj, *old_dict;
+	Py_ssize_t i;
+	long key;
+	int str_keys;
+
+	if (!PyDict_Check(value)) {
+		PyErr_SetString(PyExc_TypeError, "memo must be a dictionary");
+		return -1;
+	}
+
+	if (!( new_memo = MemoTable_New()))
+		return -1;
+
+	for (str_keys = 1; str_keys >= 0; str_keys--) {
+		i = 0;
+		while (PyDict_Next(value, &i, &py_key, &obj)) {
+			if (PyString_Check(py_key)) {
+				if (!str_keys ||
+				    parse_memo_key(PyString_AS_STRING(py_key),
+						   PyString_GET_SIZE(py_key) + 1,
+						   &key) < 0)
+					continue;
+			}
+			else if (PyInt_Check(py_key) || PyLong_Check(py_key)) {
+				if (str_keys)
+					continue;
+				key = PyInt_AsLong(py_key);
+				if (key == -1 && PyErr_Occurred()) {
+					PyErr_Clear();
+					continue;
+				}
+			}
+			else
+				continue;
+			if (MemoTable_Set(new_memo, (Py_uintptr_t)key,
+					  obj, key) < 0)
+				goto err;
+		}
+	}
+
+	old_memo = self->memo;
+	self->memo = new_memo;
+	MemoTable_Del(old_memo);
+
+	old_dict = self->memo_dict;
+	Py_INCREF(value);
+	self->memo_dict = value;
+	Py_XDECREF(old_dict);
+	return 0;
+
+  err:
+	MemoTable_Del(new_memo);
+	return -1;
+}
+
 static PyObject *
 Unpickler_getattr(Unpicklerobject *self, char *name)
 {
@@ -5464,8 +5930,7 @@ Unpickler_getattr(Unpicklerobject *self, char *name)
 			return NULL;
 		}
 
-		Py_INCREF(self->memo);
-		return self->memo;
+		return Unpickler_get_memo(self);
 	}
 
 	if (!strcmp(name, "UnpicklingError")) {
@@ -5501,17 +5966,8 @@ Unpickler_setattr(Unpicklerobject *self, char *name, PyObject *value)
 		return -1;
 	}
 
-	if (strcmp(name, "memo") == 0) {
-		if (!PyDict_Check(value)) {
-			PyErr_SetString(PyExc_TypeError,
-					"memo must be a dictionary");
-			return -1;
-		}
-		Py_XDECREF(self->memo);
-		self->memo = value;
-		Py_INCREF(value);
-		return 0;
-	}
+	if (strcmp(name, "memo") == 0)
+		return Unpickler_set_memo(self, value);
 
 	PyErr_SetString(PyExc_AttributeError, name);
 	return -1;
@@ -5550,6 +6006,32 @@ cpm_dump(PyObject *self, PyObject *args, PyObject *kwds)
 }
 
 
+/* Part of the C API (see cPickle.h) */
+static int
+dump_to_sink(PyObject *ob, int proto, PycPickle_Sink *sink)
+{
+	Picklerobject *pickler;
+	int res = -1;
+
+	if (!( pickler = newPicklerobject(Py_None, proto)))
+		return -1;
+
+	if (!( pickler->write_buf = (char *)PyMem_Malloc(SINK_BUF_SIZE))) {
+		PyErr_NoMemory();
+		goto finally;
+	}
+	pickler->write_func = write_sink;
+	pickler->sink = sink;
+
+	res = dump(pickler, ob);
+
+  finally:
+	Py_DECREF(pickler);
+
+	return res;
+}
+
+
 /* dumps(obj, protocol=0). */
 static PyObject *
 cpm_dumps(PyObject *self, PyObject *args, PyObject *kwds)
@@ -5843,6 +6325,10 @@ init_stuff(PyObject *module_dict)
 	return 0;
 }
 
+static struct PycPickle_CAPI CAPI = {
+	dump_to_sink,
+};
+
 #ifndef PyMODINIT_FUNC	/* declarations for DLL import/export */
 #define PyMODINIT_FUNC void
 #endif
@@ -5912,4 +6398,9 @@ initcPickle(void)
 	PyDict_SetItemString(d, "compatible_formats", compatible_formats);
 	Py_XDECREF(format_version);
 	Py_XDECREF(compatible_formats);
+
+	/* Export C API */
+	v = PyCObject_FromVoidPtr(&CAPI, NULL);
+	PyDict_SetItemString(d, "cPickle_CAPI", v);
+	Py_XDECREF(v);
 }
@@ -111,6 +111,7 @@ PyCode_New(int argcount, int nlocals, int stacksize, int flags,
     co->pg_func_memo_info = NULL; // pgbovine
     co->pg_force_memoization = 0; // pgbovine
     co->pg_no_stdout_stderr = 0;  // pgbovine
+    co->pg_global_varnames = NULL; // pgbovine
     co->pg_is_module = (strcmp(PyString_AsString(co->co_name), "<module>") == 0); // pgbovine
     pg_init_new_code_object(co); // pgbovine
 	}
@@ -278,6 +279,7 @@ code_dealloc(PyCodeObject *co)
 	Py_XDECREF(co->co_name);
 	Py_XDECREF(co->co_classname); // pgbovine
 	Py_XDECREF(co->pg_canonical_name); // pgbovine
+	Py_XDECREF(co->pg_global_varnames); // pgbovine
 	Py_XDECREF(co->co_lnotab);
         if (co->co_zombieframe != NULL)
                 PyObject_GC_Del(co->co_zombieframe);
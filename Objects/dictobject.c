@@ -8,6 +8,7 @@
 */
 
 #include "Python.h"
+#include "memoize.h" /* pgbovine */
 
 
 /* Set a key error with the specified argument, wrapping it in a
@@ -262,6 +263,7 @@ PyDict_New(void)
 #endif
 	}
 	mp->ma_lookup = lookdict_string;
+	PG_SET_BIRTH_TIME(mp); /* pgbovine */
 #ifdef SHOW_CONVERSION_COUNTS
 	++created;
 #endif
@@ -2210,6 +2212,7 @@ dict_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 		assert(d->ma_table == NULL && d->ma_fill == 0 && d->ma_used == 0);
 		INIT_NONZERO_DICT_SLOTS(d);
 		d->ma_lookup = lookdict_string;
+		PG_SET_BIRTH_TIME(d); /* pgbovine */
 #ifdef SHOW_CONVERSION_COUNTS
 		++created;
 #endif
@@ -732,6 +732,7 @@ PyFrame_New(PyThreadState *tstate, PyCodeObject *code, PyObject *globals,
   f->func_memo_info = NULL;
   f->stored_args_lst = NULL;
   f->stored_args_lst_hash = NULL;
+  f->lookup_bypassed = 0;
 
 	return f;
 }
@@ -1,6 +1,7 @@
 /* List object implementation */
 
 #include "Python.h"
+#include "memoize.h" /* pgbovine */
 
 #ifdef STDC_HEADERS
 #include <stddef.h>
@@ -158,6 +159,7 @@ PyList_New(Py_ssize_t size)
 	}
 	Py_SIZE(op) = size;
 	op->allocated = size;
+	PG_SET_BIRTH_TIME(op); /* pgbovine */
 	_PyObject_GC_TRACK(op);
 	return (PyObject *) op;
 }
@@ -1960,7 +1960,7 @@ PyEval_EvalFrameEx(PyFrameObject *f, int throwflag)
         /* pgbovine - ONLY register a LOAD_GLOBAL event on a NON-builtin */
         else {
           Py_INCREF(x); /* pgbovine - INCREF before calling pg_LOAD_GLOBAL_event */
-          pg_LOAD_GLOBAL_event(w, x);
+          pg_LOAD_GLOBAL_event(w, oparg, x);
         }
 
         /* pgbovine - SUCCESS case, found a global variable */
@@ -1991,7 +1991,7 @@ PyEval_EvalFrameEx(PyFrameObject *f, int throwflag)
 						PUSH(x);
             /* pgbovine - SUCCESS case, continue next iteration of interpreter loop */
             /* pgbovine - ONLY register a LOAD_GLOBAL event on a NON-builtin */
-            pg_LOAD_GLOBAL_event(w, x);
+            pg_LOAD_GLOBAL_event(w, oparg, x);
 						continue;
 					}
 					d = (PyDictObject *)(f->f_builtins);
@@ -2027,7 +2027,7 @@ PyEval_EvalFrameEx(PyFrameObject *f, int throwflag)
       /* pgbovine - ONLY register a LOAD_GLOBAL event on a NON-builtin */
       else {
         Py_INCREF(x); /* pgbovine - INCREF before calling pg_LOAD_GLOBAL_event */
-        pg_LOAD_GLOBAL_event(w, x);
+        pg_LOAD_GLOBAL_event(w, oparg, x);
       }
 
 			PUSH(x);
@@ -15,13 +15,26 @@
 #include "memoize_profiling.h"
 #include "memoize_codedep.h"
 #include "memoize_reachability.h"
+#include "memoize_costmodel.h"
+#include "memoize_eviction.h"
+#include "memoize_shmindex.h"
+#include "memoize_cacheserver.h"
+#include "memoize_storage.h"
+#include "memoize_layers.h"
+#include "memoize_manifest.h"
+#include "memoize_codec.h"
+#include "memoize_record.h"
 
 #include "dictobject.h"
 #include "import.h"
 
 #include "cStringIO.h"
 
+#include "../Modules/md5.h" // for hexdigest_str()
+#include "cPickle.h" // for hexdigest_pickled()
+
 #include <time.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <string.h>
 
@@ -203,14 +216,26 @@ static FILE* user_log_file = NULL;
 // References to Python standard library functions:
 
 PyObject* cPickle_load_func = NULL;           // cPickle.load
+PyObject* cPickle_loadstr_func = NULL;        // cPickle.loads
 PyObject* cPickle_dumpstr_func = NULL;        // cPickle.dumps
 PyObject* cPickle_dump_func = NULL;           // cPickle.dump
-static PyObject* hashlib_md5_func = NULL;     // hashlib.md5
 
 static PyObject* abspath_func = NULL; // os.path.abspath
 
 PyObject* ignore_str = NULL;
 
+PyObject* incpy_cache_dir = NULL;
+
+// set from 'project_root = <path>' in incpy.config (with a trailing '/')
+static PyObject* project_root_path = NULL;
+
+// set by 'project_root = vcs' in incpy.config
+static char project_root_is_vcs_root = 0;
+
+// Key: absolute path of a file, Value: its relocatable path
+// (see pg_relocatable_path())
+static PyObject* relocatable_path_cache = NULL;
+
 // lazily import this if necessary
 static PyObject* numpy_module = NULL;
 
@@ -233,13 +258,20 @@ extern time_t PyOS_GetLastModificationTime(char *, FILE *);
 
 // our notion of 'time' within an execution, measured by number of
 // elapsed function calls:
-unsigned int num_executed_func_calls = 0;
+unsigned PY_LONG_LONG num_executed_func_calls = 0;
 
 // from memoize_fmi.c
 extern FuncMemoInfo* NEW_func_memo_info(PyCodeObject* cod);
 extern void DELETE_func_memo_info(FuncMemoInfo* fmi);
-extern void clear_cache_and_mark_pure(FuncMemoInfo* func_memo_info);
+extern void switch_cache_version_and_mark_pure(FuncMemoInfo* func_memo_info);
 extern FuncMemoInfo* get_func_memo_info_from_cod(PyCodeObject* cod);
+extern void init_cache_versions(void);
+extern void free_cache_versions(void);
+extern void reclaim_tombstones(void);
+extern void close_cache_lock(void);
+extern void load_func_profiles(void);
+extern void save_func_profiles(void);
+extern void update_func_profile_runtime(FuncMemoInfo* fmi, long runtime_ms);
 
 
 // set time limit to something smaller for debug mode, so that my
@@ -422,7 +454,7 @@ PyObject* get_global_container(PyObject* obj) {
   return level_1_map[level_1_addr][level_2_addr][level_3_addr][level_4_addr].global_container_weakref;
 }
 
-void set_arg_reachable_func_start_time(PyObject* obj, unsigned int start_func_call_time) {
+void set_arg_reachable_func_start_time(PyObject* obj, unsigned PY_LONG_LONG start_func_call_time) {
   if (!level_1_map) {
     return;
   }
@@ -435,7 +467,7 @@ void set_arg_reachable_func_start_time(PyObject* obj, unsigned int start_func_ca
   //assert(get_arg_reachable_func_start_time(obj) == start_func_call_time);
 }
 
-unsigned int get_arg_reachable_func_start_time(PyObject* obj) {
+unsigned PY_LONG_LONG get_arg_reachable_func_start_time(PyObject* obj) {
   CREATE_ADDRS
 
   if (!level_1_map ||
@@ -547,7 +579,7 @@ PyObject* get_global_container(PyObject* obj) {
   return level_1_map[level_1_addr][level_2_addr].global_container_weakref;
 }
 
-void set_arg_reachable_func_start_time(PyObject* obj, unsigned int start_func_call_time) {
+void set_arg_reachable_func_start_time(PyObject* obj, unsigned PY_LONG_LONG start_func_call_time) {
   if (!level_1_map) {
     return;
   }
@@ -560,7 +592,7 @@ void set_arg_reachable_func_start_time(PyObject* obj, unsigned int start_func_ca
   //assert(get_arg_reachable_func_start_time(obj) == start_func_call_time);
 }
 
-unsigned int get_arg_reachable_func_start_time(PyObject* obj) {
+unsigned PY_LONG_LONG get_arg_reachable_func_start_time(PyObject* obj) {
   CREATE_ADDRS
 
   if (!level_1_map || !level_1_map[level_1_addr]) {
@@ -675,33 +707,256 @@ static PyObject* create_proxy_object(PyObject* obj) {
    from disk will be a different object than the one in memory, so '=='
    will ALWAYS FAIL, even if they are semantically equal */
 static int has_comparison_method(PyObject* elt) {
-  // all of these primitive picklable types should pass with flying colors,
-  // even if they don't explicitly implement a comparison method
-  if (IS_PRIMITIVE_TYPE(elt)) {
-    return 1;
-  }
+  unsigned int type_class = TYPE_CLASS(Py_TYPE(elt));
+
   // instance objects always have tp_compare and tp_richcompare
   // methods, so we need to check for __eq__
-  else if (PyInstance_Check(elt)) {
+  if (type_class & TYPECLASS_INSTANCE) {
     return PyObject_HasAttrString(elt, "__eq__");
   }
-  /* make an exception for compiled regular expression pattern objects,
-     since although they don't implement comparison functions, they do
-     some sort of interning that allows them to be compared properly
-     using '==' */
-  else if (strcmp(Py_TYPE(elt)->tp_name, "_sre.SRE_Pattern") == 0) {
-    return 1;
+  return (type_class & TYPECLASS_HAS_COMPARISON) != 0;
+}
+
+
+// same tolerances as numpy.allclose(), which obj_equals() used to call
+// for all NumPy arrays
+#define ARRAY_RTOL 1e-05
+#define ARRAY_ATOL 1e-08
+
+// what it means when the bytes of two array items differ:
+#define ITEMS_DIFFER 0 // they're unequal (e.g., ints)
+#define ITEMS_CLOSE_FLOAT 1 // they might be within tolerance (C floats)
+#define ITEMS_CLOSE_DOUBLE 2 // (C doubles)
+#define ITEMS_UNKNOWN 3 // can't tell without calling '=='
+
+// classifies the items of a buffer by its struct-module-style format
+static int buffer_item_kind(Py_buffer* view) {
+  const char* fmt = view->format ? view->format : "B";
+
+  // a byte order prefix doesn't matter when the bytes are identical,
+  // but we can only do float arithmetic on native-order items
+  int native_order = 1;
+  if (*fmt == '@' || *fmt == '=') {
+    fmt++;
   }
-  else {
-    return (Py_TYPE(elt)->tp_compare || Py_TYPE(elt)->tp_richcompare);
+  else if (*fmt == '<' || *fmt == '>' || *fmt == '!') {
+#ifdef WORDS_BIGENDIAN
+    native_order = (*fmt != '<');
+#else
+    native_order = (*fmt == '<');
+#endif
+    fmt++;
+  }
+
+  if (fmt[0] == '\0' || fmt[1] != '\0') {
+    return ITEMS_UNKNOWN; // e.g., records or sub-arrays
+  }
+  if (strchr("?cbBhHiIlLqQ", fmt[0])) {
+    return ITEMS_DIFFER;
+  }
+  if (native_order && fmt[0] == 'f' && view->itemsize == sizeof(float)) {
+    return ITEMS_CLOSE_FLOAT;
+  }
+  if (native_order && fmt[0] == 'd' && view->itemsize == sizeof(double)) {
+    return ITEMS_CLOSE_DOUBLE;
   }
+  return ITEMS_UNKNOWN; // e.g., 'O' (object pointers)
+}
+
+static int doubles_close(double a, double b) {
+  // NaNs fail this test, just like in numpy.allclose()
+  return fabs(a - b) <= ARRAY_ATOL + ARRAY_RTOL * fabs(b);
+}
+
+// compares n items whose bytes differ somewhere in [p1, p1 + n*itemsize)
+// and [p2, p2 + n*itemsize): returns 1 if equal, 0 if not, and -1 if
+// we can't tell
+static int buffer_items_equal(char* p1, char* p2, Py_ssize_t n,
+                              Py_ssize_t itemsize, int kind) {
+  Py_ssize_t i;
+  switch (kind) {
+    case ITEMS_DIFFER:
+      return 0;
+    case ITEMS_CLOSE_FLOAT:
+      for (i = 0; i < n; i++) {
+        float a, b;
+        memcpy(&a, p1 + i*itemsize, sizeof(a)); // may be unaligned
+        memcpy(&b, p2 + i*itemsize, sizeof(b));
+        if (a != b && !doubles_close(a, b)) {
+          return 0;
+        }
+      }
+      return 1;
+    case ITEMS_CLOSE_DOUBLE:
+      for (i = 0; i < n; i++) {
+        double a, b;
+        memcpy(&a, p1 + i*itemsize, sizeof(a));
+        memcpy(&b, p2 + i*itemsize, sizeof(b));
+        if (a != b && !doubles_close(a, b)) {
+          return 0;
+        }
+      }
+      return 1;
+    default:
+      return -1;
+  }
+}
+
+// compares the sub-arrays of v1 and v2 starting at p1 and p2, from
+// dimension dim onwards (same return values as buffer_items_equal)
+static int buffer_region_equals(Py_buffer* v1, char* p1,
+                                Py_buffer* v2, char* p2, int dim, int kind) {
+  Py_ssize_t itemsize = v1->itemsize;
+
+  if (dim == v1->ndim) { // a single item
+    if (memcmp(p1, p2, itemsize) == 0) {
+      return 1;
+    }
+    return buffer_items_equal(p1, p2, 1, itemsize, kind);
+  }
+
+  Py_ssize_t n = v1->shape[dim];
+  Py_ssize_t stride1 = v1->strides[dim];
+  Py_ssize_t stride2 = v2->strides[dim];
+
+  // common case: the innermost dimension is contiguous in both
+  if (dim == v1->ndim - 1 && stride1 == itemsize && stride2 == itemsize) {
+    if (memcmp(p1, p2, n * itemsize) == 0) {
+      return 1;
+    }
+    return buffer_items_equal(p1, p2, n, itemsize, kind);
+  }
+
+  Py_ssize_t i;
+  for (i = 0; i < n; i++) {
+    int res = buffer_region_equals(v1, p1 + i*stride1, v2, p2 + i*stride2,
+                                   dim + 1, kind);
+    if (res != 1) {
+      return res;
+    }
+  }
+  return 1;
+}
+
+// returns 1 iff comparing the buffers of two instances of t means the
+// same thing as comparing them with numpy.allclose(), i.e., if t is
+// numpy.ndarray or numpy.matrix, or a subclass of numpy.ndarray that
+// doesn't define its own '=='.  (Anything else with a buffer might
+// define equality some other way, like masked arrays, whose buffers
+// don't even include their masks.)
+static int buffer_equals_type_ok(PyTypeObject* t) {
+  PyObject* mro = t->tp_mro;
+  if (!mro || !PyTuple_Check(mro)) {
+    return 0;
+  }
+
+  Py_ssize_t i;
+  for (i = 0; i < PyTuple_GET_SIZE(mro); i++) {
+    PyTypeObject* c = (PyTypeObject*)PyTuple_GET_ITEM(mro, i);
+    if (strcmp(c->tp_name, "numpy.ndarray") == 0) {
+      return 1;
+    }
+    if ((strcmp(c->tp_name, "MaskedArray") == 0) ||
+        (strcmp(c->tp_name, "numpy.ma.core.MaskedArray") == 0)) {
+      return 0;
+    }
+    // (numpy.matrix doesn't define '==', so it passes this check)
+    if (!c->tp_dict || PyDict_GetItemString(c->tp_dict, "__eq__")) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// compares two NumPy arrays or matrices (see buffer_equals_type_ok())
+// through the buffer protocol by their shape, item format and raw
+// bytes, without calling their '==' (which builds up a whole new array
+// of booleans).  Items that are floats or doubles are compared with the
+// same tolerance as numpy.allclose().
+//
+// returns 1 if equal, 0 if not, and -1 if obj1 and obj2 aren't such
+// objects, or if it can't tell (e.g., arrays of Python objects), in
+// which case the caller should compare them some other way
+static int buffer_equals(PyObject* obj1, PyObject* obj2) {
+  PyTypeObject* t = Py_TYPE(obj1);
+
+  if (t != Py_TYPE(obj2) || !PyObject_CheckBuffer(obj1) ||
+      !buffer_equals_type_ok(t)) {
+    return -1;
+  }
+
+  Py_buffer v1, v2;
+  if (PyObject_GetBuffer(obj1, &v1, PyBUF_RECORDS_RO) < 0) {
+    PyErr_Clear();
+    return -1;
+  }
+  if (PyObject_GetBuffer(obj2, &v2, PyBUF_RECORDS_RO) < 0) {
+    PyErr_Clear();
+    PyBuffer_Release(&v1);
+    return -1;
+  }
+
+  int ret = -1;
+
+  if (v1.suboffsets || v2.suboffsets) {
+    goto buffer_equals_done; // (rare) arrays of pointers to arrays
+  }
+
+  // different shapes or item formats mean different arrays
+  // (unlike numpy.allclose(), which broadcasts and converts them)
+  const char* fmt1 = v1.format ? v1.format : "B";
+  const char* fmt2 = v2.format ? v2.format : "B";
+  if (v1.ndim != v2.ndim || v1.itemsize != v2.itemsize ||
+      strcmp(fmt1, fmt2) != 0) {
+    ret = 0;
+    goto buffer_equals_done;
+  }
+  int i;
+  for (i = 0; i < v1.ndim; i++) {
+    if (v1.shape[i] != v2.shape[i]) {
+      ret = 0;
+      goto buffer_equals_done;
+    }
+  }
+
+  int kind = buffer_item_kind(&v1);
+
+  // fast path: compare all the bytes at once when the strides match
+  // (always true for contiguous arrays of the same shape)
+  if (v1.len == v2.len &&
+      PyBuffer_IsContiguous(&v1, 'A') && PyBuffer_IsContiguous(&v2, 'A') &&
+      (v1.ndim <= 1 ||
+       memcmp(v1.strides, v2.strides, v1.ndim * sizeof(Py_ssize_t)) == 0)) {
+    if (memcmp(v1.buf, v2.buf, v1.len) == 0) {
+      ret = 1;
+    }
+    else {
+      ret = buffer_items_equal(v1.buf, v2.buf, v1.len / v1.itemsize,
+                               v1.itemsize, kind);
+    }
+  }
+  else if (v1.ndim > 0 && v1.strides && v2.strides) {
+    ret = buffer_region_equals(&v1, v1.buf, &v2, v2.buf, 0, kind);
+  }
+
+buffer_equals_done:
+  PyBuffer_Release(&v1);
+  PyBuffer_Release(&v2);
+  return ret;
 }
 
 
 // returns 1 iff "obj1 == obj2" in Python-world
 // (can be SLOW when comparing large objects)
 int obj_equals(PyObject* obj1, PyObject* obj2) {
-  // first try the regular generic '==' comparison function:
+  // NumPy arrays can be compared natively, which is MUCH faster than
+  // through '=='
+  int buffer_cmp = buffer_equals(obj1, obj2);
+  if (buffer_cmp >= 0) {
+    return buffer_cmp;
+  }
+
+  // otherwise try the regular generic '==' comparison function:
 
   // we want to use this function because it implements "obj1 == obj2"
   // spec for PyObject_RichCompareBool from Objects/object.c:
@@ -718,7 +973,8 @@ int obj_equals(PyObject* obj1, PyObject* obj2) {
     const char* obj2_typename = Py_TYPE(obj2)->tp_name;
 
     // use numpy.allclose(obj1, obj2) to compare NumPy arrays and
-    // matrices, since '==' doesn't return a single boolean value
+    // matrices that buffer_equals() couldn't handle (e.g., masked
+    // arrays), since '==' doesn't return a single boolean value
     //
     // TODO: use a trie if this seems too slow ...
     if ((strcmp(obj1_typename, "numpy.ndarray") == 0) ||
@@ -810,15 +1066,131 @@ static int prefix_in_ignore_paths_lst(PyObject* s) {
 }
 
 
+// returns a new reference to path (which is inside of incpy_cache_dir)
+// rewritten as if the cache directory were ./incpy-cache, for naming
+// cache files in ways that don't depend on where the cache lives
+// (e.g., inside of databases and base cache layers)
+PyObject* portable_cache_path(PyObject* path) {
+  Py_ssize_t dir_len = PyString_GET_SIZE(incpy_cache_dir);
+  char* path_str = PyString_AsString(path);
+
+  if ((strcmp(INCPY_CACHE_DIR, "incpy-cache") != 0) &&
+      (strncmp(path_str, INCPY_CACHE_DIR, dir_len) == 0) &&
+      ((path_str[dir_len] == '/') || (path_str[dir_len] == '\0'))) {
+    return PyString_FromFormat("incpy-cache%s", path_str + dir_len);
+  }
+
+  Py_INCREF(path);
+  return path;
+}
+
+
+/* Canonical names should stay the same when the same code is checked
+   out somewhere else (by another user, on a CI runner, in a container,
+   etc.), or else none of its cache entries can be found there.  Thus,
+   each file in a project is named by its path RELATIVE to the root of
+   that project, which is either the directory from 'project_root =
+   <path>' in incpy.config, or with 'project_root = vcs', the nearest
+   enclosing directory that is the root of a version control checkout.
+   Files outside of any project (e.g., in the standard library) keep
+   their absolute paths, and so does everything without a project_root
+   line, since that's how all existing caches were named. */
+static const char* vcs_root_markers[] = {".git", ".hg", ".svn", ".bzr", NULL};
+
+// returns the length of the nearest version control root directory
+// above the absolute path path_str (or 0 if there's none)
+static size_t find_vcs_root_len(char* path_str) {
+  char dir[PATH_MAX];
+  strncpy(dir, path_str, PATH_MAX - 1);
+  dir[PATH_MAX - 1] = '\0';
+
+  char* slash;
+  while ((slash = strrchr(dir, '/')) != NULL && slash != dir) {
+    *slash = '\0';
+
+    int i;
+    for (i = 0; vcs_root_markers[i]; i++) {
+      char marker_path[PATH_MAX + 16];
+      struct stat st;
+      snprintf(marker_path, sizeof(marker_path), "%s/%s", dir, vcs_root_markers[i]);
+      if (stat(marker_path, &st) == 0) {
+        return strlen(dir);
+      }
+    }
+  }
+  return 0;
+}
+
+// returns a borrowed reference to the path of filename relative to its
+// project root (or its absolute path if it's not in any project), or
+// NULL if it can't be turned into an absolute path
+PyObject* pg_relocatable_path(PyObject* filename) {
+  // a relative co_filename names a different file once the program
+  // changes directories, so key the cache by absolute paths (which an
+  // absolute co_filename already is, so we can skip abspath for it)
+  PyObject* key = NULL;
+  if (PyString_AsString(filename)[0] == '/') {
+    key = filename;
+    Py_INCREF(key);
+  }
+  else {
+    key = PyObject_CallFunctionObjArgs(abspath_func, filename, NULL);
+    if (!key) {
+      return NULL;
+    }
+  }
+
+  PyObject* ret = PyDict_GetItem(relocatable_path_cache, key);
+  if (ret) {
+    Py_DECREF(key);
+    return ret;
+  }
+
+  // (also normalizes things like '..' in absolute co_filenames)
+  PyObject* path = PyObject_CallFunctionObjArgs(abspath_func, key, NULL);
+  if (!path) {
+    Py_DECREF(key);
+    return NULL;
+  }
+
+  char* path_str = PyString_AsString(path);
+  size_t root_len = 0;
+  if (project_root_path) {
+    // (project_root_path ends in '/')
+    size_t len = PyString_GET_SIZE(project_root_path);
+    if (strncmp(path_str, PyString_AsString(project_root_path), len) == 0) {
+      root_len = len - 1;
+    }
+  }
+  else if (project_root_is_vcs_root) {
+    root_len = find_vcs_root_len(path_str);
+  }
+
+  if (root_len > 0) {
+    ret = PyString_FromString(path_str + root_len + 1);
+  }
+  else {
+    ret = path;
+    Py_INCREF(ret);
+  }
+  Py_DECREF(path);
+
+  PyDict_SetItem(relocatable_path_cache, key, ret);
+  Py_DECREF(ret); // relocatable_path_cache holds the only reference
+  Py_DECREF(key);
+  return ret;
+}
+
+
 /* Returns a newly-allocated PyString object that represents a canonical
    name for the given code object:
 
      "$function_name [$filename]" if it's a regular function
      "$classname::$function_name [$filename]" if it's a method
 
-   To canonicalize file paths, we use os.path.abspath to grab the
-   ABSOLUTE PATH of the filename.  If there is some error in creating
-   a canonical name, then return NULL. */
+   To canonicalize file paths, we use the path of the filename relative
+   to its project root (see pg_relocatable_path()).  If there is some
+   error in creating a canonical name, then return NULL. */
 static PyObject* create_canonical_code_name(PyCodeObject* this_code) {
   PyObject* classname = this_code->co_classname; // could be NULL
 
@@ -828,19 +1200,19 @@ static PyObject* create_canonical_code_name(PyCodeObject* this_code) {
   assert(PyString_CheckExact(name));
   assert(PyString_CheckExact(filename));
 
-  PyObject* filename_abspath = PyObject_CallFunctionObjArgs(abspath_func, filename, NULL);
+  PyObject* filename_path = pg_relocatable_path(filename);
 
   // this fails *mysteriously* in numpy when doing:
   //
   //  import numpy
   //  numpy.random.mtrand.shuffle([1])
-  if (!filename_abspath) {
+  if (!filename_path) {
     assert(PyErr_Occurred());
     // trying to clear the error results in a segfault, this is WEIRD!
     return NULL;
   }
 
-  assert(filename_abspath);
+  assert(filename_path);
 
   PyObject* ret = NULL;
 
@@ -848,21 +1220,20 @@ static PyObject* create_canonical_code_name(PyCodeObject* this_code) {
     assert(PyString_CheckExact(classname));
 
     PyObject* canonical_method_str = PyString_FromString("%s::%s [%s]");
-    PyObject* format_triple = PyTuple_Pack(3, classname, name, filename_abspath);
+    PyObject* format_triple = PyTuple_Pack(3, classname, name, filename_path);
     ret = PyString_Format(canonical_method_str, format_triple);
     Py_DECREF(format_triple);
     Py_DECREF(canonical_method_str);
   }
   else {
     PyObject* canonical_func_str = PyString_FromString("%s [%s]");
-    PyObject* format_pair = PyTuple_Pack(2, name, filename_abspath);
+    PyObject* format_pair = PyTuple_Pack(2, name, filename_path);
     ret = PyString_Format(canonical_func_str, format_pair);
     Py_DECREF(format_pair);
     Py_DECREF(canonical_func_str);
   }
 
   assert(ret);
-  Py_DECREF(filename_abspath);
 
   return ret;
 }
@@ -970,6 +1341,7 @@ void pg_CREATE_FUNCTION_event(PyFunctionObject* func) {
     USER_LOG_PRINTF("IGNORING_FUNCTION | %s\n",
                     PyString_AsString(cod->pg_canonical_name));
     cod->pg_ignore = 1;
+    Py_CLEAR(cod->pg_global_varnames); // (see get_global_varname)
   }
   else {
     add_new_code_dep(cod);
@@ -1129,18 +1501,94 @@ void pg_MARK_IMPURE_event(char* why) {
 }
 
 
+// md5_append takes an int length, so feed huge buffers in chunks
+static void md5_append_bytes(md5_state_t* md5_state,
+                             const char* s, Py_ssize_t n) {
+  const md5_byte_t* buf = (const md5_byte_t*)s;
+  while (n > 0) {
+    int chunk_len = (n > INT_MAX) ? INT_MAX : (int)n;
+    md5_append(md5_state, buf, chunk_len);
+    buf += chunk_len;
+    n -= chunk_len;
+  }
+}
+
+static PyObject* md5_hexdigest(md5_state_t* md5_state) {
+  static const char hexchars[] = "0123456789abcdef";
+
+  md5_byte_t digest[16];
+  char hexdigest[32];
+
+  md5_finish(md5_state, digest);
+
+  int i;
+  for (i = 0; i < 16; i++) {
+    hexdigest[2*i]     = hexchars[(digest[i] >> 4) & 0xf];
+    hexdigest[2*i + 1] = hexchars[digest[i] & 0xf];
+  }
+
+  return PyString_FromStringAndSize(hexdigest, 32);
+}
+
 // translates a string s into a compact md5 hexdigest string suitable
 // for use as a filename
+//
+// Equivalent to hashlib.md5(s).hexdigest(), but computed directly in C
+// using Modules/md5.c, since we call this for every new FuncMemoInfo
+// and for every argument list that we hash, and going through the
+// hashlib Python API adds up for programs that call LOTS of functions
 PyObject* hexdigest_str(PyObject* s) {
-  PyObject* md5_func = PyObject_CallFunctionObjArgs(hashlib_md5_func, s, NULL);
-  PyObject* tmp_str = PyString_FromString("hexdigest");
+  assert(PyString_Check(s));
 
-  // Perform: hashlib.md5(s).hexdigest()
-  PyObject* hexdigest = PyObject_CallMethodObjArgs(md5_func, tmp_str, NULL);
-  Py_DECREF(md5_func);
-  Py_DECREF(tmp_str);
+  md5_state_t md5_state;
+  md5_init(&md5_state);
+  md5_append_bytes(&md5_state, PyString_AS_STRING(s), PyString_GET_SIZE(s));
+  return md5_hexdigest(&md5_state);
+}
+
+
+// a cPickle sink (see "cPickle.h") that feeds a pickle into md5
+typedef struct {
+  PycPickle_Sink sink; // must be first
+  md5_state_t md5_state;
+} MD5Sink;
+
+static int md5_sink_write(PycPickle_Sink* sink, const char* s, Py_ssize_t n) {
+  md5_append_bytes(&((MD5Sink*)sink)->md5_state, s, n);
+  return 0;
+}
+
+// equivalent to hexdigest_str(cPickle.dumps(obj, -1)), but hashes the
+// pickle as cPickle produces it rather than first building it up as a
+// string, which saves a big allocation and copy when hashing large
+// argument lists
+//
+// returns NULL with an exception set if obj can't be pickled
+PyObject* hexdigest_pickled(PyObject* obj) {
+  if (!PycPickle) {
+    // pass in -1 to force cPickle to use a binary protocol
+    PyObject* negative_one = PyInt_FromLong(-1);
+    PyObject* pickled_str =
+      PyObject_CallFunctionObjArgs(cPickle_dumpstr_func, obj, negative_one, NULL);
+    Py_DECREF(negative_one);
+
+    if (!pickled_str) {
+      return NULL;
+    }
+    PyObject* ret = hexdigest_str(pickled_str);
+    Py_DECREF(pickled_str);
+    return ret;
+  }
+
+  MD5Sink md5_sink;
+  md5_sink.sink.write = md5_sink_write;
+  md5_sink.sink.next = NULL;
+  md5_init(&md5_sink.md5_state);
 
-  return hexdigest;
+  if (PycPickle->dump_to_sink(obj, -1, &md5_sink.sink) < 0) {
+    return NULL;
+  }
+  return md5_hexdigest(&md5_sink.md5_state);
 }
 
 
@@ -1213,16 +1661,19 @@ memset(level_1_map, 0, sizeof(*level_1_map) * METADATA_MAP_SIZE);
   cPickle_dump_func = PyObject_GetAttrString(cPickle_module, "dump");
   cPickle_dumpstr_func = PyObject_GetAttrString(cPickle_module, "dumps");
   cPickle_load_func = PyObject_GetAttrString(cPickle_module, "load");
+
+  // for hexdigest_pickled() (optional, since it falls back on dumps)
+  PycPickle_IMPORT;
+  if (!PycPickle) {
+    PyErr_Clear();
+  }
+  cPickle_loadstr_func = PyObject_GetAttrString(cPickle_module, "loads");
   Py_DECREF(cPickle_module);
 
   assert(cPickle_dump_func);
   assert(cPickle_dumpstr_func);
   assert(cPickle_load_func);
-
-  PyObject* hashlib_module = PyImport_ImportModule("hashlib"); // increments refcount
-  hashlib_md5_func = PyObject_GetAttrString(hashlib_module, "md5");
-  Py_DECREF(hashlib_module);
-  assert(hashlib_md5_func);
+  assert(cPickle_loadstr_func);
 
   PyObject* os_module = PyImport_ImportModule("os"); // increments refcount
   PyObject* path_module = PyObject_GetAttrString(os_module, "path");
@@ -1230,6 +1681,8 @@ memset(level_1_map, 0, sizeof(*level_1_map) * METADATA_MAP_SIZE);
   assert(abspath_func);
 
   ignore_str = PyString_FromString("IGNORE");
+  relocatable_path_cache = PyDict_New();
+  incpy_cache_dir = PyString_FromString("incpy-cache");
 
 
   // look for the mandatory incpy.config file in $HOME
@@ -1263,6 +1716,21 @@ memset(level_1_map, 0, sizeof(*level_1_map) * METADATA_MAP_SIZE);
   // parse incpy.config to look for lines of the following form:
   //   ignore = <prefix of path to ignore>
   //   time_limit = <time limit in SECONDS>
+  //   cache_budget = <max size of incpy-cache/ in MEGABYTES>
+  //   func_cache_budget = <max size of each function's entries in MEGABYTES>
+  //   code_fingerprint = exact | normalized
+  //   shared_memo_index = <size of the shared memo index in MEGABYTES>
+  //   cache_server = <path of the incpy-cached daemon's Unix socket>
+  //   storage = directory | sqlite | memory
+  //   base_cache = <directory or .zip/.tar archive with an incpy-cache/>
+  //                (can appear multiple times; searched in order)
+  //   project_root = <directory that file paths in canonical names are
+  //                   relative to> | vcs (the nearest version control
+  //                   root) (default: none, so paths stay absolute)
+  //   cache_dir = <path of the cache directory> (default: ./incpy-cache)
+  //   compression = off | auto | lz | zlib (default: off)
+  //   serializer = auto | pickle (default: auto, which stores entries as
+  //                binary records; see memoize_record.c)
 
   ignore_paths_lst = PyList_New(0);
 
@@ -1355,6 +1823,128 @@ memset(level_1_map, 0, sizeof(*level_1_map) * METADATA_MAP_SIZE);
           Py_Exit(1);
         }
       }
+      // 'cache_budget = <size in MEGABYTES>'
+      // 'func_cache_budget = <size in MEGABYTES>'
+      // 'shared_memo_index = <size in MEGABYTES>'
+      else if ((strcmp(PyString_AsString(lhs_stripped), "cache_budget") == 0) ||
+               (strcmp(PyString_AsString(lhs_stripped), "func_cache_budget") == 0) ||
+               (strcmp(PyString_AsString(lhs_stripped), "shared_memo_index") == 0)) {
+        PyObject* budget_mb_obj =
+          PyInt_FromString(PyString_AsString(rhs_stripped), NULL, 0);
+
+        if (budget_mb_obj) {
+          long budget_mb = PyInt_AsLong(budget_mb_obj);
+          if (budget_mb > 0) {
+            PY_LONG_LONG budget_bytes = (PY_LONG_LONG)budget_mb * 1024 * 1024;
+            if (strcmp(PyString_AsString(lhs_stripped), "cache_budget") == 0) {
+              cache_budget_bytes = budget_bytes;
+            }
+            else if (strcmp(PyString_AsString(lhs_stripped), "func_cache_budget") == 0) {
+              func_cache_budget_bytes = budget_bytes;
+            }
+            else {
+              shared_memo_index_bytes = budget_bytes;
+            }
+          }
+          else {
+            fprintf(stderr, "ERROR: Invalid %s %ld in incpy.config\n       (must specify a positive integer)\n",
+                    PyString_AsString(lhs_stripped), budget_mb);
+            Py_Exit(1);
+          }
+          Py_DECREF(budget_mb_obj);
+        }
+        else {
+          assert(PyErr_Occurred());
+          PyErr_Clear();
+          fprintf(stderr, "ERROR: Invalid %s '%s' in incpy.config\n       (must specify a positive integer)\n",
+                  PyString_AsString(lhs_stripped),
+                  PyString_AsString(rhs_stripped));
+          Py_Exit(1);
+        }
+      }
+      // 'code_fingerprint = exact | normalized'
+      else if (strcmp(PyString_AsString(lhs_stripped), "code_fingerprint") == 0) {
+        if (strcmp(PyString_AsString(rhs_stripped), "normalized") == 0) {
+          normalize_code_dependencies = 1;
+        }
+        else if (strcmp(PyString_AsString(rhs_stripped), "exact") == 0) {
+          normalize_code_dependencies = 0;
+        }
+        else {
+          fprintf(stderr, "ERROR: Invalid code_fingerprint '%s' in incpy.config\n       (must specify either exact or normalized)\n",
+                  PyString_AsString(rhs_stripped));
+          Py_Exit(1);
+        }
+      }
+      // 'storage = directory | sqlite | memory'
+      else if (strcmp(PyString_AsString(lhs_stripped), "storage") == 0) {
+        if (!select_memo_storage(PyString_AsString(rhs_stripped))) {
+          fprintf(stderr, "ERROR: Invalid storage '%s' in incpy.config\n       (must specify directory, sqlite, or memory)\n",
+                  PyString_AsString(rhs_stripped));
+          Py_Exit(1);
+        }
+      }
+      // 'cache_server = <path of Unix socket>'
+      else if (strcmp(PyString_AsString(lhs_stripped), "cache_server") == 0) {
+        Py_XDECREF(cache_server_socket_path);
+        cache_server_socket_path = rhs_stripped;
+        Py_INCREF(cache_server_socket_path);
+      }
+      // 'project_root = vcs'
+      else if ((strcmp(PyString_AsString(lhs_stripped), "project_root") == 0) &&
+               (strcmp(PyString_AsString(rhs_stripped), "vcs") == 0)) {
+        Py_CLEAR(project_root_path);
+        project_root_is_vcs_root = 1;
+      }
+      // 'project_root = <path of directory>'
+      else if (strcmp(PyString_AsString(lhs_stripped), "project_root") == 0) {
+        PyObject* root_abspath = PyObject_CallFunctionObjArgs(abspath_func, rhs_stripped, NULL);
+
+        struct stat st;
+        if ((stat(PyString_AsString(root_abspath), &st) != 0) || !S_ISDIR(st.st_mode)) {
+          fprintf(stderr, "ERROR: The project_root %s\n       specified in incpy.config is not a directory\n",
+                  PyString_AsString(root_abspath));
+          Py_Exit(1);
+        }
+
+        // (add a trailing '/' for the same reason as for ignore paths)
+        PyObject* slash = PyString_FromString("/");
+        PyString_Concat(&root_abspath, slash);
+        Py_DECREF(slash);
+
+        Py_XDECREF(project_root_path);
+        project_root_path = root_abspath;
+        project_root_is_vcs_root = 0;
+      }
+      // 'cache_dir = <path>'
+      else if (strcmp(PyString_AsString(lhs_stripped), "cache_dir") == 0) {
+        // (use an absolute path, since the program might change directories)
+        Py_DECREF(incpy_cache_dir);
+        incpy_cache_dir = PyObject_CallFunctionObjArgs(abspath_func, rhs_stripped, NULL);
+      }
+      // 'base_cache = <path of directory or archive>'
+      else if (strcmp(PyString_AsString(lhs_stripped), "base_cache") == 0) {
+        if (!base_cache_paths) {
+          base_cache_paths = PyList_New(0);
+        }
+        PyList_Append(base_cache_paths, rhs_stripped);
+      }
+      // 'compression = off | auto | lz | zlib'
+      else if (strcmp(PyString_AsString(lhs_stripped), "compression") == 0) {
+        if (!select_entry_compression(PyString_AsString(rhs_stripped))) {
+          fprintf(stderr, "ERROR: Invalid compression '%s' in incpy.config\n       (must specify off, auto, lz, or zlib)\n",
+                  PyString_AsString(rhs_stripped));
+          Py_Exit(1);
+        }
+      }
+      // 'serializer = auto | pickle'
+      else if (strcmp(PyString_AsString(lhs_stripped), "serializer") == 0) {
+        if (!select_entry_serializer(PyString_AsString(rhs_stripped))) {
+          fprintf(stderr, "ERROR: Invalid serializer '%s' in incpy.config\n       (must specify either auto or pickle)\n",
+                  PyString_AsString(rhs_stripped));
+          Py_Exit(1);
+        }
+      }
 
       Py_DECREF(lhs_stripped);
       Py_DECREF(rhs_stripped);
@@ -1379,10 +1969,35 @@ memset(level_1_map, 0, sizeof(*level_1_map) * METADATA_MAP_SIZE);
 
   // global data structures:
   global_containment_intern_cache = PyDict_New();
+  init_reachability_caches();
   func_name_to_code_dependency = PyDict_New();
   func_name_to_code_object = PyDict_New();
   all_func_memo_info_dict = PyDict_New();
 
+  // (must be done BEFORE the cache manifest is built, since it
+  //  includes functions that only have entries in base layers)
+  PyObject* failed_base_cache_paths = PyList_New(0);
+  open_base_cache_layers(failed_base_cache_paths);
+
+  // (must be done BEFORE the cache manifest and the shared memo index
+  //  are populated from it)
+  const char* requested_storage = memo_storage->name;
+  int storage_opened = open_memo_storage();
+
+  // load the manifest of all cache versions ONCE, rather than probing
+  // the disk for each new FuncMemoInfo
+  init_cache_versions();
+  open_cache_manifest();
+
+  // load the per-function profiles persisted by previous executions
+  // (must be done AFTER all_func_memo_info_dict is initialized)
+  load_func_profiles();
+
+  // load the index of all cache entries, which we need for enforcing
+  // cache_budget and func_cache_budget
+  load_cache_index();
+  open_shared_memo_index();
+
 
   char time_buf[100];
   time_t t = time(NULL);
@@ -1398,6 +2013,45 @@ memset(level_1_map, 0, sizeof(*level_1_map) * METADATA_MAP_SIZE);
                   PyString_AsString(tmp_str));
   Py_DECREF(tmp_str);
 
+  if (cache_budget_bytes > 0) {
+    USER_LOG_PRINTF(" | CACHE_BUDGET %lld MB", cache_budget_bytes / (1024 * 1024));
+  }
+  if (func_cache_budget_bytes > 0) {
+    USER_LOG_PRINTF(" | FUNC_CACHE_BUDGET %lld MB", func_cache_budget_bytes / (1024 * 1024));
+  }
+  if (shared_memo_index_bytes > 0) {
+    USER_LOG_PRINTF(" | SHARED_MEMO_INDEX %lld MB", shared_memo_index_bytes / (1024 * 1024));
+  }
+  if (normalize_code_dependencies) {
+    USER_LOG_PRINTF(" | NORMALIZED_FINGERPRINTS");
+  }
+  if (strcmp(memo_storage->name, "directory") != 0) {
+    USER_LOG_PRINTF(" | STORAGE %s", memo_storage->name);
+  }
+  if (cache_server_socket_path) {
+    USER_LOG_PRINTF(" | CACHE_SERVER %s", PyString_AsString(cache_server_socket_path));
+  }
+  if (strcmp(INCPY_CACHE_DIR, "incpy-cache") != 0) {
+    USER_LOG_PRINTF(" | CACHE_DIR %s", INCPY_CACHE_DIR);
+  }
+  if (project_root_path) {
+    USER_LOG_PRINTF(" | PROJECT_ROOT %s", PyString_AsString(project_root_path));
+  }
+  else if (project_root_is_vcs_root) {
+    USER_LOG_PRINTF(" | PROJECT_ROOT vcs");
+  }
+  if (base_cache_paths) {
+    tmp_str = PyObject_Repr(base_cache_paths);
+    USER_LOG_PRINTF(" | BASE_CACHE %s", PyString_AsString(tmp_str));
+    Py_DECREF(tmp_str);
+  }
+  if (entry_compression_mode != COMPRESSION_OFF) {
+    USER_LOG_PRINTF(" | COMPRESSION %s", entry_compression_name());
+  }
+  if (!use_marshal_serializer) {
+    USER_LOG_PRINTF(" | PICKLE_ONLY");
+  }
+
   if (trust_prev_memoized_results) {
     USER_LOG_PRINTF(" | TRUST_PREV_RESULTS\n");
   }
@@ -1405,6 +2059,20 @@ memset(level_1_map, 0, sizeof(*level_1_map) * METADATA_MAP_SIZE);
     USER_LOG_PRINTF("\n");
   }
 
+  if (!storage_opened) {
+    USER_LOG_PRINTF("STORAGE_UNAVAILABLE %s | using directory storage instead\n",
+                    requested_storage);
+  }
+  for (i = 0; i < PyList_GET_SIZE(failed_base_cache_paths); i++) {
+    USER_LOG_PRINTF("BASE_CACHE_UNAVAILABLE %s | ignoring it\n",
+                    PyString_AsString(PyList_GET_ITEM(failed_base_cache_paths, i)));
+  }
+  Py_DECREF(failed_base_cache_paths);
+  if (cache_server_socket_path && !connect_cache_server()) {
+    USER_LOG_PRINTF("CACHE_SERVER_UNAVAILABLE %s | accessing %s/ directly\n",
+                    PyString_AsString(cache_server_socket_path), INCPY_CACHE_DIR);
+  }
+
   init_self_mutator_c_methods();
   init_definitely_impure_funcs();
 
@@ -1437,6 +2105,14 @@ void pg_finalize() {
   // seems slow and irrelevant, so don't do it right now ...
   //free_all_shadow_memory();
 
+  // persist profiles of all functions that ran during this execution
+  // (must be done BEFORE we deallocate their FuncMemoInfo entries)
+  save_func_profiles();
+
+  // finish evicting entries to get under budget and save the cache
+  // index (also must be done BEFORE deallocating FuncMemoInfo entries)
+  save_cache_index();
+
   // deallocate all FuncMemoInfo entries:
   PyObject* canonical_name = NULL;
   PyObject* fmi_addr = NULL;
@@ -1447,16 +2123,42 @@ void pg_finalize() {
   }
   Py_CLEAR(all_func_memo_info_dict);
 
+  close_cache_manifest();
+  free_cache_versions();
+
+  // erase the cache versions that were dropped during this execution
+  // (see make_room_for_cache_version() in memoize_fmi.c)
+  reclaim_tombstones();
+  close_cache_lock();
+  close_shared_memo_index();
+
+  // summarize what the storage backend did during this execution
+  PyObject* storage_stats = memo_storage_STATS();
+  add_codec_stats(storage_stats);
+  PyObject* storage_stats_repr = PyObject_Repr(storage_stats);
+  USER_LOG_PRINTF("STORAGE_STATS %s\n", PyString_AsString(storage_stats_repr));
+  Py_DECREF(storage_stats_repr);
+  Py_DECREF(storage_stats);
+
+  close_memo_storage();
+  disconnect_cache_server();
+  close_base_cache_layers();
+
+  free_reachability_caches();
   Py_CLEAR(global_containment_intern_cache);
   Py_CLEAR(func_name_to_code_dependency);
   Py_CLEAR(func_name_to_code_object);
   Py_CLEAR(ignore_paths_lst);
+  Py_CLEAR(relocatable_path_cache);
+  Py_CLEAR(project_root_path);
+  project_root_is_vcs_root = 0;
+  Py_CLEAR(incpy_cache_dir);
 
   // function pointers
   Py_CLEAR(cPickle_dumpstr_func);
   Py_CLEAR(cPickle_dump_func);
   Py_CLEAR(cPickle_load_func);
-  Py_CLEAR(hashlib_md5_func);
+  Py_CLEAR(cPickle_loadstr_func);
   Py_CLEAR(abspath_func);
   Py_CLEAR(numpy_module);
 
@@ -1714,24 +2416,23 @@ PyObject* pg_enter_frame(PyFrameObject* f) {
   PyObject* final_file_seek_pos = NULL;
   long memoized_runtime_ms = -1;
 
-  // Optimization: pointless to do a look-up if on-disk cache is empty
+  // (other processes sharing the memo index might have stored
+  //  entries for this function since we last looked)
+  shared_memo_index_refresh(f->func_memo_info);
+
+  // Optimization: pointless to do a look-up if on-disk cache is empty,
+  // or if look-ups for this function haven't been paying off lately
   if (!f->func_memo_info->on_disk_cache_empty) {
+    f->lookup_bypassed = !should_probe_cache(f->func_memo_info);
+  }
+  if (!f->func_memo_info->on_disk_cache_empty && !f->lookup_bypassed) {
     // hash stored_args_lst and try to do a memo table look-up:
 
     assert(!f->stored_args_lst_hash);
 
-    // pass in -1 to force cPickle to use a binary protocol
-    PyObject* negative_one = PyInt_FromLong(-1);
-    PyObject* args_lst_pickled_str =
-      PyObject_CallFunctionObjArgs(cPickle_dumpstr_func,
-                                   f->stored_args_lst, negative_one, NULL);
-    Py_DECREF(negative_one);
+    f->stored_args_lst_hash = hexdigest_pickled(f->stored_args_lst);
 
-    if (args_lst_pickled_str) {
-      f->stored_args_lst_hash = hexdigest_str(args_lst_pickled_str);
-      Py_DECREF(args_lst_pickled_str);
-    }
-    else {
+    if (!f->stored_args_lst_hash) {
       assert(PyErr_Occurred());
       PyErr_Clear();
 
@@ -1740,8 +2441,11 @@ PyObject* pg_enter_frame(PyFrameObject* f) {
       goto pg_enter_frame_done;
     }
 
+    // (don't even bother probing the disk if the shared memo index
+    //  knows that there's no such entry)
     PyObject* memoized_vals_matching_args =
-      on_disk_cache_GET(f->func_memo_info, f->stored_args_lst_hash);
+      shared_memo_index_may_contain(f->func_memo_info, f->stored_args_lst_hash) ?
+      on_disk_cache_GET(f->func_memo_info, f->stored_args_lst_hash) : NULL;
 
 
     // this is a list of memo table entries that supposedly match the
@@ -1756,7 +2460,8 @@ PyObject* pg_enter_frame(PyFrameObject* f) {
         assert(PyDict_CheckExact(elt));
 
         // first check if the code dependencies are still satisfied; if
-        // not, then clear this entire cache entry and get outta here!
+        // not, then stop using this entire cache version and get outta
+        // here!
         memoized_code_dependencies = PyDict_GetItemString(elt, "code_dependencies");
         assert(memoized_code_dependencies);
 
@@ -1767,8 +2472,8 @@ PyObject* pg_enter_frame(PyFrameObject* f) {
             USER_LOG_PRINTF("TRUSTING_MEMOIZED_RESULTS %s\n", PyString_AsString(co->pg_canonical_name));
           }
           else {
-            clear_cache_and_mark_pure(f->func_memo_info);
-            USER_LOG_PRINTF("CLEAR_CACHE %s\n", PyString_AsString(co->pg_canonical_name));
+            switch_cache_version_and_mark_pure(f->func_memo_info);
+            USER_LOG_PRINTF("NEW_CACHE_VERSION %s\n", PyString_AsString(co->pg_canonical_name));
 
             Py_DECREF(memoized_vals_matching_args); // tricky tricky!
             goto pg_enter_frame_done;
@@ -1898,28 +2603,10 @@ PyObject* pg_enter_frame(PyFrameObject* f) {
         }
 
         if (!dependencies_satisfied) {
-          // KILL THIS ENTRY!!!
-          PyObject* tmp_idx = PyInt_FromLong((long)memoized_vals_idx);
-          PyObject_DelItem(memoized_vals_matching_args, tmp_idx);
-          Py_DECREF(tmp_idx);
-
-          // update on-disk cache either by writing an update, or
-          // deleting the file if there's nothing left
-          if (PyList_Size(memoized_vals_matching_args) > 0) {
-            PyObject* res =
-              on_disk_cache_PUT(f->func_memo_info, f->stored_args_lst_hash,
-                                memoized_vals_matching_args);
-            if (res) {
-              Py_DECREF(res);
-            }
-            else {
-              assert(PyErr_Occurred());
-              PyErr_Clear();
-            }
-          }
-          else {
-            on_disk_cache_DEL(f->func_memo_info, f->stored_args_lst_hash);
-          }
+          // KILL THIS ENTRY!!! (other processes might have added
+          // entries to the file since we read it, so don't simply
+          // write back our copy of the list)
+          on_disk_cache_DISCARD(f->func_memo_info, f->stored_args_lst_hash, elt);
 
           PG_LOG_PRINTF("dict(event='CLEAR_CACHE_ENTRY', idx=%u, what'%s')\n",
                         (unsigned)memoized_vals_idx,
@@ -1929,7 +2616,8 @@ PyObject* pg_enter_frame(PyFrameObject* f) {
         }
 
 
-        memoized_retval = PyDict_GetItemString(elt, "retval");
+        // (decoded only now; see memoize_record.c)
+        memoized_retval = memo_table_entry_GET(elt, "retval");
         memoized_runtime_ms = PyInt_AsLong(PyDict_GetItemString(elt, "runtime_ms"));
 
         // these can be null since they are optional fields in the dict
@@ -2087,6 +2775,10 @@ PyObject* pg_enter_frame(PyFrameObject* f) {
     long memo_lookup_time_ms = GET_ELAPSED_MS(f->start_time, skip_endtime);
     assert(memo_lookup_time_ms >= 0);
 
+    record_lookup_cost(f->func_memo_info,
+                       GET_ELAPSED_US(f->start_time, skip_endtime), 1);
+    cache_index_note_hit(f->func_memo_info, f->stored_args_lst_hash);
+
     PG_LOG_PRINTF("dict(event='SKIP_CALL', what='%s', memo_lookup_time_ms='%ld')\n",
                   PyString_AsString(co->pg_canonical_name),
                   memo_lookup_time_ms);
@@ -2114,6 +2806,15 @@ PyObject* pg_enter_frame(PyFrameObject* f) {
 // only reach here if you actually call the function, NOT if you skip it:
 pg_enter_frame_done:
 
+  // if we hashed the arguments, then we probed the on-disk cache
+  // and missed, so account for the time that we wasted
+  if (f->stored_args_lst_hash) {
+    struct timeval miss_endtime;
+    END_TIMING(f->start_time, miss_endtime);
+    record_lookup_cost(f->func_memo_info,
+                       GET_ELAPSED_US(f->start_time, miss_endtime), 0);
+  }
+
   // Track reachability from arguments ...
   //
   // Optimization: we only need to do this for functions that stand some
@@ -2133,7 +2834,7 @@ pg_enter_frame_done:
     for (i = 0; i < f->f_code->co_argcount; i++) {
       PyObject* elt = f->f_localsplus[i];
 
-      unsigned int arg_reachable_func_start_time = get_arg_reachable_func_start_time(elt);
+      unsigned PY_LONG_LONG arg_reachable_func_start_time = get_arg_reachable_func_start_time(elt);
 
       // always update if it hasn't been set yet:
       if (arg_reachable_func_start_time == 0) {
@@ -2177,7 +2878,6 @@ void pg_exit_frame(PyFrameObject* f, PyObject* retval) {
   // start these at NULL to prevent weird segfaults!
   PyObject* canonical_name = NULL;
   FuncMemoInfo* my_func_memo_info = NULL;
-  PyObject* memoized_vals_matching_args = NULL;
 
   // if retval is NULL, then that means some exception occurred on the
   // stack and we're in the process of "backing out" ... don't do
@@ -2215,12 +2915,17 @@ void pg_exit_frame(PyFrameObject* f, PyObject* retval) {
     goto pg_exit_frame_done;
   }
 
+  update_func_profile_runtime(my_func_memo_info, runtime_ms);
+
 
   // (only check these conditions if we're not forcing memoization)
   if (!co->pg_force_memoization) {
 
-    // don't bother memoizing results of short-running functions
-    if (runtime_ms <= memoize_time_limit_ms) {
+    // don't bother memoizing results of short-running functions,
+    // unless they're called often enough for the savings to add up
+    // (admit_memo_table_entry() makes the final call)
+    if ((runtime_ms <= memoize_time_limit_ms) &&
+        !is_frequently_called(my_func_memo_info, runtime_ms)) {
       // don't forget to clean up!
       goto pg_exit_frame_done;
     }
@@ -2323,21 +3028,23 @@ void pg_exit_frame(PyFrameObject* f, PyObject* retval) {
   }
 
 
+  // if we didn't probe the on-disk cache, then these arguments might
+  // already have an entry, and appending another one would only
+  // duplicate it (and make later look-ups slower)
+  if (f->lookup_bypassed) {
+    PG_LOG_PRINTF("dict(event='DO_NOT_MEMOIZE', what='%s', why='lookup bypassed')\n",
+                  PyString_AsString(canonical_name));
+    USER_LOG_PRINTF("DO_NOT_MEMOIZE %s | cache lookup was bypassed | runtime %ld ms\n",
+                    PyString_AsString(canonical_name), runtime_ms);
+    goto pg_exit_frame_done;
+  }
+
   // if we haven't yet done it, populate f->stored_args_lst_hash by
   // taking a hash of argument list values:
   if (!f->stored_args_lst_hash) {
-    // pass in -1 to force cPickle to use a binary protocol
-    PyObject* negative_one = PyInt_FromLong(-1);
-    PyObject* stored_args_lst_pickled_str =
-      PyObject_CallFunctionObjArgs(cPickle_dumpstr_func,
-                                   f->stored_args_lst, negative_one, NULL);
-    Py_DECREF(negative_one);
+    f->stored_args_lst_hash = hexdigest_pickled(f->stored_args_lst);
 
-    if (stored_args_lst_pickled_str) {
-      f->stored_args_lst_hash = hexdigest_str(stored_args_lst_pickled_str);
-      Py_DECREF(stored_args_lst_pickled_str);
-    } 
-    else {
+    if (!f->stored_args_lst_hash) {
       assert(PyErr_Occurred());
       PyErr_Clear();
 
@@ -2354,15 +3061,6 @@ void pg_exit_frame(PyFrameObject* f, PyObject* retval) {
 
   // now memoize results ...
 
-  memoized_vals_matching_args =
-    on_disk_cache_GET(my_func_memo_info, f->stored_args_lst_hash);
-
-  if (!memoized_vals_matching_args) {
-    memoized_vals_matching_args = PyList_New(0);
-  }
-
-  assert(memoized_vals_matching_args);
-
   PyObject* memo_table_entry = PyDict_New();
 
   PyDict_SetItemString(memo_table_entry, "canonical_name", canonical_name);
@@ -2480,14 +3178,32 @@ void pg_exit_frame(PyFrameObject* f, PyObject* retval) {
     Py_DECREF(files_written);
   }
 
-  /* we're just gonna blindly append memo_table_entry assuming that
-     there are no duplicates in memoized_vals_matching_args
-
-     (if this assumption is violated, then we will get some
-     funny-looking results ... but I think I should be able to convince
-     myself of why duplicates should never occur) */
-  PyList_Append(memoized_vals_matching_args, memo_table_entry);
-  Py_DECREF(memo_table_entry);
+  /* Consult the cost model BEFORE paying for pickling and writing
+     memo_table_entry, and punt if we predict that storing and loading
+     it will cost more time than re-running the function would
+     (unless we're forcing memoization) */
+  MemoCostEstimate cost_est;
+  int admitted = admit_memo_table_entry(my_func_memo_info, memo_table_entry,
+                                        runtime_ms, &cost_est);
+
+  PG_LOG_PRINTF("dict(event='ADMISSION', what='%s', admitted=%d, runtime_ms=%ld, est_bytes=%ld, predicted_write_us=%ld, predicted_read_us=%ld, expected_reuses=%g, predicted_savings_us=%ld)\n",
+                PyString_AsString(canonical_name), admitted, runtime_ms,
+                (long)cost_est.est_bytes,
+                cost_est.predicted_write_us,
+                cost_est.predicted_read_us,
+                cost_est.expected_reuses,
+                cost_est.predicted_savings_us);
+
+  if (!admitted && !co->pg_force_memoization) {
+    USER_LOG_PRINTF("DO_NOT_MEMOIZE %s | predicted store time (%ld ms) + load time (%ld ms) for ~%ld bytes not worth it | running time (%ld ms)\n",
+                    PyString_AsString(canonical_name),
+                    cost_est.predicted_write_us / 1000,
+                    cost_est.predicted_read_us / 1000,
+                    (long)cost_est.est_bytes,
+                    runtime_ms);
+    Py_DECREF(memo_table_entry);
+    goto pg_exit_frame_done;
+  }
 
 
   // starting and ending time as timeval structs
@@ -2496,10 +3212,12 @@ void pg_exit_frame(PyFrameObject* f, PyObject* retval) {
 
   BEGIN_TIMING(memoize_start_time);
 
-  // save the ENTIRE memoized_vals_matching_args to disk:
+  // add memo_table_entry to the other entries for the same arguments
+  // and save the ENTIRE list to disk:
   PyObject* cPickle_dump_res =
-    on_disk_cache_PUT(my_func_memo_info,
-                      f->stored_args_lst_hash, memoized_vals_matching_args);
+    on_disk_cache_APPEND(my_func_memo_info,
+                         f->stored_args_lst_hash, memo_table_entry);
+  Py_DECREF(memo_table_entry);
 
   END_TIMING(memoize_start_time, memoize_end_time);
   long memoize_time_ms = GET_ELAPSED_MS(memoize_start_time, memoize_end_time);
@@ -2525,12 +3243,16 @@ void pg_exit_frame(PyFrameObject* f, PyObject* retval) {
                       runtime_ms);
     }
     else {
-      PG_LOG_PRINTF("dict(event='MEMOIZED_RESULTS', what='%s', runtime_ms='%ld')\n",
+      PG_LOG_PRINTF("dict(event='MEMOIZED_RESULTS', what='%s', runtime_ms='%ld', memoize_time_us='%ld', predicted_write_us='%ld')\n",
                     PyString_AsString(canonical_name),
-                    runtime_ms);
-      USER_LOG_PRINTF("MEMOIZED %s | runtime %ld ms\n",
+                    runtime_ms,
+                    GET_ELAPSED_US(memoize_start_time, memoize_end_time),
+                    cost_est.predicted_write_us);
+      USER_LOG_PRINTF("MEMOIZED %s | runtime %ld ms | memoize time %ld ms (predicted %ld ms)\n",
                       PyString_AsString(canonical_name),
-                      runtime_ms);
+                      runtime_ms,
+                      memoize_time_ms,
+                      cost_est.predicted_write_us / 1000);
     }
   }
   else {
@@ -2548,10 +3270,6 @@ void pg_exit_frame(PyFrameObject* f, PyObject* retval) {
 
 
 pg_exit_frame_done:
-  // clear this sucker no matter what, since we DON'T want to keep it
-  // around any longer after we've memoized it to disk
-  Py_XDECREF(memoized_vals_matching_args);
-
 #ifdef ENABLE_IGNORE_FUNC_THRESHOLD_OPTIMIZATION
   if (my_func_memo_info &&
       my_func_memo_info->on_disk_cache_empty &&
@@ -2648,9 +3366,59 @@ static void add_global_read_to_all_frames(PyObject* global_container) {
 }
 
 
+// returns the interned global variable name tuple for varname, which is
+// co->co_names[name_index] (a borrowed reference)
+//
+// it only depends on the code object and the index, so we remember it
+// in co->pg_global_varnames rather than building a new tuple and
+// looking up its interned copy on every LOAD_GLOBAL
+static PyObject* get_global_varname(PyCodeObject* co, PyObject* varname,
+                                    int name_index) {
+  assert(name_index >= 0 && name_index < PyTuple_GET_SIZE(co->co_names));
+  assert(PyTuple_GET_ITEM(co->co_names, name_index) == varname);
+
+  if (co->pg_global_varnames) {
+    PyObject* cached = PyTuple_GET_ITEM(co->pg_global_varnames, name_index);
+    if (cached) {
+      return cached;
+    }
+  }
+
+  PyObject* new_varname = NULL;
+
+  // if the code is ignored, use a special ignore_str as the filename
+  if (co->pg_ignore) {
+    new_varname = create_varname_tuple(ignore_str, varname);
+  }
+  else {
+    // (name the file the same way as in canonical names, so that global
+    //  dependencies in cache entries survive moving the project)
+    PyObject* filename = pg_relocatable_path(co->co_filename);
+    if (!filename) {
+      PyErr_Clear();
+      filename = co->co_filename;
+    }
+    new_varname = create_varname_tuple(filename, varname);
+  }
+  assert(new_varname);
+
+  // (its slots start out NULL, and tuple_dealloc() skips those)
+  if (!co->pg_global_varnames) {
+    co->pg_global_varnames = PyTuple_New(PyTuple_GET_SIZE(co->co_names));
+    if (!co->pg_global_varnames) {
+      PyErr_Clear();
+      return new_varname;
+    }
+  }
+  Py_INCREF(new_varname);
+  PyTuple_SET_ITEM(co->pg_global_varnames, name_index, new_varname);
+
+  return new_varname;
+}
+
 // only register this event for loads of globals that are NOT built-ins
 // (see Python/ceval.c to make sure this is the case)
-void pg_LOAD_GLOBAL_event(PyObject *varname, PyObject *value) {
+void pg_LOAD_GLOBAL_event(PyObject *varname, int name_index, PyObject *value) {
   /* There is an opportunity for some optimization here, since there are
      lots of LOAD_GLOBALs of boring built-in types and other stuff that
      we don't really care about tracing.
@@ -2671,21 +3439,13 @@ void pg_LOAD_GLOBAL_event(PyObject *varname, PyObject *value) {
   PyFrameObject* top_frame = PyEval_GetFrame();
   assert(top_frame);
 
-  PyObject* new_varname = NULL;
-
-  // if the code is ignored, use a special ignore_str as the filename
-  // and DO NOT add a global variable dependency
-  if (top_frame->f_code->pg_ignore) {
-    new_varname = create_varname_tuple(ignore_str, varname);
-  }
-  // in the regular case, use the filename and also add a global read
-  // dependency ...
-  else {
-    new_varname = create_varname_tuple(top_frame->f_code->co_filename, varname);
+  PyObject* new_varname = get_global_varname(top_frame->f_code, varname,
+                                             name_index);
 
+  // DO NOT add a global variable dependency if the code is ignored
+  if (!top_frame->f_code->pg_ignore) {
     add_global_read_to_all_frames(new_varname);
   }
-  assert(new_varname);
 
   update_global_container_weakref(value, new_varname);
 
@@ -2836,6 +3596,29 @@ void pg_about_to_MUTATE_event(PyObject *object) {
     return;
   }
 
+  // OPTIMIZATION: the most common mutations are of lists and dicts
+  // that the function on top of the stack is building up itself, and
+  // those can't make any function on the stack impure.  The only way
+  // for such an object to become globally reachable or reachable from
+  // an argument is to be stored into a global or an argument AFTER
+  // it was created, which is itself a mutation that has already marked
+  // every function on the stack that this one could mark, since they
+  // were all running by then.  So skip the shadow memory look-ups.
+  if (top_frame->start_func_call_time) {
+    unsigned PY_LONG_LONG birth_time = 0;
+    if (PyList_Check(object)) {
+      birth_time = ((PyListObject*)object)->pg_birth_time;
+    }
+    else if (PyDict_Check(object)) {
+      birth_time = ((PyDictObject*)object)->pg_birth_time;
+    }
+
+    if (birth_time >= top_frame->start_func_call_time) {
+      MEMOIZE_PUBLIC_END()
+      return;
+    }
+  }
+
 
   // OPTIMIZATION: simply checking for global reachability is pretty
   // fast, so do this as the first check (most common case) ...
@@ -2863,7 +3646,7 @@ void pg_about_to_MUTATE_event(PyObject *object) {
     // then check for reachability from function arguments:
     PyFrameObject* f = top_frame;
 
-    unsigned int arg_reachable_func_start_time = get_arg_reachable_func_start_time(object);
+    unsigned PY_LONG_LONG arg_reachable_func_start_time = get_arg_reachable_func_start_time(object);
     if (arg_reachable_func_start_time > 0) { // if it's 0, then it's not arg reachable
       while (f) {
         if (f->func_memo_info) {
@@ -0,0 +1,422 @@
+/* Client for the incpy-cached cache server daemon
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+/* If cache_server is set in incpy.config, then cache entry files are
+   read, written, and deleted by the incpy-cached daemon
+   (incpy-support-scripts/incpy_cached.py) rather than by this process.
+   The daemon stores them in exactly the same place in the directory
+   store, but also keeps the most recently-used ones in RAM, so that
+   many IncPy processes on one machine get RAM-speed hits on each
+   other's popular entries without each of them hitting the disk.
+   (Everything else about the directory store, such as cache versions,
+   locks, and budgets, is still handled by each process.)
+
+   We talk to it over a Unix domain socket with a compact binary
+   protocol, where a message is an opcode byte followed by fields, each
+   of which is a 4-byte big-endian length followed by that many bytes:
+
+     'G' <path>              --> '+' <data> | '-'     (GET)
+     'M' <n> <path> x n      --> ('+' <data> | '-') x n  (multi-GET)
+     'P' <path> <data>       --> '+' | '-'            (PUT)
+     'D' <path>              --> '+'                  (DEL)
+     'S'                     --> '+' <text>           (STAT)
+
+   (<n> is a bare 4-byte big-endian integer, and each path is absolute)
+
+   If the daemon isn't running or anything goes wrong while talking to
+   it, then we give up on it for the rest of this execution and access
+   the directory store directly, which is always safe since that's
+   where the daemon keeps everything anyways.
+
+   Prefetching:
+
+   When memoize_fmi.c resolves a function's cache version, it asks for
+   the entries in it that got the most hits so far (according to the
+   cache index; see memoize_eviction.c) with one multi-GET, so that
+   the first lookups of a program that calls many different popular
+   functions don't each pay for a round trip.  cache_server_GET() hands
+   out each prefetched entry only once, and only within
+   PREFETCH_MAX_AGE_SEC, and PUT and DEL drop it, so a lookup sees at
+   worst a slightly older list of memo table entries, which merely
+   costs a re-computation (memoize_fmi.c also drops it before reading
+   an entry that it's about to modify, so nothing gets lost). */
+
+#include "Python.h"
+#include "memoize_cacheserver.h"
+#include "memoize_logging.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// give up on the daemon if it doesn't respond within this long
+#define CACHE_SERVER_TIMEOUT_SEC 10
+
+#define PREFETCH_MAX_AGE_SEC 10
+
+PyObject* cache_server_socket_path = NULL;
+
+static int server_fd = -1;
+
+// the process that opened server_fd (children that inherit it across
+// fork() must open their own connection, or else their messages would
+// get interleaved with their parent's)
+static pid_t server_pid = 0;
+
+// did we give up on the server for the rest of this execution?
+static char gave_up_on_server = 0;
+
+// Key: path of a cache entry, Value: (contents, time it was fetched)
+//
+// (see "Prefetching" above; created on demand, destroyed in
+//  disconnect_cache_server())
+static PyObject* prefetched_entries = NULL;
+
+
+static void give_up_on_server(char* why) {
+  if (server_fd >= 0) {
+    close(server_fd);
+    server_fd = -1;
+  }
+  if (!gave_up_on_server) {
+    gave_up_on_server = 1;
+    PG_LOG_PRINTF("dict(event='CACHE_SERVER_UNAVAILABLE', what='%s', why='%s')\n",
+                  PyString_AsString(cache_server_socket_path), why);
+  }
+}
+
+static int open_connection(void) {
+  struct sockaddr_un addr;
+  char* path = PyString_AsString(cache_server_socket_path);
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  struct timeval timeout;
+  timeout.tv_sec = CACHE_SERVER_TIMEOUT_SEC;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+// (called from pg_initialize())
+//
+// returns 1 iff we're connected to the server
+int connect_cache_server(void) {
+  return cache_server_socket_path && cache_server_available();
+}
+
+// (called from pg_finalize())
+void disconnect_cache_server(void) {
+  if (server_fd >= 0) {
+    close(server_fd);
+    server_fd = -1;
+  }
+  Py_CLEAR(cache_server_socket_path);
+  Py_CLEAR(prefetched_entries);
+  gave_up_on_server = 0;
+}
+
+// returns 1 iff we're connected to the server (connecting if necessary)
+int cache_server_available(void) {
+  if (!cache_server_socket_path || gave_up_on_server) {
+    return 0;
+  }
+  if ((server_fd >= 0) && (server_pid == getpid())) {
+    return 1;
+  }
+
+  if (server_fd >= 0) {
+    // inherited from our parent, which keeps its own copy open
+    close(server_fd);
+  }
+  server_fd = open_connection();
+  server_pid = getpid();
+  if (server_fd < 0) {
+    give_up_on_server("cannot connect");
+    return 0;
+  }
+  return 1;
+}
+
+
+static int write_all(char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(server_fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static int read_all(char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(server_fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    else if (n == 0) {
+      return 0; // server hung up
+    }
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static int write_uint32(unsigned int n) {
+  unsigned int net_n = htonl(n);
+  return write_all((char*)&net_n, 4);
+}
+
+static int write_field(char* buf, Py_ssize_t len) {
+  return write_uint32((unsigned int)len) && write_all(buf, len);
+}
+
+// paths are relative to the current directory (which the program
+// might change at any time) unless cache_dir is set in incpy.config,
+// but the server needs absolute ones
+static int write_path_field(PyObject* path) {
+  char cwd[4096];
+  if (PyString_AS_STRING(path)[0] == '/') {
+    cwd[0] = '\0';
+  }
+  else {
+    if (!getcwd(cwd, sizeof(cwd) - 1)) {
+      return 0;
+    }
+    strcat(cwd, "/");
+  }
+
+  size_t cwd_len = strlen(cwd);
+  return write_uint32((unsigned int)(cwd_len + PyString_GET_SIZE(path))) &&
+         write_all(cwd, cwd_len) &&
+         write_all(PyString_AS_STRING(path), PyString_GET_SIZE(path));
+}
+
+// reads a field into a new PyString (NULL on error)
+static PyObject* read_field(void) {
+  unsigned int net_len;
+  if (!read_all((char*)&net_len, 4)) {
+    return NULL;
+  }
+  Py_ssize_t len = (Py_ssize_t)ntohl(net_len);
+  PyObject* ret = PyString_FromStringAndSize(NULL, len);
+  if (!ret) {
+    PyErr_Clear();
+    return NULL;
+  }
+  if (!read_all(PyString_AS_STRING(ret), len)) {
+    Py_DECREF(ret);
+    return NULL;
+  }
+  return ret;
+}
+
+// reads a '+' <data> | '-' reply into *data (NULL for '-')
+static int read_data_reply(PyObject** data) {
+  char status;
+  *data = NULL;
+  if (!read_all(&status, 1)) {
+    return CACHE_SERVER_ERROR;
+  }
+  if (status == '-') {
+    return CACHE_SERVER_MISS;
+  }
+  else if (status != '+') {
+    return CACHE_SERVER_ERROR;
+  }
+
+  *data = read_field();
+  return *data ? CACHE_SERVER_HIT : CACHE_SERVER_ERROR;
+}
+
+
+int cache_server_GET(PyObject* path, PyObject** data) {
+  *data = NULL;
+  if (!cache_server_available()) {
+    return CACHE_SERVER_ERROR;
+  }
+
+  PyObject* prefetched = prefetched_entries ? PyDict_GetItem(prefetched_entries, path) : NULL;
+  if (prefetched) {
+    int fresh =
+      (time(NULL) - PyInt_AsLong(PyTuple_GET_ITEM(prefetched, 1)) <= PREFETCH_MAX_AGE_SEC);
+    if (fresh) {
+      *data = PyTuple_GET_ITEM(prefetched, 0);
+      Py_INCREF(*data);
+    }
+    PyDict_DelItem(prefetched_entries, path);
+    if (fresh) {
+      return CACHE_SERVER_HIT;
+    }
+  }
+
+  int status = CACHE_SERVER_ERROR;
+  if (write_all("G", 1) && write_path_field(path)) {
+    status = read_data_reply(data);
+  }
+
+  if (status == CACHE_SERVER_ERROR) {
+    give_up_on_server("GET failed");
+  }
+  return status;
+}
+
+// returns a list with the contents of each file in paths (or None if
+// it's not there), or NULL if something went wrong
+PyObject* cache_server_MGET(PyObject* paths) {
+  if (!cache_server_available()) {
+    return NULL;
+  }
+
+  Py_ssize_t n = PyList_GET_SIZE(paths);
+  int success = write_all("M", 1) && write_uint32((unsigned int)n);
+  Py_ssize_t i;
+  for (i = 0; success && (i < n); i++) {
+    success = write_path_field(PyList_GET_ITEM(paths, i));
+  }
+
+  PyObject* ret = success ? PyList_New(n) : NULL;
+  for (i = 0; ret && (i < n); i++) {
+    PyObject* data = NULL;
+    if (read_data_reply(&data) == CACHE_SERVER_ERROR) {
+      Py_CLEAR(ret);
+      break;
+    }
+    if (!data) {
+      data = Py_None;
+      Py_INCREF(data);
+    }
+    PyList_SET_ITEM(ret, i, data);
+  }
+
+  if (!ret) {
+    give_up_on_server("multi-GET failed");
+  }
+  return ret;
+}
+
+// fetch the contents of the files in paths in one go, so that
+// cache_server_GET() can hand them out later (see "Prefetching" above)
+void cache_server_PREFETCH(PyObject* paths) {
+  if ((PyList_GET_SIZE(paths) == 0) || !cache_server_available()) {
+    return;
+  }
+
+  PyObject* contents = cache_server_MGET(paths);
+  if (!contents) {
+    return;
+  }
+
+  if (!prefetched_entries) {
+    prefetched_entries = PyDict_New();
+  }
+  PyObject* now = PyInt_FromLong((long)time(NULL));
+  Py_ssize_t i;
+  for (i = 0; i < PyList_GET_SIZE(contents); i++) {
+    PyObject* data = PyList_GET_ITEM(contents, i);
+    if (data != Py_None) {
+      PyObject* prefetched = PyTuple_Pack(2, data, now);
+      PyDict_SetItem(prefetched_entries, PyList_GET_ITEM(paths, i), prefetched);
+      Py_DECREF(prefetched);
+    }
+  }
+  Py_DECREF(now);
+  Py_DECREF(contents);
+
+  PG_LOG_PRINTF("dict(event='CACHE_SERVER_PREFETCH', num_paths=%ld, num_prefetched=%ld)\n",
+                (long)PyList_GET_SIZE(paths), (long)PyDict_Size(prefetched_entries));
+}
+
+// make sure that the next GET of path asks the server
+void cache_server_FORGET_PREFETCHED(PyObject* path) {
+  if (prefetched_entries && PyDict_GetItem(prefetched_entries, path)) {
+    PyDict_DelItem(prefetched_entries, path);
+  }
+}
+
+// returns 1 iff the server stored data under path
+int cache_server_PUT(PyObject* path, PyObject* data) {
+  cache_server_FORGET_PREFETCHED(path);
+  if (!cache_server_available()) {
+    return 0;
+  }
+
+  char status = '-';
+  if (!(write_all("P", 1) &&
+        write_path_field(path) &&
+        write_field(PyString_AS_STRING(data), PyString_GET_SIZE(data)) &&
+        read_all(&status, 1))) {
+    give_up_on_server("PUT failed");
+    return 0;
+  }
+  return (status == '+');
+}
+
+// returns 1 iff the server deleted the file at path (if it existed)
+int cache_server_DEL(PyObject* path) {
+  cache_server_FORGET_PREFETCHED(path);
+  if (!cache_server_available()) {
+    return 0;
+  }
+
+  char status = '-';
+  if (!(write_all("D", 1) && write_path_field(path) && read_all(&status, 1))) {
+    give_up_on_server("DEL failed");
+    return 0;
+  }
+  return (status == '+');
+}
+
+// returns a PyString with a summary of the server's statistics
+PyObject* cache_server_STAT(void) {
+  if (!cache_server_available()) {
+    return NULL;
+  }
+
+  PyObject* text = NULL;
+  if (write_all("S", 1)) {
+    read_data_reply(&text);
+  }
+  if (!text) {
+    give_up_on_server("STAT failed");
+  }
+  return text;
+}
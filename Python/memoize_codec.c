@@ -0,0 +1,721 @@
+/* Encoding of cache entries (serialization and compression)
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+/* serialize_cache_entry() stores each list of memo table entries as
+   a record list (see memoize_record.c), which serializes each field of
+   each entry on its own with serialize_value().
+
+   Most fields contain nothing but ints, floats, strings, and tuples,
+   lists, and dicts of those, which marshal (marshal.c) writes and
+   reads several times faster than cPickle.  So serialize_value()
+   checks whether a value is marshal-safe (see marshal_safe()) and
+   marshals it if so, and pickles it with protocol 2 otherwise.  (Set
+   'serializer = pickle' in incpy.config to pickle entire lists like
+   IncPy used to.)
+
+   Memoized results (lists of dicts, text, numeric arrays) often
+   compress 5-20x, and when incpy-cache/ lives on a network filesystem,
+   moving those bytes dominates the cost of GETs and PUTs.  So if
+   incpy.config contains
+
+     compression = auto | lz | zlib
+
+   then serialized entries can be compressed before they're stored.  An
+   encoded entry starts with an ENTRY_HEADER_SIZE-byte header:
+
+     byte 0     ENTRY_MAGIC (never the first byte of a pickle, which
+                is always PROTO = 0x80, since we pickle with protocol 2)
+     byte 1     ENTRY_FORMAT_VERSION
+     byte 2     codec (CODEC_NONE, CODEC_LZ, or CODEC_ZLIB)
+     byte 3     serializer (SERIALIZER_PICKLE, SERIALIZER_MARSHAL, or
+                SERIALIZER_RECORD)
+     bytes 4-7  length of the uncompressed data (big-endian)
+
+   followed by the (possibly compressed) serialized entry.  Pickles that
+   aren't compressed are stored as plain pickles without any header,
+   exactly like before, so old caches still work.
+
+   (incpy-support-scripts/incpy_entries.py decodes entries in Python)
+
+   There are two codecs:
+
+     CODEC_LZ   - a tiny LZ77 codec in the style of LZF, which only
+                  gets ~2x on typical pickles but runs at hundreds of
+                  MB/sec in both directions (always available)
+
+     CODEC_ZLIB - zlib at level 1 via Modules/zlibmodule.c, which
+                  compresses better but much more slowly (only available
+                  if the zlib module could be built)
+
+   In 'auto' mode, choose_codec() picks a codec (or none) for each
+   entry by compressing a sample of its pickle with every codec and
+   comparing the predicted costs against the measured bandwidth of the
+   storage backend (see memoize_costmodel.c).  Entries smaller than
+   MIN_COMPRESS_BYTES are never compressed, since per-entry overheads
+   swamp any savings. */
+
+#include "Python.h"
+#include "marshal.h"
+#include "memoize.h"
+#include "memoize_codec.h"
+#include "memoize_costmodel.h"
+#include "memoize_logging.h"
+#include "memoize_profiling.h"
+#include "memoize_record.h"
+
+
+#define ENTRY_MAGIC 0xC7
+#define ENTRY_FORMAT_VERSION 1
+#define ENTRY_HEADER_SIZE 8
+
+#define CODEC_NONE 0
+#define CODEC_LZ 1
+#define CODEC_ZLIB 2
+#define NUM_CODECS 3
+
+static const char* codec_names[NUM_CODECS] = {"none", "lz", "zlib"};
+
+
+#define MIN_COMPRESS_BYTES 1024
+
+// choose_codec() compresses NUM_SAMPLE_CHUNKS chunks of
+// SAMPLE_CHUNK_BYTES each, taken from evenly-spaced parts of the pickle
+#define NUM_SAMPLE_CHUNKS 4
+#define SAMPLE_CHUNK_BYTES 4096
+
+// only compress if it shrinks the entry to at most this fraction
+#define MAX_USEFUL_RATIO 0.9
+
+// entries nested deeper than this are pickled (well within marshal's
+// own MAX_MARSHAL_STACK_DEPTH)
+#define MAX_MARSHAL_DEPTH 200
+
+static const char* serializer_names[NUM_SERIALIZERS] = {"pickle", "marshal", "record"};
+
+int entry_compression_mode = COMPRESSION_OFF;
+int use_marshal_serializer = 1;
+
+// zlib.compress and zlib.decompress (imported on demand, since the
+// zlib module might not even exist)
+static PyObject* zlib_compress_func = NULL;
+static PyObject* zlib_decompress_func = NULL;
+static int tried_importing_zlib = 0;
+
+// statistics for add_codec_stats()
+static unsigned long num_encoded[NUM_CODECS];
+static unsigned long num_serialized[NUM_SERIALIZERS];
+static unsigned long long raw_bytes_encoded = 0;
+static unsigned long long stored_bytes_encoded = 0;
+static unsigned long num_decode_errors = 0;
+
+
+int select_entry_compression(char* name) {
+  if (strcmp(name, "off") == 0) {
+    entry_compression_mode = COMPRESSION_OFF;
+  }
+  else if (strcmp(name, "auto") == 0) {
+    entry_compression_mode = COMPRESSION_AUTO;
+  }
+  else if (strcmp(name, "lz") == 0) {
+    entry_compression_mode = COMPRESSION_LZ;
+  }
+  else if (strcmp(name, "zlib") == 0) {
+    entry_compression_mode = COMPRESSION_ZLIB;
+  }
+  else {
+    return 0;
+  }
+  return 1;
+}
+
+const char* entry_compression_name(void) {
+  switch (entry_compression_mode) {
+    case COMPRESSION_AUTO: return "auto";
+    case COMPRESSION_LZ: return "lz";
+    case COMPRESSION_ZLIB: return "zlib";
+    default: return "off";
+  }
+}
+
+static int have_zlib(void) {
+  if (!tried_importing_zlib) {
+    tried_importing_zlib = 1;
+    PyObject* zlib_module = PyImport_ImportModule("zlib");
+    if (zlib_module) {
+      zlib_compress_func = PyObject_GetAttrString(zlib_module, "compress");
+      zlib_decompress_func = PyObject_GetAttrString(zlib_module, "decompress");
+      Py_DECREF(zlib_module);
+    }
+    if (!zlib_compress_func || !zlib_decompress_func) {
+      PyErr_Clear();
+      Py_CLEAR(zlib_compress_func);
+      Py_CLEAR(zlib_decompress_func);
+      PG_LOG("dict(event='ERROR', what='zlib is unavailable for compressing cache entries')");
+    }
+  }
+  return (zlib_compress_func != NULL);
+}
+
+
+int select_entry_serializer(char* name) {
+  if (strcmp(name, "auto") == 0) {
+    use_marshal_serializer = 1;
+  }
+  else if (strcmp(name, "pickle") == 0) {
+    use_marshal_serializer = 0;
+  }
+  else {
+    return 0;
+  }
+  return 1;
+}
+
+
+// ints, longs, floats, complex numbers, strings, unicode strings,
+// None, True, and False (exact types only, since marshal writes
+// instances of subclasses as their base types)
+static int is_marshal_scalar(PyObject* obj) {
+  return (obj == Py_None) || (obj == Py_True) || (obj == Py_False) ||
+         PyInt_CheckExact(obj) || PyString_CheckExact(obj) ||
+         PyFloat_CheckExact(obj) || PyLong_CheckExact(obj) ||
+         PyUnicode_CheckExact(obj) || PyComplex_CheckExact(obj);
+}
+
+// returns 1 if obj is made up only of objects that marshal writes and
+// reads back exactly (scalars and tuples, lists, dicts, sets, and
+// frozensets of those).
+//
+// marshal (unlike pickle) doesn't preserve aliasing, so obj is also
+// unsafe if any container is reachable more than once (which also
+// catches cycles), except for tuples of scalars (e.g., constants that
+// show up both in a return value and in its code dependencies); seen
+// holds the addresses of the containers visited so far
+static int marshal_safe(PyObject* obj, PyObject* seen, int depth) {
+  if (is_marshal_scalar(obj)) {
+    return 1;
+  }
+
+  int is_tuple = PyTuple_CheckExact(obj);
+  if (!is_tuple && !PyList_CheckExact(obj) &&
+      !PyDict_CheckExact(obj) && !PyAnySet_CheckExact(obj)) {
+    return 0;
+  }
+  if (depth > MAX_MARSHAL_DEPTH) {
+    return 0;
+  }
+
+  PyObject* addr = PyLong_FromVoidPtr(obj);
+  int already_seen = PySet_Contains(seen, addr);
+  if (!already_seen) {
+    PySet_Add(seen, addr);
+  }
+  Py_DECREF(addr);
+  if (already_seen) {
+    if (!is_tuple) {
+      return 0;
+    }
+    Py_ssize_t i;
+    for (i = 0; i < PyTuple_GET_SIZE(obj); i++) {
+      if (!is_marshal_scalar(PyTuple_GET_ITEM(obj, i))) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  Py_ssize_t i;
+  if (is_tuple) {
+    for (i = 0; i < PyTuple_GET_SIZE(obj); i++) {
+      if (!marshal_safe(PyTuple_GET_ITEM(obj, i), seen, depth + 1)) {
+        return 0;
+      }
+    }
+  }
+  else if (PyList_CheckExact(obj)) {
+    for (i = 0; i < PyList_GET_SIZE(obj); i++) {
+      if (!marshal_safe(PyList_GET_ITEM(obj, i), seen, depth + 1)) {
+        return 0;
+      }
+    }
+  }
+  else if (PyDict_CheckExact(obj)) {
+    Py_ssize_t pos = 0;
+    PyObject* key;
+    PyObject* value;
+    while (PyDict_Next(obj, &pos, &key, &value)) {
+      if (!marshal_safe(key, seen, depth + 1) ||
+          !marshal_safe(value, seen, depth + 1)) {
+        return 0;
+      }
+    }
+  }
+  else {
+    Py_ssize_t pos = 0;
+    PyObject* key;
+    while (_PySet_Next(obj, &pos, &key)) {
+      if (!marshal_safe(key, seen, depth + 1)) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+PyObject* serialize_value(PyObject* obj, int* serializer) {
+  if (use_marshal_serializer) {
+    PyObject* seen = PySet_New(NULL);
+    int safe = marshal_safe(obj, seen, 0);
+    Py_DECREF(seen);
+
+    if (safe) {
+      PyObject* ret = PyMarshal_WriteObjectToString(obj, Py_MARSHAL_VERSION);
+      if (ret) {
+        *serializer = SERIALIZER_MARSHAL;
+        return ret;
+      }
+      PyErr_Clear();
+    }
+  }
+
+  PyObject* negative_one = PyInt_FromLong(-1);
+  PyObject* ret =
+    PyObject_CallFunctionObjArgs(cPickle_dumpstr_func, obj, negative_one, NULL);
+  Py_DECREF(negative_one);
+  *serializer = SERIALIZER_PICKLE;
+  return ret;
+}
+
+PyObject* serialize_cache_entry(PyObject* contents, int* serializer) {
+  PyObject* ret = NULL;
+  if (use_marshal_serializer) {
+    ret = encode_memo_records(contents);
+    if (ret) {
+      *serializer = SERIALIZER_RECORD;
+    }
+  }
+  if (!ret) {
+    ret = serialize_value(contents, serializer);
+  }
+
+  if (ret) {
+    num_serialized[*serializer]++;
+  }
+  return ret;
+}
+
+PyObject* deserialize_cache_entry(PyObject* serialized_str, int serializer) {
+  if (serializer == SERIALIZER_RECORD) {
+    return decode_memo_records(serialized_str);
+  }
+  else if (serializer == SERIALIZER_MARSHAL) {
+    return PyMarshal_ReadObjectFromString(PyString_AS_STRING(serialized_str),
+                                          PyString_GET_SIZE(serialized_str));
+  }
+  return PyObject_CallFunctionObjArgs(cPickle_loadstr_func, serialized_str, NULL);
+}
+
+
+/* The LZ codec
+
+   The compressed stream is a sequence of items, each starting with a
+   control byte c:
+
+     c < 32:  a run of (c + 1) literal bytes follows
+
+     c >= 32: a back-reference to (len + 2) bytes that start (off + 1)
+              bytes before the current output position, where len is
+              the top 3 bits of c (if len is 7, then the next byte is
+              added to it) and off is the low 5 bits of c followed by
+              the next byte */
+#define LZ_HASH_BITS 14
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_MAX_LIT 32
+#define LZ_MAX_OFF (1 << 13)
+#define LZ_MAX_REF (7 + 255 + 2)
+
+#define LZ_HASH(p) \
+  ((((unsigned)(p)[0] << 16) ^ ((unsigned)(p)[1] << 8) ^ (unsigned)(p)[2]) * 2654435761U >> (32 - LZ_HASH_BITS))
+
+// compresses in into out (which has room for out_len bytes), and
+// returns the compressed length (or 0 if it doesn't fit)
+static Py_ssize_t lz_compress(const unsigned char* in, Py_ssize_t in_len,
+                              unsigned char* out, Py_ssize_t out_len) {
+  Py_ssize_t* htab = PyMem_New(Py_ssize_t, LZ_HASH_SIZE);
+  if (!htab) {
+    return 0;
+  }
+  Py_ssize_t i;
+  for (i = 0; i < LZ_HASH_SIZE; i++) {
+    htab[i] = -1;
+  }
+
+  Py_ssize_t ip = 0;
+  Py_ssize_t op = 1; // (reserve room for the first literal control byte)
+  int lit = 0;       // length of the current run of literals
+
+  while (ip < in_len) {
+    Py_ssize_t ref = -1;
+    if (ip + 2 < in_len) {
+      unsigned h = LZ_HASH(in + ip);
+      ref = htab[h];
+      htab[h] = ip;
+    }
+
+    if ((ref >= 0) && (ip - ref - 1 < LZ_MAX_OFF) &&
+        (in[ref] == in[ip]) && (in[ref + 1] == in[ip + 1]) && (in[ref + 2] == in[ip + 2])) {
+      Py_ssize_t off = ip - ref - 1;
+      Py_ssize_t max_len = in_len - ip;
+      if (max_len > LZ_MAX_REF) {
+        max_len = LZ_MAX_REF;
+      }
+      Py_ssize_t len = 3;
+      while ((len < max_len) && (in[ref + len] == in[ip + len])) {
+        len++;
+      }
+
+      // close the current run of literals (or take back its control
+      // byte if it's empty)
+      if (lit) {
+        out[op - lit - 1] = (unsigned char)(lit - 1);
+      }
+      else {
+        op--;
+      }
+
+      // (control byte, optional length byte, offset byte, and the
+      //  control byte for the next literal run)
+      if (op + 4 > out_len) {
+        PyMem_Del(htab);
+        return 0;
+      }
+
+      Py_ssize_t coded_len = len - 2;
+      if (coded_len < 7) {
+        out[op++] = (unsigned char)((off >> 8) + (coded_len << 5));
+      }
+      else {
+        out[op++] = (unsigned char)((off >> 8) + (7 << 5));
+        out[op++] = (unsigned char)(coded_len - 7);
+      }
+      out[op++] = (unsigned char)(off & 0xff);
+
+      ip += len;
+      lit = 0;
+      op++;
+    }
+    else {
+      if (op + 1 > out_len) {
+        PyMem_Del(htab);
+        return 0;
+      }
+      out[op++] = in[ip++];
+      lit++;
+      if (lit == LZ_MAX_LIT) {
+        out[op - lit - 1] = (unsigned char)(lit - 1);
+        lit = 0;
+        op++;
+      }
+    }
+  }
+
+  if (lit) {
+    out[op - lit - 1] = (unsigned char)(lit - 1);
+  }
+  else {
+    op--;
+  }
+
+  PyMem_Del(htab);
+  return (op <= out_len) ? op : 0;
+}
+
+// decompresses in into out, which must end up holding exactly out_len
+// bytes (returns 1 on success)
+static int lz_decompress(const unsigned char* in, Py_ssize_t in_len,
+                         unsigned char* out, Py_ssize_t out_len) {
+  Py_ssize_t ip = 0;
+  Py_ssize_t op = 0;
+
+  while (ip < in_len) {
+    unsigned int c = in[ip++];
+
+    if (c < LZ_MAX_LIT) {
+      Py_ssize_t n = c + 1;
+      if ((ip + n > in_len) || (op + n > out_len)) {
+        return 0;
+      }
+      memcpy(out + op, in + ip, n);
+      ip += n;
+      op += n;
+    }
+    else {
+      Py_ssize_t len = c >> 5;
+      Py_ssize_t off = (c & 0x1f) << 8;
+      if (len == 7) {
+        if (ip >= in_len) {
+          return 0;
+        }
+        len += in[ip++];
+      }
+      if (ip >= in_len) {
+        return 0;
+      }
+      off += in[ip++];
+      len += 2;
+
+      Py_ssize_t ref = op - off - 1;
+      if ((ref < 0) || (op + len > out_len)) {
+        return 0;
+      }
+      // (byte-by-byte, since the source and destination can overlap)
+      while (len--) {
+        out[op++] = out[ref++];
+      }
+    }
+  }
+
+  return (op == out_len);
+}
+
+
+// returns the compressed form of the n bytes at data with codec (or
+// NULL if it's not smaller than max_len)
+static PyObject* compress_with(int codec, const char* data, Py_ssize_t n,
+                               Py_ssize_t max_len) {
+  if (codec == CODEC_LZ) {
+    PyObject* ret = PyString_FromStringAndSize(NULL, max_len);
+    if (!ret) {
+      PyErr_Clear();
+      return NULL;
+    }
+    Py_ssize_t len = lz_compress((const unsigned char*)data, n,
+                                 (unsigned char*)PyString_AS_STRING(ret), max_len);
+    if (len == 0) {
+      Py_DECREF(ret);
+      return NULL;
+    }
+    _PyString_Resize(&ret, len);
+    return ret;
+  }
+  else if ((codec == CODEC_ZLIB) && have_zlib()) {
+    PyObject* ret = PyObject_CallFunction(zlib_compress_func, "s#i", data, (int)n, 1);
+    if (!ret) {
+      PyErr_Clear();
+    }
+    else if (PyString_GET_SIZE(ret) > max_len) {
+      Py_CLEAR(ret);
+    }
+    return ret;
+  }
+  return NULL;
+}
+
+// picks the codec that minimizes the predicted time to compress and
+// store the n-byte pickle at data and then load it back in
+static int choose_codec(const char* data, Py_ssize_t n) {
+  // gather the sample
+  char sample[NUM_SAMPLE_CHUNKS * SAMPLE_CHUNK_BYTES];
+  Py_ssize_t sample_len = 0;
+  if (n <= (Py_ssize_t)sizeof(sample)) {
+    memcpy(sample, data, n);
+    sample_len = n;
+  }
+  else {
+    int i;
+    for (i = 0; i < NUM_SAMPLE_CHUNKS; i++) {
+      Py_ssize_t start = (n - SAMPLE_CHUNK_BYTES) * i / (NUM_SAMPLE_CHUNKS - 1);
+      memcpy(sample + sample_len, data + start, SAMPLE_CHUNK_BYTES);
+      sample_len += SAMPLE_CHUNK_BYTES;
+    }
+  }
+
+  // every byte that we don't store has to be written once and then
+  // read back (at least) once
+  double us_per_stored_byte = cache_store_us_per_byte() + cache_read_us_per_byte();
+
+  int best_codec = CODEC_NONE;
+  double best_us_per_byte = us_per_stored_byte;
+
+  int codec;
+  for (codec = CODEC_LZ; codec < NUM_CODECS; codec++) {
+    struct timeval start_time;
+    struct timeval end_time;
+    BEGIN_TIMING(start_time);
+    PyObject* compressed = compress_with(codec, sample, sample_len, sample_len);
+    END_TIMING(start_time, end_time);
+
+    if (compressed) {
+      double ratio = PyString_GET_SIZE(compressed) / (double)sample_len;
+      // (count decompression as costing about as much as compression,
+      //  which is pessimistic for both codecs)
+      double compress_us_per_byte =
+        2.0 * GET_ELAPSED_US(start_time, end_time) / (double)sample_len;
+      double us_per_byte = compress_us_per_byte + (ratio * us_per_stored_byte);
+
+      if ((ratio <= MAX_USEFUL_RATIO) && (us_per_byte < best_us_per_byte)) {
+        best_codec = codec;
+        best_us_per_byte = us_per_byte;
+      }
+      Py_DECREF(compressed);
+    }
+  }
+
+  return best_codec;
+}
+
+PyObject* encode_cache_entry(PyObject* serialized_str, int serializer) {
+  Py_ssize_t n = PyString_GET_SIZE(serialized_str);
+  const char* data = PyString_AS_STRING(serialized_str);
+
+  int codec = CODEC_NONE;
+  if ((n >= MIN_COMPRESS_BYTES) && (n <= 0xFFFFFFFFL)) {
+    switch (entry_compression_mode) {
+      case COMPRESSION_AUTO:
+        codec = choose_codec(data, n);
+        break;
+      case COMPRESSION_LZ:
+        codec = CODEC_LZ;
+        break;
+      case COMPRESSION_ZLIB:
+        codec = have_zlib() ? CODEC_ZLIB : CODEC_LZ;
+        break;
+    }
+  }
+
+  PyObject* compressed = NULL;
+  if (codec != CODEC_NONE) {
+    compressed = compress_with(codec, data, n, n - ENTRY_HEADER_SIZE);
+  }
+
+  raw_bytes_encoded += n;
+  if (!compressed) {
+    codec = CODEC_NONE;
+
+    // (plain pickles don't need a header)
+    if (serializer == SERIALIZER_PICKLE) {
+      num_encoded[CODEC_NONE]++;
+      stored_bytes_encoded += n;
+      Py_INCREF(serialized_str);
+      return serialized_str;
+    }
+  }
+
+  const char* body = compressed ? PyString_AS_STRING(compressed) : data;
+  Py_ssize_t body_len = compressed ? PyString_GET_SIZE(compressed) : n;
+  PyObject* ret = PyString_FromStringAndSize(NULL, ENTRY_HEADER_SIZE + body_len);
+  if (ret) {
+    unsigned char* header = (unsigned char*)PyString_AS_STRING(ret);
+    header[0] = ENTRY_MAGIC;
+    header[1] = ENTRY_FORMAT_VERSION;
+    header[2] = (unsigned char)codec;
+    header[3] = (unsigned char)serializer;
+    header[4] = (unsigned char)((n >> 24) & 0xff);
+    header[5] = (unsigned char)((n >> 16) & 0xff);
+    header[6] = (unsigned char)((n >> 8) & 0xff);
+    header[7] = (unsigned char)(n & 0xff);
+    memcpy(header + ENTRY_HEADER_SIZE, body, body_len);
+
+    num_encoded[codec]++;
+    stored_bytes_encoded += PyString_GET_SIZE(ret);
+  }
+  Py_XDECREF(compressed);
+  return ret;
+}
+
+PyObject* decode_cache_entry(PyObject* data, int* serializer) {
+  Py_ssize_t len = PyString_GET_SIZE(data);
+  const unsigned char* header = (const unsigned char*)PyString_AS_STRING(data);
+
+  // a plain pickle
+  if ((len == 0) || (header[0] != ENTRY_MAGIC)) {
+    *serializer = SERIALIZER_PICKLE;
+    Py_INCREF(data);
+    return data;
+  }
+
+  if ((len < ENTRY_HEADER_SIZE) || (header[1] != ENTRY_FORMAT_VERSION) ||
+      (header[3] >= NUM_SERIALIZERS)) {
+    num_decode_errors++;
+    return NULL;
+  }
+  *serializer = header[3];
+
+  Py_ssize_t n = ((Py_ssize_t)header[4] << 24) | ((Py_ssize_t)header[5] << 16) |
+                 ((Py_ssize_t)header[6] << 8) | (Py_ssize_t)header[7];
+  const char* body = (const char*)(header + ENTRY_HEADER_SIZE);
+  Py_ssize_t body_len = len - ENTRY_HEADER_SIZE;
+
+  PyObject* ret = NULL;
+  if (header[2] == CODEC_NONE) {
+    if (body_len == n) {
+      ret = PyString_FromStringAndSize(body, n);
+    }
+  }
+  else if (header[2] == CODEC_LZ) {
+    ret = PyString_FromStringAndSize(NULL, n);
+    if (ret && !lz_decompress((const unsigned char*)body, body_len,
+                              (unsigned char*)PyString_AS_STRING(ret), n)) {
+      Py_CLEAR(ret);
+    }
+  }
+  else if ((header[2] == CODEC_ZLIB) && have_zlib()) {
+    ret = PyObject_CallFunction(zlib_decompress_func, "s#", body, (int)body_len);
+    if (ret && (!PyString_Check(ret) || PyString_GET_SIZE(ret) != n)) {
+      Py_CLEAR(ret);
+    }
+  }
+
+  if (!ret) {
+    PyErr_Clear();
+    num_decode_errors++;
+  }
+  return ret;
+}
+
+void add_codec_stats(PyObject* stats_dict) {
+  PyObject* serializer_counts = PyDict_New();
+  int serializer;
+  for (serializer = 0; serializer < NUM_SERIALIZERS; serializer++) {
+    PyObject* count = PyInt_FromSize_t(num_serialized[serializer]);
+    PyDict_SetItemString(serializer_counts, serializer_names[serializer], count);
+    Py_DECREF(count);
+  }
+  PyDict_SetItemString(stats_dict, "serializers", serializer_counts);
+  Py_DECREF(serializer_counts);
+
+  PyObject* num_corrupt = PyInt_FromSize_t(num_corrupt_records);
+  PyDict_SetItemString(stats_dict, "corrupt_entries", num_corrupt);
+  Py_DECREF(num_corrupt);
+
+  if (entry_compression_mode == COMPRESSION_OFF) {
+    return;
+  }
+
+  PyObject* codec_counts = PyDict_New();
+  int codec;
+  for (codec = 0; codec < NUM_CODECS; codec++) {
+    PyObject* count = PyInt_FromSize_t(num_encoded[codec]);
+    PyDict_SetItemString(codec_counts, codec_names[codec], count);
+    Py_DECREF(count);
+  }
+  PyDict_SetItemString(stats_dict, "codecs", codec_counts);
+  Py_DECREF(codec_counts);
+
+  PyObject* n = PyLong_FromUnsignedLongLong(raw_bytes_encoded);
+  PyDict_SetItemString(stats_dict, "raw_bytes_encoded", n);
+  Py_DECREF(n);
+  n = PyLong_FromUnsignedLongLong(stored_bytes_encoded);
+  PyDict_SetItemString(stats_dict, "stored_bytes_encoded", n);
+  Py_DECREF(n);
+  n = PyInt_FromSize_t(num_decode_errors);
+  PyDict_SetItemString(stats_dict, "decode_errors", n);
+  Py_DECREF(n);
+}
@@ -11,11 +11,16 @@
 
 #include "memoize.h"
 #include "memoize_codedep.h"
+#include "opcode.h"
 
 
 // initialize in pg_initialize(), destroy in pg_finalize()
 PyObject* module_str = NULL;
 
+// set to 1 by 'code_fingerprint = normalized' in incpy.config
+// (see "Normalized code dependencies" below)
+char normalize_code_dependencies = 0;
+
 /*
 
 Code dependency objects are just like Python code objects, except that
@@ -50,6 +55,109 @@ co_flags is an integer encoding a number of flags for the interpreter.
 
 */
 
+
+/* Normalized code dependencies:
+
+   By default, a code dependency changes whenever ANYTHING in co_code,
+   co_consts, co_names, co_varnames, etc. changes, so fixing a typo in a
+   docstring or renaming a local variable throws away all cached
+   results of that function and of everything that calls it.  When
+   normalize_code_dependencies is on, we leave out the following, none
+   of which can change what the bytecode computes:
+
+     - the docstring: co_consts[0] is replaced by None if it's a string
+       that no LOAD_CONST instruction refers to (the compiler always
+       puts a function's docstring there, and module and class code
+       loads theirs to store into __doc__, so those are kept)
+
+     - the names of local variables that aren't arguments, since
+       LOAD_FAST and STORE_FAST refer to locals by their index in
+       co_varnames; the names of arguments are kept since callers can
+       pass them as keywords, and all names are kept in functions that
+       can look them up by name (no CO_OPTIMIZED flag, or calls to
+       something named locals, vars, dir, eval, or execfile)
+
+   Line numbers (co_firstlineno and co_lnotab) are never part of a code
+   dependency, in either mode, so neither is anything in nested code
+   objects that only shifts their line numbers.
+
+   The price is that code that inspects its own __doc__ or local
+   variable names at run time might see stale memoized results. */
+
+static int loads_const_zero(PyCodeObject* codeobj) {
+  unsigned char* code = (unsigned char*)PyString_AS_STRING(codeobj->co_code);
+  Py_ssize_t len = PyString_GET_SIZE(codeobj->co_code);
+  Py_ssize_t i = 0;
+  long extended_arg = 0;
+  while (i < len) {
+    int opcode = code[i++];
+    if (HAS_ARG(opcode)) {
+      if (i + 1 >= len) {
+        break;
+      }
+      long oparg = (code[i] | (code[i + 1] << 8)) | extended_arg;
+      i += 2;
+      extended_arg = 0;
+      if (opcode == EXTENDED_ARG) {
+        extended_arg = oparg << 16;
+      }
+      else if ((opcode == LOAD_CONST) && (oparg == 0)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static int may_look_up_locals_by_name(PyCodeObject* codeobj) {
+  static char* introspective_names[] = {"locals", "vars", "dir", "eval", "execfile", NULL};
+
+  if (!(codeobj->co_flags & CO_OPTIMIZED)) {
+    return 1;
+  }
+
+  Py_ssize_t i;
+  for (i = 0; i < PyTuple_GET_SIZE(codeobj->co_names); i++) {
+    char* name = PyString_AsString(PyTuple_GET_ITEM(codeobj->co_names, i));
+    int j;
+    for (j = 0; introspective_names[j]; j++) {
+      if (strcmp(name, introspective_names[j]) == 0) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// returns a new reference to co_varnames with the names of all
+// non-argument locals replaced by their indices
+static PyObject* normalized_varnames(PyCodeObject* codeobj) {
+  Py_ssize_t num_args = codeobj->co_argcount;
+  if (codeobj->co_flags & CO_VARARGS) {
+    num_args++;
+  }
+  if (codeobj->co_flags & CO_VARKEYWORDS) {
+    num_args++;
+  }
+
+  Py_ssize_t n = PyTuple_GET_SIZE(codeobj->co_varnames);
+  PyObject* ret = PyTuple_New(n);
+  Py_ssize_t i;
+  for (i = 0; i < n; i++) {
+    PyObject* elt;
+    if (i < num_args) {
+      elt = PyTuple_GET_ITEM(codeobj->co_varnames, i);
+      Py_INCREF(elt);
+    }
+    else {
+      elt = PyInt_FromSsize_t(i);
+    }
+    PyTuple_SET_ITEM(ret, i, elt);
+  }
+  return ret;
+}
+
+
 // constructor:
 PyObject* CREATE_NEW_code_dependency(PyCodeObject* codeobj) {
   // n = {}
@@ -79,7 +187,14 @@ PyObject* CREATE_NEW_code_dependency(PyCodeObject* codeobj) {
 
   PyDict_SetItemString(n, "co_code", codeobj->co_code);
   PyDict_SetItemString(n, "co_names", codeobj->co_names);
-  PyDict_SetItemString(n, "co_varnames", codeobj->co_varnames);
+  if (normalize_code_dependencies && !may_look_up_locals_by_name(codeobj)) {
+    tmp = normalized_varnames(codeobj);
+    PyDict_SetItemString(n, "co_varnames", tmp);
+    Py_DECREF(tmp);
+  }
+  else {
+    PyDict_SetItemString(n, "co_varnames", codeobj->co_varnames);
+  }
   PyDict_SetItemString(n, "co_freevars", codeobj->co_freevars);
   PyDict_SetItemString(n, "co_cellvars", codeobj->co_cellvars);
 
@@ -92,13 +207,22 @@ PyObject* CREATE_NEW_code_dependency(PyCodeObject* codeobj) {
   // code_dependency object that serves as its picklable proxy
   PyObject* new_co_consts = PyList_New(0);
 
+  int strip_docstring = normalize_code_dependencies &&
+                        (PyTuple_GET_SIZE(codeobj->co_consts) > 0) &&
+                        PyString_Check(PyTuple_GET_ITEM(codeobj->co_consts, 0)) &&
+                        !loads_const_zero(codeobj);
+
   PyObject *iterator = PyObject_GetIter(codeobj->co_consts);
   assert(iterator);
 
   PyObject *item;
   while ((item = PyIter_Next(iterator))) {
     // create a picklable code_dependency object as a proxy:
-    if (PyCode_Check(item)) {
+    if (strip_docstring) {
+      PyList_Append(new_co_consts, Py_None);
+      strip_docstring = 0;
+    }
+    else if (PyCode_Check(item)) {
       // i hope that this recursive call to CREATE_NEW_code_dependency
       // always bottoms out ;)
       PyObject* tmp = CREATE_NEW_code_dependency((PyCodeObject*)item);
@@ -134,3 +258,50 @@ int code_dependency_EQ(PyObject* codedep1, PyObject* codedep2) {
   return obj_equals(codedep1, codedep2);
 }
 
+
+// returns a new reference to a copy of obj in which every dict is
+// replaced by a sorted list of its items, since equal dicts don't
+// necessarily pickle to equal strings
+static PyObject* canonicalize_code_dependency(PyObject* obj) {
+  Py_ssize_t i;
+  if (PyDict_Check(obj)) {
+    PyObject* items = PyDict_Items(obj);
+    for (i = 0; i < PyList_GET_SIZE(items); i++) {
+      PyObject* item = PyList_GET_ITEM(items, i);
+      PyObject* val = canonicalize_code_dependency(PyTuple_GET_ITEM(item, 1));
+      PyObject* new_item = PyTuple_Pack(2, PyTuple_GET_ITEM(item, 0), val);
+      Py_DECREF(val);
+      PyList_SetItem(items, i, new_item); // steals the reference
+    }
+    PyList_Sort(items);
+    return items;
+  }
+  else if (PyTuple_CheckExact(obj)) {
+    PyObject* ret = PyTuple_New(PyTuple_GET_SIZE(obj));
+    for (i = 0; i < PyTuple_GET_SIZE(obj); i++) {
+      PyTuple_SET_ITEM(ret, i, canonicalize_code_dependency(PyTuple_GET_ITEM(obj, i)));
+    }
+    return ret;
+  }
+  Py_INCREF(obj);
+  return obj;
+}
+
+// returns the md5 hexdigest of codedep, which is equal for all equal
+// code dependencies (new reference, or NULL if it can't be pickled)
+PyObject* code_dependency_digest(PyObject* codedep) {
+  PyObject* canonical = canonicalize_code_dependency(codedep);
+  PyObject* negative_one = PyInt_FromLong(-1);
+  PyObject* pickled_str =
+    PyObject_CallFunctionObjArgs(cPickle_dumpstr_func, canonical, negative_one, NULL);
+  Py_DECREF(negative_one);
+  Py_DECREF(canonical);
+  if (!pickled_str) {
+    PyErr_Clear();
+    return NULL;
+  }
+
+  PyObject* digest = hexdigest_str(pickled_str);
+  Py_DECREF(pickled_str);
+  return digest;
+}
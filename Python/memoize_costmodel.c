@@ -0,0 +1,355 @@
+/* Cost model for deciding which calls are worth memoizing
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+/* Rather than pickling and writing a memo table entry and THEN
+   deleting it if that took longer than re-running the function, we
+   predict how long it will take to save and load the entry from:
+
+     1. a cheap estimate of its pickled size, obtained by walking a
+        bounded sample of the objects reachable from it, and
+
+     2. a running model of how fast the on-disk cache reads and writes
+        entries (a fixed per-entry overhead plus a per-byte cost),
+        which is updated after every GET and PUT
+
+   and then compare that against the time that we expect to save when
+   the entry gets re-used. */
+
+#include "Python.h"
+#include "memoize_costmodel.h"
+#include "memoize_fmi.h"
+#include "memoize_logging.h"
+
+
+// only look this deep into nested objects when estimating sizes ...
+#define SIZE_ESTIMATE_MAX_DEPTH 8
+
+// ... and for containers with more elements than this, only look at
+// the first SIZE_ESTIMATE_SAMPLE_SIZE elements and extrapolate
+#define SIZE_ESTIMATE_SAMPLE_SIZE 16
+
+// entries smaller than this are dominated by fixed per-entry costs
+// (opening, creating, and renaming files), so use them to calibrate
+// the overhead part of the throughput model, and use bigger ones to
+// calibrate the per-byte part
+#define SMALL_ENTRY_BYTES 4096
+
+// weight of the newest sample in the exponential moving averages
+#define EMA_WEIGHT 0.25
+
+
+/* The throughput model of the on-disk cache:
+
+     cost in microseconds = overhead_us + (nbytes * us_per_byte)
+
+   The initial values are conservative guesses for pickling to a
+   local disk and get refined as soon as we see real GETs and PUTs. */
+static double write_overhead_us = 500.0;
+static double write_us_per_byte = 0.05; // ~20 MB/sec
+static double read_overhead_us = 250.0;
+static double read_us_per_byte = 0.025; // ~40 MB/sec
+
+// the same model for only storing bytes that have already been
+// pickled, which decides whether compressing entries pays off (see
+// memoize_codec.c)
+static double store_overhead_us = 250.0;
+static double store_us_per_byte = 0.01; // ~100 MB/sec
+
+
+static void update_model(double* overhead_us, double* us_per_byte,
+                         Py_ssize_t nbytes, long elapsed_us) {
+  if (nbytes <= 0 || elapsed_us < 0) {
+    return;
+  }
+
+  if (nbytes < SMALL_ENTRY_BYTES) {
+    *overhead_us = ((1.0 - EMA_WEIGHT) * (*overhead_us)) +
+                   (EMA_WEIGHT * elapsed_us);
+  }
+  else {
+    double per_byte = (elapsed_us - *overhead_us) / (double)nbytes;
+    if (per_byte < 0) {
+      per_byte = 0;
+    }
+    *us_per_byte = ((1.0 - EMA_WEIGHT) * (*us_per_byte)) +
+                   (EMA_WEIGHT * per_byte);
+  }
+}
+
+void record_cache_write_cost(Py_ssize_t nbytes, long elapsed_us) {
+  update_model(&write_overhead_us, &write_us_per_byte, nbytes, elapsed_us);
+}
+
+void record_cache_read_cost(Py_ssize_t nbytes, long elapsed_us) {
+  update_model(&read_overhead_us, &read_us_per_byte, nbytes, elapsed_us);
+}
+
+void record_cache_store_cost(Py_ssize_t nbytes, long elapsed_us) {
+  update_model(&store_overhead_us, &store_us_per_byte, nbytes, elapsed_us);
+}
+
+double cache_store_us_per_byte(void) {
+  return store_us_per_byte;
+}
+
+double cache_read_us_per_byte(void) {
+  return read_us_per_byte;
+}
+
+
+// roughly mimics how cPickle (with protocol 2) encodes obj, without
+// actually creating any objects
+static Py_ssize_t estimate_size_helper(PyObject* obj, int depth) {
+  if (obj == Py_None || PyBool_Check(obj)) {
+    return 1;
+  }
+  else if (PyInt_CheckExact(obj)) {
+    return 5;
+  }
+  else if (PyFloat_CheckExact(obj)) {
+    return 9;
+  }
+  else if (PyLong_CheckExact(obj)) {
+    return 5 + (_PyLong_NumBits(obj) / 8);
+  }
+  else if (PyString_CheckExact(obj)) {
+    return 5 + PyString_GET_SIZE(obj);
+  }
+  else if (PyUnicode_CheckExact(obj)) {
+    return 5 + (2 * PyUnicode_GET_SIZE(obj)); // UTF-8 encoded
+  }
+
+  if (depth >= SIZE_ESTIMATE_MAX_DEPTH) {
+    return Py_TYPE(obj)->tp_basicsize;
+  }
+
+  Py_ssize_t total = 0;
+  Py_ssize_t n = 0;
+  Py_ssize_t i;
+
+  if (PyList_Check(obj) || PyTuple_Check(obj)) {
+    n = PySequence_Fast_GET_SIZE(obj);
+    PyObject** items = PySequence_Fast_ITEMS(obj);
+    Py_ssize_t num_sampled = (n < SIZE_ESTIMATE_SAMPLE_SIZE) ? n : SIZE_ESTIMATE_SAMPLE_SIZE;
+    for (i = 0; i < num_sampled; i++) {
+      total += estimate_size_helper(items[i], depth + 1);
+    }
+    if (num_sampled < n) {
+      total = (total / num_sampled) * n;
+    }
+    return 3 + total;
+  }
+  else if (PyDict_Check(obj)) {
+    n = PyDict_Size(obj);
+    Py_ssize_t num_sampled = 0;
+    Py_ssize_t pos = 0;
+    PyObject* key;
+    PyObject* value;
+    while ((num_sampled < SIZE_ESTIMATE_SAMPLE_SIZE) &&
+           PyDict_Next(obj, &pos, &key, &value)) {
+      total += estimate_size_helper(key, depth + 1);
+      total += estimate_size_helper(value, depth + 1);
+      num_sampled++;
+    }
+    if (num_sampled < n) {
+      total = (total / num_sampled) * n;
+    }
+    return 3 + total;
+  }
+  else if (PyAnySet_Check(obj)) {
+    n = PySet_GET_SIZE(obj);
+    Py_ssize_t num_sampled = 0;
+    Py_ssize_t pos = 0;
+    PyObject* key;
+    while ((num_sampled < SIZE_ESTIMATE_SAMPLE_SIZE) &&
+           _PySet_Next(obj, &pos, &key)) {
+      total += estimate_size_helper(key, depth + 1);
+      num_sampled++;
+    }
+    if (num_sampled < n) {
+      total = (total / num_sampled) * n;
+    }
+    return 20 + total; // sets get pickled using __reduce__
+  }
+  else if (PyInstance_Check(obj)) {
+    PyInstanceObject* inst = (PyInstanceObject*)obj;
+    return 10 + PyString_GET_SIZE(inst->in_class->cl_name) +
+           estimate_size_helper(inst->in_dict, depth + 1);
+  }
+
+  // raw data of strings, arrays, etc. gets pickled as-is
+  const void* buf;
+  Py_ssize_t buf_len;
+  if (PyObject_CheckReadBuffer(obj)) {
+    if (PyObject_AsReadBuffer(obj, &buf, &buf_len) == 0) {
+      return 20 + buf_len;
+    }
+    PyErr_Clear();
+  }
+
+  // new-style objects with a __dict__
+  total = 10 + strlen(Py_TYPE(obj)->tp_name);
+  PyObject** dictptr = _PyObject_GetDictPtr(obj);
+  if (dictptr && *dictptr) {
+    total += estimate_size_helper(*dictptr, depth + 1);
+  }
+  else {
+    total += Py_TYPE(obj)->tp_basicsize;
+  }
+  return total;
+}
+
+// returns a rough estimate of the number of bytes that obj would take
+// up when pickled, which is usually within a small factor of the real
+// size, in time proportional to the size of a bounded sample of obj
+Py_ssize_t estimate_pickled_size(PyObject* obj) {
+  return estimate_size_helper(obj, 0);
+}
+
+
+// should we consider memoizing this call even though it ran for less
+// than memoize_time_limit_ms?
+int is_frequently_called(FuncMemoInfo* fmi, long runtime_ms) {
+  return ((fmi->num_calls >= FREQUENT_CALL_THRESHOLD) &&
+          (runtime_ms >= FREQUENT_CALL_MIN_RUNTIME_MS));
+}
+
+
+/* Fills in est with predictions for storing memo_table_entry for a call
+   to fmi's function that ran for runtime_ms, and returns 1 if the
+   entry is worth storing (0 otherwise).
+
+   (This only takes memo_table_entry itself into account, not any
+    other entries with the same arguments that will get re-written
+    along with it, since we don't want to load those unless we're
+    actually going to store this one.) */
+int admit_memo_table_entry(FuncMemoInfo* fmi, PyObject* memo_table_entry,
+                           long runtime_ms, MemoCostEstimate* est) {
+  double runtime_us = runtime_ms * 1000.0;
+
+  est->est_bytes = estimate_pickled_size(memo_table_entry);
+  est->predicted_write_us =
+    (long)(write_overhead_us + (est->est_bytes * write_us_per_byte));
+  est->predicted_read_us =
+    (long)(read_overhead_us + (est->est_bytes * read_us_per_byte));
+
+  /* How many times do we expect to load this entry?  Each cache miss
+     leaves behind one entry, so hits per miss tells us how often an
+     entry for this function has been re-used so far (these counts
+     carry over from previous executions with the same code).  Assume
+     that it will be re-used at least once, since the most common case
+     is simply re-running the same script. */
+  est->expected_reuses = 1.0;
+  if (fmi->num_lookups > fmi->num_hits) {
+    double hits_per_miss =
+      (double)fmi->num_hits / (double)(fmi->num_lookups - fmi->num_hits);
+    if (hits_per_miss > est->expected_reuses) {
+      est->expected_reuses = hits_per_miss;
+    }
+  }
+
+  est->predicted_savings_us =
+    (long)((est->expected_reuses * (runtime_us - est->predicted_read_us)) -
+           est->predicted_write_us);
+
+  // hopeless: loading the entry would be slower than re-running the call
+  if (est->predicted_read_us >= runtime_us) {
+    return 0;
+  }
+
+  return (est->predicted_savings_us > 0);
+}
+
+
+// returns 1 if we should probe the on-disk cache for this call to
+// fmi's function, or 0 if probes haven't been paying off lately
+int should_probe_cache(FuncMemoInfo* fmi) {
+  if (fmi->lookups_bypassed) {
+    if (fmi->calls_until_reprobe > 0) {
+      fmi->calls_until_reprobe--;
+      return 0;
+    }
+
+    // time for a re-probe (record_lookup_cost() decides whether to
+    // keep bypassing afterwards)
+    fmi->calls_until_reprobe = REPROBE_INTERVAL;
+  }
+  return 1;
+}
+
+// record that probing the on-disk cache for fmi's function took
+// lookup_us microseconds and found a usable entry iff hit, and then
+// decide whether probes are still worthwhile
+void record_lookup_cost(FuncMemoInfo* fmi, long lookup_us, int hit) {
+  if (lookup_us < 0) {
+    lookup_us = 0;
+  }
+
+  fmi->num_lookups++;
+  if (hit) {
+    fmi->num_hits++;
+  }
+  fmi->total_lookup_us += lookup_us;
+
+  if (fmi->num_fill_lookups == 0 && !fmi->fill_phase_done) {
+    fmi->recent_lookup_us = lookup_us;
+    fmi->recent_hit_rate = HIT_RATE_PRIOR;
+  }
+  else {
+    fmi->recent_lookup_us = ((1.0 - EMA_WEIGHT) * fmi->recent_lookup_us) +
+                            (EMA_WEIGHT * lookup_us);
+  }
+
+  // misses during the fill phase don't count against the hit rate
+  if (!fmi->fill_phase_done) {
+    if (!hit && (fmi->num_fill_lookups < MAX_FILL_LOOKUPS)) {
+      fmi->num_fill_lookups++;
+      return;
+    }
+    fmi->fill_phase_done = 1;
+  }
+
+  fmi->recent_hit_rate = ((1.0 - EMA_WEIGHT) * fmi->recent_hit_rate) +
+                         (EMA_WEIGHT * (hit ? 1.0 : 0.0));
+
+  if (fmi->num_recent_lookups < MIN_LOOKUPS_BEFORE_BYPASS) {
+    fmi->num_recent_lookups++;
+    return;
+  }
+
+  // we only know how long the function takes if it actually ran
+  if (fmi->num_calls == 0) {
+    return;
+  }
+
+  double avg_runtime_us = (fmi->total_runtime_ms * 1000.0) / fmi->num_calls;
+  double expected_savings_us =
+    (fmi->recent_hit_rate * avg_runtime_us) - fmi->recent_lookup_us;
+
+  // (only bother when probes cost a real fraction of a call)
+  int probes_dont_pay_off =
+    (fmi->recent_lookup_us > (LOOKUP_COST_FRACTION * avg_runtime_us)) &&
+    (expected_savings_us < 0);
+
+  if (!fmi->lookups_bypassed && probes_dont_pay_off) {
+    fmi->lookups_bypassed = 1;
+    fmi->calls_until_reprobe = REPROBE_INTERVAL;
+    PG_LOG_PRINTF("dict(event='BYPASS_LOOKUPS', what='%s', recent_lookup_us=%g, recent_hit_rate=%g, avg_runtime_us=%g)\n",
+                  PyString_AsString(GET_CANONICAL_NAME(fmi)),
+                  fmi->recent_lookup_us, fmi->recent_hit_rate, avg_runtime_us);
+  }
+  else if (fmi->lookups_bypassed && !probes_dont_pay_off) {
+    fmi->lookups_bypassed = 0;
+    PG_LOG_PRINTF("dict(event='RESUME_LOOKUPS', what='%s', recent_lookup_us=%g, recent_hit_rate=%g, avg_runtime_us=%g)\n",
+                  PyString_AsString(GET_CANONICAL_NAME(fmi)),
+                  fmi->recent_lookup_us, fmi->recent_hit_rate, avg_runtime_us);
+  }
+}
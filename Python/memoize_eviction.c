@@ -0,0 +1,902 @@
+/* Cache size budget and cost-aware eviction
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+/* Without a budget, incpy-cache/ only ever grows.  We keep an index of
+   all cache entry files, which lives in incpy-cache/cache_index.pickle
+   and contains a dict where each key is a canonical function name and
+   each value is a dict mapping a cache entry's key (its version and
+   the basename of its .pickle file, as "<version>/<hash key>") to a
+   list of 4 ints:
+
+     [size in bytes, runtime in ms, number of hits, last access time]
+
+   (the runtime is the longest runtime of all calls memoized in that
+    file, and the last access time is in seconds since the epoch)
+
+   Every PUT, hit, and DEL updates the index.  Whenever a PUT pushes the
+   function or the entire cache over its budget, we evict entries until
+   it's back under EVICTION_LOW_WATER_PERCENT of its budget, at most
+   MAX_EVICTIONS_PER_PUT at a time, so that the program never stalls
+   for long; whatever's left over is evicted in save_cache_index() at
+   finalize time.  (A PUT only queues up that check, and memoize_fmi.c
+   runs it with cache_index_enforce_budgets() as soon as it isn't
+   holding any entry lock anymore, since evicting deletes other
+   entries.)
+
+   Several processes can share one incpy-cache/, so we remember which
+   records this process changed (see cache_index_changes), and at
+   finalize time save_cache_index() re-reads the index under an
+   exclusive lock and merges our changes into it, rather than
+   overwriting everybody else's.
+
+   incpy-support-scripts/sweep_cache.py implements the same policy as a
+   standalone sweep, which also indexes entry files that this index
+   doesn't know about.
+
+   Eviction order:
+
+   The time that an entry saves is (runtime in ms) x (number of hits + 1),
+   counting the re-use that we expected when we stored it.  Entries are
+   first grouped into tiers by the order of magnitude of the time that
+   they save, and we evict ALL entries of a lower tier before touching
+   a higher one, so that an entry that saves hours is never thrown out
+   to make room for thousands of small entries that each save a second.
+   Within a tier, we evict the entries that save the least time per byte
+   first, and break ties by evicting the least-recently-accessed ones.
+   The entry that a PUT just wrote competes just like all others, so if
+   it ranks below everything else, then it's the one that goes (i.e.,
+   the cache refuses it rather than give up more valuable entries).
+
+   Another process (or incpy-support-scripts/sweep_cache.py) might have
+   re-written or deleted an entry since we last looked, so evict_entry()
+   re-checks its actual size while holding its entry lock, and
+   save_cache_index() doesn't bring back the records of entries that are
+   gone. */
+
+#include "Python.h"
+#include "memoize_eviction.h"
+#include "memoize_fmi.h"
+#include "memoize.h"
+#include "memoize_logging.h"
+#include "memoize_shmindex.h"
+#include "memoize_storage.h"
+
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// fields of each record in the cache index
+#define REC_NBYTES 0
+#define REC_RUNTIME_MS 1
+#define REC_NUM_HITS 2
+#define REC_LAST_ACCESS 3
+#define REC_LEN 4
+
+#define EVICTION_LOW_WATER_PERCENT 90
+#define MAX_EVICTIONS_PER_PUT 64
+
+
+PY_LONG_LONG cache_budget_bytes = 0;
+PY_LONG_LONG func_cache_budget_bytes = 0;
+
+// Key: canonical name, Value: dict of records (see above)
+//
+// initialize in load_cache_index(), destroy in save_cache_index()
+static PyObject* cache_index_dict = NULL;
+
+// Key: canonical name, Value: total bytes of its cache entries (PyLong)
+static PyObject* func_bytes_dict = NULL;
+
+// total bytes of all cache entries in cache_index_dict
+static PY_LONG_LONG total_cache_bytes = 0;
+
+// Key: canonical name of a function that was PUT into since the last
+// cache_index_enforce_budgets(), Value: None
+static PyObject* pending_budget_checks = NULL;
+
+// Key: canonical name, Value: dict mapping the key of each record that
+// this process changed to a list of 2 ints:
+//
+//   [number of hits before our first change, time that we deleted it]
+//
+// (the deletion time is 0 if we never deleted it)
+//
+// save_cache_index() uses this to merge our changes into whatever other
+// processes have written to cache_index.pickle since we loaded it
+static PyObject* cache_index_changes = NULL;
+
+#define CHANGE_BASE_HITS 0
+#define CHANGE_DELETED_AT 1
+#define CHANGE_LEN 2
+
+// has cache_index_dict changed since we loaded it?  (if not, then
+// don't write it back out, so that we don't clobber changes made by
+// other processes or by incpy-support-scripts/sweep_cache.py)
+static char cache_index_dirty = 0;
+
+
+static long get_rec_field(PyObject* rec, int field) {
+  return PyInt_AsLong(PyList_GET_ITEM(rec, field));
+}
+
+static void set_rec_field(PyObject* rec, int field, long val) {
+  PyList_SetItem(rec, field, PyInt_FromLong(val)); // steals the reference
+}
+
+// the index key of the entry with hash_key in fmi's current cache
+// version (new reference)
+static PyObject* index_key(FuncMemoInfo* fmi, PyObject* hash_key) {
+  assert(fmi->cache_version);
+  return PyString_FromFormat("%s/%s",
+                             PyString_AsString(fmi->cache_version),
+                             PyString_AsString(hash_key));
+}
+
+// the cache sub-directory of canonical_name's function (new reference)
+static PyObject* func_subdir_path(PyObject* canonical_name) {
+  PyObject* fmi_addr = PyDict_GetItem(all_func_memo_info_dict, canonical_name);
+  if (fmi_addr) {
+    FuncMemoInfo* fmi = (FuncMemoInfo*)PyInt_AsLong(fmi_addr);
+    Py_INCREF(fmi->cache_subdirectory_path);
+    return fmi->cache_subdirectory_path;
+  }
+
+  PyObject* subdir_basename = hexdigest_str(canonical_name);
+  PyObject* subdir_path = PyString_FromFormat("%s/%s.cache", INCPY_CACHE_DIR,
+                                              PyString_AsString(subdir_basename));
+  Py_DECREF(subdir_basename);
+  return subdir_path;
+}
+
+static PY_LONG_LONG get_func_bytes(PyObject* canonical_name) {
+  PyObject* n = PyDict_GetItem(func_bytes_dict, canonical_name);
+  return n ? PyLong_AsLongLong(n) : 0;
+}
+
+static void add_func_bytes(PyObject* canonical_name, PY_LONG_LONG delta) {
+  PyObject* n = PyLong_FromLongLong(get_func_bytes(canonical_name) + delta);
+  PyDict_SetItem(func_bytes_dict, canonical_name, n);
+  Py_DECREF(n);
+  total_cache_bytes += delta;
+}
+
+
+// read incpy-cache/cache_index.pickle, returning a new reference to
+// its dict, or NULL if it's missing or malformed
+static PyObject* read_cache_index_file(void) {
+  PyObject* cache_index_path =
+    PyString_FromFormat("%s/" CACHE_INDEX_FILENAME, INCPY_CACHE_DIR);
+  PyObject* pf = PyFile_FromString(PyString_AsString(cache_index_path), "rb");
+  Py_DECREF(cache_index_path);
+  if (!pf) {
+    assert(PyErr_Occurred());
+    PyErr_Clear();
+    return NULL;
+  }
+
+  PyObject* index = PyObject_CallFunctionObjArgs(cPickle_load_func, pf, NULL);
+  Py_DECREF(pf);
+  if (!index) {
+    assert(PyErr_Occurred());
+    PyErr_Clear();
+    PG_LOG("dict(event='ERROR', what='Cannot unpickle cache index')");
+    return NULL;
+  }
+  if (!PyDict_CheckExact(index)) {
+    Py_DECREF(index);
+    return NULL;
+  }
+
+  // weed out malformed records, just to be safe
+  PyObject* canonical_name = NULL;
+  PyObject* func_entries = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(index, &pos, &canonical_name, &func_entries)) {
+    if (!PyDict_CheckExact(func_entries)) {
+      Py_DECREF(index);
+      return NULL;
+    }
+
+    PyObject* hash_key = NULL;
+    PyObject* rec = NULL;
+    Py_ssize_t rec_pos = 0;
+    while (PyDict_Next(func_entries, &rec_pos, &hash_key, &rec)) {
+      if (!PyList_CheckExact(rec) || (PyList_GET_SIZE(rec) != REC_LEN)) {
+        Py_DECREF(index);
+        return NULL;
+      }
+    }
+  }
+  return index;
+}
+
+// re-compute func_bytes_dict and total_cache_bytes from cache_index_dict
+static void tally_cache_index(void) {
+  PyDict_Clear(func_bytes_dict);
+  total_cache_bytes = 0;
+
+  PyObject* canonical_name = NULL;
+  PyObject* func_entries = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(cache_index_dict, &pos, &canonical_name, &func_entries)) {
+    PyObject* hash_key = NULL;
+    PyObject* rec = NULL;
+    Py_ssize_t rec_pos = 0;
+    while (PyDict_Next(func_entries, &rec_pos, &hash_key, &rec)) {
+      add_func_bytes(canonical_name, get_rec_field(rec, REC_NBYTES));
+    }
+  }
+}
+
+// (called from pg_initialize())
+void load_cache_index(void) {
+  assert(!cache_index_dict);
+  func_bytes_dict = PyDict_New();
+  cache_index_changes = PyDict_New();
+  pending_budget_checks = PyDict_New();
+  total_cache_bytes = 0;
+
+  // entries in a non-persistent backend start out empty every time,
+  // so only track the ones that this execution creates
+  cache_index_dict = memo_storage->is_persistent ? read_cache_index_file() : NULL;
+  if (!cache_index_dict) {
+    cache_index_dict = PyDict_New();
+    return;
+  }
+
+  tally_cache_index();
+
+  PG_LOG_PRINTF("dict(event='CACHE_INDEX', num_funcs=%ld, total_bytes=%lld)\n",
+                (long)PyDict_Size(cache_index_dict), total_cache_bytes);
+}
+
+
+// the changes to canonical_name's records (created on demand; borrowed
+// reference)
+static PyObject* get_func_changes(PyObject* canonical_name) {
+  PyObject* func_changes = PyDict_GetItem(cache_index_changes, canonical_name);
+  if (!func_changes) {
+    func_changes = PyDict_New();
+    PyDict_SetItem(cache_index_changes, canonical_name, func_changes);
+    Py_DECREF(func_changes);
+  }
+  return func_changes;
+}
+
+// remember that we're about to update the record of key (rec, which is
+// NULL if it doesn't exist yet)
+static void note_changed_rec(PyObject* canonical_name, PyObject* key,
+                             PyObject* rec) {
+  PyObject* func_changes = get_func_changes(canonical_name);
+  if (PyDict_GetItem(func_changes, key)) {
+    return; // keep the number of hits from the first time around
+  }
+
+  PyObject* change = PyList_New(CHANGE_LEN);
+  set_rec_field(change, CHANGE_BASE_HITS, rec ? get_rec_field(rec, REC_NUM_HITS) : 0);
+  set_rec_field(change, CHANGE_DELETED_AT, 0);
+  PyDict_SetItem(func_changes, key, change);
+  Py_DECREF(change);
+}
+
+// remember that we're about to delete the record of key
+static void note_deleted_rec(PyObject* canonical_name, PyObject* key) {
+  PyObject* change = PyList_New(CHANGE_LEN);
+  set_rec_field(change, CHANGE_BASE_HITS, 0);
+  set_rec_field(change, CHANGE_DELETED_AT, (long)time(NULL));
+  PyDict_SetItem(get_func_changes(canonical_name), key, change);
+  Py_DECREF(change);
+}
+
+// apply the changes in cache_index_changes to disk_index, which is
+// what's currently in cache_index.pickle
+static void merge_changes_into(PyObject* disk_index) {
+  PyObject* canonical_name = NULL;
+  PyObject* func_changes = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(cache_index_changes, &pos, &canonical_name, &func_changes)) {
+    PyObject* our_entries = PyDict_GetItem(cache_index_dict, canonical_name);
+    PyObject* disk_entries = PyDict_GetItem(disk_index, canonical_name);
+    if (!disk_entries) {
+      disk_entries = PyDict_New();
+      PyDict_SetItem(disk_index, canonical_name, disk_entries);
+      Py_DECREF(disk_entries);
+    }
+
+    PyObject* key = NULL;
+    PyObject* change = NULL;
+    Py_ssize_t change_pos = 0;
+    while (PyDict_Next(func_changes, &change_pos, &key, &change)) {
+      PyObject* our_rec = our_entries ? PyDict_GetItem(our_entries, key) : NULL;
+      PyObject* disk_rec = PyDict_GetItem(disk_entries, key);
+      long deleted_at = get_rec_field(change, CHANGE_DELETED_AT);
+
+      if (!our_rec) {
+        // we deleted it, so drop its record unless another process
+        // re-wrote or hit it since then
+        if (disk_rec && (get_rec_field(disk_rec, REC_LAST_ACCESS) <= deleted_at)) {
+          PyDict_DelItem(disk_entries, key);
+        }
+        continue;
+      }
+
+      PyObject* merged = PyList_GetSlice(our_rec, 0, REC_LEN);
+
+      // if the index on disk doesn't have it (anymore), then somebody
+      // might have deleted it since we last touched it, so only bring
+      // its record back if its file is still there
+      if (!disk_rec) {
+        PyObject* subdir_path = func_subdir_path(canonical_name);
+        PyObject* pickle_filename =
+          PyString_FromFormat("%s/%s.pickle", PyString_AsString(subdir_path),
+                              PyString_AsString(key));
+        Py_ssize_t nbytes = memo_storage_SIZE(pickle_filename);
+        Py_DECREF(pickle_filename);
+        Py_DECREF(subdir_path);
+        if (nbytes < 0) {
+          Py_DECREF(merged);
+          continue;
+        }
+        set_rec_field(merged, REC_NBYTES, (long)nbytes);
+      }
+
+      // if we deleted and then re-wrote it, then our record supersedes
+      // the one on disk; otherwise add up both processes' hits
+      if (disk_rec && !deleted_at) {
+        set_rec_field(merged, REC_NUM_HITS,
+                      get_rec_field(disk_rec, REC_NUM_HITS) +
+                      get_rec_field(our_rec, REC_NUM_HITS) -
+                      get_rec_field(change, CHANGE_BASE_HITS));
+        if (get_rec_field(disk_rec, REC_RUNTIME_MS) > get_rec_field(our_rec, REC_RUNTIME_MS)) {
+          set_rec_field(merged, REC_RUNTIME_MS, get_rec_field(disk_rec, REC_RUNTIME_MS));
+        }
+        if (get_rec_field(disk_rec, REC_LAST_ACCESS) > get_rec_field(our_rec, REC_LAST_ACCESS)) {
+          set_rec_field(merged, REC_LAST_ACCESS, get_rec_field(disk_rec, REC_LAST_ACCESS));
+        }
+      }
+      PyDict_SetItem(disk_entries, key, merged);
+      Py_DECREF(merged);
+    }
+
+    if (PyDict_Size(disk_entries) == 0) {
+      PyDict_DelItem(disk_index, canonical_name);
+    }
+  }
+}
+
+
+typedef struct {
+  PyObject* canonical_name; // new reference
+  PyObject* hash_key;       // new reference
+  int tier;
+  double saved_ms_per_byte;
+  long last_access;
+  long nbytes;
+} EvictionCandidate;
+
+static int compare_eviction_candidates(const void* a, const void* b) {
+  const EvictionCandidate* c1 = (const EvictionCandidate*)a;
+  const EvictionCandidate* c2 = (const EvictionCandidate*)b;
+
+  if (c1->tier != c2->tier) {
+    return (c1->tier < c2->tier) ? -1 : 1;
+  }
+  if (c1->saved_ms_per_byte != c2->saved_ms_per_byte) {
+    return (c1->saved_ms_per_byte < c2->saved_ms_per_byte) ? -1 : 1;
+  }
+  if (c1->last_access != c2->last_access) {
+    return (c1->last_access < c2->last_access) ? -1 : 1;
+  }
+  return 0;
+}
+
+// append candidates for all entries in func_entries to the end of
+// candidates
+static Py_ssize_t add_eviction_candidates(EvictionCandidate* candidates,
+                                          Py_ssize_t n,
+                                          PyObject* canonical_name,
+                                          PyObject* func_entries) {
+  PyObject* hash_key = NULL;
+  PyObject* rec = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(func_entries, &pos, &hash_key, &rec)) {
+    EvictionCandidate* c = &candidates[n++];
+    c->canonical_name = canonical_name;
+    Py_INCREF(canonical_name);
+    c->hash_key = hash_key;
+    Py_INCREF(hash_key);
+
+    c->nbytes = get_rec_field(rec, REC_NBYTES);
+    c->last_access = get_rec_field(rec, REC_LAST_ACCESS);
+
+    double saved_ms = (double)get_rec_field(rec, REC_RUNTIME_MS) *
+                      (double)(get_rec_field(rec, REC_NUM_HITS) + 1);
+    c->saved_ms_per_byte = saved_ms / (double)(c->nbytes > 0 ? c->nbytes : 1);
+
+    // order of magnitude of saved_ms
+    c->tier = 0;
+    while (saved_ms >= 10.0) {
+      saved_ms /= 10.0;
+      c->tier++;
+    }
+  }
+  return n;
+}
+
+// delete one cache entry file and its record (see "Eviction order"
+// above for why we lock it and re-check its size first)
+static void evict_entry(PyObject* canonical_name, PyObject* hash_key) {
+  PyObject* func_entries = PyDict_GetItem(cache_index_dict, canonical_name);
+  assert(func_entries);
+  PyObject* rec = PyDict_GetItem(func_entries, hash_key);
+  assert(rec);
+  long nbytes = get_rec_field(rec, REC_NBYTES);
+
+  FuncMemoInfo* fmi = NULL;
+  PyObject* fmi_addr = PyDict_GetItem(all_func_memo_info_dict, canonical_name);
+  if (fmi_addr) {
+    fmi = (FuncMemoInfo*)PyInt_AsLong(fmi_addr);
+  }
+  PyObject* subdir_path = func_subdir_path(canonical_name);
+
+  // hash_key is "<version>/<hash key>"
+  char* slash = strchr(PyString_AsString(hash_key), '/');
+  PyObject* basename_key = slash ? PyString_FromString(slash + 1) : NULL;
+  if (basename_key) {
+    lock_cache_entry(subdir_path, basename_key);
+  }
+
+  PyObject* pickle_filename =
+    PyString_FromFormat("%s/%s.pickle",
+                        PyString_AsString(subdir_path),
+                        PyString_AsString(hash_key));
+  Py_ssize_t actual_nbytes = memo_storage_SIZE(pickle_filename);
+  if (actual_nbytes >= 0) {
+    memo_storage_DEL(pickle_filename);
+  }
+  Py_DECREF(pickle_filename);
+
+  PG_LOG_PRINTF("dict(event='EVICT', what='%s', key='%s', nbytes=%ld, actual_nbytes=%ld)\n",
+                PyString_AsString(canonical_name),
+                PyString_AsString(hash_key),
+                nbytes, (long)actual_nbytes);
+
+  // count what it actually took up, not what our record says
+  if (actual_nbytes >= 0) {
+    add_func_bytes(canonical_name, (PY_LONG_LONG)actual_nbytes - nbytes);
+    nbytes = (long)actual_nbytes;
+  }
+
+  note_deleted_rec(canonical_name, hash_key);
+  add_func_bytes(canonical_name, -nbytes);
+  PyDict_DelItem(func_entries, hash_key);
+  cache_index_dirty = 1;
+
+  if (PyDict_Size(func_entries) == 0) {
+    PyDict_DelItem(cache_index_dict, canonical_name);
+    PyDict_DelItem(func_bytes_dict, canonical_name);
+  }
+
+  // erase its version sub-directory if it's now empty
+  if (basename_key) {
+    PyObject* version =
+      PyString_FromStringAndSize(PyString_AsString(hash_key),
+                                 slash - PyString_AsString(hash_key));
+    shared_memo_index_note_del(subdir_path, version, basename_key);
+    remove_cache_version_if_empty(fmi, subdir_path, version);
+    Py_DECREF(version);
+
+    unlock_cache_entry(subdir_path, basename_key);
+    Py_DECREF(basename_key);
+  }
+
+  Py_DECREF(subdir_path);
+}
+
+/* Evict entries of only_func (or of ALL functions if only_func is NULL)
+   in eviction order until they take up at most target_bytes, evicting
+   at most max_evictions entries (unlimited if negative). */
+static void evict_down_to(PyObject* only_func,
+                          PY_LONG_LONG target_bytes, int max_evictions) {
+  PY_LONG_LONG cur_bytes =
+    only_func ? get_func_bytes(only_func) : total_cache_bytes;
+
+  if (cur_bytes <= target_bytes) {
+    return;
+  }
+
+  // collect and sort candidates
+  Py_ssize_t max_candidates = 0;
+  PyObject* canonical_name = NULL;
+  PyObject* func_entries = NULL;
+  Py_ssize_t pos = 0;
+  if (only_func) {
+    func_entries = PyDict_GetItem(cache_index_dict, only_func);
+    if (!func_entries) {
+      return;
+    }
+    max_candidates = PyDict_Size(func_entries);
+  }
+  else {
+    while (PyDict_Next(cache_index_dict, &pos, &canonical_name, &func_entries)) {
+      max_candidates += PyDict_Size(func_entries);
+    }
+  }
+
+  EvictionCandidate* candidates = PyMem_New(EvictionCandidate, max_candidates);
+  Py_ssize_t n = 0;
+  if (only_func) {
+    n = add_eviction_candidates(candidates, n, only_func,
+                                PyDict_GetItem(cache_index_dict, only_func));
+  }
+  else {
+    pos = 0;
+    while (PyDict_Next(cache_index_dict, &pos, &canonical_name, &func_entries)) {
+      n = add_eviction_candidates(candidates, n, canonical_name, func_entries);
+    }
+  }
+
+  qsort(candidates, n, sizeof(EvictionCandidate), compare_eviction_candidates);
+
+  Py_ssize_t i;
+  int num_evicted = 0;
+  for (i = 0; i < n; i++) {
+    if ((cur_bytes <= target_bytes) ||
+        ((max_evictions >= 0) && (num_evicted >= max_evictions))) {
+      break;
+    }
+    // (re-read the total, since the victim's actual size might not
+    //  have been what its record said)
+    evict_entry(candidates[i].canonical_name, candidates[i].hash_key);
+    cur_bytes = only_func ? get_func_bytes(only_func) : total_cache_bytes;
+    num_evicted++;
+  }
+
+  for (i = 0; i < n; i++) {
+    Py_DECREF(candidates[i].canonical_name);
+    Py_DECREF(candidates[i].hash_key);
+  }
+  PyMem_Del(candidates);
+}
+
+// evict entries if either canonical_name's function or the entire
+// cache is over its budget
+static void enforce_cache_budgets(PyObject* canonical_name, int max_evictions) {
+  if (func_cache_budget_bytes > 0 &&
+      (get_func_bytes(canonical_name) > func_cache_budget_bytes)) {
+    evict_down_to(canonical_name,
+                  func_cache_budget_bytes * EVICTION_LOW_WATER_PERCENT / 100,
+                  max_evictions);
+  }
+
+  if (cache_budget_bytes > 0 && (total_cache_bytes > cache_budget_bytes)) {
+    evict_down_to(NULL,
+                  cache_budget_bytes * EVICTION_LOW_WATER_PERCENT / 100,
+                  max_evictions);
+  }
+}
+
+
+// records that the entry at key in canonical_name's cache was (re-)written
+static void note_put_rec(PyObject* canonical_name, PyObject* key,
+                         Py_ssize_t nbytes, long runtime_ms) {
+  PyObject* func_entries = PyDict_GetItem(cache_index_dict, canonical_name);
+  if (!func_entries) {
+    func_entries = PyDict_New();
+    PyDict_SetItem(cache_index_dict, canonical_name, func_entries);
+    Py_DECREF(func_entries);
+  }
+
+  PyObject* rec = PyDict_GetItem(func_entries, key);
+  note_changed_rec(canonical_name, key, rec);
+  if (rec) {
+    // the entry file got re-written with more calls
+    add_func_bytes(canonical_name, -get_rec_field(rec, REC_NBYTES));
+    if (get_rec_field(rec, REC_RUNTIME_MS) > runtime_ms) {
+      runtime_ms = get_rec_field(rec, REC_RUNTIME_MS);
+    }
+  }
+  else {
+    rec = PyList_New(REC_LEN);
+    set_rec_field(rec, REC_NUM_HITS, 0);
+    PyDict_SetItem(func_entries, key, rec);
+    Py_DECREF(rec);
+  }
+
+  set_rec_field(rec, REC_NBYTES, nbytes);
+  set_rec_field(rec, REC_RUNTIME_MS, runtime_ms);
+  set_rec_field(rec, REC_LAST_ACCESS, (long)time(NULL));
+  add_func_bytes(canonical_name, nbytes);
+  cache_index_dirty = 1;
+}
+
+// (called from on_disk_cache_PUT() after a successful write)
+void cache_index_note_put(FuncMemoInfo* fmi, PyObject* hash_key,
+                          Py_ssize_t nbytes, long runtime_ms) {
+  if (!cache_index_dict) {
+    return;
+  }
+
+  PyObject* key = index_key(fmi, hash_key);
+  PyObject* canonical_name = GET_CANONICAL_NAME(fmi);
+  note_put_rec(canonical_name, key, nbytes, runtime_ms);
+
+  // (might have to evict entries if we're now over budget)
+  PyDict_SetItem(pending_budget_checks, canonical_name, Py_None);
+  Py_DECREF(key);
+}
+
+// enforce the budgets on behalf of the PUTs since the last call
+// (called from memoize_fmi.c while it's not holding any entry locks)
+void cache_index_enforce_budgets(void) {
+  if (!pending_budget_checks || (PyDict_Size(pending_budget_checks) == 0)) {
+    return;
+  }
+
+  PyObject* pending = pending_budget_checks;
+  pending_budget_checks = PyDict_New();
+
+  PyObject* canonical_name = NULL;
+  PyObject* none = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(pending, &pos, &canonical_name, &none)) {
+    enforce_cache_budgets(canonical_name, MAX_EVICTIONS_PER_PUT);
+  }
+  Py_DECREF(pending);
+}
+
+// (called from memoize_fmi.c after moving an entry from before there
+// were cache versions into version, which isn't necessarily fmi's
+// current one ... that entry took up space all along, so it doesn't
+// count as a new PUT)
+void cache_index_note_migrated(FuncMemoInfo* fmi, PyObject* version, PyObject* hash_key,
+                               Py_ssize_t nbytes, long runtime_ms) {
+  if (!cache_index_dict) {
+    return;
+  }
+
+  PyObject* key = PyString_FromFormat("%s/%s", PyString_AsString(version),
+                                      PyString_AsString(hash_key));
+  note_put_rec(GET_CANONICAL_NAME(fmi), key, nbytes, runtime_ms);
+  Py_DECREF(key);
+}
+
+// returns a new list of the hash keys of up to max_keys entries in
+// fmi's current cache version that got hit before, most hits first
+// (for prefetching them; see memoize_cacheserver.c)
+PyObject* cache_index_popular_keys(FuncMemoInfo* fmi, Py_ssize_t max_keys) {
+  PyObject* keys = PyList_New(0);
+  PyObject* func_entries =
+    cache_index_dict ? PyDict_GetItem(cache_index_dict, GET_CANONICAL_NAME(fmi)) : NULL;
+  if (!func_entries || !fmi->cache_version) {
+    return keys;
+  }
+
+  // (sort (-hits, hash key) pairs)
+  PyObject* prefix = PyString_FromFormat("%s/", PyString_AsString(fmi->cache_version));
+  Py_ssize_t prefix_len = PyString_GET_SIZE(prefix);
+  PyObject* key = NULL;
+  PyObject* rec = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(func_entries, &pos, &key, &rec)) {
+    long num_hits = get_rec_field(rec, REC_NUM_HITS);
+    if ((num_hits > 0) &&
+        (strncmp(PyString_AsString(key), PyString_AsString(prefix), prefix_len) == 0)) {
+      PyObject* pair = Py_BuildValue("(ls)", -num_hits, PyString_AsString(key) + prefix_len);
+      PyList_Append(keys, pair);
+      Py_DECREF(pair);
+    }
+  }
+  Py_DECREF(prefix);
+
+  PyList_Sort(keys);
+  if (PyList_GET_SIZE(keys) > max_keys) {
+    PyList_SetSlice(keys, max_keys, PyList_GET_SIZE(keys), NULL);
+  }
+  Py_ssize_t i;
+  for (i = 0; i < PyList_GET_SIZE(keys); i++) {
+    PyObject* hash_key = PyTuple_GET_ITEM(PyList_GET_ITEM(keys, i), 1);
+    Py_INCREF(hash_key);
+    PyList_SetItem(keys, i, hash_key); // steals the reference
+  }
+  return keys;
+}
+
+// (called from pg_enter_frame() when an entry let us skip a call)
+void cache_index_note_hit(FuncMemoInfo* fmi, PyObject* hash_key) {
+  if (!cache_index_dict) {
+    return;
+  }
+
+  PyObject* key = index_key(fmi, hash_key);
+  PyObject* func_entries = PyDict_GetItem(cache_index_dict, GET_CANONICAL_NAME(fmi));
+  PyObject* rec = func_entries ? PyDict_GetItem(func_entries, key) : NULL;
+  if (rec) {
+    note_changed_rec(GET_CANONICAL_NAME(fmi), key, rec);
+    set_rec_field(rec, REC_NUM_HITS, get_rec_field(rec, REC_NUM_HITS) + 1);
+    set_rec_field(rec, REC_LAST_ACCESS, (long)time(NULL));
+    cache_index_dirty = 1;
+  }
+  Py_DECREF(key);
+}
+
+// (called from on_disk_cache_DEL())
+void cache_index_note_del(FuncMemoInfo* fmi, PyObject* hash_key) {
+  if (!cache_index_dict) {
+    return;
+  }
+
+  PyObject* key = index_key(fmi, hash_key);
+  PyObject* canonical_name = GET_CANONICAL_NAME(fmi);
+  PyObject* func_entries = PyDict_GetItem(cache_index_dict, canonical_name);
+  PyObject* rec = func_entries ? PyDict_GetItem(func_entries, key) : NULL;
+  if (rec) {
+    note_deleted_rec(canonical_name, key);
+    add_func_bytes(canonical_name, -get_rec_field(rec, REC_NBYTES));
+    PyDict_DelItem(func_entries, key);
+    cache_index_dirty = 1;
+  }
+  Py_DECREF(key);
+}
+
+// forget about all entries in one version of fmi's cache
+// (called from memoize_fmi.c when it drops that version)
+void cache_index_forget_version(FuncMemoInfo* fmi, PyObject* version) {
+  if (!cache_index_dict) {
+    return;
+  }
+
+  PyObject* canonical_name = GET_CANONICAL_NAME(fmi);
+  PyObject* func_entries = PyDict_GetItem(cache_index_dict, canonical_name);
+  if (!func_entries) {
+    return;
+  }
+
+  PyObject* prefix = PyString_FromFormat("%s/", PyString_AsString(version));
+  Py_ssize_t prefix_len = PyString_GET_SIZE(prefix);
+  PyObject* keys = PyDict_Keys(func_entries);
+  Py_ssize_t i;
+  for (i = 0; i < PyList_GET_SIZE(keys); i++) {
+    PyObject* key = PyList_GET_ITEM(keys, i);
+    if (strncmp(PyString_AsString(key), PyString_AsString(prefix), prefix_len) == 0) {
+      PyObject* rec = PyDict_GetItem(func_entries, key);
+      note_deleted_rec(canonical_name, key);
+      add_func_bytes(canonical_name, -get_rec_field(rec, REC_NBYTES));
+      PyDict_DelItem(func_entries, key);
+      cache_index_dirty = 1;
+    }
+  }
+  Py_DECREF(keys);
+  Py_DECREF(prefix);
+
+  if (PyDict_Size(func_entries) == 0) {
+    PyDict_DelItem(cache_index_dict, canonical_name);
+    PyDict_DelItem(func_bytes_dict, canonical_name);
+  }
+}
+
+
+// is any function or the entire cache over its budget?
+static int over_cache_budgets(void) {
+  if (cache_budget_bytes > 0 && (total_cache_bytes > cache_budget_bytes)) {
+    return 1;
+  }
+  if (func_cache_budget_bytes > 0) {
+    PyObject* canonical_name = NULL;
+    PyObject* n = NULL;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(func_bytes_dict, &pos, &canonical_name, &n)) {
+      if (PyLong_AsLongLong(n) > func_cache_budget_bytes) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// merge our changes into whatever other processes have written to the
+// index since we loaded it, finish evicting whatever incremental
+// eviction didn't get to, and then write the index back out to disk
+//
+// we hold the cache index lock throughout, so that concurrent processes
+// finalizing at the same time can't lose each other's changes
+// (called from pg_finalize())
+void save_cache_index(void) {
+  if (!cache_index_dict) {
+    return;
+  }
+
+  // (entries in a non-persistent backend are about to vanish anyways,
+  //  so their records must not outlive them)
+  if (!memo_storage->is_persistent ||
+      (!cache_index_dirty && !over_cache_budgets())) {
+    goto save_cache_index_done;
+  }
+
+  lock_cache_index();
+  shared_memo_index_note_cache_index_saved(0);
+
+  PyObject* disk_index = read_cache_index_file();
+  if (disk_index) {
+    merge_changes_into(disk_index);
+    Py_DECREF(cache_index_dict);
+    cache_index_dict = disk_index;
+    tally_cache_index();
+  }
+
+  // no limit on evictions this time
+  if (func_cache_budget_bytes > 0) {
+    PyObject* names = PyDict_Keys(cache_index_dict);
+    Py_ssize_t i;
+    for (i = 0; i < PyList_GET_SIZE(names); i++) {
+      PyObject* canonical_name = PyList_GET_ITEM(names, i);
+      if (get_func_bytes(canonical_name) > func_cache_budget_bytes) {
+        evict_down_to(canonical_name,
+                      func_cache_budget_bytes * EVICTION_LOW_WATER_PERCENT / 100,
+                      -1);
+      }
+    }
+    Py_DECREF(names);
+  }
+  if (cache_budget_bytes > 0 && (total_cache_bytes > cache_budget_bytes)) {
+    evict_down_to(NULL, cache_budget_bytes * EVICTION_LOW_WATER_PERCENT / 100, -1);
+  }
+
+  struct stat st;
+  if (stat(INCPY_CACHE_DIR, &st) != 0) {
+    mkdir(INCPY_CACHE_DIR, 0777);
+  }
+
+  // write to a temporary file, then atomically rename it
+  PyObject* cache_index_path =
+    PyString_FromFormat("%s/" CACHE_INDEX_FILENAME, INCPY_CACHE_DIR);
+  PyObject* tmp_filename =
+    PyString_FromFormat("%s.partial.%d", PyString_AsString(cache_index_path), (int)getpid());
+  PyObject* outfile = PyFile_FromString(PyString_AsString(tmp_filename), "wb");
+  if (outfile) {
+    PyObject* negative_one = PyInt_FromLong(-1);
+    PyObject* dump_res =
+      PyObject_CallFunctionObjArgs(cPickle_dump_func,
+                                   cache_index_dict,
+                                   outfile,
+                                   negative_one, NULL);
+    Py_DECREF(negative_one);
+    Py_DECREF(outfile);
+
+    if (dump_res) {
+      Py_DECREF(dump_res);
+      rename(PyString_AsString(tmp_filename), PyString_AsString(cache_index_path));
+      shared_memo_index_note_cache_index_saved(1);
+    }
+    else {
+      assert(PyErr_Occurred());
+      PyErr_Clear();
+      unlink(PyString_AsString(tmp_filename));
+      PG_LOG("dict(event='ERROR', what='Cannot pickle cache index')");
+    }
+  }
+  else {
+    assert(PyErr_Occurred());
+    PyErr_Clear();
+  }
+  Py_DECREF(tmp_filename);
+  Py_DECREF(cache_index_path);
+
+  unlock_cache_index();
+
+save_cache_index_done:
+  Py_CLEAR(cache_index_dict);
+  Py_CLEAR(func_bytes_dict);
+  Py_CLEAR(cache_index_changes);
+  Py_CLEAR(pending_budget_checks);
+  cache_index_dirty = 0;
+}
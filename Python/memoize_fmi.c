@@ -16,11 +16,1508 @@
 #include "code.h"
 #include "memoize.h"
 #include "memoize_logging.h"
+#include "memoize_codec.h"
+#include "memoize_codedep.h"
+#include "memoize_costmodel.h"
+#include "memoize_eviction.h"
+#include "memoize_layers.h"
+#include "memoize_manifest.h"
+#include "memoize_cacheserver.h"
+#include "memoize_profiling.h"
+#include "memoize_shmindex.h"
+#include "memoize_storage.h"
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 
+static PyObject* transient_versions_dict = NULL; // see "Cache versions" below
+
+// (called from pg_initialize())
+void init_cache_versions(void) {
+  assert(!transient_versions_dict);
+  transient_versions_dict = PyDict_New();
+}
+
+// (called from pg_finalize())
+void free_cache_versions(void) {
+  Py_CLEAR(transient_versions_dict);
+}
+
+
+/* The persisted per-function profiles live in a single pickle file in
+   the cache root, which contains a dict where each key is a canonical
+   name and each value is a dict with the following fields:
+
+     "code_dependencies" --> dict mapping function names to code 'objects'
+                             (the code fingerprint of this profile)
+
+     "num_calls", "total_runtime_ms", "max_runtime_ms" --> ints
+     "runtime_histogram" --> tuple of NUM_RUNTIME_BUCKETS ints
+     "num_lookups", "num_hits", "total_lookup_us" --> ints
+
+     "is_impure" --> bool
+     "impure_status_msg" --> why it's impure (OPTIONAL)
+     "likely_nothing_to_memoize" --> bool
+     "num_fast_calls_with_no_memoized_vals" --> int
+
+   A profile is only trusted if ALL of its code dependencies match the
+   code of this execution, so that known-fast and known-impure functions
+   can go straight into untracked mode without re-running
+   NO_MEMOIZED_VALS_THRESHOLD calls or re-discovering their impurity.
+   As soon as the code of the function (or anything it calls) changes,
+   its profile is thrown away and rebuilt from scratch. */
+#define FUNC_PROFILES_FILENAME "func_profiles.pickle"
+
+// Key: canonical name, Value: profile dict (see above)
+//
+// initialize in load_func_profiles(), destroy in save_func_profiles()
+static PyObject* persisted_profiles_dict = NULL;
+
+// (called from pg_initialize())
+void load_func_profiles(void) {
+  assert(!persisted_profiles_dict);
+
+  PyObject* profiles_path =
+    PyString_FromFormat("%s/" FUNC_PROFILES_FILENAME, INCPY_CACHE_DIR);
+  PyObject* pf = PyFile_FromString(PyString_AsString(profiles_path), "rb");
+  Py_DECREF(profiles_path);
+  if (pf) {
+    persisted_profiles_dict =
+      PyObject_CallFunctionObjArgs(cPickle_load_func, pf, NULL);
+    Py_DECREF(pf);
+
+    if (!persisted_profiles_dict) {
+      assert(PyErr_Occurred());
+      PyErr_Clear();
+      PG_LOG("dict(event='ERROR', what='Cannot unpickle function profiles')");
+    }
+    else if (!PyDict_CheckExact(persisted_profiles_dict)) {
+      Py_CLEAR(persisted_profiles_dict);
+    }
+  }
+  else {
+    // silently start from scratch if there's no profiles file
+    assert(PyErr_Occurred());
+    PyErr_Clear();
+  }
+
+  if (!persisted_profiles_dict) {
+    persisted_profiles_dict = PyDict_New();
+  }
+}
+
+// returns 1 iff all code dependencies in code_dependency_dict match
+// the code of this execution (quiet version of
+// are_code_dependencies_satisfied() in memoize.c)
+static int code_dependencies_unchanged(PyObject* code_dependency_dict) {
+  PyObject* dependent_func_canonical_name = NULL;
+  PyObject* saved_code_dependency = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(code_dependency_dict,
+                     &pos, &dependent_func_canonical_name, &saved_code_dependency)) {
+    PyObject* cur_code_dependency =
+      PyDict_GetItem(func_name_to_code_dependency, dependent_func_canonical_name);
+    if (!cur_code_dependency ||
+        !code_dependency_EQ(cur_code_dependency, saved_code_dependency)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static unsigned long get_ulong_field(PyObject* profile, char* field_name) {
+  PyObject* val = PyDict_GetItemString(profile, field_name);
+  if (val && (PyInt_Check(val) || PyLong_Check(val))) {
+    return PyInt_AsUnsignedLongMask(val);
+  }
+  return 0;
+}
+
+static void set_ulong_field(PyObject* profile, char* field_name, unsigned long n) {
+  PyObject* val = PyLong_FromUnsignedLong(n);
+  PyDict_SetItemString(profile, field_name, val);
+  Py_DECREF(val);
+}
+
+// initialize fmi's fields from its persisted profile (if there is one
+// and its code fingerprint still matches)
+static void restore_func_profile(FuncMemoInfo* fmi) {
+  if (!persisted_profiles_dict) {
+    return;
+  }
+
+  PyObject* canonical_name = GET_CANONICAL_NAME(fmi);
+  PyObject* profile = PyDict_GetItem(persisted_profiles_dict, canonical_name);
+  if (!profile) {
+    return;
+  }
+
+  PyObject* saved_code_deps = PyDict_GetItemString(profile, "code_dependencies");
+  if (!saved_code_deps ||
+      !PyDict_CheckExact(saved_code_deps) ||
+      !code_dependencies_unchanged(saved_code_deps)) {
+    PG_LOG_PRINTF("dict(event='DISCARD_PROFILE', what='%s', why='code changed')\n",
+                  PyString_AsString(canonical_name));
+    PyDict_DelItem(persisted_profiles_dict, canonical_name);
+    return;
+  }
+
+  fmi->num_calls = get_ulong_field(profile, "num_calls");
+  fmi->total_runtime_ms = get_ulong_field(profile, "total_runtime_ms");
+  fmi->max_runtime_ms = get_ulong_field(profile, "max_runtime_ms");
+  fmi->num_lookups = get_ulong_field(profile, "num_lookups");
+  fmi->num_hits = get_ulong_field(profile, "num_hits");
+  fmi->total_lookup_us = get_ulong_field(profile, "total_lookup_us");
+
+  PyObject* histogram = PyDict_GetItemString(profile, "runtime_histogram");
+  if (histogram && PyTuple_CheckExact(histogram) &&
+      (PyTuple_GET_SIZE(histogram) == NUM_RUNTIME_BUCKETS)) {
+    int i;
+    for (i = 0; i < NUM_RUNTIME_BUCKETS; i++) {
+      fmi->runtime_histogram[i] =
+        PyInt_AsUnsignedLongMask(PyTuple_GET_ITEM(histogram, i));
+    }
+  }
+
+  unsigned long num_fast_calls =
+    get_ulong_field(profile, "num_fast_calls_with_no_memoized_vals");
+  fmi->num_fast_calls_with_no_memoized_vals =
+    (num_fast_calls > 255) ? 255 : (unsigned char)num_fast_calls;
+
+  PyObject* likely_nothing_to_memoize =
+    PyDict_GetItemString(profile, "likely_nothing_to_memoize");
+  if (likely_nothing_to_memoize && PyObject_IsTrue(likely_nothing_to_memoize)) {
+    fmi->likely_nothing_to_memoize = 1;
+  }
+
+  PyObject* is_impure = PyDict_GetItemString(profile, "is_impure");
+  if (is_impure && PyObject_IsTrue(is_impure)) {
+    PyObject* impure_status_msg = PyDict_GetItemString(profile, "impure_status_msg");
+    fmi->is_impure = 1;
+    if (impure_status_msg && PyString_CheckExact(impure_status_msg)) {
+      fmi->impure_status_msg = impure_status_msg;
+      Py_INCREF(impure_status_msg);
+    }
+    else {
+      fmi->impure_status_msg = PyString_FromString("impure in a previous execution");
+    }
+  }
+
+  PG_LOG_PRINTF("dict(event='RESTORE_PROFILE', what='%s', num_calls=%lu, is_impure=%d, likely_nothing_to_memoize=%d)\n",
+                PyString_AsString(canonical_name), fmi->num_calls,
+                (int)fmi->is_impure, (int)fmi->likely_nothing_to_memoize);
+}
+
+// record the runtime of one call to fmi's function
+void update_func_profile_runtime(FuncMemoInfo* fmi, long runtime_ms) {
+  assert(runtime_ms >= 0);
+
+  fmi->num_calls++;
+  fmi->total_runtime_ms += runtime_ms;
+  if ((unsigned long)runtime_ms > fmi->max_runtime_ms) {
+    fmi->max_runtime_ms = runtime_ms;
+  }
+
+  int bucket = 0;
+  long bucket_limit_ms = 1;
+  while ((bucket < NUM_RUNTIME_BUCKETS - 1) && (runtime_ms >= bucket_limit_ms)) {
+    bucket++;
+    bucket_limit_ms *= 10;
+  }
+  fmi->runtime_histogram[bucket]++;
+}
+
+// merge the profiles of all functions that ran during this execution
+// into persisted_profiles_dict and write it back out to disk
+// (called from pg_finalize())
+void save_func_profiles(void) {
+  if (!persisted_profiles_dict) {
+    return;
+  }
+
+  PyObject* canonical_name = NULL;
+  PyObject* fmi_addr = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(all_func_memo_info_dict, &pos, &canonical_name, &fmi_addr)) {
+    FuncMemoInfo* fmi = (FuncMemoInfo*)PyInt_AsLong(fmi_addr);
+
+    // if this function had a (still-valid) profile at startup, then keep
+    // its code dependencies around as well, since the same code might
+    // not have called all of its callees during THIS execution
+    PyObject* code_deps = NULL;
+    PyObject* old_profile = PyDict_GetItem(persisted_profiles_dict, canonical_name);
+    PyObject* old_code_deps =
+      old_profile ? PyDict_GetItemString(old_profile, "code_dependencies") : NULL;
+    if (old_code_deps) {
+      code_deps = PyDict_Copy(old_code_deps);
+      PyDict_Update(code_deps, fmi->code_dependencies);
+    }
+    else {
+      code_deps = PyDict_Copy(fmi->code_dependencies);
+    }
+
+    PyObject* profile = PyDict_New();
+    PyDict_SetItemString(profile, "code_dependencies", code_deps);
+    Py_DECREF(code_deps);
+
+    set_ulong_field(profile, "num_calls", fmi->num_calls);
+    set_ulong_field(profile, "total_runtime_ms", fmi->total_runtime_ms);
+    set_ulong_field(profile, "max_runtime_ms", fmi->max_runtime_ms);
+    set_ulong_field(profile, "num_lookups", fmi->num_lookups);
+    set_ulong_field(profile, "num_hits", fmi->num_hits);
+    set_ulong_field(profile, "total_lookup_us", fmi->total_lookup_us);
+    set_ulong_field(profile, "num_fast_calls_with_no_memoized_vals",
+                    fmi->num_fast_calls_with_no_memoized_vals);
+
+    PyObject* histogram = PyTuple_New(NUM_RUNTIME_BUCKETS);
+    int i;
+    for (i = 0; i < NUM_RUNTIME_BUCKETS; i++) {
+      PyTuple_SET_ITEM(histogram, i, PyLong_FromUnsignedLong(fmi->runtime_histogram[i]));
+    }
+    PyDict_SetItemString(profile, "runtime_histogram", histogram);
+    Py_DECREF(histogram);
+
+    PyDict_SetItemString(profile, "likely_nothing_to_memoize",
+                         fmi->likely_nothing_to_memoize ? Py_True : Py_False);
+    PyDict_SetItemString(profile, "is_impure",
+                         fmi->is_impure ? Py_True : Py_False);
+    if (fmi->is_impure && fmi->impure_status_msg) {
+      PyDict_SetItemString(profile, "impure_status_msg", fmi->impure_status_msg);
+    }
+
+    PyDict_SetItem(persisted_profiles_dict, canonical_name, profile);
+    Py_DECREF(profile);
+  }
+
+  if (PyDict_Size(persisted_profiles_dict) > 0) {
+    struct stat st;
+    if (stat(INCPY_CACHE_DIR, &st) != 0) {
+      mkdir(INCPY_CACHE_DIR, 0777);
+    }
+
+    // write to a temporary file, then atomically rename it, so that
+    // other processes never see a partially-written profiles file
+    PyObject* profiles_path =
+      PyString_FromFormat("%s/" FUNC_PROFILES_FILENAME, INCPY_CACHE_DIR);
+    PyObject* tmp_filename =
+      PyString_FromFormat("%s.partial.%d", PyString_AsString(profiles_path), (int)getpid());
+    PyObject* outfile = PyFile_FromString(PyString_AsString(tmp_filename), "wb");
+    if (outfile) {
+      PyObject* negative_one = PyInt_FromLong(-1);
+      PyObject* dump_res =
+        PyObject_CallFunctionObjArgs(cPickle_dump_func,
+                                     persisted_profiles_dict,
+                                     outfile,
+                                     negative_one, NULL);
+      Py_DECREF(negative_one);
+      Py_DECREF(outfile);
+
+      if (dump_res) {
+        Py_DECREF(dump_res);
+        rename(PyString_AsString(tmp_filename), PyString_AsString(profiles_path));
+      }
+      else {
+        assert(PyErr_Occurred());
+        PyErr_Clear();
+        unlink(PyString_AsString(tmp_filename));
+        PG_LOG("dict(event='ERROR', what='Cannot pickle function profiles')");
+      }
+    }
+    else {
+      assert(PyErr_Occurred());
+      PyErr_Clear();
+    }
+    Py_DECREF(tmp_filename);
+    Py_DECREF(profiles_path);
+  }
+
+  Py_CLEAR(persisted_profiles_dict);
+}
+
+// erase a cache sub-directory along with everything inside of it
+static void remove_cache_subdirectory(char* subdir_path_str) {
+  DIR* dp = opendir(subdir_path_str);
+  if (dp) {
+    struct dirent* dirp;
+    while ((dirp = readdir(dp)) != NULL) {
+      if ((strcmp(dirp->d_name, ".") != 0) && (strcmp(dirp->d_name, "..") != 0)) {
+        PyObject* file_path =
+          PyString_FromFormat("%s/%s", subdir_path_str, dirp->d_name);
+        // if it's not a file, then it's a version sub-directory
+        if (unlink(PyString_AsString(file_path)) != 0) {
+          remove_cache_subdirectory(PyString_AsString(file_path));
+        }
+        Py_DECREF(file_path);
+      }
+    }
+    rmdir(subdir_path_str);
+    closedir(dp);
+  }
+}
+
+
+/* Getting rid of cache entries must not stall the program, since it
+   happens on the call path, and erasing a sub-directory with 100,000
+   entries one unlink() at a time can take seconds.  So instead, we
+   atomically rename the sub-directory to a 'tombstone' in incpy-cache/
+   with a name that's unique to this process:
+
+     incpy-cache/<hash of function name>.<version>.<pid>-<counter>.tombstone/
+
+   and return right away.  Nobody ever looks inside of tombstones (the
+   cache manifest only picks up *.cache sub-directories), and
+   reclaim_tombstones() erases all of them at finalize time, including
+   ones left behind by processes that crashed before they could do so. */
+static unsigned int num_tombstones_created = 0;
+
+// turn the version sub-directory at path into a tombstone
+static void make_tombstone(char* path, PyObject* subdir_basename, char* version) {
+  // (unless the storage backend keeps the entries inside of it, it's up
+  //  to the backend to get rid of them)
+  PyObject* path_obj = PyString_FromString(path);
+  memo_storage_DROP_DIR(path_obj);
+
+  // a non-persistent version has nothing on disk to tombstone
+  if (!memo_storage->is_persistent) {
+    if (PyDict_DelItem(transient_versions_dict, path_obj) != 0) {
+      PyErr_Clear();
+    }
+    Py_DECREF(path_obj);
+    return;
+  }
+  Py_DECREF(path_obj);
+
+  PyObject* tombstone_path =
+    PyString_FromFormat("%s/%s.%s.%d-%u.tombstone",
+                        INCPY_CACHE_DIR,
+                        PyString_AsString(subdir_basename),
+                        version,
+                        (int)getpid(),
+                        num_tombstones_created++);
+
+  if (rename(path, PyString_AsString(tombstone_path)) != 0) {
+    // if the rename fails for any reason other than the sub-directory
+    // not existing, then fall back on erasing it right now
+    struct stat st;
+    if (stat(path, &st) == 0) {
+      remove_cache_subdirectory(path);
+    }
+  }
+  Py_DECREF(tombstone_path);
+
+  path_obj = PyString_FromString(path);
+  cache_manifest_note_version_gone(path_obj);
+  Py_DECREF(path_obj);
+}
+
+// (called from pg_finalize())
+void reclaim_tombstones(void) {
+  DIR* dp = opendir(INCPY_CACHE_DIR);
+  if (!dp) {
+    return;
+  }
+
+  int num_reclaimed = 0;
+  struct dirent* dirp;
+  while ((dirp = readdir(dp)) != NULL) {
+    size_t len = strlen(dirp->d_name);
+    if ((len > 10) && (strcmp(dirp->d_name + len - 10, ".tombstone") == 0)) {
+      PyObject* tombstone_path = PyString_FromFormat("%s/%s", INCPY_CACHE_DIR, dirp->d_name);
+      remove_cache_subdirectory(PyString_AsString(tombstone_path));
+      Py_DECREF(tombstone_path);
+      num_reclaimed++;
+    }
+  }
+  closedir(dp);
+
+  if (num_reclaimed) {
+    PG_LOG_PRINTF("dict(event='RECLAIM_TOMBSTONES', num_reclaimed=%d)\n", num_reclaimed);
+  }
+}
+
+
+/* Concurrency:
+
+   Several processes (e.g., the workers of a multiprocessing.Pool) can
+   share one incpy-cache/.  Readers never need to lock anything, since
+   every file is first written to a temporary file whose name is unique
+   to the writing process and then atomically renamed into place.
+   Writers coordinate using POSIX advisory (fcntl) locks on single
+   bytes of one shared file, CACHE_LOCK_FILENAME:
+
+     - the byte at entry_lock_offset() of a cache entry is held
+       EXCLUSIVELY across the read-modify-write of its list of memo
+       table entries (see on_disk_cache_APPEND() and
+       on_disk_cache_DISCARD()), so that concurrent calls with the same
+       arguments never lose each other's entries
+
+     - the byte at version_lock_offset() of a version sub-directory is
+       held SHARED while writing a cache entry into it, and EXCLUSIVELY
+       while creating it, merging into its code dependencies, or erasing
+       it once it's empty, so that it can't vanish out from under a
+       writer
+
+     - the byte at CACHE_INDEX_LOCK_OFFSET is held EXCLUSIVELY while
+       save_cache_index() merges this process's changes into
+       cache_index.pickle (and evicts entries) at finalize time
+
+     - the byte at CACHE_MANIFEST_LOCK_OFFSET is held EXCLUSIVELY while
+       appending to (or re-writing) the cache manifest, and SHARED while
+       reading it (see memoize_manifest.c)
+
+   The cache index lock is only ever acquired before all other locks,
+   entry locks are only ever acquired before version locks (and
+   eviction, which takes the entry locks of its victims, never runs
+   while this process holds one; see cache_index_enforce_budgets()),
+   nobody waits for any lock other than the manifest lock while holding
+   a version lock exclusively (make_room_for_cache_version() merely
+   tries to lock the versions that it drops), and nobody waits for any
+   lock at all while holding the manifest lock, so there can't be any
+   deadlocks.  Unrelated keys that hash to the same byte merely take
+   turns, and the kernel releases the locks of processes that die. */
+#define CACHE_LOCK_FILENAME "cache.lock"
+#define NUM_LOCK_SLOTS 65536
+#define CACHE_INDEX_LOCK_OFFSET (2 * NUM_LOCK_SLOTS)
+#define CACHE_MANIFEST_LOCK_OFFSET (2 * NUM_LOCK_SLOTS + 1)
+
+// opened on demand, closed in close_cache_lock()
+static int cache_lock_fd = -1;
+
+// how many entry locks on_disk_cache_APPEND() and
+// on_disk_cache_DISCARD() are holding right now
+static int num_entry_locks_held = 0;
+
+// (hashes path as if the cache directory were ./incpy-cache, so that
+// processes that spell the cache directory differently, including
+// incpy-support-scripts/sweep_cache.py, agree on which byte to lock)
+static long lock_slot(PyObject* path) {
+  PyObject* str = portable_cache_path(path);
+  unsigned long h = 5381;
+  unsigned char* s = (unsigned char*)PyString_AsString(str);
+  while (*s) {
+    h = (h * 33) + *s++;
+  }
+  Py_DECREF(str);
+  return (long)(h % NUM_LOCK_SLOTS);
+}
+
+// hash_key is the basename of the entry's .pickle file (entries with
+// the same key share a lock across all versions)
+static long entry_path_lock_offset(PyObject* subdir_path, PyObject* hash_key) {
+  PyObject* entry_name =
+    PyString_FromFormat("%s/%s", PyString_AsString(subdir_path),
+                        PyString_AsString(hash_key));
+  long offset = lock_slot(entry_name);
+  Py_DECREF(entry_name);
+  return offset;
+}
+
+static long entry_lock_offset(FuncMemoInfo* fmi, PyObject* hash_key) {
+  return entry_path_lock_offset(fmi->cache_subdirectory_path, hash_key);
+}
+
+static long version_lock_offset(PyObject* version_path) {
+  return NUM_LOCK_SLOTS + lock_slot(version_path);
+}
+
+// returns 0 if there's no lock file, in which case we degrade
+// gracefully to no locking at all
+static int open_cache_lock_file(void) {
+  if (cache_lock_fd < 0) {
+    struct stat st;
+    if (stat(INCPY_CACHE_DIR, &st) != 0) {
+      mkdir(INCPY_CACHE_DIR, 0777);
+    }
+    PyObject* lock_path = PyString_FromFormat("%s/" CACHE_LOCK_FILENAME, INCPY_CACHE_DIR);
+    cache_lock_fd = open(PyString_AsString(lock_path), O_RDWR | O_CREAT, 0666);
+    Py_DECREF(lock_path);
+  }
+  return (cache_lock_fd >= 0);
+}
+
+// lock_type is either F_RDLCK (shared) or F_WRLCK (exclusive)
+static void cache_lock(long offset, short lock_type) {
+  if (!open_cache_lock_file()) {
+    return;
+  }
+
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = lock_type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = offset;
+  fl.l_len = 1;
+  while ((fcntl(cache_lock_fd, F_SETLKW, &fl) != 0) && (errno == EINTR)) {
+    // retry if interrupted by a signal
+  }
+}
+
+// like cache_lock(), but gives up right away if somebody else holds a
+// conflicting lock (returns 1 if we got it)
+static int cache_trylock(long offset, short lock_type) {
+  if (!open_cache_lock_file()) {
+    return 1;
+  }
+
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = lock_type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = offset;
+  fl.l_len = 1;
+  int res;
+  while (((res = fcntl(cache_lock_fd, F_SETLK, &fl)) != 0) && (errno == EINTR)) {
+    // retry if interrupted by a signal
+  }
+  return (res == 0);
+}
+
+static void cache_unlock(long offset) {
+  if (cache_lock_fd < 0) {
+    return;
+  }
+
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = offset;
+  fl.l_len = 1;
+  fcntl(cache_lock_fd, F_SETLK, &fl);
+}
+
+void lock_cache_index(void) {
+  cache_lock(CACHE_INDEX_LOCK_OFFSET, F_WRLCK);
+}
+
+void unlock_cache_index(void) {
+  cache_unlock(CACHE_INDEX_LOCK_OFFSET);
+}
+
+void lock_cache_entry(PyObject* subdir_path, PyObject* hash_key) {
+  cache_lock(entry_path_lock_offset(subdir_path, hash_key), F_WRLCK);
+}
+
+void unlock_cache_entry(PyObject* subdir_path, PyObject* hash_key) {
+  cache_unlock(entry_path_lock_offset(subdir_path, hash_key));
+}
+
+void lock_cache_manifest(int exclusive) {
+  cache_lock(CACHE_MANIFEST_LOCK_OFFSET, exclusive ? F_WRLCK : F_RDLCK);
+}
+
+void unlock_cache_manifest(void) {
+  cache_unlock(CACHE_MANIFEST_LOCK_OFFSET);
+}
+
+// (called from pg_finalize())
+void close_cache_lock(void) {
+  if (cache_lock_fd >= 0) {
+    close(cache_lock_fd);
+    cache_lock_fd = -1;
+  }
+}
+
+
+/* Cache versions:
+
+   Each function's cache sub-directory holds one sub-directory per
+   VERSION of its code, where a version is identified by the md5 hash
+   of the code dependencies (of the function itself AND of everything
+   that it calls) in effect when the version was created:
+
+     incpy-cache/<hash of function name>.cache/<version>/
+
+   and each version sub-directory contains a CODE_DEPS_FILENAME file
+   with the union of the code dependencies of all of its entries.  Only
+   a version whose code dependencies ALL match the code of this
+   execution is ever used (see resolve_cache_version()), so when you
+   edit some code, a fresh version is started alongside the old ones,
+   and when you change your mind (or switch back to another branch),
+   the old version becomes valid again and its entries can be re-used
+   right away.
+
+   Old versions simply sit on disk until they're evicted like any other
+   cache entries (see memoize_eviction.c), except that we keep at most
+   MAX_CACHE_VERSIONS versions of each function, tombstoning the ones
+   that have been written to least recently.
+
+   With a non-persistent storage backend, a version can't outlive this
+   execution any more than its entries can, so instead of creating
+   version sub-directories on disk, we keep track of them in
+   transient_versions_dict, where each key is the path that the version
+   sub-directory would have, and each value is a list of its code
+   dependencies and the time when it was last written to. */
+#define MAX_CACHE_VERSIONS 8
+
+// returns the unpickled contents of path (or NULL on any error)
+static PyObject* load_pickle_file(char* path) {
+  PyObject* pf = PyFile_FromString(path, "rb");
+  if (!pf) {
+    PyErr_Clear();
+    return NULL;
+  }
+
+  PyObject* ret = PyObject_CallFunctionObjArgs(cPickle_load_func, pf, NULL);
+  Py_DECREF(pf);
+  if (!ret) {
+    PyErr_Clear();
+  }
+  return ret;
+}
+
+// pickles obj into path by writing to a temporary file and then
+// atomically renaming it (returns 1 on success)
+static int write_pickle_file(char* path, PyObject* obj) {
+  int success = 0;
+  PyObject* tmp_filename = PyString_FromFormat("%s.partial.%d", path, (int)getpid());
+  PyObject* outfile = PyFile_FromString(PyString_AsString(tmp_filename), "wb");
+  if (outfile) {
+    PyObject* negative_one = PyInt_FromLong(-1);
+    PyObject* dump_res =
+      PyObject_CallFunctionObjArgs(cPickle_dump_func, obj, outfile, negative_one, NULL);
+    Py_DECREF(negative_one);
+    Py_DECREF(outfile);
+
+    if (dump_res) {
+      Py_DECREF(dump_res);
+      success = (rename(PyString_AsString(tmp_filename), path) == 0);
+    }
+    else {
+      PyErr_Clear();
+      unlink(PyString_AsString(tmp_filename));
+    }
+  }
+  else {
+    PyErr_Clear();
+  }
+  Py_DECREF(tmp_filename);
+  return success;
+}
+
+// returns the code dependencies of the version sub-directory at
+// version_path, from the local cache if it has that version or else
+// from the first base cache layer that does (or NULL if none do)
+//
+// *mtime is set to when the local copy was last written (or 0 if it
+// came from a base layer, so that local versions look newer)
+static PyObject* load_cache_version_deps(PyObject* version_path, time_t* mtime) {
+  PyObject* deps_path =
+    PyString_FromFormat("%s/" CODE_DEPS_FILENAME, PyString_AsString(version_path));
+  PyObject* deps = NULL;
+
+  *mtime = 0;
+  if (memo_storage->is_persistent) {
+    deps = load_pickle_file(PyString_AsString(deps_path));
+    struct stat st;
+    if (deps && (stat(PyString_AsString(deps_path), &st) == 0)) {
+      *mtime = st.st_mtime;
+    }
+  }
+  else {
+    PyObject* rec = PyDict_GetItem(transient_versions_dict, version_path);
+    if (rec) {
+      deps = PyList_GET_ITEM(rec, 0);
+      Py_INCREF(deps);
+      *mtime = (time_t)PyInt_AsLong(PyList_GET_ITEM(rec, 1));
+    }
+  }
+
+  if (!deps) {
+    PyObject* deps_str = base_cache_READ(deps_path);
+    if (deps_str) {
+      deps = PyObject_CallFunctionObjArgs(cPickle_loadstr_func, deps_str, NULL);
+      if (!deps) {
+        PyErr_Clear();
+      }
+      Py_DECREF(deps_str);
+    }
+  }
+
+  Py_DECREF(deps_path);
+
+  if (deps && !PyDict_CheckExact(deps)) {
+    Py_CLEAR(deps);
+  }
+  return deps;
+}
+
+// does the version at version_path exist in the local cache (as opposed
+// to only in a base cache layer, or not at all)?
+static int cache_version_is_local(PyObject* version_path) {
+  if (!memo_storage->is_persistent) {
+    return (PyDict_GetItem(transient_versions_dict, version_path) != NULL);
+  }
+
+  PyObject* deps_path =
+    PyString_FromFormat("%s/" CODE_DEPS_FILENAME, PyString_AsString(version_path));
+  struct stat st;
+  int is_local = (stat(PyString_AsString(deps_path), &st) == 0);
+  Py_DECREF(deps_path);
+  return is_local;
+}
+
+// when the local version at version_path was last written to (creating
+// or renaming an entry file updates the mtime of its sub-directory)
+static time_t cache_version_mtime(PyObject* version_path) {
+  if (!memo_storage->is_persistent) {
+    PyObject* rec = PyDict_GetItem(transient_versions_dict, version_path);
+    return rec ? (time_t)PyInt_AsLong(PyList_GET_ITEM(rec, 1)) : 0;
+  }
+
+  struct stat st;
+  return (stat(PyString_AsString(version_path), &st) == 0) ? st.st_mtime : 0;
+}
+
+// (called after writing an entry into the local version at version_path)
+static void touch_cache_version(PyObject* version_path) {
+  PyObject* rec = memo_storage->is_persistent ? NULL :
+    PyDict_GetItem(transient_versions_dict, version_path);
+  if (rec) {
+    PyList_SetItem(rec, 1, PyInt_FromLong((long)time(NULL))); // steals the reference
+  }
+}
+
+// creates the version sub-directory at version_path (and its parents)
+static void make_cache_version_dir(char* subdir_path_str, char* version_path_str) {
+  struct stat st;
+  if (stat(INCPY_CACHE_DIR, &st) != 0) {
+    mkdir(INCPY_CACHE_DIR, 0777);
+  }
+
+  // (another process might have just erased the function's
+  //  sub-directory because its last version became empty)
+  if ((mkdir(version_path_str, 0777) != 0) && (errno == ENOENT)) {
+    mkdir(subdir_path_str, 0777);
+    mkdir(version_path_str, 0777);
+  }
+}
+
+// sets the code dependencies of the local version at version_path to
+// deps, creating that version if necessary (returns 1 on success)
+static int store_cache_version_deps(PyObject* subdir_path, PyObject* version_path,
+                                    PyObject* deps) {
+  if (!memo_storage->is_persistent) {
+    PyObject* rec = PyList_New(2);
+    Py_INCREF(deps);
+    PyList_SET_ITEM(rec, 0, deps);
+    PyList_SET_ITEM(rec, 1, PyInt_FromLong((long)time(NULL)));
+    PyDict_SetItem(transient_versions_dict, version_path, rec);
+    Py_DECREF(rec);
+    return 1;
+  }
+
+  make_cache_version_dir(PyString_AsString(subdir_path), PyString_AsString(version_path));
+  PyObject* deps_path =
+    PyString_FromFormat("%s/" CODE_DEPS_FILENAME, PyString_AsString(version_path));
+  int success = write_pickle_file(PyString_AsString(deps_path), deps);
+  Py_DECREF(deps_path);
+  if (success) {
+    cache_manifest_note_version(version_path, deps);
+  }
+  return success;
+}
+
+// erases the local version at version_path (which has no entries left),
+// and then the function's cache sub-directory at subdir_path if it has
+// no more versions left
+static void erase_cache_version(PyObject* subdir_path, PyObject* version_path) {
+  if (!memo_storage->is_persistent) {
+    if (PyDict_DelItem(transient_versions_dict, version_path) != 0) {
+      PyErr_Clear();
+    }
+    return;
+  }
+
+  PyObject* deps_path =
+    PyString_FromFormat("%s/" CODE_DEPS_FILENAME, PyString_AsString(version_path));
+  unlink(PyString_AsString(deps_path));
+  Py_DECREF(deps_path);
+  rmdir(PyString_AsString(version_path));
+  cache_manifest_note_version_gone(version_path);
+
+  // if rmdir succeeds, then that means that there were NO other
+  // versions left in the directory
+  rmdir(PyString_AsString(subdir_path));
+}
+
+// appends the names of all local versions of the function whose cache
+// sub-directory is at subdir_path to versions, and the names of the
+// files in it that are entries from before there were cache versions
+// to legacy_names (unless it's NULL)
+static void list_local_cache_versions(PyObject* subdir_path, PyObject* versions,
+                                      PyObject* legacy_names) {
+  if (!memo_storage->is_persistent) {
+    Py_ssize_t subdir_len = PyString_GET_SIZE(subdir_path);
+    PyObject* version_path = NULL;
+    PyObject* rec = NULL;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(transient_versions_dict, &pos, &version_path, &rec)) {
+      char* path_str = PyString_AsString(version_path);
+      if ((PyString_GET_SIZE(version_path) > subdir_len + 1) &&
+          (strncmp(path_str, PyString_AsString(subdir_path), subdir_len) == 0) &&
+          (path_str[subdir_len] == '/')) {
+        PyObject* version = PyString_FromString(path_str + subdir_len + 1);
+        PyList_Append(versions, version);
+        Py_DECREF(version);
+      }
+    }
+    return;
+  }
+
+  DIR* dp = opendir(PyString_AsString(subdir_path));
+  if (!dp) {
+    return;
+  }
+
+  struct dirent* dirp;
+  while ((dirp = readdir(dp)) != NULL) {
+    if (dirp->d_name[0] == '.') {
+      continue;
+    }
+
+    // version names never contain dots, but <hash of key>.pickle
+    // entries from before there were cache versions (and temporary
+    // files) do
+    char* dot = strchr(dirp->d_name, '.');
+    PyObject* name = PyString_FromString(dirp->d_name);
+    if (!dot) {
+      PyList_Append(versions, name);
+    }
+    else if (legacy_names && (strcmp(dot, ".pickle") == 0)) {
+      PyList_Append(legacy_names, name);
+    }
+    Py_DECREF(name);
+  }
+  closedir(dp);
+}
+
+// returns the name of the version for code_deps, which is the md5 hash
+// of its (sorted) items (new reference, or NULL on error)
+static PyObject* cache_version_name(PyObject* code_deps) {
+  PyObject* items = PyDict_Items(code_deps);
+  PyList_Sort(items);
+  PyObject* negative_one = PyInt_FromLong(-1);
+  PyObject* items_pickled_str =
+    PyObject_CallFunctionObjArgs(cPickle_dumpstr_func, items, negative_one, NULL);
+  Py_DECREF(negative_one);
+  Py_DECREF(items);
+
+  if (!items_pickled_str) {
+    PyErr_Clear();
+    return NULL;
+  }
+  PyObject* version = hexdigest_str(items_pickled_str);
+  Py_DECREF(items_pickled_str);
+  return version;
+}
+
+// returns the longest runtime of all memo table entries in contents
+// (for the eviction policy)
+static long max_entry_runtime_ms(PyObject* contents) {
+  long max_runtime_ms = 0;
+  if (PyList_CheckExact(contents)) {
+    Py_ssize_t i;
+    for (i = 0; i < PyList_GET_SIZE(contents); i++) {
+      PyObject* elt = PyList_GET_ITEM(contents, i);
+      PyObject* runtime_ms_obj =
+        PyDict_Check(elt) ? PyDict_GetItemString(elt, "runtime_ms") : NULL;
+      if (runtime_ms_obj && PyInt_AsLong(runtime_ms_obj) > max_runtime_ms) {
+        max_runtime_ms = PyInt_AsLong(runtime_ms_obj);
+      }
+    }
+  }
+  return max_runtime_ms;
+}
+
+/* Legacy entries:
+
+   Before there were cache versions, each entry of a function was
+   stored right in its cache sub-directory as <hash of key>.pickle (a
+   pickled list of memo table entries, just like the ones in version
+   sub-directories today).  The first time that we resolve such a
+   function, we move each legacy entry into the version named after the
+   code dependencies of its newest memo table entry, so that it stays
+   usable if that code hasn't changed since, and gets evicted along
+   with that version otherwise.  A legacy file is only erased after its
+   contents were stored in its new place, and files that can't be read
+   are left alone (they're ignored just like before). */
+
+// moves one legacy entry (see above) into its version, returning a new
+// reference to that version, or NULL if it can't be moved
+static PyObject* migrate_legacy_cache_entry(FuncMemoInfo* fmi, PyObject* hash_key,
+                                            Py_ssize_t* nbytes, long* runtime_ms) {
+  PyObject* subdir_path = fmi->cache_subdirectory_path;
+  PyObject* legacy_path =
+    PyString_FromFormat("%s/%s.pickle", PyString_AsString(subdir_path),
+                        PyString_AsString(hash_key));
+
+  // (another process might have already moved it)
+  PyObject* contents = load_pickle_file(PyString_AsString(legacy_path));
+  PyObject* version = NULL;
+  if (contents && PyList_CheckExact(contents) && (PyList_GET_SIZE(contents) > 0)) {
+    PyObject* last_elt = PyList_GET_ITEM(contents, PyList_GET_SIZE(contents) - 1);
+    PyObject* code_deps =
+      PyDict_Check(last_elt) ? PyDict_GetItemString(last_elt, "code_dependencies") : NULL;
+    if (code_deps && PyDict_Check(code_deps)) {
+      version = cache_version_name(code_deps);
+    }
+  }
+  if (!version) {
+    Py_XDECREF(contents);
+    Py_DECREF(legacy_path);
+    return NULL;
+  }
+
+  PyObject* version_path =
+    PyString_FromFormat("%s/%s", PyString_AsString(subdir_path), PyString_AsString(version));
+  long version_lock = version_lock_offset(version_path);
+  cache_lock(version_lock, F_WRLCK);
+
+  // the version's code dependencies must cover those of every memo
+  // table entry in it
+  time_t mtime;
+  PyObject* disk_deps = load_cache_version_deps(version_path, &mtime);
+  PyObject* merged_deps = disk_deps ? PyDict_Copy(disk_deps) : PyDict_New();
+  Py_ssize_t i;
+  for (i = 0; i < PyList_GET_SIZE(contents); i++) {
+    PyObject* elt = PyList_GET_ITEM(contents, i);
+    PyObject* elt_deps =
+      PyDict_Check(elt) ? PyDict_GetItemString(elt, "code_dependencies") : NULL;
+    if (elt_deps && PyDict_Check(elt_deps)) {
+      PyDict_Merge(merged_deps, elt_deps, 0);
+    }
+  }
+  int success = 1;
+  if (!disk_deps || !cache_version_is_local(version_path) ||
+      (PyDict_Size(merged_deps) > PyDict_Size(disk_deps))) {
+    success = store_cache_version_deps(subdir_path, version_path, merged_deps);
+  }
+  Py_XDECREF(disk_deps);
+  Py_DECREF(merged_deps);
+
+  PyObject* pickle_filename =
+    PyString_FromFormat("%s/%s.pickle", PyString_AsString(version_path),
+                        PyString_AsString(hash_key));
+
+  // keep whatever a newer execution already stored under the same key
+  PyObject* data = NULL;
+  if (success && (memo_storage_GET(pickle_filename, &data) == MEMO_STORAGE_HIT) &&
+      (PyString_GET_SIZE(data) > 0)) {
+    int serializer;
+    PyObject* serialized_str = decode_cache_entry(data, &serializer);
+    PyObject* existing =
+      serialized_str ? deserialize_cache_entry(serialized_str, serializer) : NULL;
+    if (existing && PyList_CheckExact(existing)) {
+      for (i = 0; i < PyList_GET_SIZE(contents); i++) {
+        PyObject* elt = PyList_GET_ITEM(contents, i);
+        if (PySequence_Contains(existing, elt) == 0) {
+          PyList_Append(existing, elt);
+        }
+      }
+      Py_DECREF(contents);
+      contents = existing;
+      existing = NULL;
+    }
+    Py_XDECREF(existing);
+    Py_XDECREF(serialized_str);
+  }
+  Py_XDECREF(data);
+
+  if (success) {
+    int serializer;
+    PyObject* serialized_str = serialize_cache_entry(contents, &serializer);
+    PyObject* encoded = serialized_str ? encode_cache_entry(serialized_str, serializer) : NULL;
+    success = (encoded && memo_storage_PUT(pickle_filename, encoded));
+    if (success) {
+      *nbytes = PyString_GET_SIZE(encoded);
+      *runtime_ms = max_entry_runtime_ms(contents);
+      touch_cache_version(version_path);
+      unlink(PyString_AsString(legacy_path));
+    }
+    Py_XDECREF(encoded);
+    Py_XDECREF(serialized_str);
+  }
+  if (PyErr_Occurred()) {
+    PyErr_Clear();
+  }
+
+  cache_unlock(version_lock);
+
+  Py_DECREF(pickle_filename);
+  Py_DECREF(version_path);
+  Py_DECREF(contents);
+  Py_DECREF(legacy_path);
+  if (!success) {
+    Py_CLEAR(version);
+  }
+  return version;
+}
+
+// moves all of fmi's legacy entries, whose file names are in
+// legacy_names, into their versions (returns 1 if any were moved)
+static int migrate_legacy_cache_entries(FuncMemoInfo* fmi, PyObject* legacy_names) {
+  int num_migrated = 0;
+  Py_ssize_t i;
+  for (i = 0; i < PyList_GET_SIZE(legacy_names); i++) {
+    char* name = PyString_AsString(PyList_GET_ITEM(legacy_names, i));
+    PyObject* hash_key = PyString_FromStringAndSize(name, strlen(name) - strlen(".pickle"));
+
+    long entry_lock = entry_lock_offset(fmi, hash_key);
+    cache_lock(entry_lock, F_WRLCK);
+    Py_ssize_t nbytes = 0;
+    long runtime_ms = 0;
+    PyObject* version = migrate_legacy_cache_entry(fmi, hash_key, &nbytes, &runtime_ms);
+    cache_unlock(entry_lock);
+
+    if (version) {
+      shared_memo_index_note_put(fmi->cache_subdirectory_path, version, hash_key);
+      cache_index_note_migrated(fmi, version, hash_key, nbytes, runtime_ms);
+      Py_DECREF(version);
+      num_migrated++;
+    }
+    Py_DECREF(hash_key);
+  }
+
+  if (num_migrated) {
+    PG_LOG_PRINTF("dict(event='MIGRATE_LEGACY_ENTRIES', what='%s', num_migrated=%d)\n",
+                  PyString_AsString(GET_CANONICAL_NAME(fmi)), num_migrated);
+  }
+  return (num_migrated > 0);
+}
+
+// makes version, whose code dependencies are deps, fmi's current
+// version if they match the code of this execution, or else remembers
+// it in *newest_version if we're trusting previous results and it's
+// the most recently written one so far (steals deps)
+static void consider_cache_version(FuncMemoInfo* fmi, PyObject* version,
+                                   PyObject* deps, time_t mtime,
+                                   PyObject** newest_version, time_t* newest_mtime) {
+  if (code_dependencies_unchanged(deps)) {
+    Py_INCREF(version);
+    fmi->cache_version = version;
+    fmi->cache_version_deps = deps;
+    return;
+  }
+
+  if (trust_prev_memoized_results && (!*newest_version || (mtime > *newest_mtime))) {
+    Py_XDECREF(*newest_version);
+    Py_INCREF(version);
+    *newest_version = version;
+    *newest_mtime = mtime;
+  }
+  Py_DECREF(deps);
+}
+
+// the most entries of a version to prefetch from the cache server
+#define MAX_PREFETCHED_ENTRIES 32
+
+// ask the cache server (if any) for the most popular entries of fmi's
+// current cache version up front (see "Prefetching" in
+// memoize_cacheserver.c)
+static void prefetch_popular_cache_entries(FuncMemoInfo* fmi) {
+  // (only the directory backend goes through the cache server)
+  if (strcmp(memo_storage->name, "directory") != 0 || !cache_server_available()) {
+    return;
+  }
+
+  PyObject* keys = cache_index_popular_keys(fmi, MAX_PREFETCHED_ENTRIES);
+  Py_ssize_t i;
+  for (i = 0; i < PyList_GET_SIZE(keys); i++) {
+    PyObject* pickle_filename =
+      PyString_FromFormat("%s/%s/%s.pickle",
+                          PyString_AsString(fmi->cache_subdirectory_path),
+                          PyString_AsString(fmi->cache_version),
+                          PyString_AsString(PyList_GET_ITEM(keys, i)));
+    PyList_SetItem(keys, i, pickle_filename); // steals the reference
+  }
+  cache_server_PREFETCH(keys);
+  Py_DECREF(keys);
+}
+
+// find the version of fmi's on-disk cache that matches the code of
+// this execution, or set on_disk_cache_empty if there's none
+static void resolve_cache_version(FuncMemoInfo* fmi) {
+  assert(!fmi->cache_version);
+  char* subdir_path_str = PyString_AsString(fmi->cache_subdirectory_path);
+  PyObject* subdir_basename = hexdigest_str(GET_CANONICAL_NAME(fmi));
+
+  // if we're trusting previous results, then fall back on the version
+  // that was most recently written to
+  PyObject* newest_version = NULL;
+  time_t newest_mtime = 0;
+
+  PyObject* local_versions = PyList_New(0);
+  Py_ssize_t i;
+  if (memo_storage->is_persistent) {
+    if (cache_manifest_HAS_LEGACY_ENTRIES(subdir_basename)) {
+      PyObject* legacy_names = PyList_New(0);
+      list_local_cache_versions(fmi->cache_subdirectory_path, local_versions, legacy_names);
+      migrate_legacy_cache_entries(fmi, legacy_names);
+      cache_manifest_note_legacy_migrated(subdir_basename);
+      Py_DECREF(legacy_names);
+      PyList_SetSlice(local_versions, 0, PyList_GET_SIZE(local_versions), NULL);
+    }
+
+    // the manifest knows the digests of the code dependencies of every
+    // local version, so we don't need to touch the disk at all
+    PyObject* func_versions = cache_manifest_VERSIONS(subdir_basename);
+    PyObject* version = NULL;
+    PyObject* rec = NULL;
+    Py_ssize_t pos = 0;
+    while (func_versions && PyDict_Next(func_versions, &pos, &version, &rec)) {
+      PyList_Append(local_versions, version);
+
+      PyObject* digests = PyList_GET_ITEM(rec, 0);
+      time_t mtime = (time_t)PyInt_AsLong(PyList_GET_ITEM(rec, 1));
+      if (cache_manifest_digests_unchanged(digests)) {
+        Py_INCREF(version);
+        fmi->cache_version = version;
+        fmi->cache_version_deps = cache_manifest_current_deps(digests);
+        break;
+      }
+      else if (trust_prev_memoized_results && (!newest_version || (mtime > newest_mtime))) {
+        Py_XDECREF(newest_version);
+        Py_INCREF(version);
+        newest_version = version;
+        newest_mtime = mtime;
+      }
+    }
+  }
+  else {
+    list_local_cache_versions(fmi->cache_subdirectory_path, local_versions, NULL);
+    for (i = 0; (i < PyList_GET_SIZE(local_versions)) && !fmi->cache_version; i++) {
+      PyObject* version = PyList_GET_ITEM(local_versions, i);
+      PyObject* version_path =
+        PyString_FromFormat("%s/%s", subdir_path_str, PyString_AsString(version));
+      time_t mtime;
+      PyObject* deps = load_cache_version_deps(version_path, &mtime);
+      Py_DECREF(version_path);
+      if (deps) {
+        consider_cache_version(fmi, version, deps, mtime, &newest_version, &newest_mtime);
+      }
+    }
+  }
+
+  // versions that only exist in base cache layers come after local ones
+  if (!fmi->cache_version && cache_manifest_IN_BASE_LAYERS(subdir_basename)) {
+    PyObject* base_versions = PyList_New(0);
+    base_cache_LISTDIR(fmi->cache_subdirectory_path, base_versions);
+    for (i = 0; (i < PyList_GET_SIZE(base_versions)) && !fmi->cache_version; i++) {
+      PyObject* version = PyList_GET_ITEM(base_versions, i);
+      if (PySequence_Contains(local_versions, version) == 1) {
+        continue;
+      }
+      PyObject* version_path =
+        PyString_FromFormat("%s/%s", subdir_path_str, PyString_AsString(version));
+      time_t mtime;
+      PyObject* deps = load_cache_version_deps(version_path, &mtime);
+      Py_DECREF(version_path);
+      if (deps) {
+        consider_cache_version(fmi, version, deps, mtime, &newest_version, &newest_mtime);
+      }
+    }
+    Py_DECREF(base_versions);
+  }
+  Py_DECREF(local_versions);
+
+  if (!fmi->cache_version && newest_version) {
+    PyObject* version_path =
+      PyString_FromFormat("%s/%s", subdir_path_str, PyString_AsString(newest_version));
+    time_t mtime;
+    PyObject* deps = load_cache_version_deps(version_path, &mtime);
+    Py_DECREF(version_path);
+    if (deps) {
+      Py_INCREF(newest_version);
+      fmi->cache_version = newest_version;
+      fmi->cache_version_deps = deps;
+    }
+  }
+  Py_XDECREF(newest_version);
+  Py_DECREF(subdir_basename);
+
+  if (!fmi->cache_version) {
+    fmi->on_disk_cache_empty = 1;
+  }
+  else {
+    prefetch_popular_cache_entries(fmi);
+  }
+
+  PG_LOG_PRINTF("dict(event='RESOLVE_CACHE_VERSION', what='%s', version='%s')\n",
+                PyString_AsString(GET_CANONICAL_NAME(fmi)),
+                fmi->cache_version ? PyString_AsString(fmi->cache_version) : "");
+}
+
+// forget fmi's current cache version and look for one that matches
+// the current code again (e.g., because another process might have
+// created one since we last looked)
+void refresh_cache_version(FuncMemoInfo* fmi) {
+  cache_manifest_REFRESH();
+  Py_CLEAR(fmi->cache_version);
+  Py_CLEAR(fmi->cache_version_deps);
+  fmi->on_disk_cache_empty = 0;
+  resolve_cache_version(fmi);
+}
+
+typedef struct {
+  PyObject* version; // new reference
+  time_t mtime;
+} CacheVersionAge;
+
+static int compare_cache_version_ages(const void* a, const void* b) {
+  time_t t1 = ((const CacheVersionAge*)a)->mtime;
+  time_t t2 = ((const CacheVersionAge*)b)->mtime;
+  return (t1 < t2) ? -1 : ((t1 > t2) ? 1 : 0);
+}
+
+// tombstone the least-recently-written versions of fmi's cache until
+// there's room for one more
+//
+// we're holding the lock at held_lock_offset (that of the version
+// that we're making room for) exclusively, so we mustn't WAIT for the
+// locks of the versions that we drop, or else two processes doing this
+// the other way around could deadlock ... instead, we skip versions
+// that somebody's still writing into and drop the next-oldest ones
+static void make_room_for_cache_version(FuncMemoInfo* fmi, long held_lock_offset) {
+  char* subdir_path_str = PyString_AsString(fmi->cache_subdirectory_path);
+  PyObject* versions = PyList_New(0);
+  list_local_cache_versions(fmi->cache_subdirectory_path, versions, NULL);
+
+  Py_ssize_t num_versions = PyList_GET_SIZE(versions);
+  if (num_versions >= MAX_CACHE_VERSIONS) {
+    CacheVersionAge* ages = PyMem_New(CacheVersionAge, num_versions);
+    Py_ssize_t i;
+    for (i = 0; i < num_versions; i++) {
+      ages[i].version = PyList_GET_ITEM(versions, i);
+      Py_INCREF(ages[i].version);
+
+      PyObject* version_path =
+        PyString_FromFormat("%s/%s", subdir_path_str, PyString_AsString(ages[i].version));
+      ages[i].mtime = cache_version_mtime(version_path);
+      Py_DECREF(version_path);
+    }
+
+    qsort(ages, num_versions, sizeof(CacheVersionAge), compare_cache_version_ages);
+
+    PyObject* subdir_basename = hexdigest_str(GET_CANONICAL_NAME(fmi));
+    Py_ssize_t num_to_drop = num_versions - MAX_CACHE_VERSIONS + 1;
+    for (i = 0; i < num_versions; i++) {
+      if (num_to_drop > 0) {
+        PyObject* version_path =
+          PyString_FromFormat("%s/%s", subdir_path_str, PyString_AsString(ages[i].version));
+
+        // (fcntl locks of the same process never conflict, so if this
+        //  version's lock is the byte that we're already holding, then
+        //  we mustn't unlock it afterwards)
+        long lock_offset = version_lock_offset(version_path);
+        int already_held = (lock_offset == held_lock_offset);
+        if (already_held || cache_trylock(lock_offset, F_WRLCK)) {
+          make_tombstone(PyString_AsString(version_path), subdir_basename,
+                         PyString_AsString(ages[i].version));
+          cache_index_forget_version(fmi, ages[i].version);
+          if (!already_held) {
+            cache_unlock(lock_offset);
+          }
+          num_to_drop--;
+
+          PG_LOG_PRINTF("dict(event='DROP_CACHE_VERSION', what='%s', version='%s')\n",
+                        PyString_AsString(GET_CANONICAL_NAME(fmi)),
+                        PyString_AsString(ages[i].version));
+        }
+        Py_DECREF(version_path);
+      }
+      Py_DECREF(ages[i].version);
+    }
+    Py_DECREF(subdir_basename);
+    PyMem_Del(ages);
+  }
+
+  Py_DECREF(versions);
+}
+
+// make sure that fmi has a current cache version that covers all of
+// the code dependencies in code_deps, creating a new version on disk
+// if necessary (returns 1 on success)
+static int ensure_cache_version(FuncMemoInfo* fmi, PyObject* code_deps) {
+  char* subdir_path_str = PyString_AsString(fmi->cache_subdirectory_path);
+
+  if (fmi->cache_version) {
+    PyObject* version_path =
+      PyString_FromFormat("%s/%s", subdir_path_str, PyString_AsString(fmi->cache_version));
+    long lock_offset = version_lock_offset(version_path);
+    cache_lock(lock_offset, F_WRLCK);
+
+    // another process might have merged other code dependencies into
+    // this version, or erased it, since we last looked at it
+    time_t mtime;
+    PyObject* disk_deps = load_cache_version_deps(version_path, &mtime);
+
+    if (disk_deps) {
+      // merge in any code dependencies that the version doesn't know
+      // about yet (e.g., ones that only some calls depend on)
+      PyObject* merged_deps = PyDict_Copy(disk_deps);
+      PyDict_Merge(merged_deps, fmi->cache_version_deps, 0);
+      PyDict_Merge(merged_deps, code_deps, 0);
+
+      // if the version only exists in a base cache layer so far, then
+      // start a local copy of it to put new entries into
+      if (!cache_version_is_local(version_path)) {
+        store_cache_version_deps(fmi->cache_subdirectory_path, version_path, merged_deps);
+        PG_LOG_PRINTF("dict(event='COPY_BASE_CACHE_VERSION', what='%s', version='%s')\n",
+                      PyString_AsString(GET_CANONICAL_NAME(fmi)),
+                      PyString_AsString(fmi->cache_version));
+      }
+      else if (PyDict_Size(merged_deps) > PyDict_Size(disk_deps)) {
+        store_cache_version_deps(fmi->cache_subdirectory_path, version_path, merged_deps);
+      }
+
+      Py_DECREF(fmi->cache_version_deps);
+      fmi->cache_version_deps = merged_deps;
+    }
+    else {
+      cache_manifest_note_version_gone(version_path);
+      Py_CLEAR(fmi->cache_version);
+      Py_CLEAR(fmi->cache_version_deps);
+    }
+
+    cache_unlock(lock_offset);
+    Py_XDECREF(disk_deps);
+    Py_DECREF(version_path);
+
+    if (fmi->cache_version) {
+      return 1;
+    }
+  }
+
+  // otherwise create a new version
+  PyObject* version = cache_version_name(code_deps);
+  if (!version) {
+    return 0;
+  }
+
+  PyObject* version_path =
+    PyString_FromFormat("%s/%s", subdir_path_str, PyString_AsString(version));
+  PyObject* deps_path =
+    PyString_FromFormat("%s/" CODE_DEPS_FILENAME, PyString_AsString(version_path));
+  long lock_offset = version_lock_offset(version_path);
+  cache_lock(lock_offset, F_WRLCK);
+
+  int success = 0;
+  int is_local = cache_version_is_local(version_path);
+  time_t mtime;
+  PyObject* disk_deps = NULL;
+  if (is_local || base_cache_CONTAINS(deps_path)) {
+    disk_deps = load_cache_version_deps(version_path, &mtime);
+  }
+
+  // a base cache layer has a version with the same name but conflicting
+  // code dependencies, and since we can't tombstone it, we'd better not
+  // create a local version that would let its entries show through
+  if (!is_local && disk_deps && !code_dependencies_unchanged(disk_deps)) {
+    cache_unlock(lock_offset);
+    Py_DECREF(disk_deps);
+    Py_DECREF(deps_path);
+    Py_DECREF(version_path);
+    Py_DECREF(version);
+    return 0;
+  }
+
+  if (is_local || disk_deps) {
+    // another process (or a base cache layer) already has the same
+    // version, so join it
+    if (disk_deps && code_dependencies_unchanged(disk_deps)) {
+      PyObject* merged_deps = PyDict_Copy(disk_deps);
+      PyDict_Merge(merged_deps, code_deps, 0);
+      if (!is_local || (PyDict_Size(merged_deps) > PyDict_Size(disk_deps))) {
+        store_cache_version_deps(fmi->cache_subdirectory_path, version_path, merged_deps);
+      }
+      fmi->cache_version = version;
+      fmi->cache_version_deps = merged_deps;
+      success = 1;
+      PG_LOG_PRINTF("dict(event='JOIN_CACHE_VERSION', what='%s', version='%s')\n",
+                    PyString_AsString(GET_CANONICAL_NAME(fmi)),
+                    PyString_AsString(version));
+    }
+    // otherwise it's a leftover version with the same name, which must
+    // have had conflicting code dependencies merged into it, or else it
+    // would've been valid
+    else {
+      PyObject* subdir_basename = hexdigest_str(GET_CANONICAL_NAME(fmi));
+      make_tombstone(PyString_AsString(version_path), subdir_basename,
+                     PyString_AsString(version));
+      Py_DECREF(subdir_basename);
+      cache_index_forget_version(fmi, version);
+    }
+  }
+  Py_XDECREF(disk_deps);
+
+  if (!success) {
+    make_room_for_cache_version(fmi, lock_offset);
+
+    success = store_cache_version_deps(fmi->cache_subdirectory_path, version_path, code_deps);
+    if (success) {
+      fmi->cache_version = version;
+      fmi->cache_version_deps = PyDict_Copy(code_deps);
+      PG_LOG_PRINTF("dict(event='NEW_CACHE_VERSION', what='%s', version='%s')\n",
+                    PyString_AsString(GET_CANONICAL_NAME(fmi)),
+                    PyString_AsString(version));
+    }
+    else {
+      Py_DECREF(version);
+    }
+  }
+
+  cache_unlock(lock_offset);
+  Py_DECREF(deps_path);
+  Py_DECREF(version_path);
+  return success;
+}
+
+// erase the version sub-directory of fmi's function (fmi can be NULL
+// if that function hasn't been called during this execution) if it has
+// no more cache entries left, and then erase the function's cache
+// sub-directory if it has no more versions left
+//
+// returns 1 if the version sub-directory was erased
+int remove_cache_version_if_empty(FuncMemoInfo* fmi, PyObject* subdir_path,
+                                  PyObject* version) {
+  PyObject* version_path =
+    PyString_FromFormat("%s/%s", PyString_AsString(subdir_path), PyString_AsString(version));
+  long lock_offset = version_lock_offset(version_path);
+  cache_lock(lock_offset, F_WRLCK);
+
+  // stop as soon as we find any entry (this is usually quick)
+  PyObject* names = memo_storage_SCAN(version_path, 1);
+  int is_empty = (PyList_GET_SIZE(names) == 0);
+  Py_DECREF(names);
+
+  if (is_empty) {
+    erase_cache_version(subdir_path, version_path);
+
+    // (but a base cache layer might still have entries in this version)
+    PyObject* deps_path =
+      PyString_FromFormat("%s/" CODE_DEPS_FILENAME, PyString_AsString(version_path));
+    if (fmi && fmi->cache_version && _PyString_Eq(fmi->cache_version, version) &&
+        !base_cache_CONTAINS(deps_path)) {
+      Py_CLEAR(fmi->cache_version);
+      Py_CLEAR(fmi->cache_version_deps);
+      fmi->on_disk_cache_empty = 1;
+    }
+    Py_DECREF(deps_path);
+  }
+
+  cache_unlock(lock_offset);
+  Py_DECREF(version_path);
+  return is_empty;
+}
+
+
+
 FuncMemoInfo* NEW_func_memo_info(PyCodeObject* cod) {
   FuncMemoInfo* new_fmi = PyMem_New(FuncMemoInfo, 1);
   // null out all fields
@@ -58,9 +1555,21 @@ FuncMemoInfo* NEW_func_memo_info(PyCodeObject* cod) {
 
   PyObject* subdir_basename = hexdigest_str(GET_CANONICAL_NAME(new_fmi));
   new_fmi->cache_subdirectory_path =
-    PyString_FromFormat("incpy-cache/%s.cache", PyString_AsString(subdir_basename));
+    PyString_FromFormat("%s/%s.cache", INCPY_CACHE_DIR, PyString_AsString(subdir_basename));
+
+  // set on_disk_cache_empty depending on whether the function has any
+  // versions at all (see memoize_manifest.c)
+  if (cache_manifest_HAS_FUNC(subdir_basename)) {
+    resolve_cache_version(new_fmi);
+  }
+  else {
+    new_fmi->on_disk_cache_empty = 1;
+  }
+
   Py_DECREF(subdir_basename);
 
+  restore_func_profile(new_fmi);
+
   return new_fmi;
 }
 
@@ -69,33 +1578,25 @@ void DELETE_func_memo_info(FuncMemoInfo* fmi) {
   Py_CLEAR(fmi->code_dependencies);
   Py_CLEAR(fmi->f_code);
   Py_CLEAR(fmi->cache_subdirectory_path);
+  Py_CLEAR(fmi->cache_version);
+  Py_CLEAR(fmi->cache_version_deps);
   Py_CLEAR(fmi->impure_status_msg);
   PyMem_Del(fmi);
 }
 
 
-void clear_cache_and_mark_pure(FuncMemoInfo* func_memo_info) {
-  PG_LOG_PRINTF("dict(event='CLEAR_CACHE_AND_MARK_PURE', what='%s')\n",
+// called when fmi's current cache version no longer matches its code
+// (e.g., because it was re-defined during this execution) ... note
+// that we don't erase that version, since we might still switch back
+// to that code in a later execution
+void switch_cache_version_and_mark_pure(FuncMemoInfo* func_memo_info) {
+  PG_LOG_PRINTF("dict(event='SWITCH_CACHE_VERSION_AND_MARK_PURE', what='%s')\n",
                 PyString_AsString(GET_CANONICAL_NAME(func_memo_info)));
 
-  // erase the entire sub-directory of cache entries associated with func_memo_info
-  assert(func_memo_info->cache_subdirectory_path);
-  char* subdir_path_str = PyString_AsString(func_memo_info->cache_subdirectory_path);
-
-  DIR* dp = opendir(subdir_path_str);
-  if (dp) {
-    struct dirent* dirp;
-    while ((dirp = readdir(dp)) != NULL) {
-      if ((strcmp(dirp->d_name, ".") != 0) && (strcmp(dirp->d_name, "..") != 0)) {
-        PyObject* file_path =
-          PyString_FromFormat("%s/%s", subdir_path_str, dirp->d_name);
-        unlink(PyString_AsString(file_path));
-      }
-    }
-    rmdir(subdir_path_str);
-    closedir(dp);
-  }
-
+  // forget about the current version, so that the next PUT starts a
+  // new one
+  Py_CLEAR(func_memo_info->cache_version);
+  Py_CLEAR(func_memo_info->cache_version_deps);
   func_memo_info->on_disk_cache_empty = 1;
 
 
@@ -122,7 +1623,6 @@ void clear_cache_and_mark_pure(FuncMemoInfo* func_memo_info) {
   Py_CLEAR(func_memo_info->impure_status_msg);
 }
 
-
 // Look for the appropriate func_memo_info entry from a code object,
 // in memory, or create a new one if it doesn't yet exist
 FuncMemoInfo* get_func_memo_info_from_cod(PyCodeObject* cod) {
@@ -142,15 +1642,9 @@ FuncMemoInfo* get_func_memo_info_from_cod(PyCodeObject* cod) {
     // otherwise, create a fresh new entry and add it to
     // all_func_memo_info_dict:
 
+    // (NEW_func_memo_info also sets on_disk_cache_empty)
     FuncMemoInfo* new_fmi = NEW_func_memo_info(cod);
 
-    // set on_disk_cache_empty depending on whether cache sub-directory exists
-    assert(new_fmi->cache_subdirectory_path);
-    struct stat st;
-    if (stat(PyString_AsString(new_fmi->cache_subdirectory_path), &st) != 0) {
-      new_fmi->on_disk_cache_empty = 1;
-    }
-
     // add its address to all_func_memo_info_dict:
     assert(new_fmi);
     fmi_addr = PyInt_FromLong((long)new_fmi);
@@ -192,13 +1686,20 @@ FuncMemoInfo* get_func_memo_info_from_cod(PyCodeObject* cod) {
    there could be MULTIPLE valid matches for a particular argument list,
    due to differing global variable values)
 
-   Each function stores its persistent cache in its own sub-directory:
+   Each function stores its persistent cache in its own sub-directory,
+   with one sub-directory per version of its code (see "Cache versions"
+   above):
 
-     incpy-cache/<hash of function name>.cache/
+     incpy-cache/<hash of function name>.cache/<version>/
 
-   and each 'value' is serialized in a pickle file named by the key:
+   and each 'value' is serialized (marshaled or pickled, and possibly
+   compressed; see memoize_codec.c) in a file named by the key in the
+   CURRENT version's sub-directory:
  
-     incpy-cache/<hash of function name>.cache/<hash of key>.pickle
+     incpy-cache/<hash of function name>.cache/<version>/<hash of key>.pickle
+
+   (or wherever the storage backend keeps that path's contents; see
+    memoize_storage.c)
 
 */
 
@@ -210,39 +1711,74 @@ PyObject* on_disk_cache_GET(FuncMemoInfo* fmi, PyObject* hash_key) {
   assert(fmi->cache_subdirectory_path);
 
   // Optimization:
-  if (fmi->on_disk_cache_empty) {
+  if (fmi->on_disk_cache_empty || !fmi->cache_version) {
     return NULL;
   }
 
   PyObject* pickle_filename =
-    PyString_FromFormat("%s/%s.pickle",
+    PyString_FromFormat("%s/%s/%s.pickle",
                         PyString_AsString(fmi->cache_subdirectory_path),
+                        PyString_AsString(fmi->cache_version),
                         PyString_AsString(hash_key));
-  PyObject* pf = PyFile_FromString(PyString_AsString(pickle_filename), "r");
-  Py_DECREF(pickle_filename);
 
-  if (pf) {
-    PyObject* ret = PyObject_CallFunctionObjArgs(cPickle_load_func, pf, NULL);
-    Py_DECREF(pf);
+  struct timeval load_start_time;
+  struct timeval load_end_time;
+  BEGIN_TIMING(load_start_time);
 
-    if (ret) {
-      return ret;
-    }
-    else {
-      assert(PyErr_Occurred());
-      PyErr_Clear();
-      PG_LOG_PRINTF("dict(event='ERROR', what='Cannot unpickle cache entry', funcname='%s')\n",
-                    PyString_AsString(GET_CANONICAL_NAME(fmi)));
-      return NULL;
+  // APPEND and DISCARD are about to re-write this entry, so they need
+  // its latest contents, not what we might have prefetched
+  if (num_entry_locks_held) {
+    cache_server_FORGET_PREFETCHED(pickle_filename);
+  }
+
+  // silently return NULL if cache file isn't found, either locally or
+  // in any base cache layer
+  PyObject* data = NULL;
+  int status = memo_storage_GET(pickle_filename, &data);
+  if (status == MEMO_STORAGE_MISS) {
+    data = base_cache_READ(pickle_filename);
+    if (data) {
+      status = MEMO_STORAGE_HIT;
     }
   }
+  Py_DECREF(pickle_filename);
+  if (status != MEMO_STORAGE_HIT) {
+    return NULL;
+  }
+
+  // an empty entry is a tombstone that hides an entry in a base cache
+  // layer (see on_disk_cache_DEL())
+  if (PyString_GET_SIZE(data) == 0) {
+    Py_DECREF(data);
+    return NULL;
+  }
+
+  // (decompress it if necessary)
+  int serializer;
+  PyObject* serialized_str = decode_cache_entry(data, &serializer);
+  Py_DECREF(data);
+  if (!serialized_str) {
+    PG_LOG_PRINTF("dict(event='ERROR', what='Cannot decode cache entry', funcname='%s')\n",
+                  PyString_AsString(GET_CANONICAL_NAME(fmi)));
+    return NULL;
+  }
+
+  PyObject* ret = deserialize_cache_entry(serialized_str, serializer);
+
+  END_TIMING(load_start_time, load_end_time);
+  if (ret) {
+    record_cache_read_cost(PyString_GET_SIZE(serialized_str),
+                           GET_ELAPSED_US(load_start_time, load_end_time));
+  }
   else {
-    // silently return NULL if cache file isn't found
     assert(PyErr_Occurred());
     PyErr_Clear();
-
-    return NULL;
+    PG_LOG_PRINTF("dict(event='ERROR', what='Cannot load cache entry', funcname='%s')\n",
+                  PyString_AsString(GET_CANONICAL_NAME(fmi)));
   }
+
+  Py_DECREF(serialized_str);
+  return ret;
 }
 
 
@@ -254,84 +1790,247 @@ PyObject* on_disk_cache_GET(FuncMemoInfo* fmi, PyObject* hash_key) {
 PyObject* on_disk_cache_PUT(FuncMemoInfo* fmi, PyObject* hash_key, PyObject* contents) {
   assert(hash_key);
   assert(fmi->cache_subdirectory_path);
-  char* subdir_path_str = PyString_AsString(fmi->cache_subdirectory_path);
 
-  // first create parent directories if they don't yet exist
-  struct stat st;
-  if (stat("incpy-cache", &st) != 0) {
-    mkdir("incpy-cache", 0777);
+  // contents is a list of memo table entries, the last of which is
+  // the one that's being added, so make sure that the current version
+  // covers its code dependencies (creating its sub-directories if
+  // necessary)
+  PyObject* code_deps = NULL;
+  if (PyList_CheckExact(contents) && (PyList_GET_SIZE(contents) > 0)) {
+    PyObject* last_elt = PyList_GET_ITEM(contents, PyList_GET_SIZE(contents) - 1);
+    if (PyDict_Check(last_elt)) {
+      code_deps = PyDict_GetItemString(last_elt, "code_dependencies");
+    }
+  }
+  if (!code_deps || !PyDict_Check(code_deps)) {
+    PyErr_SetString(PyExc_ValueError, "cache entry has no code dependencies");
+    return NULL;
   }
 
-  if (stat(subdir_path_str, &st) != 0) {
-    mkdir(subdir_path_str, 0777);
+  // hold the version's lock (shared) while writing into it so that
+  // nobody can erase it out from under us, and if somebody erased it
+  // right before we got the lock, then try again with a fresh version
+  PyObject* version_path_obj = NULL;
+  long version_lock = 0;
+  int attempt;
+  for (attempt = 0; (attempt < 2) && !version_path_obj; attempt++) {
+    if (!ensure_cache_version(fmi, code_deps)) {
+      break;
+    }
+
+    version_path_obj =
+      PyString_FromFormat("%s/%s",
+                          PyString_AsString(fmi->cache_subdirectory_path),
+                          PyString_AsString(fmi->cache_version));
+    version_lock = version_lock_offset(version_path_obj);
+    cache_lock(version_lock, F_RDLCK);
+
+    if (!cache_version_is_local(version_path_obj)) {
+      cache_unlock(version_lock);
+      Py_CLEAR(version_path_obj);
+      Py_CLEAR(fmi->cache_version);
+      Py_CLEAR(fmi->cache_version_deps);
+    }
   }
 
-  // write to a temporary filename, then atomically rename it
-  // to its proper filename when pickling successfully completed,
-  // so that .pickle files are ALWAYS seen in a consistent state
-  PyObject* pickle_tmp_filename =
-    PyString_FromFormat("%s/%s.pickle.partial",
-                        subdir_path_str,
+  if (!version_path_obj) {
+    PyErr_SetString(PyExc_IOError, "cannot create a cache version");
+    return NULL;
+  }
+  PyObject* pickle_filename =
+    PyString_FromFormat("%s/%s.pickle",
+                        PyString_AsString(version_path_obj),
                         PyString_AsString(hash_key));
 
-  PyObject* pickle_outfile =
-    PyFile_FromString(PyString_AsString(pickle_tmp_filename), "wb");
-  assert(pickle_outfile);
-  PyObject* negative_one = PyInt_FromLong(-1);
-  PyObject* cPickle_dump_res =
-    PyObject_CallFunctionObjArgs(cPickle_dump_func,
-                                 contents,
-                                 pickle_outfile,
-                                 negative_one, NULL);
-  Py_DECREF(negative_one);
-  Py_DECREF(pickle_outfile);
+  struct timeval dump_start_time;
+  struct timeval dump_end_time;
+  BEGIN_TIMING(dump_start_time);
 
+  // (marshals contents if possible, and pickles it otherwise)
+  int serializer;
+  PyObject* cPickle_dump_res = serialize_cache_entry(contents, &serializer);
+
+  Py_ssize_t nbytes_pickled = 0;
+  Py_ssize_t nbytes_written = 0;
   if (cPickle_dump_res) {
+    nbytes_pickled = PyString_GET_SIZE(cPickle_dump_res);
+
+    // (compress it if that pays off)
+    PyObject* encoded = encode_cache_entry(cPickle_dump_res, serializer);
+
+    struct timeval store_start_time;
+    struct timeval store_end_time;
+    BEGIN_TIMING(store_start_time);
+    if (encoded && memo_storage_PUT(pickle_filename, encoded)) {
+      END_TIMING(store_start_time, store_end_time);
+      nbytes_written = PyString_GET_SIZE(encoded);
+      record_cache_store_cost(nbytes_written,
+                              GET_ELAPSED_US(store_start_time, store_end_time));
+    }
+    else {
+      Py_CLEAR(cPickle_dump_res);
+      PyErr_SetString(PyExc_IOError, "cannot store cache entry");
+    }
+    Py_XDECREF(encoded);
+  }
+
+  END_TIMING(dump_start_time, dump_end_time);
+  Py_DECREF(pickle_filename);
+
+  if (cPickle_dump_res) {
+    record_cache_write_cost(nbytes_pickled,
+                            GET_ELAPSED_US(dump_start_time, dump_end_time));
+
+    long max_runtime_ms = max_entry_runtime_ms(contents);
+
     // For optimization purposes ... if the PUT succeeded, then the
     // cache is no longer empty
     fmi->on_disk_cache_empty = 0;
+    touch_cache_version(version_path_obj);
 
-    // atomically rename to its permanent filename
-    PyObject* pickle_filename =
-      PyString_FromFormat("%s/%s.pickle",
-                          subdir_path_str,
-                          PyString_AsString(hash_key));
+    cache_unlock(version_lock);
 
-    rename(PyString_AsString(pickle_tmp_filename), PyString_AsString(pickle_filename));
-    Py_DECREF(pickle_filename);
+    shared_memo_index_note_put(fmi->cache_subdirectory_path, fmi->cache_version, hash_key);
+    cache_index_note_put(fmi, hash_key, nbytes_written, max_runtime_ms);
   }
   else {
-    // if the PUT failed, then just to be safe, delete the file so that
-    // we don't try to unpickle an inconsistent file
-    unlink(PyString_AsString(pickle_tmp_filename));
+    cache_unlock(version_lock);
   }
 
-  Py_DECREF(pickle_tmp_filename);
+  Py_DECREF(version_path_obj);
+
+  // evict entries if we're now over budget, unless we're still inside
+  // of APPEND or DISCARD (which do it once they've let go of their
+  // entry lock)
+  if (!num_entry_locks_held) {
+    cache_index_enforce_budgets();
+  }
   return cPickle_dump_res;
 }
 
 void on_disk_cache_DEL(FuncMemoInfo* fmi, PyObject* hash_key) {
   assert(hash_key);
   assert(fmi->cache_subdirectory_path);
-  char* subdir_path_str = PyString_AsString(fmi->cache_subdirectory_path);
+
+  if (!fmi->cache_version) {
+    return;
+  }
 
   PyObject* pickle_filename =
-    PyString_FromFormat("%s/%s.pickle",
-                        subdir_path_str,
+    PyString_FromFormat("%s/%s/%s.pickle",
+                        PyString_AsString(fmi->cache_subdirectory_path),
+                        PyString_AsString(fmi->cache_version),
                         PyString_AsString(hash_key));
 
-  // delete the cache file
-  unlink(PyString_AsString(pickle_filename));
+  // delete the cache file, or if a base cache layer has it, then hide
+  // it behind an empty local entry, since we can't delete it there
+  if (base_cache_CONTAINS(pickle_filename)) {
+    // (makes a local copy of the version if there's none yet)
+    if (ensure_cache_version(fmi, fmi->cache_version_deps)) {
+      PyObject* empty_str = PyString_FromString("");
+      memo_storage_PUT(pickle_filename, empty_str);
+      Py_DECREF(empty_str);
+    }
+  }
+  else {
+    memo_storage_DEL(pickle_filename);
+  }
 
   Py_DECREF(pickle_filename);
 
-  // if rmdir succeeds, then that means that there were NO other cache
-  // entries left in the directory, so fmi->on_disk_cache_empty should
-  // be set
-  rmdir(subdir_path_str);
+  cache_index_note_del(fmi, hash_key);
+  shared_memo_index_note_del(fmi->cache_subdirectory_path, fmi->cache_version, hash_key);
 
-  struct stat st;
-  if (stat(subdir_path_str, &st) != 0) {
-      fmi->on_disk_cache_empty = 1;
+  // if there are NO other cache entries left in this version, then
+  // fmi->on_disk_cache_empty gets set
+  PyObject* version = fmi->cache_version;
+  Py_INCREF(version);
+  remove_cache_version_if_empty(fmi, fmi->cache_subdirectory_path, version);
+  Py_DECREF(version);
+}
+
+// atomically adds memo_table_entry to the list of entries stored under
+// hash_key, even if other processes are doing the same thing
+//
+// returns the result of the pickling attempt, just like PUT
+PyObject* on_disk_cache_APPEND(FuncMemoInfo* fmi, PyObject* hash_key,
+                               PyObject* memo_table_entry) {
+  long entry_lock = entry_lock_offset(fmi, hash_key);
+  cache_lock(entry_lock, F_WRLCK);
+  num_entry_locks_held++;
+
+  // first switch to the version that another process might have
+  // created in the meantime, so that we GET from the same version that
+  // we'll PUT into
+  PyObject* code_deps = PyDict_GetItemString(memo_table_entry, "code_dependencies");
+  if (code_deps && PyDict_Check(code_deps)) {
+    if (ensure_cache_version(fmi, code_deps)) {
+      fmi->on_disk_cache_empty = 0;
+    }
+  }
+
+  PyObject* contents = on_disk_cache_GET(fmi, hash_key);
+  if (!contents) {
+    contents = PyList_New(0);
   }
+
+  /* we're just gonna blindly append memo_table_entry assuming that
+     there are no duplicates in contents
+
+     (if this assumption is violated, then we will get some
+     funny-looking results ... but I think I should be able to convince
+     myself of why duplicates should never occur) */
+  PyList_Append(contents, memo_table_entry);
+
+  PyObject* ret = on_disk_cache_PUT(fmi, hash_key, contents);
+  Py_DECREF(contents);
+
+  num_entry_locks_held--;
+  cache_unlock(entry_lock);
+
+  cache_index_enforce_budgets();
+  return ret;
+}
+
+// atomically removes the entry equal to stale_entry from the list of
+// entries stored under hash_key (erasing the file if nothing's left),
+// even if other processes have changed that list since we read it
+void on_disk_cache_DISCARD(FuncMemoInfo* fmi, PyObject* hash_key,
+                           PyObject* stale_entry) {
+  long entry_lock = entry_lock_offset(fmi, hash_key);
+  cache_lock(entry_lock, F_WRLCK);
+  num_entry_locks_held++;
+
+  PyObject* contents = on_disk_cache_GET(fmi, hash_key);
+  if (contents && PyList_CheckExact(contents)) {
+    Py_ssize_t i;
+    for (i = 0; i < PyList_GET_SIZE(contents); i++) {
+      if (obj_equals(PyList_GET_ITEM(contents, i), stale_entry)) {
+        PyList_SetSlice(contents, i, i + 1, NULL);
+
+        // update on-disk cache either by writing an update, or
+        // deleting the file if there's nothing left
+        if (PyList_GET_SIZE(contents) > 0) {
+          PyObject* res = on_disk_cache_PUT(fmi, hash_key, contents);
+          if (res) {
+            Py_DECREF(res);
+          }
+          else {
+            assert(PyErr_Occurred());
+            PyErr_Clear();
+          }
+        }
+        else {
+          on_disk_cache_DEL(fmi, hash_key);
+        }
+        break;
+      }
+    }
+  }
+  Py_XDECREF(contents);
+
+  num_entry_locks_held--;
+  cache_unlock(entry_lock);
+
+  cache_index_enforce_budgets();
 }
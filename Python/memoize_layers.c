@@ -0,0 +1,399 @@
+/* Read-only base cache layers underneath incpy-cache/
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+/* A nightly job can populate a big canonical cache once, and then
+   every developer and worker can re-use it without copying it by
+   adding lines like these to their incpy.config:
+
+     base_cache = /shared/nightly
+     base_cache = /shared/nightly-cache.zip
+
+   Each base cache layer is a read-only copy of some incpy-cache/
+   directory (in the directory storage layout), either inside of a
+   directory (like the one that you'd pass to the scripts in
+   incpy-support-scripts/) or inside of a .zip or .tar archive (which
+   can be compressed, e.g., .tar.gz) that was made from such a
+   directory, e.g.:
+
+     cd /shared/nightly && zip -r -0 ../nightly-cache.zip incpy-cache
+
+   The local incpy-cache/ is the writable overlay on top of all base
+   layers.  Looking for a cache version or an entry falls through from
+   the overlay to each base layer in the order in which they were
+   listed, and new entries (including ones that merge new memo table
+   entries into entries from a base layer) always go into the overlay.
+   The first time that we store an entry into a version that only
+   exists in a base layer, we copy the version's code dependencies into
+   the overlay.
+
+   We can't delete entries from base layers, so deleting an entry that
+   a base layer has instead stores an empty entry in the overlay (a
+   TOMBSTONE), which hides it (see on_disk_cache_DEL()). */
+
+#include "Python.h"
+#include "memoize_layers.h"
+#include "memoize.h"
+#include "memoize_logging.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+
+typedef struct {
+  PyObject* root; // absolute path of the directory or archive
+
+  // for archives only (NULL for directories):
+  PyObject* archive; // zipfile.ZipFile or tarfile.TarFile
+  PyObject* members; // Key: path, Value: ZipInfo or TarInfo of a file
+  PyObject* dirs;    // Key: path of a directory, Value: set of names in it
+} BaseCacheLayer;
+
+PyObject* base_cache_paths = NULL;
+
+static BaseCacheLayer* layers = NULL;
+static int num_layers = 0;
+
+
+// records that dir_path contains name in layer->dirs
+static void add_to_dir(BaseCacheLayer* layer, char* dir_path, Py_ssize_t dir_len,
+                       char* name, Py_ssize_t name_len) {
+  PyObject* dir_path_obj = PyString_FromStringAndSize(dir_path, dir_len);
+  PyObject* names = PyDict_GetItem(layer->dirs, dir_path_obj);
+  if (!names) {
+    names = PySet_New(NULL);
+    PyDict_SetItem(layer->dirs, dir_path_obj, names);
+    Py_DECREF(names); // PyDict_SetItem took a reference
+  }
+
+  PyObject* name_obj = PyString_FromStringAndSize(name, name_len);
+  PySet_Add(names, name_obj);
+  Py_DECREF(name_obj);
+  Py_DECREF(dir_path_obj);
+}
+
+// indexes the file in layer's archive with the given member name
+static void add_archive_member(BaseCacheLayer* layer, PyObject* name, PyObject* member) {
+  char* path = PyString_AsString(name);
+  if (!path) {
+    PyErr_Clear();
+    return;
+  }
+  if (strncmp(path, "./", 2) == 0) {
+    path += 2;
+  }
+  if (strncmp(path, "incpy-cache/", 12) != 0) {
+    return;
+  }
+
+  PyObject* path_obj = PyString_FromString(path);
+  PyDict_SetItem(layer->members, path_obj, member);
+  Py_DECREF(path_obj);
+
+  // add it (and all of its parent directories) to layer->dirs
+  Py_ssize_t len = strlen(path);
+  while (len > 0) {
+    Py_ssize_t slash = len - 1;
+    while (slash >= 0 && path[slash] != '/') {
+      slash--;
+    }
+    if (slash < 0) {
+      break;
+    }
+    add_to_dir(layer, path, slash, path + slash + 1, len - slash - 1);
+    len = slash;
+  }
+}
+
+static int ends_with(char* s, char* suffix) {
+  size_t len = strlen(s);
+  size_t suffix_len = strlen(suffix);
+  return (len >= suffix_len) && (strcmp(s + len - suffix_len, suffix) == 0);
+}
+
+// returns 1 on success
+static int open_archive(BaseCacheLayer* layer) {
+  char* root = PyString_AsString(layer->root);
+  int is_zip = ends_with(root, ".zip");
+
+  PyObject* module = PyImport_ImportModule(is_zip ? "zipfile" : "tarfile");
+  if (!module) {
+    return 0;
+  }
+
+  if (is_zip) {
+    layer->archive = PyObject_CallMethod(module, "ZipFile", "O", layer->root);
+  }
+  else {
+    // (transparently decompresses .tar.gz and .tar.bz2)
+    layer->archive = PyObject_CallMethod(module, "open", "Os", layer->root, "r:*");
+  }
+  Py_DECREF(module);
+  if (!layer->archive) {
+    return 0;
+  }
+
+  PyObject* members =
+    PyObject_CallMethod(layer->archive, is_zip ? "infolist" : "getmembers", NULL);
+  if (!members || !PyList_Check(members)) {
+    Py_XDECREF(members);
+    return 0;
+  }
+
+  layer->members = PyDict_New();
+  layer->dirs = PyDict_New();
+
+  Py_ssize_t i;
+  for (i = 0; i < PyList_GET_SIZE(members); i++) {
+    PyObject* member = PyList_GET_ITEM(members, i);
+    PyObject* name = PyObject_GetAttrString(member, is_zip ? "filename" : "name");
+
+    int is_file = 1;
+    if (!is_zip) {
+      PyObject* isfile_res = PyObject_CallMethod(member, "isfile", NULL);
+      is_file = isfile_res && PyObject_IsTrue(isfile_res);
+      Py_XDECREF(isfile_res);
+    }
+    if (name && is_file) {
+      add_archive_member(layer, name, member);
+    }
+    Py_XDECREF(name);
+    PyErr_Clear();
+  }
+  Py_DECREF(members);
+  return 1;
+}
+
+// (called from pg_initialize())
+//
+// appends the roots of base layers that we couldn't open to failed_paths
+void open_base_cache_layers(PyObject* failed_paths) {
+  if (!base_cache_paths) {
+    return;
+  }
+
+  layers = PyMem_New(BaseCacheLayer, PyList_GET_SIZE(base_cache_paths));
+  num_layers = 0;
+
+  Py_ssize_t i;
+  for (i = 0; i < PyList_GET_SIZE(base_cache_paths); i++) {
+    PyObject* path = PyList_GET_ITEM(base_cache_paths, i);
+    BaseCacheLayer* layer = &layers[num_layers];
+    memset(layer, 0, sizeof(*layer));
+
+    // absolute paths still work if the program changes directories
+    char resolved_path[PATH_MAX];
+    struct stat st;
+    int success = 0;
+    if (realpath(PyString_AsString(path), resolved_path) &&
+        (stat(resolved_path, &st) == 0)) {
+      layer->root = PyString_FromString(resolved_path);
+      if (S_ISDIR(st.st_mode)) {
+        success = 1;
+      }
+      else {
+        success = open_archive(layer);
+        if (!success) {
+          PyErr_Clear();
+        }
+      }
+    }
+
+    if (success) {
+      num_layers++;
+      PG_LOG_PRINTF("dict(event='OPEN_BASE_CACHE', root='%s', archive=%d)\n",
+                    PyString_AsString(layer->root), layer->archive != NULL);
+    }
+    else {
+      PyList_Append(failed_paths, path);
+      Py_CLEAR(layer->root);
+      Py_CLEAR(layer->archive);
+      Py_CLEAR(layer->members);
+      Py_CLEAR(layer->dirs);
+    }
+  }
+}
+
+// (called from pg_finalize())
+void close_base_cache_layers(void) {
+  int i;
+  for (i = 0; i < num_layers; i++) {
+    if (layers[i].archive) {
+      PyObject* res = PyObject_CallMethod(layers[i].archive, "close", NULL);
+      Py_XDECREF(res);
+      PyErr_Clear();
+    }
+    Py_CLEAR(layers[i].root);
+    Py_CLEAR(layers[i].archive);
+    Py_CLEAR(layers[i].members);
+    Py_CLEAR(layers[i].dirs);
+  }
+  if (layers) {
+    PyMem_Del(layers);
+    layers = NULL;
+  }
+  num_layers = 0;
+  Py_CLEAR(base_cache_paths);
+}
+
+int have_base_cache_layers(void) {
+  return (num_layers > 0);
+}
+
+
+// returns the contents of the file at path in layer (or NULL)
+static PyObject* read_from_layer(BaseCacheLayer* layer, PyObject* path) {
+  PyObject* ret = NULL;
+
+  if (layer->archive) {
+    PyObject* member = PyDict_GetItem(layer->members, path);
+    if (!member) {
+      return NULL;
+    }
+
+    if (PyObject_HasAttrString(layer->archive, "extractfile")) {
+      PyObject* f = PyObject_CallMethod(layer->archive, "extractfile", "O", member);
+      if (f) {
+        ret = PyObject_CallMethod(f, "read", NULL);
+        Py_DECREF(f);
+      }
+    }
+    else {
+      ret = PyObject_CallMethod(layer->archive, "read", "O", member);
+    }
+
+    if (!ret || !PyString_Check(ret)) {
+      PyErr_Clear();
+      Py_CLEAR(ret);
+    }
+    return ret;
+  }
+
+  PyObject* full_path = PyString_FromFormat("%s/%s",
+                                            PyString_AsString(layer->root),
+                                            PyString_AsString(path));
+  FILE* fp = fopen(PyString_AsString(full_path), "rb");
+  Py_DECREF(full_path);
+  if (!fp) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fileno(fp), &st) == 0) {
+    ret = PyString_FromStringAndSize(NULL, (Py_ssize_t)st.st_size);
+    if (ret &&
+        (fread(PyString_AS_STRING(ret), 1, (size_t)st.st_size, fp) != (size_t)st.st_size)) {
+      Py_CLEAR(ret);
+    }
+    PyErr_Clear();
+  }
+  fclose(fp);
+  return ret;
+}
+
+// returns the contents of the file at path in the first base layer
+// that has it (or NULL if none do)
+PyObject* base_cache_READ(PyObject* path) {
+  if (num_layers == 0) {
+    return NULL;
+  }
+
+  PyObject* ret = NULL;
+  path = portable_cache_path(path);
+  int i;
+  for (i = 0; (i < num_layers) && !ret; i++) {
+    ret = read_from_layer(&layers[i], path);
+  }
+  Py_DECREF(path);
+  return ret;
+}
+
+// does any base layer have a file at path?
+int base_cache_CONTAINS(PyObject* path) {
+  if (num_layers == 0) {
+    return 0;
+  }
+
+  int found = 0;
+  path = portable_cache_path(path);
+  int i;
+  for (i = 0; (i < num_layers) && !found; i++) {
+    if (layers[i].archive) {
+      found = (PyDict_GetItem(layers[i].members, path) != NULL);
+    }
+    else {
+      struct stat st;
+      PyObject* full_path = PyString_FromFormat("%s/%s",
+                                                PyString_AsString(layers[i].root),
+                                                PyString_AsString(path));
+      found = (stat(PyString_AsString(full_path), &st) == 0);
+      Py_DECREF(full_path);
+    }
+  }
+  Py_DECREF(path);
+  return found;
+}
+
+// appends the names in the directory at dir_path in all base layers
+// to names (skipping ones that are already in names)
+void base_cache_LISTDIR(PyObject* dir_path, PyObject* names) {
+  if (num_layers == 0) {
+    return;
+  }
+
+  dir_path = portable_cache_path(dir_path);
+  int i;
+  for (i = 0; i < num_layers; i++) {
+    PyObject* layer_names = PyList_New(0);
+
+    if (layers[i].archive) {
+      PyObject* name_set = PyDict_GetItem(layers[i].dirs, dir_path);
+      if (name_set) {
+        PyObject* name;
+        PyObject* it = PyObject_GetIter(name_set);
+        while ((name = PyIter_Next(it)) != NULL) {
+          PyList_Append(layer_names, name);
+          Py_DECREF(name);
+        }
+        Py_DECREF(it);
+      }
+    }
+    else {
+      PyObject* full_path = PyString_FromFormat("%s/%s",
+                                                PyString_AsString(layers[i].root),
+                                                PyString_AsString(dir_path));
+      DIR* dp = opendir(PyString_AsString(full_path));
+      Py_DECREF(full_path);
+      if (dp) {
+        struct dirent* dirp;
+        while ((dirp = readdir(dp)) != NULL) {
+          if (dirp->d_name[0] != '.') {
+            PyObject* name = PyString_FromString(dirp->d_name);
+            PyList_Append(layer_names, name);
+            Py_DECREF(name);
+          }
+        }
+        closedir(dp);
+      }
+    }
+
+    Py_ssize_t j;
+    for (j = 0; j < PyList_GET_SIZE(layer_names); j++) {
+      PyObject* name = PyList_GET_ITEM(layer_names, j);
+      if (PySequence_Contains(names, name) == 0) {
+        PyList_Append(names, name);
+      }
+    }
+    Py_DECREF(layer_names);
+  }
+  Py_DECREF(dir_path);
+}
@@ -0,0 +1,766 @@
+/* Persistent manifest of the versions in the on-disk cache
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+/* To find the version of a function's cache that matches the code of
+   this execution (see "Cache versions" in memoize_fmi.c), we'd have to
+   list its cache sub-directory and unpickle the code_dependencies.pickle
+   of every version in it, which programs that call thousands of
+   distinct small functions pay dearly for at startup.  So instead, the
+   manifest keeps track of every local version of every function:
+
+     Key: <hash of function name> (its sub-directory minus ".cache")
+     Value: dict mapping each version to [digests, mtime]
+
+   where digests is a dict mapping each function name in the version's
+   code dependencies to code_dependency_digest() of its code, and mtime
+   is when the version's code dependencies were last written, so that a
+   version can be resolved by comparing digests without touching the
+   disk at all.  It also lists the functions whose sub-directories still
+   hold entries from before there were cache versions, so that those can
+   be migrated (see "Legacy entries" in memoize_fmi.c).
+
+   The manifest lives in two files in the cache directory:
+
+     MANIFEST_FILENAME is a snapshot of the whole thing, plus a
+     generation number that changes every time the snapshot is
+     re-written
+
+     MANIFEST_JOURNAL_FILENAME starts with ("gen", generation) and then
+     lists every change made since that snapshot was written, as
+     (op, subdir_basename, version, rec) tuples, where op is "put" (rec
+     is the new [digests, mtime] of the version), "del", or "migrated"
+     (all legacy entries are gone, so there's no version or rec)
+
+   Every process appends its changes to the journal right away, while
+   holding the byte at CACHE_MANIFEST_LOCK_OFFSET in the cache lock file
+   (see memoize_fmi.c) exclusively, and reads everybody else's changes
+   from the end of the journal while holding it shared, at most once a
+   second, or whenever memoize_fmi.c refreshes a function's version
+   (see refresh_cache_version()).  At exit, the journal is folded back into the snapshot once
+   it's grown past MANIFEST_JOURNAL_COMPACT_BYTES.
+
+   If either file is missing or corrupt (e.g., in a cache directory that
+   was created by an IncPy that didn't have a manifest yet), then both
+   are rebuilt by scanning the cache directory once.  A manifest that
+   lists versions that somebody else (like
+   incpy-support-scripts/sweep_cache.py) has since erased is merely
+   stale, since looking in a version that's gone just misses, and
+   writing to it re-reads its code dependencies from disk first (which
+   drops it from the manifest).
+
+   With a non-persistent storage backend, there are no local versions on
+   disk, so there's no manifest either.
+
+   Versions that only exist in read-only base cache layers (see
+   memoize_layers.c) aren't in the manifest; instead, we remember which
+   functions have sub-directories in any base layer, and only look
+   there for those. */
+
+#include "Python.h"
+#include "memoize_manifest.h"
+#include "memoize.h"
+#include "memoize_codedep.h"
+#include "memoize_fmi.h"
+#include "memoize_layers.h"
+#include "memoize_logging.h"
+#include "memoize_storage.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define MANIFEST_FILENAME "cache_manifest.pickle"
+#define MANIFEST_JOURNAL_FILENAME "cache_manifest.journal"
+#define MANIFEST_JOURNAL_COMPACT_BYTES (64 * 1024)
+
+// initialize in open_cache_manifest(), destroy in close_cache_manifest()
+static PyObject* manifest_versions = NULL; // see above
+static PyObject* manifest_legacy = NULL;   // Key: subdir basename, Value: True
+static long manifest_generation = 0;
+
+// set of the subdir basenames of all functions that have a
+// sub-directory in any base cache layer
+static PyObject* base_layer_funcs = NULL;
+
+// Key: canonical name, Value: (its current code dependency, digest)
+static PyObject* current_digests = NULL;
+
+// is there a manifest at all? (only with a persistent storage backend)
+static char manifest_enabled = 0;
+
+// how much of which journal file we've applied so far
+static ino_t journal_ino = 0;
+static off_t journal_offset = 0;
+
+static time_t last_refresh_time = 0;
+
+
+static PyObject* manifest_file_path(char* filename) {
+  return PyString_FromFormat("%s/%s", INCPY_CACHE_DIR, filename);
+}
+
+// returns a new dict mapping each function name in deps to the digest
+// of its code dependency (or NULL if any of them can't be pickled)
+static PyObject* digest_code_dependencies(PyObject* deps) {
+  PyObject* digests = PyDict_New();
+  PyObject* name = NULL;
+  PyObject* dep = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(deps, &pos, &name, &dep)) {
+    PyObject* cached = PyDict_GetItem(current_digests, name);
+    PyObject* digest = NULL;
+    if (cached && (PyTuple_GET_ITEM(cached, 0) == dep)) {
+      digest = PyTuple_GET_ITEM(cached, 1);
+      Py_INCREF(digest);
+    }
+    else {
+      digest = code_dependency_digest(dep);
+    }
+
+    if (!digest) {
+      Py_DECREF(digests);
+      return NULL;
+    }
+    PyDict_SetItem(digests, name, digest);
+    Py_DECREF(digest);
+  }
+  return digests;
+}
+
+// the digest of the code of name in this execution (borrowed
+// reference, or NULL if name's code hasn't been loaded)
+static PyObject* current_digest(PyObject* name) {
+  PyObject* dep = PyDict_GetItem(func_name_to_code_dependency, name);
+  if (!dep) {
+    return NULL;
+  }
+
+  // (a re-defined function gets a new code dependency object)
+  PyObject* cached = PyDict_GetItem(current_digests, name);
+  if (cached && (PyTuple_GET_ITEM(cached, 0) == dep)) {
+    return PyTuple_GET_ITEM(cached, 1);
+  }
+
+  PyObject* digest = code_dependency_digest(dep);
+  if (!digest) {
+    return NULL;
+  }
+  cached = PyTuple_Pack(2, dep, digest);
+  Py_DECREF(digest);
+  PyDict_SetItem(current_digests, name, cached);
+  Py_DECREF(cached);
+  return PyTuple_GET_ITEM(cached, 1);
+}
+
+int cache_manifest_digests_unchanged(PyObject* digests) {
+  PyObject* name = NULL;
+  PyObject* digest = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(digests, &pos, &name, &digest)) {
+    PyObject* cur = current_digest(name);
+    if (!cur || !_PyString_Eq(cur, digest)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// returns a new dict mapping each function name in digests to its
+// current code dependency (call only if cache_manifest_digests_unchanged())
+PyObject* cache_manifest_current_deps(PyObject* digests) {
+  PyObject* deps = PyDict_New();
+  PyObject* name = NULL;
+  PyObject* digest = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(digests, &pos, &name, &digest)) {
+    PyObject* dep = PyDict_GetItem(func_name_to_code_dependency, name);
+    assert(dep);
+    PyDict_SetItem(deps, name, dep);
+  }
+  return deps;
+}
+
+
+// splits "<cache dir>/<subdir basename>.cache/<version>" (returns 0 if
+// version_path doesn't look like that)
+static int split_version_path(PyObject* version_path,
+                              PyObject** subdir_basename, PyObject** version) {
+  char* path_str = PyString_AsString(version_path);
+  char* slash = strrchr(path_str, '/');
+  if (!slash || (slash - path_str < 7) || (strncmp(slash - 6, ".cache", 6) != 0)) {
+    return 0;
+  }
+  char* basename_start = slash - 6;
+  while ((basename_start > path_str) && (basename_start[-1] != '/')) {
+    basename_start--;
+  }
+
+  *subdir_basename = PyString_FromStringAndSize(basename_start, slash - 6 - basename_start);
+  *version = PyString_FromString(slash + 1);
+  return 1;
+}
+
+static int valid_version_rec(PyObject* rec) {
+  return PyList_CheckExact(rec) && (PyList_GET_SIZE(rec) == 2) &&
+         PyDict_CheckExact(PyList_GET_ITEM(rec, 0)) &&
+         PyInt_Check(PyList_GET_ITEM(rec, 1));
+}
+
+// applies one journal record to the manifest in memory (returns 0 if
+// it's malformed)
+static int apply_journal_record(PyObject* record) {
+  if (!PyTuple_CheckExact(record) || (PyTuple_GET_SIZE(record) != 4) ||
+      !PyString_CheckExact(PyTuple_GET_ITEM(record, 0)) ||
+      !PyString_CheckExact(PyTuple_GET_ITEM(record, 1))) {
+    return 0;
+  }
+
+  char* op = PyString_AsString(PyTuple_GET_ITEM(record, 0));
+  PyObject* subdir_basename = PyTuple_GET_ITEM(record, 1);
+  PyObject* version = PyTuple_GET_ITEM(record, 2);
+  PyObject* rec = PyTuple_GET_ITEM(record, 3);
+
+  if (strcmp(op, "put") == 0) {
+    if (!PyString_CheckExact(version) || !valid_version_rec(rec)) {
+      return 0;
+    }
+    PyObject* func_versions = PyDict_GetItem(manifest_versions, subdir_basename);
+    if (!func_versions) {
+      func_versions = PyDict_New();
+      PyDict_SetItem(manifest_versions, subdir_basename, func_versions);
+      Py_DECREF(func_versions);
+    }
+    PyDict_SetItem(func_versions, version, rec);
+  }
+  else if (strcmp(op, "del") == 0) {
+    PyObject* func_versions = PyDict_GetItem(manifest_versions, subdir_basename);
+    if (func_versions && PyString_CheckExact(version) &&
+        PyDict_GetItem(func_versions, version)) {
+      PyDict_DelItem(func_versions, version);
+      if (PyDict_Size(func_versions) == 0) {
+        PyDict_DelItem(manifest_versions, subdir_basename);
+      }
+    }
+  }
+  else if (strcmp(op, "migrated") == 0) {
+    if (PyDict_GetItem(manifest_legacy, subdir_basename)) {
+      PyDict_DelItem(manifest_legacy, subdir_basename);
+    }
+  }
+  else {
+    return 0;
+  }
+  return 1;
+}
+
+// applies the records in the journal from journal_offset on (or checks
+// its generation first if journal_offset is 0), returning 0 if it's
+// missing, corrupt, or from another generation
+//
+// (call while holding the manifest lock)
+static int read_journal(void) {
+  PyObject* journal_path = manifest_file_path(MANIFEST_JOURNAL_FILENAME);
+  PyObject* jf = PyFile_FromString(PyString_AsString(journal_path), "rb");
+  Py_DECREF(journal_path);
+  if (!jf) {
+    PyErr_Clear();
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fileno(PyFile_AsFile(jf)), &st) != 0) {
+    Py_DECREF(jf);
+    return 0;
+  }
+
+  int success = 1;
+  off_t pos = 0;
+  if (journal_offset == 0) {
+    PyObject* header = PyObject_CallFunctionObjArgs(cPickle_load_func, jf, NULL);
+    success = (header && PyTuple_CheckExact(header) && (PyTuple_GET_SIZE(header) == 2) &&
+               PyInt_Check(PyTuple_GET_ITEM(header, 1)) &&
+               (PyInt_AsLong(PyTuple_GET_ITEM(header, 1)) == manifest_generation));
+    Py_XDECREF(header);
+  }
+  else if (fseeko(PyFile_AsFile(jf), journal_offset, SEEK_SET) != 0) {
+    success = 0;
+  }
+
+  while (success) {
+    pos = ftello(PyFile_AsFile(jf));
+    if (pos >= st.st_size) {
+      break;
+    }
+    PyObject* record = PyObject_CallFunctionObjArgs(cPickle_load_func, jf, NULL);
+    success = (record && apply_journal_record(record));
+    Py_XDECREF(record);
+  }
+
+  if (PyErr_Occurred()) {
+    PyErr_Clear();
+  }
+  Py_DECREF(jf);
+
+  if (success) {
+    journal_ino = st.st_ino;
+    journal_offset = pos;
+  }
+  return success;
+}
+
+// loads the snapshot and applies the journal to it, returning 0 if
+// either one is missing or corrupt
+//
+// (call while holding the manifest lock)
+static int load_manifest(void) {
+  PyDict_Clear(manifest_versions);
+  PyDict_Clear(manifest_legacy);
+  manifest_generation = 0;
+  journal_ino = 0;
+  journal_offset = 0;
+
+  PyObject* snapshot_path = manifest_file_path(MANIFEST_FILENAME);
+  PyObject* pf = PyFile_FromString(PyString_AsString(snapshot_path), "rb");
+  Py_DECREF(snapshot_path);
+  if (!pf) {
+    PyErr_Clear();
+    return 0;
+  }
+  PyObject* snapshot = PyObject_CallFunctionObjArgs(cPickle_load_func, pf, NULL);
+  Py_DECREF(pf);
+  if (!snapshot) {
+    PyErr_Clear();
+    return 0;
+  }
+
+  PyObject* generation = PyDict_Check(snapshot) ?
+    PyDict_GetItemString(snapshot, "generation") : NULL;
+  PyObject* versions = PyDict_Check(snapshot) ?
+    PyDict_GetItemString(snapshot, "versions") : NULL;
+  PyObject* legacy = PyDict_Check(snapshot) ?
+    PyDict_GetItemString(snapshot, "legacy") : NULL;
+  int success = (generation && PyInt_Check(generation) &&
+                 versions && PyDict_CheckExact(versions) &&
+                 legacy && PyDict_CheckExact(legacy));
+
+  // weed out malformed records, just to be safe
+  PyObject* subdir_basename = NULL;
+  PyObject* func_versions = NULL;
+  Py_ssize_t pos = 0;
+  while (success && PyDict_Next(versions, &pos, &subdir_basename, &func_versions)) {
+    PyObject* version = NULL;
+    PyObject* rec = NULL;
+    Py_ssize_t rec_pos = 0;
+    success = PyDict_CheckExact(func_versions);
+    while (success && PyDict_Next(func_versions, &rec_pos, &version, &rec)) {
+      success = valid_version_rec(rec);
+    }
+  }
+
+  if (success) {
+    manifest_generation = PyInt_AsLong(generation);
+    PyDict_Update(manifest_versions, versions);
+    PyDict_Update(manifest_legacy, legacy);
+    success = read_journal();
+  }
+  Py_DECREF(snapshot);
+  return success;
+}
+
+// atomically replaces the file in the cache directory with a pickle of
+// obj, returning 1 on success
+static int write_manifest_file(char* filename, PyObject* obj) {
+  PyObject* path = manifest_file_path(filename);
+  PyObject* tmp_path =
+    PyString_FromFormat("%s.partial.%d", PyString_AsString(path), (int)getpid());
+  int success = 0;
+  PyObject* outfile = PyFile_FromString(PyString_AsString(tmp_path), "wb");
+  if (outfile) {
+    PyObject* negative_one = PyInt_FromLong(-1);
+    PyObject* dump_res =
+      PyObject_CallFunctionObjArgs(cPickle_dump_func, obj, outfile, negative_one, NULL);
+    Py_DECREF(negative_one);
+    Py_DECREF(outfile);
+    if (dump_res) {
+      Py_DECREF(dump_res);
+      success = (rename(PyString_AsString(tmp_path), PyString_AsString(path)) == 0);
+    }
+    else {
+      PyErr_Clear();
+      unlink(PyString_AsString(tmp_path));
+    }
+  }
+  else {
+    PyErr_Clear();
+  }
+  Py_DECREF(tmp_path);
+  Py_DECREF(path);
+  return success;
+}
+
+// writes the manifest in memory out as a new snapshot with an empty
+// journal (call while holding the manifest lock exclusively)
+static void write_manifest(void) {
+  // a new generation number that nobody else could've picked
+  manifest_generation = (long)(((unsigned long)time(NULL) << 16) ^ (unsigned long)getpid());
+  manifest_generation &= 0x7fffffffL;
+
+  PyObject* generation = PyInt_FromLong(manifest_generation);
+  PyObject* snapshot = PyDict_New();
+  PyDict_SetItemString(snapshot, "generation", generation);
+  PyDict_SetItemString(snapshot, "versions", manifest_versions);
+  PyDict_SetItemString(snapshot, "legacy", manifest_legacy);
+  PyObject* header = Py_BuildValue("(sO)", "gen", generation);
+
+  // (the snapshot first, since a journal from another generation makes
+  //  the whole manifest look corrupt, so it gets rebuilt)
+  if (write_manifest_file(MANIFEST_FILENAME, snapshot) &&
+      write_manifest_file(MANIFEST_JOURNAL_FILENAME, header)) {
+    struct stat st;
+    PyObject* journal_path = manifest_file_path(MANIFEST_JOURNAL_FILENAME);
+    if (stat(PyString_AsString(journal_path), &st) == 0) {
+      journal_ino = st.st_ino;
+      journal_offset = st.st_size;
+    }
+    Py_DECREF(journal_path);
+  }
+
+  Py_DECREF(header);
+  Py_DECREF(snapshot);
+  Py_DECREF(generation);
+}
+
+// returns the unpickled contents of path (or NULL on any error)
+static PyObject* load_pickle_file(char* path) {
+  PyObject* pf = PyFile_FromString(path, "rb");
+  if (!pf) {
+    PyErr_Clear();
+    return NULL;
+  }
+  PyObject* ret = PyObject_CallFunctionObjArgs(cPickle_load_func, pf, NULL);
+  Py_DECREF(pf);
+  if (!ret) {
+    PyErr_Clear();
+  }
+  return ret;
+}
+
+// adds all versions and legacy entries in the function's cache
+// sub-directory named subdir_name to the manifest in memory
+static void scan_cache_subdirectory(char* subdir_name) {
+  PyObject* subdir_path = PyString_FromFormat("%s/%s", INCPY_CACHE_DIR, subdir_name);
+  DIR* dp = opendir(PyString_AsString(subdir_path));
+  if (!dp) {
+    Py_DECREF(subdir_path);
+    return;
+  }
+
+  PyObject* subdir_basename =
+    PyString_FromStringAndSize(subdir_name, strlen(subdir_name) - strlen(".cache"));
+  struct dirent* dirp;
+  while ((dirp = readdir(dp)) != NULL) {
+    if (dirp->d_name[0] == '.') {
+      continue;
+    }
+
+    // (see list_local_cache_versions() in memoize_fmi.c)
+    char* dot = strchr(dirp->d_name, '.');
+    if (dot) {
+      if (strcmp(dot, ".pickle") == 0) {
+        PyDict_SetItem(manifest_legacy, subdir_basename, Py_True);
+      }
+      continue;
+    }
+
+    PyObject* deps_path =
+      PyString_FromFormat("%s/%s/" CODE_DEPS_FILENAME, PyString_AsString(subdir_path),
+                          dirp->d_name);
+    PyObject* deps = load_pickle_file(PyString_AsString(deps_path));
+    PyObject* digests = (deps && PyDict_CheckExact(deps)) ?
+      digest_code_dependencies(deps) : NULL;
+    struct stat st;
+    if (digests && (stat(PyString_AsString(deps_path), &st) == 0)) {
+      PyObject* version = PyString_FromString(dirp->d_name);
+      PyObject* rec = Py_BuildValue("[Ol]", digests, (long)st.st_mtime);
+      PyObject* record = Py_BuildValue("(sOOO)", "put", subdir_basename, version, rec);
+      apply_journal_record(record);
+      Py_DECREF(record);
+      Py_DECREF(rec);
+      Py_DECREF(version);
+    }
+    Py_XDECREF(digests);
+    Py_XDECREF(deps);
+    Py_DECREF(deps_path);
+  }
+  closedir(dp);
+
+  Py_DECREF(subdir_basename);
+  Py_DECREF(subdir_path);
+}
+
+// rebuilds the manifest from scratch by scanning the cache directory
+static void rebuild_manifest(void) {
+  lock_cache_manifest(1);
+
+  // (somebody else might have just done it)
+  if (!load_manifest()) {
+    PyDict_Clear(manifest_versions);
+    PyDict_Clear(manifest_legacy);
+
+    DIR* dp = opendir(INCPY_CACHE_DIR);
+    if (dp) {
+      struct dirent* dirp;
+      while ((dirp = readdir(dp)) != NULL) {
+        char* dot = strrchr(dirp->d_name, '.');
+        if (dot && (dot != dirp->d_name) && (strcmp(dot, ".cache") == 0)) {
+          scan_cache_subdirectory(dirp->d_name);
+        }
+      }
+      closedir(dp);
+    }
+
+    write_manifest();
+
+    PG_LOG_PRINTF("dict(event='REBUILD_CACHE_MANIFEST', num_funcs=%ld)\n",
+                  (long)PyDict_Size(manifest_versions));
+  }
+
+  unlock_cache_manifest();
+}
+
+// (called from pg_initialize(), after the storage backend is opened)
+void open_cache_manifest(void) {
+  assert(!manifest_versions);
+  manifest_versions = PyDict_New();
+  manifest_legacy = PyDict_New();
+  current_digests = PyDict_New();
+  base_layer_funcs = PySet_New(NULL);
+
+  PyObject* names = PyList_New(0);
+  base_cache_LISTDIR(incpy_cache_dir, names);
+  Py_ssize_t i;
+  for (i = 0; i < PyList_GET_SIZE(names); i++) {
+    char* name = PyString_AsString(PyList_GET_ITEM(names, i));
+    char* dot = strrchr(name, '.');
+    if (dot && (dot != name) && (strcmp(dot, ".cache") == 0)) {
+      PyObject* subdir_basename = PyString_FromStringAndSize(name, dot - name);
+      PySet_Add(base_layer_funcs, subdir_basename);
+      Py_DECREF(subdir_basename);
+    }
+  }
+  Py_DECREF(names);
+
+  manifest_enabled = memo_storage->is_persistent;
+  last_refresh_time = time(NULL);
+
+  // it's perfectly fine if the cache directory doesn't exist yet (the
+  // manifest gets created along with the first version)
+  struct stat st;
+  if (!manifest_enabled || (stat(INCPY_CACHE_DIR, &st) != 0)) {
+    return;
+  }
+
+  lock_cache_manifest(0);
+  int loaded = load_manifest();
+  unlock_cache_manifest();
+  if (!loaded) {
+    rebuild_manifest();
+  }
+
+  PG_LOG_PRINTF("dict(event='CACHE_MANIFEST', num_funcs=%ld)\n",
+                (long)PyDict_Size(manifest_versions));
+}
+
+// (called from pg_finalize())
+void close_cache_manifest(void) {
+  struct stat st;
+  PyObject* journal_path = manifest_file_path(MANIFEST_JOURNAL_FILENAME);
+  if (manifest_enabled && (stat(PyString_AsString(journal_path), &st) == 0) &&
+      (st.st_size > MANIFEST_JOURNAL_COMPACT_BYTES)) {
+    lock_cache_manifest(1);
+    if (load_manifest() && (journal_offset > MANIFEST_JOURNAL_COMPACT_BYTES)) {
+      write_manifest();
+    }
+    unlock_cache_manifest();
+  }
+  Py_DECREF(journal_path);
+
+  Py_CLEAR(manifest_versions);
+  Py_CLEAR(manifest_legacy);
+  Py_CLEAR(current_digests);
+  Py_CLEAR(base_layer_funcs);
+  manifest_enabled = 0;
+  journal_ino = 0;
+  journal_offset = 0;
+}
+
+void cache_manifest_REFRESH(void) {
+  if (!manifest_enabled) {
+    return;
+  }
+  last_refresh_time = time(NULL);
+
+  // (don't even open the journal if it hasn't changed)
+  struct stat st;
+  PyObject* journal_path = manifest_file_path(MANIFEST_JOURNAL_FILENAME);
+  int same_journal = (stat(PyString_AsString(journal_path), &st) == 0) &&
+                     (st.st_ino == journal_ino);
+  Py_DECREF(journal_path);
+  if (same_journal && (st.st_size == journal_offset)) {
+    return;
+  }
+
+  lock_cache_manifest(0);
+  int success = 0;
+  if (same_journal) {
+    success = read_journal();
+  }
+  // (somebody folded the journal into a new snapshot)
+  if (!success) {
+    success = load_manifest();
+  }
+  unlock_cache_manifest();
+
+  if (!success) {
+    rebuild_manifest();
+  }
+}
+
+static void maybe_refresh(void) {
+  if (manifest_enabled && (time(NULL) != last_refresh_time)) {
+    cache_manifest_REFRESH();
+  }
+}
+
+int cache_manifest_HAS_FUNC(PyObject* subdir_basename) {
+  maybe_refresh();
+  return (PyDict_GetItem(manifest_versions, subdir_basename) != NULL) ||
+         (PyDict_GetItem(manifest_legacy, subdir_basename) != NULL) ||
+         (PySet_Contains(base_layer_funcs, subdir_basename) == 1);
+}
+
+// returns a borrowed reference to the dict of the function's local
+// versions (see above), or NULL if it has none
+PyObject* cache_manifest_VERSIONS(PyObject* subdir_basename) {
+  maybe_refresh();
+  return PyDict_GetItem(manifest_versions, subdir_basename);
+}
+
+int cache_manifest_HAS_LEGACY_ENTRIES(PyObject* subdir_basename) {
+  return (PyDict_GetItem(manifest_legacy, subdir_basename) != NULL);
+}
+
+int cache_manifest_IN_BASE_LAYERS(PyObject* subdir_basename) {
+  return (PySet_Contains(base_layer_funcs, subdir_basename) == 1);
+}
+
+
+// appends record to the journal and applies it in memory
+static void append_journal_record(PyObject* record) {
+  if (!manifest_enabled) {
+    return;
+  }
+  apply_journal_record(record);
+
+  PyObject* negative_one = PyInt_FromLong(-1);
+  PyObject* record_str =
+    PyObject_CallFunctionObjArgs(cPickle_dumpstr_func, record, negative_one, NULL);
+  Py_DECREF(negative_one);
+  if (!record_str) {
+    PyErr_Clear();
+    return;
+  }
+
+  lock_cache_manifest(1);
+  PyObject* journal_path = manifest_file_path(MANIFEST_JOURNAL_FILENAME);
+  int fd = open(PyString_AsString(journal_path), O_WRONLY | O_APPEND);
+  Py_DECREF(journal_path);
+  if (fd >= 0) {
+    char* buf = PyString_AS_STRING(record_str);
+    Py_ssize_t n = PyString_GET_SIZE(record_str);
+    while (n > 0) {
+      ssize_t written = write(fd, buf, n);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      buf += written;
+      n -= written;
+    }
+    close(fd);
+    unlock_cache_manifest();
+  }
+  else {
+    // there's no manifest yet (e.g., because this is the very first
+    // version in a fresh cache directory), so create one, which will
+    // include this change since it's already on disk
+    unlock_cache_manifest();
+    rebuild_manifest();
+  }
+  Py_DECREF(record_str);
+}
+
+// (called after the code dependencies of the local version at
+// version_path were written)
+void cache_manifest_note_version(PyObject* version_path, PyObject* deps) {
+  PyObject* subdir_basename;
+  PyObject* version;
+  if (!manifest_enabled || !split_version_path(version_path, &subdir_basename, &version)) {
+    return;
+  }
+
+  PyObject* digests = digest_code_dependencies(deps);
+  if (digests) {
+    PyObject* rec = Py_BuildValue("[Nl]", digests, (long)time(NULL));
+    PyObject* record = Py_BuildValue("(sOOO)", "put", subdir_basename, version, rec);
+    append_journal_record(record);
+    Py_DECREF(record);
+    Py_DECREF(rec);
+  }
+  Py_DECREF(version);
+  Py_DECREF(subdir_basename);
+}
+
+// (called after the local version at version_path was erased or
+// tombstoned)
+void cache_manifest_note_version_gone(PyObject* version_path) {
+  PyObject* subdir_basename;
+  PyObject* version;
+  if (!manifest_enabled || !split_version_path(version_path, &subdir_basename, &version)) {
+    return;
+  }
+
+  // (don't bother other processes with versions we never knew about)
+  PyObject* func_versions = PyDict_GetItem(manifest_versions, subdir_basename);
+  if (func_versions && PyDict_GetItem(func_versions, version)) {
+    PyObject* record = Py_BuildValue("(sOOO)", "del", subdir_basename, version, Py_None);
+    append_journal_record(record);
+    Py_DECREF(record);
+  }
+  Py_DECREF(version);
+  Py_DECREF(subdir_basename);
+}
+
+// (called after all legacy entries of a function were migrated)
+void cache_manifest_note_legacy_migrated(PyObject* subdir_basename) {
+  if (!cache_manifest_HAS_LEGACY_ENTRIES(subdir_basename)) {
+    return;
+  }
+  PyObject* record = Py_BuildValue("(sOOO)", "migrated", subdir_basename, Py_None, Py_None);
+  append_journal_record(record);
+  Py_DECREF(record);
+}
@@ -12,6 +12,7 @@
 #include "memoize.h"
 #include "memoize_logging.h"
 #include "memoize_reachability.h"
+#include "structmember.h"
 
 /* Optimization:
 
@@ -47,6 +48,110 @@
 PyObject* global_containment_intern_cache = NULL;
 
 
+/* Every read of a module attribute (e.g., mod.x) calls
+   extend_with_attrname(), which used to build a new tuple and look it
+   up in global_containment_intern_cache just to find the interned
+   tuple that it got last time.  So we remember the result for each
+   (parent container, attrname) pair in a direct-mapped cache of
+   pointer pairs, where a collision simply evicts the older pair.
+
+   Each entry owns references to its container and attrname so that
+   neither can be freed (and its address reused by another object)
+   while the entry refers to it. */
+typedef struct {
+  PyObject* container; // NULL if the slot is empty
+  PyObject* attrname;
+  PyObject* extended; // the interned extended tuple
+} AttrnameCacheEntry;
+
+#define ATTRNAME_CACHE_SIZE 4096 // must be a power of 2
+
+static AttrnameCacheEntry* attrname_cache = NULL;
+
+#define ATTRNAME_CACHE_ENTRY(container, attrname) \
+  (attrname_cache[(((Py_uintptr_t)(container) >> 4) ^ \
+                   ((Py_uintptr_t)(attrname) >> 3)) & \
+                  (ATTRNAME_CACHE_SIZE - 1)])
+
+
+/* Maps the filename in the first element of a global variable name
+   tuple to the (interned) name of the module that it's defined in,
+   since find_globally_reachable_obj_by_name() needs that for every
+   global read from another module each time a frame exits, and it
+   only depends on the filename. */
+static PyObject* module_name_cache = NULL;
+
+
+void init_reachability_caches(void) {
+  attrname_cache = PyMem_New(AttrnameCacheEntry, ATTRNAME_CACHE_SIZE);
+  if (attrname_cache) {
+    memset(attrname_cache, 0, ATTRNAME_CACHE_SIZE * sizeof(*attrname_cache));
+  }
+
+  module_name_cache = PyDict_New();
+}
+
+void free_reachability_caches(void) {
+  if (attrname_cache) {
+    int i;
+    for (i = 0; i < ATTRNAME_CACHE_SIZE; i++) {
+      Py_XDECREF(attrname_cache[i].container);
+      Py_XDECREF(attrname_cache[i].attrname);
+      Py_XDECREF(attrname_cache[i].extended);
+    }
+    PyMem_Free(attrname_cache);
+    attrname_cache = NULL;
+  }
+
+  Py_CLEAR(module_name_cache);
+}
+
+
+// our simple-ass algorithm is to take the LAST component of the
+// path and strip off the '.' extension.
+//
+// This assumes POSIX-style paths with '/' separators, so it might
+// not work on Windows systems ;)
+//
+// e.g., convert '/Users/pgbovine/Desktop/my_module.pyc' into my_module
+//
+// returns a borrowed reference (or NULL with an exception set)
+static PyObject* module_name_for_filename(PyObject* filename) {
+  PyObject* ret = NULL;
+  if (module_name_cache) {
+    ret = PyDict_GetItem(module_name_cache, filename);
+    if (ret) {
+      return ret;
+    }
+  }
+
+  char* path = PyString_AsString(filename);
+  char* basename = strrchr(path, '/');
+  basename = basename ? basename + 1 : path;
+  char* extension = strchr(basename, '.');
+  assert(extension); // should be name.extension
+
+  ret = PyString_FromStringAndSize(basename,
+                                   extension ? extension - basename
+                                             : strlen(basename));
+  if (!ret) {
+    return NULL;
+  }
+  // (so that looking it up in f_globals compares pointers)
+  PyString_InternInPlace(&ret);
+
+  if (!module_name_cache ||
+      PyDict_SetItem(module_name_cache, filename, ret) < 0) {
+    PyErr_Clear();
+    // (nobody else has a reference to hold it for us)
+    Py_DECREF(ret);
+    return NULL;
+  }
+  Py_DECREF(ret); // module_name_cache holds the only reference
+  return ret;
+}
+
+
 /* Looks up the value of a global variable using cur_frame as a starting
    point for the search.
   
@@ -80,38 +185,28 @@ PyObject* find_globally_reachable_obj_by_name(PyObject* varname_tuple,
 
   // if the filename is the SAME as cur_frame, then we can use
   // cur_frame->f_globals as the basis for our look-up
-  if (_PyString_Eq(filename, cur_frame->f_code->co_filename)) {
+  // (filename is relocatable; see pg_relocatable_path())
+  PyObject* cur_filename = pg_relocatable_path(cur_frame->f_code->co_filename);
+  if (!cur_filename) {
+    PyErr_Clear();
+    cur_filename = cur_frame->f_code->co_filename;
+  }
+  if (_PyString_Eq(filename, cur_filename)) {
     globals_dict = cur_frame->f_globals;
   }
   else {
     // otherwise, we have to look up the module associated with filename
     // and use f_globals from that module
-
-    // our simple-ass algorithm is to take the LAST component of the
-    // path and strip off the '.' extension.
-    //
-    // This assumes POSIX-style paths with '/' separators, so it might
-    // not work on Windows systems ;)
-    // 
-    // e.g., convert '/Users/pgbovine/Desktop/my_module.pyc' into my_module
-    PyObject* path_components_lst = PyObject_CallMethod(filename, "split", "s", "/");
-    Py_ssize_t len = PyList_Size(path_components_lst);
-    assert(len > 0);
-    PyObject* basename = PyList_GET_ITEM(path_components_lst, len - 1); // does NOT incref
-
-    PyObject* external_module_name_lst = PyObject_CallMethod(basename, "split", "s", ".");
-
-    assert(PyList_Size(external_module_name_lst) == 2); // should be name.extension
-
-    PyObject* external_module_name = PyList_GET_ITEM(external_module_name_lst, 0); // does NOT incref
+    PyObject* external_module_name = module_name_for_filename(filename);
+    if (!external_module_name) {
+      PyErr_Clear();
+      return NULL;
+    }
 
     // start at cur_frame->f_globals and look up external_module_name.
     // we BETTER find this module, or else we must return NULL for FAIL!
     PyObject* external_module = PyDict_GetItem(cur_frame->f_globals, external_module_name);
 
-    Py_DECREF(external_module_name_lst);
-    Py_DECREF(path_components_lst);
-
     // if we can't find a module with that name, then simply defer back
     // to using cur_frame->f_globals in the hopes that the symbol was
     // imported into cur_frame's namespace via a "from <MODULE> import X"
@@ -138,6 +233,18 @@ PyObject* find_globally_reachable_obj_by_name(PyObject* varname_tuple,
   // start at 2, since 0 is the filename and 1 is cur_attrname!
   for (i = 2; i < len; i++) {
     cur_attrname = PyTuple_GetItem(varname_tuple, i);
+
+    // the rest of the elements come from extend_with_attrname(), which
+    // only names attributes of modules, so look in the module's dict
+    // directly rather than going through the generic getattr machinery
+    if (PyModule_CheckExact(ret)) {
+      PyObject* val = PyDict_GetItem(PyModule_GetDict(ret), cur_attrname);
+      if (val) {
+        ret = val;
+        continue;
+      }
+    }
+
     ret = PyObject_GetAttr(ret, cur_attrname);
 
     // if at any time can't find an attribute, then PUNT!
@@ -208,6 +315,14 @@ PyObject* extend_with_attrname(PyObject* parent, PyObject* attrname) {
   PyObject* parent_container = get_global_container(parent);
   assert(parent_container && PyTuple_CheckExact(parent_container));
 
+  AttrnameCacheEntry* entry = NULL;
+  if (attrname_cache) {
+    entry = &ATTRNAME_CACHE_ENTRY(parent_container, attrname);
+    if (entry->container == parent_container && entry->attrname == attrname) {
+      return entry->extended;
+    }
+  }
+
   PyObject* result = extend_tuple(parent_container, attrname);
   assert(result);
 
@@ -218,6 +333,23 @@ PyObject* extend_with_attrname(PyObject* parent, PyObject* attrname) {
   }
   Py_DECREF(result);
 
+  if (entry) {
+    PyObject* old_container = entry->container;
+    PyObject* old_attrname = entry->attrname;
+    PyObject* old_extended = entry->extended;
+
+    Py_INCREF(parent_container);
+    Py_INCREF(attrname);
+    Py_INCREF(interned_result);
+    entry->container = parent_container;
+    entry->attrname = attrname;
+    entry->extended = interned_result;
+
+    Py_XDECREF(old_container);
+    Py_XDECREF(old_attrname);
+    Py_XDECREF(old_extended);
+  }
+
   return interned_result;
 }
 
@@ -253,7 +385,7 @@ void update_arg_reachable_func_start_time(PyObject* parent, PyObject* child) {
     return;
   }
 
-  unsigned int parent_start_time = get_arg_reachable_func_start_time(parent);
+  unsigned PY_LONG_LONG parent_start_time = get_arg_reachable_func_start_time(parent);
 
   if (parent_start_time) {
     set_arg_reachable_func_start_time(child, parent_start_time);
@@ -261,73 +393,180 @@ void update_arg_reachable_func_start_time(PyObject* parent, PyObject* child) {
 }
 
 
-// returns 1 iff obj contains within it a MUTABLE object that
-// existed before the invocation of frame f, 0 otherwise
-//
-// TODO: this will TOTALLY infinite-loop on an object with circular
-// references ... let's deal with this later!!!
-int contains_externally_aliased_mutable_obj(PyObject* obj, PyFrameObject* f) {
+/* contains_externally_aliased_mutable_obj() walks the whole object
+   graph of a return value, which might be huge, deeply nested, or
+   cyclic, so rather than recursing, it keeps an explicit stack of
+   objects still to check, and a set of the addresses of objects that
+   it has already checked, so that it looks at each object only once.
+
+   It never runs any Python code while it walks, so nothing can be
+   freed out from under it and borrowed references are fine. */
+
+#define WALK_INITIAL_SIZE 64 // must be a power of 2
+
+typedef struct {
+  PyObject** stack;
+  Py_ssize_t stack_size;
+  Py_ssize_t stack_allocated;
+
+  // open-addressed set of object addresses (0 means an empty slot)
+  Py_uintptr_t* visited;
+  size_t visited_mask;
+  size_t visited_used;
+
+  // small walks (the common case) don't need to malloc anything
+  PyObject* initial_stack[WALK_INITIAL_SIZE];
+  Py_uintptr_t initial_visited[WALK_INITIAL_SIZE];
+} ObjectWalk;
+
+static void walk_init(ObjectWalk* w) {
+  w->stack = w->initial_stack;
+  w->stack_size = 0;
+  w->stack_allocated = WALK_INITIAL_SIZE;
+
+  w->visited = w->initial_visited;
+  w->visited_mask = WALK_INITIAL_SIZE - 1;
+  w->visited_used = 0;
+  memset(w->initial_visited, 0, sizeof(w->initial_visited));
+}
+
+static void walk_free(ObjectWalk* w) {
+  if (w->stack != w->initial_stack) {
+    PyMem_Free(w->stack);
+  }
+  if (w->visited != w->initial_visited) {
+    PyMem_Free(w->visited);
+  }
+}
+
+// returns 0 on success, -1 if out of memory
+static int walk_push(ObjectWalk* w, PyObject* obj) {
+  // (an easy filter that keeps most leaves off of the stack)
   if (DEFINITELY_IMMUTABLE(obj)) {
     return 0;
   }
 
-  // this is a hacky-hack ... tuples are immutable, so we don't need
-  // to check their creation time.  however, they can hold mutable
-  // elements, so we still need to traverse inside of them.
-  // e.g., ([1, 2], [3]) is a legal tuple
-  //
-  // tuples can appear as constants in function code (co_consts),
-  // so those are actually created BEFORE a function is called but
-  // are harmless since they can't contain mutable items inside.
-  if (!PyTuple_CheckExact(obj)) {
-
-    // if it's globally-reachable, then return 1
-    if (get_global_container(obj)) {
-      return 1;
+  if (w->stack_size == w->stack_allocated) {
+    Py_ssize_t new_allocated = w->stack_allocated * 2;
+    PyObject** new_stack = PyMem_New(PyObject*, new_allocated);
+    if (!new_stack) {
+      return -1;
     }
+    memcpy(new_stack, w->stack, w->stack_size * sizeof(PyObject*));
+    if (w->stack != w->initial_stack) {
+      PyMem_Free(w->stack);
+    }
+    w->stack = new_stack;
+    w->stack_allocated = new_allocated;
+  }
+
+  w->stack[w->stack_size++] = obj;
+  return 0;
+}
+
+static Py_uintptr_t* walk_visited_slot(Py_uintptr_t* table, size_t mask,
+                                       Py_uintptr_t key) {
+  size_t i = (size_t)((key >> 4) ^ (key >> 12)) & mask;
+  while (table[i] && table[i] != key) {
+    i = (i + 1) & mask;
+  }
+  return &table[i];
+}
+
+// returns 1 if obj was newly added to the visited set, 0 if it was
+// already in there, or -1 if out of memory
+static int walk_visit(ObjectWalk* w, PyObject* obj) {
+  Py_uintptr_t key = (Py_uintptr_t)obj;
+  Py_uintptr_t* slot = walk_visited_slot(w->visited, w->visited_mask, key);
+  if (*slot) {
+    return 0;
+  }
+
+  // keep the table at most 2/3 full
+  if ((w->visited_used + 1) * 3 >= (w->visited_mask + 1) * 2) {
+    size_t new_size = (w->visited_mask + 1) * 4;
+    Py_uintptr_t* new_table = PyMem_New(Py_uintptr_t, new_size);
+    if (!new_table) {
+      return -1;
+    }
+    memset(new_table, 0, new_size * sizeof(Py_uintptr_t));
+
+    size_t i;
+    for (i = 0; i <= w->visited_mask; i++) {
+      if (w->visited[i]) {
+        *walk_visited_slot(new_table, new_size - 1, w->visited[i]) = w->visited[i];
+      }
+    }
+    if (w->visited != w->initial_visited) {
+      PyMem_Free(w->visited);
+    }
+    w->visited = new_table;
+    w->visited_mask = new_size - 1;
 
-    // if it's reachable from an argument to a function currently on the
-    // stack, then return 1
-    unsigned int arg_reachable_func_start_time = get_arg_reachable_func_start_time(obj);
-    if (arg_reachable_func_start_time > 0) {
-      PyFrameObject* cur_frame = f;
-      while (cur_frame) {
-        if (arg_reachable_func_start_time == cur_frame->start_func_call_time) {
-          return 1;
+    slot = walk_visited_slot(w->visited, w->visited_mask, key);
+  }
+
+  *slot = key;
+  w->visited_used++;
+  return 1;
+}
+
+// pushes the attributes of an instance of a class defined in Python
+// (i.e., a new-style class), from both its __dict__ and its __slots__
+static int walk_push_heap_type_attrs(ObjectWalk* w, PyObject* obj) {
+  PyObject** dictptr = _PyObject_GetDictPtr(obj);
+  if (dictptr && *dictptr) {
+    if (walk_push(w, *dictptr) < 0) return -1;
+  }
+
+  // each class in the MRO that defines __slots__ has a member
+  // descriptor for each slot, which tells us where it's stored
+  PyObject* mro = Py_TYPE(obj)->tp_mro;
+  if (!mro) return 0;
+
+  Py_ssize_t i;
+  for (i = 0; i < PyTuple_GET_SIZE(mro); i++) {
+    PyTypeObject* base = (PyTypeObject*)PyTuple_GET_ITEM(mro, i);
+    if (!PyType_Check(base) ||
+        !PyType_HasFeature(base, Py_TPFLAGS_HEAPTYPE) ||
+        !base->tp_members) {
+      continue;
+    }
+
+    PyMemberDef* m;
+    for (m = base->tp_members; m->name; m++) {
+      if (m->type == T_OBJECT || m->type == T_OBJECT_EX) {
+        PyObject* slot_value = *(PyObject**)((char*)obj + m->offset);
+        if (slot_value) {
+          if (walk_push(w, slot_value) < 0) return -1;
         }
-        cur_frame = cur_frame->f_back;
       }
     }
   }
+  return 0;
+}
 
-  // otherwise recurse inside of yourself to get your constituent
-  // sub-objects (note: this will NOT traverse inside of extension
-  // types defined as C code, only pure Python types)
+// pushes all of the objects directly inside of obj (note: this will
+// NOT look inside of extension types defined as C code, only built-in
+// collection types and instances of classes defined in Python)
+static int walk_push_children(ObjectWalk* w, PyObject* obj) {
+  Py_ssize_t i;
 
-  /* if it's a built-in collection type (list, tuple, dict, set), then
-     recurse on all elements. (TODO: might be slow) */
   if (PyList_Check(obj)) {
-    Py_ssize_t i;
-    for (i = 0; i < PyList_Size(obj); i++) {
-      int sub_res = contains_externally_aliased_mutable_obj(PyList_GetItem(obj, i), f);
-      // break out as soon as you find just ONE element
-      // that's globally-reachable
-      if (sub_res) return 1;
+    for (i = 0; i < PyList_GET_SIZE(obj); i++) {
+      if (walk_push(w, PyList_GET_ITEM(obj, i)) < 0) return -1;
     }
   }
   else if (PyTuple_Check(obj)) {
-    Py_ssize_t i;
-    for (i = 0; i < PyTuple_Size(obj); i++) {
-      int sub_res = contains_externally_aliased_mutable_obj(PyTuple_GetItem(obj, i), f);
-      if (sub_res) return 1;
+    for (i = 0; i < PyTuple_GET_SIZE(obj); i++) {
+      if (walk_push(w, PyTuple_GET_ITEM(obj, i)) < 0) return -1;
     }
   }
-  else if (PySet_Check(obj)) {
+  else if (PyAnySet_Check(obj)) {
     Py_ssize_t pos = 0;
     PyObject* child;
     while (_PySet_Next(obj, &pos, &child)) {
-      int sub_res = contains_externally_aliased_mutable_obj(child, f);
-      if (sub_res) return 1;
+      if (walk_push(w, child) < 0) return -1;
     }
   }
   else if (PyDict_Check(obj)) {
@@ -335,20 +574,109 @@ int contains_externally_aliased_mutable_obj(PyObject* obj, PyFrameObject* f) {
     PyObject* value = NULL;
     Py_ssize_t pos = 0;
     while (PyDict_Next(obj, &pos, &key, &value)) {
-      int key_res = contains_externally_aliased_mutable_obj(key, f);
-      int value_res = contains_externally_aliased_mutable_obj(value, f);
-      if (key_res || value_res) return 1;
+      if (walk_push(w, key) < 0) return -1;
+      if (walk_push(w, value) < 0) return -1;
     }
   }
-  // instance of a user-defined class ... dig inside its attributes dict
+  // instance of an old-style class ... dig inside its attributes dict
   else if (PyInstance_Check(obj)) {
-    PyInstanceObject* inst = (PyInstanceObject*)obj;
-    return contains_externally_aliased_mutable_obj(inst->in_dict, f);
+    if (walk_push(w, ((PyInstanceObject*)obj)->in_dict) < 0) return -1;
   }
 
+  // instance of a new-style class (possibly a subclass of one of the
+  // collection types above, which can have attributes of its own)
+  //
+  // (a metaclass is a heap type too, but we don't want to dig inside
+  //  of the dicts of the classes that it creates)
+  if (PyType_HasFeature(Py_TYPE(obj), Py_TPFLAGS_HEAPTYPE) &&
+      !PyType_Check(obj)) {
+    if (walk_push_heap_type_attrs(w, obj) < 0) return -1;
+  }
 
-  // if you've made it this far without tripping any alarms, then let's 
-  // assume that you don't contain any externally-aliased values
   return 0;
 }
 
+// returns 1 iff obj itself is globally-reachable or reachable from an
+// argument of a function on the stack starting at frame f
+static int is_externally_aliased(PyObject* obj, PyFrameObject* f) {
+  // if it's globally-reachable, then return 1
+  if (get_global_container(obj)) {
+    return 1;
+  }
+
+  // if it's reachable from an argument to a function currently on the
+  // stack, then return 1
+  unsigned PY_LONG_LONG arg_reachable_func_start_time = get_arg_reachable_func_start_time(obj);
+  if (arg_reachable_func_start_time > 0) {
+    PyFrameObject* cur_frame = f;
+    while (cur_frame) {
+      if (arg_reachable_func_start_time == cur_frame->start_func_call_time) {
+        return 1;
+      }
+      cur_frame = cur_frame->f_back;
+    }
+  }
+
+  return 0;
+}
+
+// returns 1 iff obj contains within it a MUTABLE object that
+// existed before the invocation of frame f, 0 otherwise
+//
+// this takes time linear in the number of objects reachable from obj
+// (each of which it checks only once, even if it's shared or part of
+// a cycle), and stops as soon as it finds ONE such object
+int contains_externally_aliased_mutable_obj(PyObject* obj, PyFrameObject* f) {
+  ObjectWalk w;
+  walk_init(&w);
+
+  int ret = 0;
+
+  if (walk_push(&w, obj) < 0) {
+    ret = -1;
+  }
+
+  while (!ret && w.stack_size > 0) {
+    PyObject* cur = w.stack[--w.stack_size];
+
+    int is_new = walk_visit(&w, cur);
+    if (is_new < 0) {
+      ret = -1;
+      break;
+    }
+    if (!is_new) {
+      continue;
+    }
+
+    // this is a hacky-hack ... tuples are immutable, so we don't need
+    // to check their creation time.  however, they can hold mutable
+    // elements, so we still need to traverse inside of them.
+    // e.g., ([1, 2], [3]) is a legal tuple
+    //
+    // tuples can appear as constants in function code (co_consts),
+    // so those are actually created BEFORE a function is called but
+    // are harmless since they can't contain mutable items inside.
+    if (!PyTuple_CheckExact(cur) && is_externally_aliased(cur, f)) {
+      ret = 1;
+      break;
+    }
+
+    if (walk_push_children(&w, cur) < 0) {
+      ret = -1;
+    }
+  }
+
+  walk_free(&w);
+
+  // if we ran out of memory, then play it safe and assume that obj
+  // DOES contain an externally-aliased value
+  if (ret < 0) {
+    PyErr_Clear();
+    return 1;
+  }
+
+  // if you've made it this far without tripping any alarms, then let's
+  // assume that you don't contain any externally-aliased values
+  return ret;
+}
+
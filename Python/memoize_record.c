@@ -0,0 +1,433 @@
+/* Binary records for memo table entries
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+/* Each cache entry file holds a list of memo table entries (see the
+   comment above on_disk_cache_GET() in memoize_fmi.c), and each entry
+   is a dict with string keys like "code_dependencies" and "retval".
+   Serializing that list as a whole repeats the key strings and dict
+   framing in every entry, and a look-up has to load everything in the
+   file (including return values and argument lists of entries whose
+   global variables don't even match) before it can check anything.
+
+   So serialize_cache_entry() (memoize_codec.c) stores such a list as
+   a record list instead (all integers are big-endian):
+
+     bytes 0-3   Adler-32 checksum of everything after it
+     byte 4      RECORD_FORMAT_VERSION
+     byte 5      reserved (0)
+     bytes 6-7   number of records
+
+   followed by one record per memo table entry:
+
+     bytes 0-3   length of this record (including this header)
+     bytes 4-7   runtime_ms
+     bytes 8-9   flags (bit i is set if field i is present)
+     byte 10     number of sections
+     byte 11     reserved (0)
+
+   followed by a SECTION_ENTRY_SIZE-byte table entry for each section:
+
+     byte 0      field (index into field_names)
+     byte 1      serializer (SERIALIZER_MARSHAL or SERIALIZER_PICKLE)
+     bytes 2-3   reserved (0)
+     bytes 4-7   offset of the section from the start of the record
+     bytes 8-11  length of the section
+
+   followed by the sections themselves, each holding the value of one
+   field serialized on its own with serialize_value().
+
+   decode_memo_records() verifies the checksum (so corrupted entries
+   are reported rather than mysteriously failing to unpickle) and
+   decodes every field except for args and retval (IS_LAZY_FIELD),
+   which look-ups only need after every other check has passed, and
+   which are usually the bulk of an entry; it stashes their sections
+   in the entry's RAW_SECTIONS_KEY dict, and memo_table_entry_GET()
+   decodes them on demand.  encode_memo_records() copies those raw
+   sections straight back out, so appending an entry to a list doesn't
+   re-serialize the return values of the entries already in it. */
+
+#include "Python.h"
+#include "memoize_record.h"
+#include "memoize_codec.h"
+
+
+#define RECORD_FORMAT_VERSION 1
+#define RECORD_LIST_HEADER_SIZE 8
+#define RECORD_HEADER_SIZE 12
+#define SECTION_ENTRY_SIZE 12
+
+#define NUM_FIELDS 10
+static const char* field_names[NUM_FIELDS] = {
+  "canonical_name",
+  "args",
+  "retval",
+  "code_dependencies",
+  "global_vars_read",
+  "files_read",
+  "files_written",
+  "stdout_buf",
+  "stderr_buf",
+  "final_file_seek_pos"};
+
+#define FIELD_ARGS 1
+#define FIELD_RETVAL 2
+#define IS_LAZY_FIELD(field) (((field) == FIELD_ARGS) || ((field) == FIELD_RETVAL))
+
+// (runtime_ms lives in the record header rather than in a section)
+#define RUNTIME_MS_KEY "runtime_ms"
+
+// maps names of fields that haven't been decoded yet to
+// (serializer, serialized value) tuples
+#define RAW_SECTIONS_KEY "raw_sections"
+
+unsigned long num_corrupt_records = 0;
+
+
+static unsigned long adler32(const unsigned char* buf, Py_ssize_t len) {
+  unsigned long a = 1;
+  unsigned long b = 0;
+  while (len > 0) {
+    // (5552 is the most bytes that can be summed before b overflows)
+    Py_ssize_t n = (len < 5552) ? len : 5552;
+    len -= n;
+    while (n--) {
+      a += *buf++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+static void put_uint16(unsigned char* p, unsigned long v) {
+  p[0] = (unsigned char)((v >> 8) & 0xff);
+  p[1] = (unsigned char)(v & 0xff);
+}
+
+static void put_uint32(unsigned char* p, unsigned long v) {
+  p[0] = (unsigned char)((v >> 24) & 0xff);
+  p[1] = (unsigned char)((v >> 16) & 0xff);
+  p[2] = (unsigned char)((v >> 8) & 0xff);
+  p[3] = (unsigned char)(v & 0xff);
+}
+
+static unsigned long get_uint16(const unsigned char* p) {
+  return ((unsigned long)p[0] << 8) | (unsigned long)p[1];
+}
+
+static unsigned long get_uint32(const unsigned char* p) {
+  return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+         ((unsigned long)p[2] << 8) | (unsigned long)p[3];
+}
+
+static int field_index(PyObject* key) {
+  if (!PyString_CheckExact(key)) {
+    return -1;
+  }
+  int i;
+  for (i = 0; i < NUM_FIELDS; i++) {
+    if (strcmp(PyString_AS_STRING(key), field_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+// returns a new string holding the record for entry (or NULL if entry
+// doesn't fit into the format)
+static PyObject* encode_record(PyObject* entry) {
+  if (!PyDict_CheckExact(entry)) {
+    return NULL;
+  }
+
+  PyObject* runtime_ms_obj = PyDict_GetItemString(entry, RUNTIME_MS_KEY);
+  if (!runtime_ms_obj || !PyInt_CheckExact(runtime_ms_obj) ||
+      (PyInt_AS_LONG(runtime_ms_obj) < 0) ||
+      (PyInt_AS_LONG(runtime_ms_obj) > 0xFFFFFFFFL)) {
+    return NULL;
+  }
+  PyObject* raw_sections = PyDict_GetItemString(entry, RAW_SECTIONS_KEY);
+  if (raw_sections && !PyDict_CheckExact(raw_sections)) {
+    return NULL;
+  }
+
+  // every key must be a field (or one of our own)
+  Py_ssize_t pos = 0;
+  PyObject* key;
+  PyObject* value;
+  while (PyDict_Next(entry, &pos, &key, &value)) {
+    if ((field_index(key) < 0) &&
+        (!PyString_CheckExact(key) ||
+         ((strcmp(PyString_AS_STRING(key), RUNTIME_MS_KEY) != 0) &&
+          (strcmp(PyString_AS_STRING(key), RAW_SECTIONS_KEY) != 0)))) {
+      return NULL;
+    }
+  }
+
+  PyObject* section_data[NUM_FIELDS];
+  int section_serializer[NUM_FIELDS];
+  int num_sections = 0;
+  unsigned long flags = 0;
+  Py_ssize_t record_len = RECORD_HEADER_SIZE;
+  PyObject* ret = NULL;
+
+  int field;
+  for (field = 0; field < NUM_FIELDS; field++) {
+    section_data[field] = NULL;
+  }
+
+  for (field = 0; field < NUM_FIELDS; field++) {
+    value = PyDict_GetItemString(entry, field_names[field]);
+    if (value) {
+      section_data[field] = serialize_value(value, &section_serializer[field]);
+      if (!section_data[field]) {
+        PyErr_Clear();
+        goto encode_record_done;
+      }
+    }
+    else if (raw_sections) {
+      // (a lazy field that was never decoded)
+      PyObject* raw = PyDict_GetItemString(raw_sections, field_names[field]);
+      if (raw) {
+        if (!PyTuple_CheckExact(raw) || (PyTuple_GET_SIZE(raw) != 2) ||
+            !PyString_CheckExact(PyTuple_GET_ITEM(raw, 1))) {
+          goto encode_record_done;
+        }
+        section_serializer[field] = (int)PyInt_AsLong(PyTuple_GET_ITEM(raw, 0));
+        section_data[field] = PyTuple_GET_ITEM(raw, 1);
+        Py_INCREF(section_data[field]);
+      }
+    }
+
+    if (section_data[field]) {
+      num_sections++;
+      flags |= (1UL << field);
+      record_len += SECTION_ENTRY_SIZE + PyString_GET_SIZE(section_data[field]);
+    }
+  }
+
+  if (record_len > 0xFFFFFFFFL) {
+    goto encode_record_done;
+  }
+
+  ret = PyString_FromStringAndSize(NULL, record_len);
+  if (!ret) {
+    PyErr_Clear();
+    goto encode_record_done;
+  }
+
+  unsigned char* p = (unsigned char*)PyString_AS_STRING(ret);
+  put_uint32(p, (unsigned long)record_len);
+  put_uint32(p + 4, (unsigned long)PyInt_AS_LONG(runtime_ms_obj));
+  put_uint16(p + 8, flags);
+  p[10] = (unsigned char)num_sections;
+  p[11] = 0;
+
+  unsigned char* table_entry = p + RECORD_HEADER_SIZE;
+  Py_ssize_t offset = RECORD_HEADER_SIZE + (num_sections * SECTION_ENTRY_SIZE);
+  for (field = 0; field < NUM_FIELDS; field++) {
+    if (section_data[field]) {
+      Py_ssize_t len = PyString_GET_SIZE(section_data[field]);
+      table_entry[0] = (unsigned char)field;
+      table_entry[1] = (unsigned char)section_serializer[field];
+      table_entry[2] = 0;
+      table_entry[3] = 0;
+      put_uint32(table_entry + 4, (unsigned long)offset);
+      put_uint32(table_entry + 8, (unsigned long)len);
+      memcpy(p + offset, PyString_AS_STRING(section_data[field]), len);
+
+      table_entry += SECTION_ENTRY_SIZE;
+      offset += len;
+    }
+  }
+
+encode_record_done:
+  for (field = 0; field < NUM_FIELDS; field++) {
+    Py_XDECREF(section_data[field]);
+  }
+  return ret;
+}
+
+PyObject* encode_memo_records(PyObject* entries) {
+  if (!PyList_CheckExact(entries) || (PyList_GET_SIZE(entries) > 0xFFFF)) {
+    return NULL;
+  }
+
+  Py_ssize_t num_records = PyList_GET_SIZE(entries);
+  PyObject* records = PyList_New(num_records);
+  Py_ssize_t total_len = RECORD_LIST_HEADER_SIZE;
+  Py_ssize_t i;
+  for (i = 0; i < num_records; i++) {
+    PyObject* record = encode_record(PyList_GET_ITEM(entries, i));
+    if (!record) {
+      Py_DECREF(records);
+      return NULL;
+    }
+    PyList_SET_ITEM(records, i, record); // steals reference
+    total_len += PyString_GET_SIZE(record);
+  }
+
+  PyObject* ret = PyString_FromStringAndSize(NULL, total_len);
+  if (ret) {
+    unsigned char* p = (unsigned char*)PyString_AS_STRING(ret);
+    p[4] = RECORD_FORMAT_VERSION;
+    p[5] = 0;
+    put_uint16(p + 6, (unsigned long)num_records);
+
+    Py_ssize_t offset = RECORD_LIST_HEADER_SIZE;
+    for (i = 0; i < num_records; i++) {
+      PyObject* record = PyList_GET_ITEM(records, i);
+      memcpy(p + offset, PyString_AS_STRING(record), PyString_GET_SIZE(record));
+      offset += PyString_GET_SIZE(record);
+    }
+
+    put_uint32(p, adler32(p + 4, total_len - 4));
+  }
+  else {
+    PyErr_Clear();
+  }
+
+  Py_DECREF(records);
+  return ret;
+}
+
+
+// returns a new dict for the len-byte record at p (or NULL if it's
+// malformed)
+static PyObject* decode_record(const unsigned char* p, Py_ssize_t len) {
+  int num_sections = p[10];
+  if (RECORD_HEADER_SIZE + (num_sections * SECTION_ENTRY_SIZE) > len) {
+    return NULL;
+  }
+
+  PyObject* entry = PyDict_New();
+  PyObject* raw_sections = NULL;
+
+  PyObject* runtime_ms_obj = PyInt_FromLong((long)get_uint32(p + 4));
+  PyDict_SetItemString(entry, RUNTIME_MS_KEY, runtime_ms_obj);
+  Py_DECREF(runtime_ms_obj);
+
+  int i;
+  for (i = 0; i < num_sections; i++) {
+    const unsigned char* table_entry = p + RECORD_HEADER_SIZE + (i * SECTION_ENTRY_SIZE);
+    int field = table_entry[0];
+    int serializer = table_entry[1];
+    unsigned long offset = get_uint32(table_entry + 4);
+    unsigned long section_len = get_uint32(table_entry + 8);
+
+    if ((field >= NUM_FIELDS) ||
+        ((serializer != SERIALIZER_MARSHAL) && (serializer != SERIALIZER_PICKLE)) ||
+        (offset > (unsigned long)len) || (section_len > (unsigned long)len - offset)) {
+      goto decode_record_failed;
+    }
+
+    PyObject* section = PyString_FromStringAndSize((const char*)(p + offset), section_len);
+    if (IS_LAZY_FIELD(field)) {
+      if (!raw_sections) {
+        raw_sections = PyDict_New();
+        PyDict_SetItemString(entry, RAW_SECTIONS_KEY, raw_sections);
+      }
+      PyObject* raw = Py_BuildValue("(iN)", serializer, section);
+      PyDict_SetItemString(raw_sections, field_names[field], raw);
+      Py_DECREF(raw);
+    }
+    else {
+      PyObject* value = deserialize_cache_entry(section, serializer);
+      Py_DECREF(section);
+      if (!value) {
+        goto decode_record_failed;
+      }
+      PyDict_SetItemString(entry, field_names[field], value);
+      Py_DECREF(value);
+    }
+  }
+
+  Py_XDECREF(raw_sections);
+  return entry;
+
+decode_record_failed:
+  Py_XDECREF(raw_sections);
+  Py_DECREF(entry);
+  return NULL;
+}
+
+PyObject* decode_memo_records(PyObject* data) {
+  const unsigned char* p = (const unsigned char*)PyString_AS_STRING(data);
+  Py_ssize_t len = PyString_GET_SIZE(data);
+
+  if ((len < RECORD_LIST_HEADER_SIZE) ||
+      (get_uint32(p) != adler32(p + 4, len - 4))) {
+    num_corrupt_records++;
+    PyErr_SetString(PyExc_ValueError, "memo table entry records fail their checksum");
+    return NULL;
+  }
+  if (p[4] != RECORD_FORMAT_VERSION) {
+    PyErr_SetString(PyExc_ValueError, "unknown memo table entry record format");
+    return NULL;
+  }
+
+  Py_ssize_t num_records = get_uint16(p + 6);
+  PyObject* entries = PyList_New(num_records);
+  Py_ssize_t offset = RECORD_LIST_HEADER_SIZE;
+  Py_ssize_t i;
+  for (i = 0; i < num_records; i++) {
+    PyObject* entry = NULL;
+    if (offset + RECORD_HEADER_SIZE <= len) {
+      unsigned long record_len = get_uint32(p + offset);
+      if ((record_len >= RECORD_HEADER_SIZE) &&
+          (record_len <= (unsigned long)(len - offset))) {
+        entry = decode_record(p + offset, record_len);
+        offset += record_len;
+      }
+    }
+
+    if (!entry) {
+      Py_DECREF(entries);
+      if (!PyErr_Occurred()) {
+        PyErr_SetString(PyExc_ValueError, "malformed memo table entry record");
+      }
+      return NULL;
+    }
+    PyList_SET_ITEM(entries, i, entry); // steals reference
+  }
+
+  return entries;
+}
+
+
+PyObject* memo_table_entry_GET(PyObject* entry, const char* field_name) {
+  PyObject* ret = PyDict_GetItemString(entry, field_name);
+  if (ret) {
+    return ret;
+  }
+
+  PyObject* raw_sections = PyDict_GetItemString(entry, RAW_SECTIONS_KEY);
+  PyObject* raw = raw_sections ? PyDict_GetItemString(raw_sections, field_name) : NULL;
+  if (!raw) {
+    return NULL;
+  }
+
+  ret = deserialize_cache_entry(PyTuple_GET_ITEM(raw, 1),
+                                (int)PyInt_AsLong(PyTuple_GET_ITEM(raw, 0)));
+  if (!ret) {
+    PyErr_Clear();
+    return NULL;
+  }
+
+  // (entry holds on to it from now on, and so encode_memo_records()
+  //  will serialize it afresh)
+  PyDict_SetItemString(entry, field_name, ret);
+  PyDict_DelItemString(raw_sections, field_name);
+  Py_DECREF(ret);
+  return ret;
+}
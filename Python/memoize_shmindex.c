@@ -0,0 +1,493 @@
+/* Host-wide shared-memory index of cache entries
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+/* When many processes on one host share an incpy-cache/ (e.g., the
+   workers of a multiprocessing.Pool), each of them would otherwise have
+   to probe the disk to find out about entries that its siblings just
+   stored, and wouldn't notice at all that a function whose cache was
+   empty at startup now has entries.  So if shared_memo_index is set in
+   incpy.config, all of them mmap() the same file in the cache
+   directory, SHARED_INDEX_FILENAME, which holds an open-addressing
+   hash table (with linear probing) with one slot per cache entry in
+   each version of its function's cache (see "Cache versions" in
+   memoize_fmi.c):
+
+     tag = hash of "<function's cache sub-directory>/<version>/<hash key>"
+     value = 1 (0 if deleted)
+
+   plus one slot per function (tag = hash of its cache sub-directory)
+   whose value is the first 64 bits of the name of the version that was
+   most recently written to.
+
+   Writers update slots without any locks, claiming empty slots with a
+   compare-and-swap on the tag; slots are never freed, only marked as
+   deleted.  The index is only ever used to SKIP disk probes, and every
+   race merely makes it claim that an entry is absent when it's present
+   (which costs a re-computation) or vice versa (which costs a wasted
+   probe), so it can't ever cause a wrong result.
+
+   The first process to create the file fills it in from the contents of
+   incpy-cache/ while holding an exclusive lock on it.  Once the table is
+   3/4 full, it's marked as overflowed and everybody goes back to always
+   probing the disk.
+
+   Processes that don't use the index (or incpy-support-scripts/
+   sweep_cache.py) won't update it, but all of them re-write
+   cache_index.pickle (see memoize_eviction.c) after changing the cache,
+   so processes that DO use the index remember the identity (inode,
+   size, and mtime) of the cache_index.pickle that they wrote last in
+   the header.  The next process to start up rebuilds the index in
+   place (under the same lock) if somebody else has re-written
+   cache_index.pickle since then, or if the index is overflowed (since
+   deleted slots are only reclaimed by rebuilding), or if it's corrupt
+   or its creator died before it could finish filling it in.  While a
+   rebuild is in progress, everybody else ignores the index, and writes
+   that race with the rebuild might be missing from it afterwards,
+   which, again, only costs re-computations. */
+
+#include "Python.h"
+#include "memoize_shmindex.h"
+#include "memoize_eviction.h"
+#include "memoize_fmi.h"
+#include "memoize.h"
+#include "memoize_layers.h"
+#include "memoize_logging.h"
+#include "memoize_storage.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#define SHARED_INDEX_FILENAME "memo_index.shm"
+#define SHARED_INDEX_MAGIC 0x1c9e1d02
+#define SHARED_INDEX_MAX_LOAD_PERCENT 75
+
+// values of SharedIndexHeader.overflowed
+#define OVERFLOWED_WHILE_RUNNING 1 // (rebuilding would reclaim deleted slots)
+#define OVERFLOWED_WHILE_BUILDING 2 // (only a bigger index would help)
+
+typedef unsigned PY_LONG_LONG index_word;
+
+typedef struct {
+  unsigned int magic;
+  unsigned int overflowed;
+  index_word num_slots;
+  index_word num_used;  // updated atomically
+  unsigned int rebuilding;
+  unsigned int stale;   // somebody else re-wrote cache_index.pickle
+  index_word cache_index_ino;   // identity of the cache_index.pickle
+  index_word cache_index_size;  // that we wrote last (all 0 if none)
+  index_word cache_index_mtime;
+  char padding[8];      // so that the slots start on a cache line
+} SharedIndexHeader;
+
+typedef struct {
+  index_word tag;   // 0 if empty
+  index_word value; // (see above)
+} SharedIndexSlot;
+
+
+PY_LONG_LONG shared_memo_index_bytes = 0;
+
+// initialize in open_shared_memo_index(), destroy in
+// close_shared_memo_index()
+static SharedIndexHeader* shared_index = NULL;
+static size_t shared_index_mapped_bytes = 0;
+
+#define SHARED_INDEX_SLOTS(h) ((SharedIndexSlot*)((h) + 1))
+
+// can we trust what's in the index right now?
+#define SHARED_INDEX_USABLE(h) (!(h)->overflowed && !(h)->rebuilding)
+
+
+// 64-bit FNV-1a hash of "<subdir>/<version>/<hash_key>" (or just
+// subdir if version and hash_key are NULL), which is never 0
+static index_word hash_tag(char* subdir, char* version, char* hash_key) {
+  index_word h = 14695981039346656037ULL;
+  unsigned char* s = (unsigned char*)subdir;
+  while (*s) {
+    h = (h ^ *s++) * 1099511628211ULL;
+  }
+  if (version) {
+    h = (h ^ '/') * 1099511628211ULL;
+    s = (unsigned char*)version;
+    while (*s) {
+      h = (h ^ *s++) * 1099511628211ULL;
+    }
+    h = (h ^ '/') * 1099511628211ULL;
+    s = (unsigned char*)hash_key;
+    while (*s) {
+      h = (h ^ *s++) * 1099511628211ULL;
+    }
+  }
+  return h ? h : 1;
+}
+
+// the first 64 bits of a version name (a hex md5 digest), which is
+// never 0
+static index_word version_word(char* version) {
+  char buf[17];
+  strncpy(buf, version, 16);
+  buf[16] = '\0';
+  index_word v = strtoull(buf, NULL, 16);
+  return v ? v : 1;
+}
+
+// returns the slot with tag, or NULL if there's none
+static SharedIndexSlot* find_slot(index_word tag) {
+  SharedIndexSlot* slots = SHARED_INDEX_SLOTS(shared_index);
+  index_word n = shared_index->num_slots;
+  index_word i = tag % n;
+  index_word num_probed;
+  for (num_probed = 0; num_probed < n; num_probed++) {
+    index_word t = slots[i].tag;
+    if (t == tag) {
+      return &slots[i];
+    }
+    else if (t == 0) {
+      return NULL;
+    }
+    i = (i + 1) % n;
+  }
+  return NULL;
+}
+
+// sets the value of the slot with tag, claiming an empty slot for it
+// if necessary (unless the index is too full)
+static void set_slot(index_word tag, index_word value) {
+  if (shared_index->overflowed) {
+    return;
+  }
+
+  SharedIndexSlot* slots = SHARED_INDEX_SLOTS(shared_index);
+  index_word n = shared_index->num_slots;
+  index_word i = tag % n;
+  index_word num_probed;
+  for (num_probed = 0; num_probed < n; num_probed++) {
+    index_word t = slots[i].tag;
+    if (t == 0) {
+      if (__sync_bool_compare_and_swap(&slots[i].tag, 0, tag)) {
+        slots[i].value = value;
+        index_word num_used = __sync_add_and_fetch(&shared_index->num_used, 1);
+        if (num_used * 100 > n * SHARED_INDEX_MAX_LOAD_PERCENT) {
+          shared_index->overflowed = OVERFLOWED_WHILE_RUNNING;
+        }
+        return;
+      }
+      // somebody else just claimed it, so look at it again
+      t = slots[i].tag;
+    }
+    if (t == tag) {
+      slots[i].value = value;
+      return;
+    }
+    i = (i + 1) % n;
+  }
+  shared_index->overflowed = OVERFLOWED_WHILE_RUNNING;
+}
+
+
+// the identity of cache_index.pickle right now (all 0 if there's none)
+static void stat_cache_index(index_word* ino, index_word* size, index_word* mtime) {
+  PyObject* cache_index_path =
+    PyString_FromFormat("%s/" CACHE_INDEX_FILENAME, INCPY_CACHE_DIR);
+  struct stat st;
+  if (stat(PyString_AsString(cache_index_path), &st) == 0) {
+    *ino = (index_word)st.st_ino;
+    *size = (index_word)st.st_size;
+    *mtime = (index_word)st.st_mtime;
+  }
+  else {
+    *ino = *size = *mtime = 0;
+  }
+  Py_DECREF(cache_index_path);
+}
+
+// has anybody other than a process that uses the index re-written
+// cache_index.pickle since one of those last did?
+static int cache_index_changed_behind_our_back(void) {
+  index_word ino, size, mtime;
+  stat_cache_index(&ino, &size, &mtime);
+  return ((ino != shared_index->cache_index_ino) ||
+          (size != shared_index->cache_index_size) ||
+          (mtime != shared_index->cache_index_mtime));
+}
+
+
+// fill in an empty index from the contents of incpy-cache/
+static void populate_shared_index(void) {
+  DIR* dp = opendir(INCPY_CACHE_DIR);
+  if (!dp) {
+    return;
+  }
+
+  struct dirent* dirp;
+  while ((dirp = readdir(dp)) != NULL) {
+    char* dot = strrchr(dirp->d_name, '.');
+    if (!dot || (dot == dirp->d_name) || (strcmp(dot, ".cache") != 0)) {
+      continue;
+    }
+
+    PyObject* subdir_path = PyString_FromFormat("%s/%s", INCPY_CACHE_DIR, dirp->d_name);
+    DIR* subdir_dp = opendir(PyString_AsString(subdir_path));
+    if (subdir_dp) {
+      struct dirent* version_dirp;
+      while ((version_dirp = readdir(subdir_dp)) != NULL) {
+        if (version_dirp->d_name[0] == '.') {
+          continue;
+        }
+
+        PyObject* version_path =
+          PyString_FromFormat("%s/%s", PyString_AsString(subdir_path), version_dirp->d_name);
+        DIR* version_dp = opendir(PyString_AsString(version_path));
+        if (version_dp) {
+          set_slot(hash_tag(PyString_AsString(subdir_path), NULL, NULL),
+                   version_word(version_dirp->d_name));
+
+          closedir(version_dp);
+
+          // ask the storage backend, since it might not keep entries
+          // inside of the version sub-directory
+          PyObject* hash_keys = memo_storage_SCAN(version_path, 0);
+          Py_ssize_t i;
+          for (i = 0; i < PyList_GET_SIZE(hash_keys); i++) {
+            set_slot(hash_tag(PyString_AsString(subdir_path), version_dirp->d_name,
+                              PyString_AsString(PyList_GET_ITEM(hash_keys, i))),
+                     1);
+          }
+          Py_DECREF(hash_keys);
+        }
+        Py_DECREF(version_path);
+      }
+      closedir(subdir_dp);
+    }
+    Py_DECREF(subdir_path);
+  }
+  closedir(dp);
+}
+
+// (called from pg_initialize())
+void open_shared_memo_index(void) {
+  assert(!shared_index);
+  // (nothing in a non-persistent backend is worth sharing)
+  if ((shared_memo_index_bytes <= 0) || !memo_storage->is_persistent) {
+    return;
+  }
+
+  struct stat st;
+  if (stat(INCPY_CACHE_DIR, &st) != 0) {
+    mkdir(INCPY_CACHE_DIR, 0777);
+  }
+
+  PyObject* index_path = PyString_FromFormat("%s/" SHARED_INDEX_FILENAME, INCPY_CACHE_DIR);
+  int fd = open(PyString_AsString(index_path), O_RDWR | O_CREAT, 0666);
+  Py_DECREF(index_path);
+  if (fd < 0) {
+    PG_LOG("dict(event='ERROR', what='Cannot open shared memo index')");
+    return;
+  }
+
+  // hold an exclusive lock on the entire file while checking whether
+  // it needs to be created, so that only one process creates it
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  while ((fcntl(fd, F_SETLKW, &fl) != 0) && (errno == EINTR)) {
+    // retry if interrupted by a signal
+  }
+
+  int created = 0;
+  if ((fstat(fd, &st) == 0) && (st.st_size > (off_t)sizeof(SharedIndexHeader))) {
+    // use the existing file, whatever size it is
+    shared_index_mapped_bytes = (size_t)st.st_size;
+  }
+  else {
+    index_word num_slots =
+      (shared_memo_index_bytes - sizeof(SharedIndexHeader)) / sizeof(SharedIndexSlot);
+    shared_index_mapped_bytes =
+      sizeof(SharedIndexHeader) + (size_t)num_slots * sizeof(SharedIndexSlot);
+    if ((num_slots == 0) || (ftruncate(fd, shared_index_mapped_bytes) != 0)) {
+      shared_index_mapped_bytes = 0;
+    }
+    created = 1;
+  }
+
+  if (shared_index_mapped_bytes) {
+    void* p = mmap(NULL, shared_index_mapped_bytes, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+      shared_index = (SharedIndexHeader*)p;
+    }
+  }
+
+  // (see the comment at the top for when we rebuild it)
+  const char* rebuild_reason = NULL;
+  if (shared_index) {
+    index_word num_slots =
+      (shared_index_mapped_bytes - sizeof(SharedIndexHeader)) / sizeof(SharedIndexSlot);
+    if (created) {
+      rebuild_reason = "created";
+    }
+    else if ((shared_index->magic != SHARED_INDEX_MAGIC) ||
+             (shared_index->num_slots != num_slots) ||
+             shared_index->rebuilding) {
+      rebuild_reason = "corrupt";
+    }
+    else if (shared_index->overflowed == OVERFLOWED_WHILE_RUNNING) {
+      rebuild_reason = "overflowed";
+    }
+    else if (shared_index->stale) {
+      rebuild_reason = "stale";
+    }
+    else {
+      // (hold the cache index lock so that we don't catch a process
+      //  that uses the index between re-writing cache_index.pickle and
+      //  noting that in the header)
+      lock_cache_index();
+      if (cache_index_changed_behind_our_back()) {
+        rebuild_reason = "stale";
+      }
+      unlock_cache_index();
+    }
+
+    if (rebuild_reason) {
+      // everybody else ignores it until we're done
+      shared_index->rebuilding = 1;
+      shared_index->magic = SHARED_INDEX_MAGIC;
+      shared_index->num_slots = num_slots;
+      memset(SHARED_INDEX_SLOTS(shared_index), 0,
+             (size_t)num_slots * sizeof(SharedIndexSlot));
+      shared_index->num_used = 0;
+      shared_index->overflowed = 0;
+      shared_index->stale = 0;
+
+      lock_cache_index();
+      populate_shared_index();
+      stat_cache_index(&shared_index->cache_index_ino,
+                       &shared_index->cache_index_size,
+                       &shared_index->cache_index_mtime);
+      unlock_cache_index();
+
+      if (shared_index->overflowed) {
+        shared_index->overflowed = OVERFLOWED_WHILE_BUILDING;
+      }
+      shared_index->rebuilding = 0;
+    }
+  }
+
+  fl.l_type = F_UNLCK;
+  fcntl(fd, F_SETLK, &fl);
+  close(fd); // the mapping stays valid
+
+  if (shared_index) {
+    PG_LOG_PRINTF("dict(event='SHARED_MEMO_INDEX', rebuilt='%s', num_slots=%llu, num_used=%llu, overflowed=%u)\n",
+                  rebuild_reason ? rebuild_reason : "", shared_index->num_slots,
+                  shared_index->num_used, shared_index->overflowed);
+  }
+}
+
+// (called from pg_finalize())
+void close_shared_memo_index(void) {
+  if (shared_index) {
+    munmap(shared_index, shared_index_mapped_bytes);
+    shared_index = NULL;
+    shared_index_mapped_bytes = 0;
+  }
+}
+
+
+// returns 0 only if the index knows that hash_key is NOT in fmi's
+// current cache version, so that there's no need to probe the disk
+//
+// (the index only knows about local entries, not ones in base cache
+//  layers, so it's no use when there are base layers)
+int shared_memo_index_may_contain(FuncMemoInfo* fmi, PyObject* hash_key) {
+  if (!shared_index || !SHARED_INDEX_USABLE(shared_index) || !fmi->cache_version ||
+      have_base_cache_layers()) {
+    return 1;
+  }
+
+  SharedIndexSlot* slot =
+    find_slot(hash_tag(PyString_AsString(fmi->cache_subdirectory_path),
+                       PyString_AsString(fmi->cache_version),
+                       PyString_AsString(hash_key)));
+  return slot && slot->value;
+}
+
+// if fmi's cache looked empty, check whether some other process has
+// since stored entries for it, and if so, start using them
+void shared_memo_index_refresh(FuncMemoInfo* fmi) {
+  if (!shared_index || !SHARED_INDEX_USABLE(shared_index) || !fmi->on_disk_cache_empty) {
+    return;
+  }
+
+  SharedIndexSlot* slot =
+    find_slot(hash_tag(PyString_AsString(fmi->cache_subdirectory_path), NULL, NULL));
+  if (slot && slot->value && (slot->value != fmi->shared_index_seen_version)) {
+    // only look at the disk again when that changes
+    fmi->shared_index_seen_version = slot->value;
+    refresh_cache_version(fmi);
+  }
+}
+
+// (called from on_disk_cache_PUT())
+void shared_memo_index_note_put(PyObject* subdir_path, PyObject* version,
+                                PyObject* hash_key) {
+  if (!shared_index || shared_index->rebuilding) {
+    return;
+  }
+
+  set_slot(hash_tag(PyString_AsString(subdir_path), PyString_AsString(version),
+                    PyString_AsString(hash_key)),
+           1);
+  set_slot(hash_tag(PyString_AsString(subdir_path), NULL, NULL),
+           version_word(PyString_AsString(version)));
+}
+
+// (called whenever a cache entry file gets deleted)
+void shared_memo_index_note_del(PyObject* subdir_path, PyObject* version,
+                                PyObject* hash_key) {
+  if (!shared_index || shared_index->rebuilding) {
+    return;
+  }
+
+  SharedIndexSlot* slot =
+    find_slot(hash_tag(PyString_AsString(subdir_path), PyString_AsString(version),
+                       PyString_AsString(hash_key)));
+  if (slot) {
+    slot->value = 0;
+  }
+}
+
+// (called from save_cache_index() while it's holding the cache index
+// lock, right before and right after it re-writes cache_index.pickle)
+void shared_memo_index_note_cache_index_saved(int after_write) {
+  if (!shared_index) {
+    return;
+  }
+
+  if (!after_write) {
+    if (cache_index_changed_behind_our_back()) {
+      shared_index->stale = 1;
+    }
+  }
+  else {
+    stat_cache_index(&shared_index->cache_index_ino,
+                     &shared_index->cache_index_size,
+                     &shared_index->cache_index_mtime);
+  }
+}
@@ -0,0 +1,653 @@
+/* Pluggable storage backends for cache entries
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+/* The on-disk cache (see memoize_fmi.c) keeps track of functions,
+   versions, and the memo table entries inside of each cache entry, but
+   leaves storing the pickled bytes of each entry to a backend, which is
+   selected by this line in incpy.config:
+
+     storage = directory | sqlite | memory
+
+   - directory (the default) stores each entry as its own file, and
+     can go through the incpy-cached daemon (see memoize_cacheserver.c)
+
+   - sqlite stores all entries in a single database file,
+     incpy-cache/entries.sqlite, using the sqlite3 module (so it's only
+     available if Modules/_sqlite was built), which avoids creating
+     lots of small files on file systems that handle them poorly
+
+   - memory keeps entries in RAM for the rest of this execution only,
+     which is handy for programs that call the same functions over and
+     over again but don't need to save anything between executions
+     (so it leaves no cache versions, cache index records, or shared
+     memo index slots on disk either)
+
+   If the selected backend can't be opened, then we fall back on the
+   directory backend.
+
+   incpy-support-scripts/test_storage_backends.py is a conformance and
+   throughput test suite that every backend must pass. */
+
+#include "Python.h"
+#include "memoize_storage.h"
+#include "memoize.h"
+#include "memoize_cacheserver.h"
+#include "memoize_fmi.h"
+#include "memoize_logging.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/* directory backend */
+
+static int directory_open(void) {
+  return 1;
+}
+
+static int directory_get(PyObject* path, PyObject** data) {
+  // ask the cache server first, since it might have it in RAM (and
+  // only read the file ourselves if we can't reach the server)
+  int server_status = cache_server_GET(path, data);
+  if (server_status == CACHE_SERVER_HIT) {
+    return MEMO_STORAGE_HIT;
+  }
+  else if (server_status == CACHE_SERVER_MISS) {
+    return MEMO_STORAGE_MISS;
+  }
+
+  FILE* fp = fopen(PyString_AsString(path), "rb");
+  if (!fp) {
+    // silently miss if cache file isn't found
+    return MEMO_STORAGE_MISS;
+  }
+
+  int status = MEMO_STORAGE_ERROR;
+  struct stat st;
+  if (fstat(fileno(fp), &st) == 0) {
+    *data = PyString_FromStringAndSize(NULL, (Py_ssize_t)st.st_size);
+    if (*data &&
+        (fread(PyString_AS_STRING(*data), 1, (size_t)st.st_size, fp) == (size_t)st.st_size)) {
+      status = MEMO_STORAGE_HIT;
+    }
+    else {
+      PyErr_Clear();
+      Py_CLEAR(*data);
+    }
+  }
+  fclose(fp);
+  return status;
+}
+
+static int directory_put(PyObject* path, PyObject* data) {
+  if (cache_server_PUT(path, data)) {
+    return 1;
+  }
+
+  // write to a temporary filename that's unique to this process, then
+  // atomically rename it to its proper filename when writing
+  // successfully completed, so that .pickle files are ALWAYS seen in a
+  // consistent state
+  PyObject* tmp_path =
+    PyString_FromFormat("%s.partial.%d", PyString_AsString(path), (int)getpid());
+
+  int success = 0;
+  FILE* fp = fopen(PyString_AsString(tmp_path), "wb");
+  if (fp) {
+    size_t len = (size_t)PyString_GET_SIZE(data);
+    success = (fwrite(PyString_AS_STRING(data), 1, len, fp) == len);
+    success = (fclose(fp) == 0) && success;
+
+    if (success) {
+      success = (rename(PyString_AsString(tmp_path), PyString_AsString(path)) == 0);
+    }
+    if (!success) {
+      unlink(PyString_AsString(tmp_path));
+    }
+  }
+
+  Py_DECREF(tmp_path);
+  return success;
+}
+
+static void directory_del(PyObject* path) {
+  // (via the cache server, if any, so that it also drops its copy in RAM)
+  if (!cache_server_DEL(path)) {
+    unlink(PyString_AsString(path));
+  }
+}
+
+static Py_ssize_t directory_size(PyObject* path) {
+  // (the cache server keeps every entry in the same file as we would)
+  struct stat st;
+  if (stat(PyString_AsString(path), &st) != 0) {
+    return -1;
+  }
+  return (Py_ssize_t)st.st_size;
+}
+
+static void directory_scan(PyObject* dir_path, PyObject* names, Py_ssize_t max_names) {
+  DIR* dp = opendir(PyString_AsString(dir_path));
+  if (!dp) {
+    return;
+  }
+
+  struct dirent* dirp;
+  while ((dirp = readdir(dp)) != NULL) {
+    size_t len = strlen(dirp->d_name);
+    if ((len > 7) &&
+        (strcmp(dirp->d_name + len - 7, ".pickle") == 0) &&
+        (strcmp(dirp->d_name, CODE_DEPS_FILENAME) != 0)) {
+      PyObject* name = PyString_FromStringAndSize(dirp->d_name, len - 7);
+      PyList_Append(names, name);
+      Py_DECREF(name);
+
+      if (max_names && (PyList_GET_SIZE(names) >= max_names)) {
+        break;
+      }
+    }
+  }
+  closedir(dp);
+}
+
+static void directory_stats(PyObject* stats_dict) {
+  PyObject* server_stats = cache_server_STAT();
+  if (server_stats) {
+    PyDict_SetItemString(stats_dict, "cache_server", server_stats);
+    Py_DECREF(server_stats);
+  }
+}
+
+static void directory_close(void) {
+}
+
+static MemoStorageBackend directory_backend = {
+  "directory", 1, 1,
+  directory_open, directory_get, directory_put, directory_del,
+  directory_size, directory_scan, directory_stats, directory_close
+};
+
+
+/* memory backend */
+
+// Key: path of cache entry
+// Value: PyString contents
+static PyObject* memory_entries = NULL;
+
+static int memory_open(void) {
+  memory_entries = PyDict_New();
+  return (memory_entries != NULL);
+}
+
+static int memory_get(PyObject* path, PyObject** data) {
+  *data = PyDict_GetItem(memory_entries, path);
+  if (*data) {
+    Py_INCREF(*data);
+    return MEMO_STORAGE_HIT;
+  }
+  return MEMO_STORAGE_MISS;
+}
+
+static int memory_put(PyObject* path, PyObject* data) {
+  if (PyDict_SetItem(memory_entries, path, data) != 0) {
+    PyErr_Clear();
+    return 0;
+  }
+  return 1;
+}
+
+static void memory_del(PyObject* path) {
+  if (PyDict_DelItem(memory_entries, path) != 0) {
+    PyErr_Clear();
+  }
+}
+
+static Py_ssize_t memory_size(PyObject* path) {
+  PyObject* data = PyDict_GetItem(memory_entries, path);
+  return data ? PyString_GET_SIZE(data) : -1;
+}
+
+static void memory_scan(PyObject* dir_path, PyObject* names, Py_ssize_t max_names) {
+  Py_ssize_t dir_len = PyString_GET_SIZE(dir_path);
+
+  PyObject* path = NULL;
+  PyObject* data = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(memory_entries, &pos, &path, &data)) {
+    char* path_str = PyString_AS_STRING(path);
+    Py_ssize_t len = PyString_GET_SIZE(path);
+    if ((len > dir_len + 8) &&
+        (strncmp(path_str, PyString_AS_STRING(dir_path), dir_len) == 0) &&
+        (path_str[dir_len] == '/') &&
+        !strchr(path_str + dir_len + 1, '/')) {
+      PyObject* name = PyString_FromStringAndSize(path_str + dir_len + 1, len - dir_len - 8);
+      PyList_Append(names, name);
+      Py_DECREF(name);
+
+      if (max_names && (PyList_GET_SIZE(names) >= max_names)) {
+        break;
+      }
+    }
+  }
+}
+
+static void memory_stats(PyObject* stats_dict) {
+  PY_LONG_LONG nbytes = 0;
+  PyObject* path = NULL;
+  PyObject* data = NULL;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(memory_entries, &pos, &path, &data)) {
+    nbytes += PyString_GET_SIZE(data);
+  }
+
+  PyObject* num_entries_obj = PyInt_FromSsize_t(PyDict_Size(memory_entries));
+  PyObject* nbytes_obj = PyInt_FromSize_t((size_t)nbytes);
+  PyDict_SetItemString(stats_dict, "num_entries", num_entries_obj);
+  PyDict_SetItemString(stats_dict, "nbytes", nbytes_obj);
+  Py_DECREF(num_entries_obj);
+  Py_DECREF(nbytes_obj);
+}
+
+static void memory_close(void) {
+  Py_CLEAR(memory_entries);
+}
+
+static MemoStorageBackend memory_backend = {
+  "memory", 0, 0,
+  memory_open, memory_get, memory_put, memory_del,
+  memory_size, memory_scan, memory_stats, memory_close
+};
+
+
+/* sqlite backend
+
+   All entries live in one table of SQLITE_DB_FILENAME in the cache
+   directory:
+
+     entries(path TEXT PRIMARY KEY, data BLOB)
+
+   where each path is relative to the cache directory's parent (see
+   portable_cache_path()), so that the database can be moved.
+
+   Every statement commits right away, and sqlite's own locking lets
+   several processes share the database (waiting up to
+   SQLITE_TIMEOUT_SEC for each other).  Entries are stored as BLOBs,
+   so they come back as buffers. */
+#define SQLITE_DB_FILENAME "entries.sqlite"
+#define SQLITE_TIMEOUT_SEC 60
+
+static PyObject* sqlite_conn = NULL;
+static pid_t sqlite_pid = 0; // the process that opened sqlite_conn
+
+static int sqlite_open(void);
+
+// returns 1 iff we have a connection to the database (re-opening it if
+// we've forked since it was opened)
+static int sqlite_connected(void) {
+  if (sqlite_pid == getpid()) {
+    return (sqlite_conn != NULL);
+  }
+
+  // sqlite_conn was inherited from our parent, which keeps using it.
+  // sqlite doesn't allow a connection to be used, or even closed, on
+  // both sides of a fork, so leak our copy and open our own
+  sqlite_conn = NULL;
+  return sqlite_open();
+}
+
+// runs sql with the given parameters (a tuple), and returns its cursor
+// (or NULL on error)
+static PyObject* sqlite_execute(char* sql, PyObject* params) {
+  PyObject* cursor = NULL;
+  if (params && !sqlite_connected()) {
+    Py_CLEAR(params);
+  }
+  if (params) {
+    cursor = PyObject_CallMethod(sqlite_conn, "execute", "sO", sql, params);
+    Py_DECREF(params);
+  }
+  if (!cursor) {
+    PyErr_Clear();
+  }
+  return cursor;
+}
+
+// runs sql and returns the first row of its results (or NULL if none)
+static PyObject* sqlite_fetchone(char* sql, PyObject* params) {
+  PyObject* cursor = sqlite_execute(sql, params);
+  if (!cursor) {
+    return NULL;
+  }
+
+  PyObject* row = PyObject_CallMethod(cursor, "fetchone", NULL);
+  Py_DECREF(cursor);
+  if (!row) {
+    PyErr_Clear();
+  }
+  else if (!PyTuple_Check(row)) {
+    Py_CLEAR(row); // None
+  }
+  return row;
+}
+
+static int sqlite_open(void) {
+  sqlite_pid = getpid();
+
+  PyObject* sqlite3_module = PyImport_ImportModule("sqlite3");
+  if (!sqlite3_module) {
+    PyErr_Clear();
+    return 0;
+  }
+
+  struct stat st;
+  if (stat(INCPY_CACHE_DIR, &st) != 0) {
+    mkdir(INCPY_CACHE_DIR, 0777);
+  }
+
+  // isolation_level=None means to commit after every statement
+  PyObject* connect_func = PyObject_GetAttrString(sqlite3_module, "connect");
+  PyObject* args = Py_BuildValue("(N)",
+                                 PyString_FromFormat("%s/" SQLITE_DB_FILENAME, INCPY_CACHE_DIR));
+  PyObject* kwargs = Py_BuildValue("{s:d,s:O}",
+                                   "timeout", (double)SQLITE_TIMEOUT_SEC,
+                                   "isolation_level", Py_None);
+  sqlite_conn = connect_func ? PyObject_Call(connect_func, args, kwargs) : NULL;
+  Py_XDECREF(connect_func);
+  Py_DECREF(args);
+  Py_DECREF(kwargs);
+  Py_DECREF(sqlite3_module);
+  if (!sqlite_conn) {
+    PyErr_Clear();
+    return 0;
+  }
+
+  // write-ahead logging lets readers proceed while another process
+  // writes, and since it's only a cache, it's fine to lose the last few
+  // entries if the machine crashes, so don't sync on every commit
+  PyObject* cursor = sqlite_execute("PRAGMA journal_mode=WAL", PyTuple_New(0));
+  Py_XDECREF(cursor);
+  cursor = sqlite_execute("PRAGMA synchronous=NORMAL", PyTuple_New(0));
+  Py_XDECREF(cursor);
+
+  cursor =
+    sqlite_execute("CREATE TABLE IF NOT EXISTS entries (path TEXT PRIMARY KEY, data BLOB)",
+                   PyTuple_New(0));
+  if (!cursor) {
+    Py_CLEAR(sqlite_conn);
+    return 0;
+  }
+  Py_DECREF(cursor);
+  return 1;
+}
+
+static int sqlite_get(PyObject* path, PyObject** data) {
+  PyObject* row = sqlite_fetchone("SELECT data FROM entries WHERE path = ?",
+                                  Py_BuildValue("(N)", portable_cache_path(path)));
+  if (!row) {
+    return MEMO_STORAGE_MISS;
+  }
+
+  // data comes back as a buffer
+  *data = PyObject_Str(PyTuple_GET_ITEM(row, 0));
+  Py_DECREF(row);
+  if (!*data) {
+    PyErr_Clear();
+    return MEMO_STORAGE_ERROR;
+  }
+  return MEMO_STORAGE_HIT;
+}
+
+static int sqlite_put(PyObject* path, PyObject* data) {
+  PyObject* data_buffer = PyBuffer_FromObject(data, 0, Py_END_OF_BUFFER);
+  if (!data_buffer) {
+    PyErr_Clear();
+    return 0;
+  }
+
+  PyObject* cursor =
+    sqlite_execute("INSERT OR REPLACE INTO entries (path, data) VALUES (?, ?)",
+                   Py_BuildValue("(NO)", portable_cache_path(path), data_buffer));
+  Py_DECREF(data_buffer);
+  Py_XDECREF(cursor);
+  return (cursor != NULL);
+}
+
+static void sqlite_del(PyObject* path) {
+  PyObject* cursor = sqlite_execute("DELETE FROM entries WHERE path = ?",
+                                    Py_BuildValue("(N)", portable_cache_path(path)));
+  Py_XDECREF(cursor);
+}
+
+static Py_ssize_t sqlite_size(PyObject* path) {
+  PyObject* row = sqlite_fetchone("SELECT LENGTH(data) FROM entries WHERE path = ?",
+                                  Py_BuildValue("(N)", portable_cache_path(path)));
+  if (!row) {
+    return -1;
+  }
+  Py_ssize_t size = PyInt_AsSsize_t(PyTuple_GET_ITEM(row, 0));
+  Py_DECREF(row);
+  if (PyErr_Occurred()) {
+    PyErr_Clear();
+    return -1;
+  }
+  return size;
+}
+
+static void sqlite_scan(PyObject* dir_path, PyObject* names, Py_ssize_t max_names) {
+  dir_path = portable_cache_path(dir_path);
+
+  // (all paths inside of dir_path are between dir_path + "/" and
+  //  dir_path + "0", since '0' comes right after '/')
+  PyObject* cursor =
+    sqlite_execute("SELECT path FROM entries WHERE path >= ? AND path < ? LIMIT ?",
+                   Py_BuildValue("(NNn)",
+                                 PyString_FromFormat("%s/", PyString_AsString(dir_path)),
+                                 PyString_FromFormat("%s0", PyString_AsString(dir_path)),
+                                 max_names ? max_names : (Py_ssize_t)-1));
+  PyObject* rows = cursor ? PyObject_CallMethod(cursor, "fetchall", NULL) : NULL;
+  Py_XDECREF(cursor);
+  if (!rows) {
+    PyErr_Clear();
+    Py_DECREF(dir_path);
+    return;
+  }
+
+  Py_ssize_t dir_len = PyString_GET_SIZE(dir_path);
+  Py_ssize_t i;
+  for (i = 0; i < PyList_GET_SIZE(rows); i++) {
+    // paths come back as unicode
+    PyObject* path = PyObject_Str(PyTuple_GET_ITEM(PyList_GET_ITEM(rows, i), 0));
+    if (!path) {
+      PyErr_Clear();
+      continue;
+    }
+    Py_ssize_t len = PyString_GET_SIZE(path);
+    if ((len > dir_len + 8) && !strchr(PyString_AS_STRING(path) + dir_len + 1, '/')) {
+      PyObject* name =
+        PyString_FromStringAndSize(PyString_AS_STRING(path) + dir_len + 1, len - dir_len - 8);
+      PyList_Append(names, name);
+      Py_DECREF(name);
+    }
+    Py_DECREF(path);
+  }
+  Py_DECREF(rows);
+  Py_DECREF(dir_path);
+}
+
+static void sqlite_stats(PyObject* stats_dict) {
+  PyObject* row = sqlite_fetchone("SELECT COUNT(*), IFNULL(SUM(LENGTH(data)), 0) FROM entries",
+                                  PyTuple_New(0));
+  if (row) {
+    PyDict_SetItemString(stats_dict, "num_entries", PyTuple_GET_ITEM(row, 0));
+    PyDict_SetItemString(stats_dict, "nbytes", PyTuple_GET_ITEM(row, 1));
+    Py_DECREF(row);
+  }
+}
+
+static void sqlite_close(void) {
+  if (sqlite_conn) {
+    PyObject* res = PyObject_CallMethod(sqlite_conn, "close", NULL);
+    if (!res) {
+      PyErr_Clear();
+    }
+    Py_XDECREF(res);
+    Py_CLEAR(sqlite_conn);
+  }
+}
+
+static MemoStorageBackend sqlite_backend = {
+  "sqlite", 0, 1,
+  sqlite_open, sqlite_get, sqlite_put, sqlite_del,
+  sqlite_size, sqlite_scan, sqlite_stats, sqlite_close
+};
+
+
+/* dispatching to the current backend */
+
+static MemoStorageBackend* all_backends[] = {
+  &directory_backend,
+  &sqlite_backend,
+  &memory_backend,
+  NULL
+};
+
+MemoStorageBackend* memo_storage = &directory_backend;
+
+// counts of operations during this execution
+static unsigned long num_gets = 0;
+static unsigned long num_hits = 0;
+static unsigned long num_puts = 0;
+static unsigned long num_failed_puts = 0;
+static unsigned long num_dels = 0;
+static PY_LONG_LONG num_bytes_read = 0;
+static PY_LONG_LONG num_bytes_written = 0;
+
+
+// (called while parsing incpy.config)
+//
+// returns 0 if there's no backend with that name
+int select_memo_storage(char* name) {
+  MemoStorageBackend** b;
+  for (b = all_backends; *b; b++) {
+    if (strcmp((*b)->name, name) == 0) {
+      memo_storage = *b;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// (called from pg_initialize())
+//
+// returns 0 if we had to fall back on the directory backend
+int open_memo_storage(void) {
+  if (memo_storage->open()) {
+    return 1;
+  }
+
+  memo_storage = &directory_backend;
+  memo_storage->open();
+  return 0;
+}
+
+// (called from pg_finalize())
+void close_memo_storage(void) {
+  memo_storage->close();
+  num_gets = num_hits = num_puts = num_failed_puts = num_dels = 0;
+  num_bytes_read = num_bytes_written = 0;
+}
+
+int memo_storage_GET(PyObject* path, PyObject** data) {
+  *data = NULL;
+  int status = memo_storage->get(path, data);
+  num_gets++;
+  if (status == MEMO_STORAGE_HIT) {
+    num_hits++;
+    num_bytes_read += PyString_GET_SIZE(*data);
+  }
+  return status;
+}
+
+int memo_storage_PUT(PyObject* path, PyObject* data) {
+  int success = memo_storage->put(path, data);
+  if (success) {
+    num_puts++;
+    num_bytes_written += PyString_GET_SIZE(data);
+  }
+  else {
+    num_failed_puts++;
+  }
+  return success;
+}
+
+void memo_storage_DEL(PyObject* path) {
+  memo_storage->del(path);
+  num_dels++;
+}
+
+Py_ssize_t memo_storage_SIZE(PyObject* path) {
+  return memo_storage->size(path);
+}
+
+// returns a new list of the names of entries in the version
+// sub-directory at dir_path (see MemoStorageBackend.scan)
+PyObject* memo_storage_SCAN(PyObject* dir_path, Py_ssize_t max_names) {
+  PyObject* names = PyList_New(0);
+  memo_storage->scan(dir_path, names, max_names);
+  return names;
+}
+
+// deletes all entries in the version sub-directory at dir_path, which
+// is about to be tombstoned
+void memo_storage_DROP_DIR(PyObject* dir_path) {
+  if (memo_storage->entries_live_in_version_dirs) {
+    return; // they're going away along with it
+  }
+
+  PyObject* names = memo_storage_SCAN(dir_path, 0);
+  Py_ssize_t i;
+  for (i = 0; i < PyList_GET_SIZE(names); i++) {
+    PyObject* path = PyString_FromFormat("%s/%s.pickle",
+                                         PyString_AsString(dir_path),
+                                         PyString_AsString(PyList_GET_ITEM(names, i)));
+    memo_storage_DEL(path);
+    Py_DECREF(path);
+  }
+  Py_DECREF(names);
+}
+
+// returns a new dict of statistics about the current backend
+PyObject* memo_storage_STATS(void) {
+  PyObject* stats_dict = PyDict_New();
+  PyObject* backend_name = PyString_FromString(memo_storage->name);
+  PyDict_SetItemString(stats_dict, "backend", backend_name);
+  Py_DECREF(backend_name);
+
+#define SET_STAT(field, obj) \
+  do { \
+    PyObject* o = (obj); \
+    PyDict_SetItemString(stats_dict, field, o); \
+    Py_DECREF(o); \
+  } while (0)
+
+  SET_STAT("gets", PyInt_FromSize_t((size_t)num_gets));
+  SET_STAT("hits", PyInt_FromSize_t((size_t)num_hits));
+  SET_STAT("puts", PyInt_FromSize_t((size_t)num_puts));
+  SET_STAT("failed_puts", PyInt_FromSize_t((size_t)num_failed_puts));
+  SET_STAT("dels", PyInt_FromSize_t((size_t)num_dels));
+  SET_STAT("bytes_read", PyInt_FromSize_t((size_t)num_bytes_read));
+  SET_STAT("bytes_written", PyInt_FromSize_t((size_t)num_bytes_written));
+#undef SET_STAT
+
+  memo_storage->stats(stats_dict);
+  return stats_dict;
+}
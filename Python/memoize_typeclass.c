@@ -0,0 +1,111 @@
+/* Per-type classification cache
+
+   IncPy: An auto-memoizing Python interpreter supporting incremental
+   recomputation. Copyright 2009-2010 Philip J. Guo (pg@cs.stanford.edu)
+   All rights reserved.
+
+   This code carries the same license as the enclosing Python
+   distribution: http://www.python.org/psf/license/
+
+*/
+
+#include "memoize_typeclass.h"
+
+#include <string.h>
+
+
+TypeClassEntry type_class_cache[TYPE_CLASS_CACHE_SIZE];
+
+// any attribute name will do; looking it up gives a type a version tag
+static PyObject* version_tag_probe_str = NULL;
+
+
+// kinda gross that we have to hard-code the NumPy basic data types,
+// hmmm ... http://docs.scipy.org/doc/numpy/user/basics.types.html
+static int is_numpy_scalar_type(const char* name) {
+  return ((strncmp(name, "numpy", 5) == 0) &&
+          ((strcmp(name,  "numpy.bool") == 0) ||
+           (strncmp(name, "numpy.int", 9) == 0) ||
+           (strncmp(name, "numpy.uint", 10) == 0) ||
+           (strncmp(name, "numpy.float", 11) == 0) ||
+           (strncmp(name, "numpy.complex", 13) == 0)));
+}
+
+static unsigned int compute_type_class(PyTypeObject* t) {
+  unsigned int bits = 0;
+
+  // (these all used to be *_CheckExact() tests on objects)
+  int is_primitive = ((t == Py_TYPE(Py_None)) ||
+                      (t == &PyString_Type) ||
+                      (t == &PyInt_Type) ||
+                      (t == &PyLong_Type) ||
+                      (t == &PyBool_Type) ||
+                      (t == &PyComplex_Type) ||
+                      (t == &PyFloat_Type) ||
+                      (t == &PyUnicode_Type));
+
+  // code and other objects that we never try to pickle
+  int is_unpicklable = ((t == &PyFunction_Type) ||
+                        (t == &PyCFunction_Type) ||
+                        (t == &PyMethod_Type) ||
+                        (t == &PyType_Type) ||
+                        (t == &PyClass_Type) ||
+                        (t == &PyFile_Type));
+
+  if (is_primitive || is_unpicklable || is_numpy_scalar_type(t->tp_name)) {
+    bits |= TYPECLASS_DEFINITELY_IMMUTABLE;
+  }
+
+  if (is_unpicklable ||
+      (t == &PyModule_Type) ||
+      (strcmp(t->tp_name, "sqlite3.Cursor") == 0)) {
+    bits |= TYPECLASS_NEVER_PICKLE;
+  }
+
+  // instance objects always have tp_compare and tp_richcompare
+  // methods, so we need to check each one for __eq__
+  if (t == &PyInstance_Type) {
+    bits |= TYPECLASS_INSTANCE;
+  }
+  // primitive types should pass with flying colors, even if they
+  // don't explicitly implement a comparison method, and compiled
+  // regular expression patterns do some sort of interning that allows
+  // them to be compared properly using '=='
+  else if (is_primitive ||
+           (strcmp(t->tp_name, "_sre.SRE_Pattern") == 0) ||
+           t->tp_compare || t->tp_richcompare) {
+    bits |= TYPECLASS_HAS_COMPARISON;
+  }
+
+  return bits;
+}
+
+unsigned int classify_type(PyTypeObject* t) {
+  unsigned int bits = compute_type_class(t);
+
+  // we can only trust a cache entry for a class while its version tag
+  // stays valid, so make sure that it has one
+  if (PyType_HasFeature(t, Py_TPFLAGS_HEAPTYPE) &&
+      !PyType_HasFeature(t, Py_TPFLAGS_VALID_VERSION_TAG)) {
+    if (!version_tag_probe_str) {
+      version_tag_probe_str = PyString_InternFromString("__eq__");
+      if (!version_tag_probe_str) {
+        PyErr_Clear();
+        return bits;
+      }
+    }
+    _PyType_Lookup(t, version_tag_probe_str);
+
+    // (e.g., a subclass of an extension type that doesn't support
+    //  version tags, so just don't cache it)
+    if (!PyType_HasFeature(t, Py_TPFLAGS_VALID_VERSION_TAG)) {
+      return bits;
+    }
+  }
+
+  TypeClassEntry* entry = &TYPE_CLASS_ENTRY(t);
+  entry->type = t;
+  entry->version = t->tp_version_tag;
+  entry->bits = bits;
+  return bits;
+}
@@ -0,0 +1,81 @@
+# benchmarks cPickle on large nested structures that look like the
+# object graphs that IncPy pickles (memo table entries, argument lists,
+# and the results of data analysis functions), mostly to measure the
+# cost of the Pickler and Unpickler memos (see MemoTable in
+# Modules/cPickle.c)
+#
+# usage: python bench_cpickle.py [--size=<n>] [--repeat=<n>]
+#
+# For each structure and protocol, prints the best time out of --repeat
+# runs of dumps() and of loads(), and the size of the pickle.
+#
+# (Run it with a regular Python, or else put this directory in an
+#  'ignore = ' line in incpy.config, since otherwise IncPy might
+#  memoize the functions being timed)
+
+import cPickle, time
+from optparse import OptionParser
+
+
+def shared_records(n):
+  '''a list of dicts that share their keys and some of their values'''
+  tags = [('tag%d' % i,) for i in range(32)]
+  return [{'id': i, 'name': 'record %d' % i, 'tags': tags[i % 32],
+           'scores': [float(i), i * 0.5, -1.0]}
+          for i in xrange(n)]
+
+
+def nested_lists(n):
+  '''a tree of lists and tuples, four levels deep'''
+  width = max(int(n ** 0.25), 2)
+  def build(depth):
+    if depth == 0:
+      return [str(i) for i in range(width)]
+    return [(build(depth - 1), depth) for i in range(width)]
+  return build(4)
+
+
+def memo_entries(n):
+  '''memo table entries for n calls of a function on overlapping
+     argument lists, in the same form as memoize.c creates them'''
+  rows = [[i, i * 2, str(i)] for i in xrange(n)]
+  entries = []
+  for i in xrange(0, n, 100):
+    args = (rows[i:i+100],)
+    entries.append({'canonical_name': 'analysis.py:summarize',
+                    'args': args,
+                    'retval': dict((r[2], r) for r in args[0]),
+                    'runtime_ms': i,
+                    'files_read': {'data.csv': 1234567890.0}})
+  return entries
+
+
+def best_time(func, arg, repeat):
+  best = None
+  for i in range(repeat):
+    start = time.time()
+    result = func(arg)
+    elapsed = time.time() - start
+    if best is None or elapsed < best:
+      best = elapsed
+  return (best, result)
+
+
+if __name__ == "__main__":
+  parser = OptionParser()
+  parser.add_option('--size', type='int', dest='size', default=200000)
+  parser.add_option('--repeat', type='int', dest='repeat', default=3)
+  (options, args) = parser.parse_args()
+
+  print '%-16s %5s %12s %12s %12s' % ('structure', 'proto',
+                                      'dumps ms', 'loads ms', 'bytes')
+  for make_structure in (shared_records, nested_lists, memo_entries):
+    obj = make_structure(options.size)
+    for proto in (0, 2):
+      (dumps_time, s) = best_time(lambda o: cPickle.dumps(o, proto),
+                                  obj, options.repeat)
+      (loads_time, copy) = best_time(cPickle.loads, s, options.repeat)
+      assert copy == obj
+      print '%-16s %5d %12.1f %12.1f %12d' % (make_structure.__name__, proto,
+                                              dumps_time * 1000,
+                                              loads_time * 1000, len(s))
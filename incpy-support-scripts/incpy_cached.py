@@ -0,0 +1,272 @@
+# incpy-cached: a cache server daemon that reads, writes, and deletes
+# cache entry files on behalf of all IncPy processes on this machine
+# whose incpy.config contains this line:
+#
+#   cache_server = <path of the socket>
+#
+# It stores everything in the same incpy-cache/ directories as always,
+# but also keeps the most recently-used entries in RAM (the 'hot tier')
+# so that processes get fast hits on each other's popular entries.  If
+# it isn't running, IncPy processes simply access the files directly.
+# (see Python/memoize_cacheserver.c for the protocol)
+#
+# usage:
+#
+#   python incpy_cached.py [--hot-mb=<size>] <socket path>
+#   python incpy_cached.py --stat <socket path>
+#
+# --hot-mb is the max size of the hot tier in MEGABYTES (default 256)
+#
+# Run it with a regular Python (or add this directory to the ignore
+# lines of incpy.config), since it's not worth memoizing.
+
+import os, re, sys, stat, errno, socket, struct, threading
+from optparse import OptionParser
+from SocketServer import ThreadingMixIn, UnixStreamServer, StreamRequestHandler
+
+HOT_TIER_LOW_WATER_PERCENT = 90
+
+
+# <cache dir>/<hash of function name>.cache/<version>/<hash of key>.pickle
+ENTRY_PATH_RE = re.compile(r'/[0-9a-f]{32}\.cache/[0-9a-f]{32}/[0-9a-f]{32}\.pickle$')
+
+def valid_path(path):
+  # only ever touch cache entry files (which can be in any cache
+  # directory, since incpy.config can set cache_dir)
+  return path.startswith('/') and ENTRY_PATH_RE.search(path) and \
+         '/../' not in path
+
+
+class HotTier:
+  def __init__(self, max_bytes):
+    self.max_bytes = max_bytes
+    self.cur_bytes = 0
+    self.entries = {} # path -> [data, file stamp, last access]
+    self.clock = 0
+    self.lock = threading.Lock()
+
+  def get(self, path, file_stamp):
+    self.lock.acquire()
+    try:
+      e = self.entries.get(path)
+      if e and e[1] == file_stamp:
+        self.clock += 1
+        e[2] = self.clock
+        return e[0]
+      return None
+    finally:
+      self.lock.release()
+
+  def put(self, path, data, file_stamp):
+    if len(data) > self.max_bytes:
+      return
+    self.lock.acquire()
+    try:
+      self._drop(path)
+      self.clock += 1
+      self.entries[path] = [data, file_stamp, self.clock]
+      self.cur_bytes += len(data)
+      if self.cur_bytes > self.max_bytes:
+        # evict least-recently-used entries in one batch
+        target_bytes = self.max_bytes * HOT_TIER_LOW_WATER_PERCENT / 100
+        for (p, e) in sorted(self.entries.items(), key=lambda x: x[1][2]):
+          if self.cur_bytes <= target_bytes:
+            break
+          self._drop(p)
+    finally:
+      self.lock.release()
+
+  def drop(self, path):
+    self.lock.acquire()
+    try:
+      self._drop(path)
+    finally:
+      self.lock.release()
+
+  def _drop(self, path):
+    e = self.entries.pop(path, None)
+    if e:
+      self.cur_bytes -= len(e[0])
+
+
+def get_file_stamp(path):
+  # detects when IncPy processes that aren't using this daemon (or
+  # sweep_cache.py) change a file behind our back
+  try:
+    st = os.stat(path)
+  except OSError:
+    return None
+  return (st[stat.ST_INO], st[stat.ST_SIZE], st[stat.ST_MTIME])
+
+
+class CacheServer(ThreadingMixIn, UnixStreamServer):
+  daemon_threads = True
+
+  def __init__(self, socket_path, hot_tier_bytes):
+    UnixStreamServer.__init__(self, socket_path, CacheRequestHandler)
+    self.hot_tier = HotTier(hot_tier_bytes)
+    self.stats = dict(gets=0, hot_hits=0, disk_hits=0, misses=0, puts=0, dels=0)
+    self.stats_lock = threading.Lock()
+
+  def count(self, stat_name):
+    self.stats_lock.acquire()
+    self.stats[stat_name] += 1
+    self.stats_lock.release()
+
+  def GET(self, path):
+    self.count('gets')
+    if not valid_path(path):
+      self.count('misses')
+      return None
+
+    file_stamp = get_file_stamp(path)
+    if not file_stamp:
+      self.hot_tier.drop(path)
+      self.count('misses')
+      return None
+
+    data = self.hot_tier.get(path, file_stamp)
+    if data is not None:
+      self.count('hot_hits')
+      return data
+
+    try:
+      f = open(path, 'rb')
+      data = f.read()
+      f.close()
+    except IOError:
+      self.count('misses')
+      return None
+    self.hot_tier.put(path, data, file_stamp)
+    self.count('disk_hits')
+    return data
+
+  def PUT(self, path, data):
+    self.count('puts')
+    if not valid_path(path):
+      return False
+
+    # same temp file + rename scheme as IncPy uses for direct writes
+    tmp_path = '%s.partial.%d.%d' % (path, os.getpid(), threading.currentThread().ident)
+    try:
+      f = open(tmp_path, 'wb')
+      f.write(data)
+      f.close()
+      os.rename(tmp_path, path)
+    except (IOError, OSError):
+      try:
+        os.unlink(tmp_path)
+      except OSError:
+        pass
+      return False
+
+    file_stamp = get_file_stamp(path)
+    if file_stamp:
+      self.hot_tier.put(path, data, file_stamp)
+    return True
+
+  def DEL(self, path):
+    self.count('dels')
+    if valid_path(path):
+      self.hot_tier.drop(path)
+      try:
+        os.unlink(path)
+      except OSError:
+        pass
+
+  def STAT(self):
+    self.stats_lock.acquire()
+    d = dict(self.stats)
+    self.stats_lock.release()
+    d['hot_entries'] = len(self.hot_tier.entries)
+    d['hot_bytes'] = self.hot_tier.cur_bytes
+    return ' '.join('%s=%d' % (k, d[k]) for k in sorted(d))
+
+
+class CacheRequestHandler(StreamRequestHandler):
+  def read_exactly(self, n):
+    buf = self.rfile.read(n)
+    if len(buf) != n:
+      raise EOFError
+    return buf
+
+  def read_uint32(self):
+    return struct.unpack('!I', self.read_exactly(4))[0]
+
+  def read_field(self):
+    return self.read_exactly(self.read_uint32())
+
+  def data_reply(self, data):
+    if data is None:
+      return '-'
+    return '+' + struct.pack('!I', len(data)) + data
+
+  def handle(self):
+    server = self.server
+    try:
+      while True:
+        op = self.rfile.read(1)
+        if not op:
+          break # client hung up
+
+        if op == 'G':
+          reply = self.data_reply(server.GET(self.read_field()))
+        elif op == 'M':
+          paths = [self.read_field() for i in range(self.read_uint32())]
+          reply = ''.join(self.data_reply(server.GET(p)) for p in paths)
+        elif op == 'P':
+          path = self.read_field()
+          data = self.read_field()
+          reply = server.PUT(path, data) and '+' or '-'
+        elif op == 'D':
+          server.DEL(self.read_field())
+          reply = '+'
+        elif op == 'S':
+          reply = self.data_reply(server.STAT())
+        else:
+          break # protocol error, so hang up
+
+        self.wfile.write(reply)
+        self.wfile.flush()
+    except (EOFError, socket.error):
+      pass
+
+
+def print_stats(socket_path):
+  s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+  s.connect(socket_path)
+  s.sendall('S')
+  f = s.makefile('rb')
+  assert f.read(1) == '+'
+  (n,) = struct.unpack('!I', f.read(4))
+  print f.read(n)
+  s.close()
+
+
+if __name__ == "__main__":
+  parser = OptionParser(usage='%prog [--hot-mb=<size>] [--stat] <socket path>')
+  parser.add_option('--hot-mb', type='int', dest='hot_mb', default=256)
+  parser.add_option('--stat', action='store_true', dest='stat', default=False)
+  (options, args) = parser.parse_args()
+  if len(args) != 1:
+    parser.error('must specify a socket path')
+  socket_path = args[0]
+
+  if options.stat:
+    print_stats(socket_path)
+    sys.exit(0)
+
+  # clear out the socket left by a previous daemon that died
+  if os.path.exists(socket_path):
+    try:
+      socket.socket(socket.AF_UNIX, socket.SOCK_STREAM).connect(socket_path)
+      print >> sys.stderr, 'ERROR: another daemon is already listening on', socket_path
+      sys.exit(1)
+    except socket.error:
+      os.unlink(socket_path)
+
+  server = CacheServer(socket_path, options.hot_mb * 1024 * 1024)
+  try:
+    server.serve_forever()
+  finally:
+    os.unlink(socket_path)
@@ -0,0 +1,129 @@
+# reads cache entry files, which the interpreter stores as either plain
+# pickles or as encoded entries (binary records, marshaled, and/or
+# compressed) that start with a header (see Python/memoize_codec.c and
+# Python/memoize_record.c)
+#
+# usage:
+#
+#   from incpy_entries import load_entry_file
+#   memo_table_entry_lst = load_entry_file(path)
+#
+# This works with a regular Python too, although it can't decode
+# entries compressed with zlib if the zlib module is unavailable.
+
+import marshal, struct
+import cPickle
+
+ENTRY_MAGIC = '\xc7'
+ENTRY_FORMAT_VERSION = 1
+ENTRY_HEADER_SIZE = 8
+
+CODEC_NONE, CODEC_LZ, CODEC_ZLIB = range(3)
+SERIALIZER_PICKLE, SERIALIZER_MARSHAL, SERIALIZER_RECORD = range(3)
+
+RECORD_FORMAT_VERSION = 1
+RECORD_FIELDS = ('canonical_name', 'args', 'retval', 'code_dependencies',
+                 'global_vars_read', 'files_read', 'files_written',
+                 'stdout_buf', 'stderr_buf', 'final_file_seek_pos')
+
+
+def lz_decompress(data, out_len):
+  # see the comment above lz_compress() in Python/memoize_codec.c
+  out = bytearray()
+  ip = 0
+  while ip < len(data):
+    c = ord(data[ip])
+    ip += 1
+    if c < 32:
+      out += data[ip:ip + c + 1]
+      ip += c + 1
+    else:
+      length = c >> 5
+      if length == 7:
+        length += ord(data[ip])
+        ip += 1
+      off = ((c & 0x1f) << 8) + ord(data[ip]) + 1
+      ip += 1
+      length += 2
+      ref = len(out) - off
+      if ref < 0:
+        raise ValueError('corrupted LZ data')
+      if off >= length:
+        out += out[ref:ref + length]
+      else:
+        # (byte-by-byte, since the source and destination overlap)
+        for i in xrange(length):
+          out.append(out[ref + i])
+  if len(out) != out_len:
+    raise ValueError('corrupted LZ data')
+  return str(out)
+
+
+def adler32(data):
+  try:
+    import zlib
+    return zlib.adler32(data) & 0xffffffff
+  except ImportError:
+    a, b = 1, 0
+    for c in data:
+      a = (a + ord(c)) % 65521
+      b = (b + a) % 65521
+    return (b << 16) | a
+
+
+def deserialize(data, serializer):
+  if serializer == SERIALIZER_RECORD:
+    return decode_records(data)
+  elif serializer == SERIALIZER_MARSHAL:
+    return marshal.loads(data)
+  return cPickle.loads(data)
+
+
+def decode_records(data):
+  (checksum, version, num_records) = struct.unpack('!IBxH', data[:8])
+  if checksum != adler32(data[4:]):
+    raise ValueError('corrupted cache entry (bad checksum)')
+  if version != RECORD_FORMAT_VERSION:
+    raise ValueError('unknown record format version %d' % version)
+
+  entries = []
+  pos = 8
+  for i in range(num_records):
+    (record_len, runtime_ms, flags, num_sections) = \
+      struct.unpack('!IIHBx', data[pos:pos + 12])
+    entry = {'runtime_ms': runtime_ms}
+    for j in range(num_sections):
+      (field, serializer, offset, length) = \
+        struct.unpack('!BBxxII', data[pos + 12 + j * 12:pos + 24 + j * 12])
+      section = data[pos + offset:pos + offset + length]
+      entry[RECORD_FIELDS[field]] = deserialize(section, serializer)
+    entries.append(entry)
+    pos += record_len
+  return entries
+
+
+def decode_entry(data):
+  if not data.startswith(ENTRY_MAGIC):
+    return cPickle.loads(data)
+
+  (magic, version, codec, serializer, n) = struct.unpack('!BBBBI', data[:ENTRY_HEADER_SIZE])
+  if version != ENTRY_FORMAT_VERSION:
+    raise ValueError('unknown entry format version %d' % version)
+  body = data[ENTRY_HEADER_SIZE:]
+  if codec == CODEC_LZ:
+    body = lz_decompress(body, n)
+  elif codec == CODEC_ZLIB:
+    import zlib
+    body = zlib.decompress(body)
+  elif codec != CODEC_NONE:
+    raise ValueError('unknown codec %d' % codec)
+
+  return deserialize(body, serializer)
+
+
+def load_entry_file(path):
+  f = open(path, 'rb')
+  try:
+    return decode_entry(f.read())
+  finally:
+    f.close()
@@ -0,0 +1,335 @@
+# evicts entries from a directory's incpy-cache/ sub-directory until it
+# fits within its budget, using the same policy as the interpreter
+# (see Python/memoize_eviction.c)
+#
+# pass in a directory (argv[1]) that contains an incpy-cache/ sub-directory
+# (or a cache directory set with cache_dir in incpy.config)
+#
+# by default, budgets are read from the cache_budget and
+# func_cache_budget lines of $HOME/incpy.config, but you can override
+# them with these options (in MEGABYTES):
+#
+#   --budget=<size>        max size of the entire incpy-cache/
+#   --func-budget=<size>   max size of each function's entries
+#
+# Unlike the interpreter, this also indexes cache entry files that
+# incpy-cache/cache_index.pickle doesn't know about (e.g., ones created
+# before budgets were turned on), so run it once after turning them on.
+#
+# It's safe to run while IncPy processes are using the cache, since it
+# takes the same locks that they do, and it sweeps whichever storage
+# backend the storage line of $HOME/incpy.config selects (entries of
+# the memory backend never outlive their process, so there's nothing
+# to sweep then).
+
+import os, sys, stat, time, fcntl
+import cPickle
+from hashlib import md5
+from optparse import OptionParser
+from incpy_entries import load_entry_file, decode_entry
+
+EVICTION_LOW_WATER_PERCENT = 90
+
+# the file in each cache version sub-directory that isn't a cache entry
+CODE_DEPS_FILENAME = 'code_dependencies.pickle'
+
+# the same bytes of incpy-cache/cache.lock that the interpreter locks
+# (see "Concurrency" in Python/memoize_fmi.c): we hold the cache index
+# lock throughout, and then lock each entry that we evict and then its
+# version, just like the interpreter does
+CACHE_LOCK_FILENAME = 'cache.lock'
+NUM_LOCK_SLOTS = 65536
+CACHE_INDEX_LOCK_OFFSET = 2 * NUM_LOCK_SLOTS
+
+# fields of each record in the cache index
+REC_NBYTES, REC_RUNTIME_MS, REC_NUM_HITS, REC_LAST_ACCESS = range(4)
+
+
+def read_config():
+  budget = func_budget = 0
+  storage = 'directory'
+  config_path = os.path.join(os.getenv('HOME'), 'incpy.config')
+  if os.path.isfile(config_path):
+    for line in open(config_path):
+      toks = line.split('=')
+      if len(toks) == 2:
+        lhs, rhs = toks[0].strip(), toks[1].strip()
+        if lhs == 'cache_budget':
+          budget = int(rhs)
+        elif lhs == 'func_cache_budget':
+          func_budget = int(rhs)
+        elif lhs == 'storage':
+          storage = rhs
+  return budget, func_budget, storage
+
+
+def load_entries(pickle_path):
+  try:
+    return load_entry_file(pickle_path)
+  except:
+    return None
+
+
+# each entry is named by its path relative to the cache directory,
+# '<hash of function name>.cache/<version>/<hash of key>.pickle'
+
+class DirectoryStore:
+  def __init__(self, cache_dir):
+    self.cache_dir = cache_dir
+
+  def list_entries(self):
+    for d in os.listdir(self.cache_dir):
+      cache_dir_path = os.path.join(self.cache_dir, d)
+      if not (d.endswith('.cache') and os.path.isdir(cache_dir_path)):
+        continue
+      for version in os.listdir(cache_dir_path):
+        version_dir_path = os.path.join(cache_dir_path, version)
+        if not os.path.isdir(version_dir_path):
+          continue
+        for f in os.listdir(version_dir_path):
+          if f.endswith('.pickle') and f != CODE_DEPS_FILENAME:
+            yield '%s/%s/%s' % (d, version, f)
+
+  def size(self, entry):
+    try:
+      return os.stat(os.path.join(self.cache_dir, entry))[stat.ST_SIZE]
+    except OSError:
+      return None
+
+  def load(self, entry):
+    return load_entries(os.path.join(self.cache_dir, entry))
+
+  def delete(self, entry):
+    try:
+      os.unlink(os.path.join(self.cache_dir, entry))
+    except OSError:
+      pass
+
+  def version_is_empty(self, subdir, version):
+    version_dir_path = os.path.join(self.cache_dir, subdir, version)
+    return os.listdir(version_dir_path) == [CODE_DEPS_FILENAME]
+
+
+# (see "sqlite backend" in Python/memoize_storage.c)
+class SqliteStore:
+  def __init__(self, cache_dir):
+    import sqlite3
+    self.conn = sqlite3.connect(os.path.join(cache_dir, 'entries.sqlite'),
+                                timeout=60, isolation_level=None)
+
+  def list_entries(self):
+    rows = self.conn.execute('SELECT path FROM entries').fetchall()
+    for (path,) in rows:
+      path = str(path)
+      if path.startswith('incpy-cache/') and path.count('/') == 3:
+        yield path[len('incpy-cache/'):]
+
+  def size(self, entry):
+    row = self.conn.execute('SELECT LENGTH(data) FROM entries WHERE path = ?',
+                            ('incpy-cache/' + entry,)).fetchone()
+    return row and row[0]
+
+  def load(self, entry):
+    row = self.conn.execute('SELECT data FROM entries WHERE path = ?',
+                            ('incpy-cache/' + entry,)).fetchone()
+    try:
+      return decode_entry(str(row[0]))
+    except:
+      return None
+
+  def delete(self, entry):
+    self.conn.execute('DELETE FROM entries WHERE path = ?', ('incpy-cache/' + entry,))
+
+  def version_is_empty(self, subdir, version):
+    # (all paths inside of a version are between its path + '/' and its
+    #  path + '0', since '0' comes right after '/')
+    prefix = 'incpy-cache/%s/%s' % (subdir, version)
+    row = self.conn.execute('SELECT 1 FROM entries WHERE path >= ? AND path < ? LIMIT 1',
+                            (prefix + '/', prefix + '0')).fetchone()
+    return row is None
+
+
+class CacheLock:
+  def __init__(self, cache_dir):
+    self.f = open(os.path.join(cache_dir, CACHE_LOCK_FILENAME), 'a+')
+
+  # the byte for path (relative to the cache directory), hashed just
+  # like lock_slot() in Python/memoize_fmi.c does
+  def slot(self, path):
+    h = 5381
+    for c in 'incpy-cache/' + path:
+      h = (h * 33 + ord(c)) % NUM_LOCK_SLOTS
+    return h
+
+  def lock(self, offset):
+    fcntl.lockf(self.f, fcntl.LOCK_EX, 1, offset)
+
+  def unlock(self, offset):
+    fcntl.lockf(self.f, fcntl.LOCK_UN, 1, offset)
+
+
+def eviction_key(rec):
+  saved_ms = rec[REC_RUNTIME_MS] * (rec[REC_NUM_HITS] + 1)
+  tier = 0
+  while saved_ms >= 10:
+    saved_ms /= 10.0
+    tier += 1
+  saved_ms_per_byte = (rec[REC_RUNTIME_MS] * (rec[REC_NUM_HITS] + 1)) / float(max(rec[REC_NBYTES], 1))
+  return (tier, saved_ms_per_byte, rec[REC_LAST_ACCESS])
+
+
+def evict_entry(store, cache_dir, lock, entry):
+  # returns how many bytes that freed up, or None if it was already gone
+  (subdir, version, f) = entry.split('/')
+  entry_lock = lock.slot('%s/%s' % (subdir, f[:-len('.pickle')]))
+  version_lock = NUM_LOCK_SLOTS + lock.slot('%s/%s' % (subdir, version))
+
+  lock.lock(entry_lock)
+  try:
+    # (an IncPy process might have re-written or deleted it since we
+    #  looked at it)
+    nbytes = store.size(entry)
+    if nbytes is None:
+      return None
+    store.delete(entry)
+
+    # erase its version sub-directory (and the function's sub-directory)
+    # if there's nothing left in it except for its code dependencies
+    lock.lock(version_lock)
+    try:
+      version_dir_path = os.path.join(cache_dir, subdir, version)
+      if os.path.isdir(version_dir_path) and store.version_is_empty(subdir, version):
+        os.unlink(os.path.join(version_dir_path, CODE_DEPS_FILENAME))
+        os.rmdir(version_dir_path)
+        try:
+          os.rmdir(os.path.dirname(version_dir_path))
+        except OSError:
+          pass # still has other versions
+    finally:
+      lock.unlock(version_lock)
+    return nbytes
+  finally:
+    lock.unlock(entry_lock)
+
+
+def evict_down_to(files, target_bytes, store, cache_dir, lock):
+  # files is a list of (entry, canonical_name, key, rec) tuples
+  cur_bytes = sum(e[3][REC_NBYTES] for e in files)
+  evicted = []
+  for e in sorted(files, key=lambda e: eviction_key(e[3])):
+    if cur_bytes <= target_bytes:
+      break
+    nbytes = evict_entry(store, cache_dir, lock, e[0])
+    cur_bytes -= e[3][REC_NBYTES]
+    if nbytes is not None:
+      e[3][REC_NBYTES] = nbytes
+      evicted.append(e)
+  return evicted
+
+
+if __name__ == "__main__":
+  parser = OptionParser(usage='%prog [options] <dir containing incpy-cache/>')
+  parser.add_option('--budget', type='int', dest='budget')
+  parser.add_option('--func-budget', type='int', dest='func_budget')
+  (options, args) = parser.parse_args()
+
+  dirname = args[0]
+  assert os.path.isdir(dirname)
+  sys.path.insert(0, dirname) # so that we can unpickle user-defined objects
+
+  budget, func_budget, storage = read_config()
+  if options.budget is not None:
+    budget = options.budget
+  if options.func_budget is not None:
+    func_budget = options.func_budget
+  budget *= 1024 * 1024
+  func_budget *= 1024 * 1024
+
+  if storage == 'memory':
+    print 'Nothing to sweep (memory storage never outlives its process)'
+    sys.exit(0)
+
+  incpy_cache_dir = os.path.join(dirname, 'incpy-cache')
+  if not os.path.isdir(incpy_cache_dir):
+    incpy_cache_dir = dirname # (a cache_dir from incpy.config)
+  index_path = os.path.join(incpy_cache_dir, 'cache_index.pickle')
+
+  if storage == 'sqlite':
+    store = SqliteStore(incpy_cache_dir)
+  else:
+    store = DirectoryStore(incpy_cache_dir)
+
+  lock = CacheLock(incpy_cache_dir)
+  lock.lock(CACHE_INDEX_LOCK_OFFSET)
+
+  old_index = {}
+  if os.path.isfile(index_path):
+    old_index = load_entries(index_path) or {}
+
+  subdir_to_name = {}
+  for name in old_index:
+    subdir_to_name[md5(name).hexdigest() + '.cache'] = name
+
+  # list of (entry, canonical_name, key, rec) tuples for ALL entries
+  files = []
+  now = int(time.time())
+
+  for entry in store.list_entries():
+    (subdir, version, f) = entry.split('/')
+    name = subdir_to_name.get(subdir)
+    key = version + '/' + f[:-len('.pickle')]
+    nbytes = store.size(entry)
+    if nbytes is None:
+      continue
+
+    rec = None
+    if name in old_index and key in old_index[name]:
+      rec = list(old_index[name][key])
+      rec[REC_NBYTES] = nbytes
+    else:
+      # index this entry from scratch
+      runtime_ms = 0
+      entries = store.load(entry)
+      if entries:
+        runtime_ms = max(e['runtime_ms'] for e in entries)
+        name = name or entries[0]['canonical_name']
+      rec = [nbytes, runtime_ms, 0, now]
+
+    files.append((entry, name, key, rec))
+
+  total_evicted = []
+
+  if func_budget > 0:
+    files_by_func = {}
+    for e in files:
+      files_by_func.setdefault(e[1], []).append(e)
+    for func_files in files_by_func.values():
+      if sum(e[3][REC_NBYTES] for e in func_files) > func_budget:
+        total_evicted.extend(evict_down_to(func_files, func_budget * EVICTION_LOW_WATER_PERCENT / 100,
+                                           store, incpy_cache_dir, lock))
+
+  if budget > 0:
+    evicted_entries = set(e[0] for e in total_evicted)
+    remaining = [e for e in files if e[0] not in evicted_entries]
+    if sum(e[3][REC_NBYTES] for e in remaining) > budget:
+      total_evicted.extend(evict_down_to(remaining, budget * EVICTION_LOW_WATER_PERCENT / 100,
+                                         store, incpy_cache_dir, lock))
+
+  # write out the new index (only entries whose canonical name we know,
+  # and not the ones that vanished while we were sweeping)
+  evicted_entries = set(e[0] for e in total_evicted)
+  new_index = {}
+  for (entry, name, key, rec) in files:
+    if entry not in evicted_entries and name and store.size(entry) is not None:
+      new_index.setdefault(name, {})[key] = rec
+
+  tmp_index_path = '%s.partial.%d' % (index_path, os.getpid())
+  f = open(tmp_index_path, 'wb')
+  cPickle.dump(new_index, f, -1)
+  f.close()
+  os.rename(tmp_index_path, index_path)
+
+  lock.unlock(CACHE_INDEX_LOCK_OFFSET)
+
+  print 'Evicted %d of %d cache entries (%d bytes)' % \
+        (len(total_evicted), len(files), sum(e[3][REC_NBYTES] for e in total_evicted))
@@ -0,0 +1,355 @@
+# conformance and throughput test suite for the storage backends that
+# hold cache entries (see Python/memoize_storage.c)
+#
+# usage: python test_storage_backends.py [--python=<IncPy executable>]
+#                                        [--backend=<name>] [--calls=<n>]
+#
+# Every backend must pass every conformance test (except for the ones
+# that need entries to persist across executions, which the memory
+# backend skips), and a backend that IncPy can't even open (e.g., sqlite
+# when Modules/_sqlite wasn't built) fails outright.  Each test runs small scripts under IncPy in a fresh
+# temporary directory with its own $HOME/incpy.config, and checks both
+# the scripts' output and what incpy.log says that IncPy did.
+#
+# Afterwards, the throughput test times --calls calls that each store a
+# new entry, and then the same calls when they all hit, for each backend.
+#
+# (All of the test functions are annotated with incpy.memoize so that
+#  they don't need to run for longer than time_limit.)
+#
+# (This script itself doesn't need to run under IncPy.)
+
+import os, sys, shutil, tempfile
+from optparse import OptionParser
+from subprocess import Popen, PIPE
+
+ALL_BACKENDS = ['directory', 'sqlite', 'memory']
+
+# backends whose entries don't outlive an execution
+NON_PERSISTENT_BACKENDS = ['memory']
+
+
+class TestFailure(Exception):
+  pass
+
+
+class Sandbox:
+  '''a temporary working directory plus $HOME for running IncPy'''
+
+  def __init__(self, python, backend, extra_config=''):
+    self.python = python
+    self.dir = tempfile.mkdtemp(prefix='incpy-storage-test-')
+    self.home = os.path.join(self.dir, 'home')
+    os.mkdir(self.home)
+
+    # ignore the standard library, just like users are told to (IncPy
+    # refuses to start without an incpy.config)
+    config_path = os.path.join(self.home, 'incpy.config')
+    open(config_path, 'w').close()
+    lib_dir = Popen([python, '-c', 'import os; print os.path.dirname(os.__file__)'],
+                    cwd=self.dir, stdout=PIPE, env=self.env()).communicate()[0].strip()
+    f = open(config_path, 'w')
+    print >> f, 'ignore = %s' % lib_dir
+    print >> f, 'storage = %s' % backend
+    f.write(extra_config)
+    f.close()
+
+  def env(self):
+    env = dict(os.environ)
+    if hasattr(self, 'home'):
+      env['HOME'] = self.home
+    env['PYTHONDONTWRITEBYTECODE'] = '1'
+    return env
+
+  def write_script(self, name, source):
+    f = open(os.path.join(self.dir, name), 'w')
+    f.write(source)
+    f.close()
+
+  def start(self, script, *args):
+    return Popen([self.python, script] + list(args), cwd=self.dir,
+                 stdout=PIPE, stderr=PIPE, env=self.env())
+
+  def run(self, script, *args):
+    '''runs script and returns (its stdout, the lines of incpy.log)'''
+    p = self.start(script, *args)
+    (out, err) = p.communicate()
+    if p.returncode != 0:
+      raise TestFailure('%s exited with %d:\n%s' % (script, p.returncode, err))
+    return (out, self.log_lines())
+
+  def log_lines(self):
+    return open(os.path.join(self.dir, 'incpy.log')).read().splitlines()
+
+  def cleanup(self):
+    shutil.rmtree(self.dir)
+
+
+def count_events(log_lines, event, funcname):
+  return len([l for l in log_lines if l.startswith('%s %s ' % (event, funcname))])
+
+def storage_stats(log_lines):
+  for l in log_lines:
+    if l.startswith('STORAGE_STATS '):
+      return eval(l[len('STORAGE_STATS '):])
+  raise TestFailure('no STORAGE_STATS in incpy.log')
+
+def check(condition, what, out, log_lines):
+  if not condition:
+    raise TestFailure('%s\n--- stdout:\n%s--- incpy.log:\n%s' % (what, out, '\n'.join(log_lines)))
+
+def check_events(log_lines, out, funcname, num_memoized, num_skipped):
+  m = count_events(log_lines, 'MEMOIZED', funcname)
+  s = count_events(log_lines, 'SKIPPED', funcname)
+  check((m, s) == (num_memoized, num_skipped),
+        'expected %d MEMOIZED and %d SKIPPED for %s, but got %d and %d' %
+        (num_memoized, num_skipped, funcname, m, s), out, log_lines)
+
+
+SLOW_FUNC = '''
+import sys, time
+def slow(x):
+  """incpy.memoize"""
+  time.sleep(0.05)
+  return [x, {'double': x * 2}, 'payload' * %(payload_reps)d]
+'''
+
+ROUNDTRIP_SCRIPT = SLOW_FUNC % dict(payload_reps=10) + '''
+for x in sys.argv[1:]:
+  print slow(int(x))[:2]
+'''
+
+
+def test_roundtrip(sb, persistent):
+  '''values come back exactly as they were stored'''
+  sb.write_script('roundtrip.py', ROUNDTRIP_SCRIPT)
+  (out, log) = sb.run('roundtrip.py', '1', '2', '1', '2')
+  check(out == "[1, {'double': 2}]\n[2, {'double': 4}]\n" * 2, 'wrong output', out, log)
+  check_events(log, out, 'slow', 2, 2)
+
+  stats = storage_stats(log)
+  check(stats['puts'] == 2 and stats['hits'] == 2 and stats['failed_puts'] == 0,
+        'wrong STORAGE_STATS', out, log)
+
+def test_persistence(sb, persistent):
+  '''entries stored by one execution are seen by the next one'''
+  sb.write_script('roundtrip.py', ROUNDTRIP_SCRIPT)
+  sb.run('roundtrip.py', '1', '2')
+  (out, log) = sb.run('roundtrip.py', '1', '2', '3')
+  check(out == "[1, {'double': 2}]\n[2, {'double': 4}]\n[3, {'double': 6}]\n",
+        'wrong output', out, log)
+  if persistent:
+    check_events(log, out, 'slow', 1, 2)
+  else:
+    check_events(log, out, 'slow', 3, 0)
+
+    # nothing about entries that are gone may be left on disk, or else
+    # the next execution would count their bytes against cache_budget
+    cache_dir = os.path.join(sb.dir, 'incpy-cache')
+    leftovers = [n for n in os.listdir(cache_dir)
+                 if n.endswith('.cache') or n in ('cache_index.pickle', 'memo_index.shm')]
+    check(not leftovers, 'left %s behind on disk' % ', '.join(leftovers), out, log)
+
+def test_code_versions(sb, persistent):
+  '''edits start a new cache version, and reverting them re-uses the old one'''
+  sb.write_script('roundtrip.py', ROUNDTRIP_SCRIPT)
+  sb.run('roundtrip.py', '5')
+
+  sb.write_script('roundtrip.py', ROUNDTRIP_SCRIPT.replace('x * 2', 'x * 3'))
+  (out, log) = sb.run('roundtrip.py', '5', '5')
+  check(out == "[5, {'double': 15}]\n" * 2, 'stale entry after code edit', out, log)
+  check_events(log, out, 'slow', 1, 1)
+
+  sb.write_script('roundtrip.py', ROUNDTRIP_SCRIPT)
+  (out, log) = sb.run('roundtrip.py', '5')
+  check(out == "[5, {'double': 10}]\n", 'wrong output after reverting', out, log)
+  if persistent:
+    check_events(log, out, 'slow', 0, 1)
+
+GLOBAL_SCRIPT = '''
+import sys, time
+G = int(sys.argv[1])
+def uses_global(x):
+  """incpy.memoize"""
+  time.sleep(0.05)
+  return x + G
+print uses_global(1), uses_global(1)
+'''
+
+def test_global_dependencies(sb, persistent):
+  '''entries whose global dependencies changed are never used'''
+  sb.write_script('globals.py', GLOBAL_SCRIPT)
+  (out, log) = sb.run('globals.py', '10')
+  check(out == '11 11\n', 'wrong output', out, log)
+  check_events(log, out, 'uses_global', 1, 1)
+
+  (out, log) = sb.run('globals.py', '20')
+  check(out == '21 21\n', 'stale entry after global changed', out, log)
+  check_events(log, out, 'uses_global', 1, 1)
+
+BIG_SCRIPT = '''
+import time
+def big(n):
+  """incpy.memoize"""
+  time.sleep(0.05)
+  return 'x' * n
+for i in range(2):
+  print len(big(%d))
+'''
+
+def test_big_entry(sb, persistent):
+  '''entries bigger than a typical I/O buffer survive intact'''
+  nbytes = 3 * 1024 * 1024
+  sb.write_script('big.py', BIG_SCRIPT % nbytes)
+  (out, log) = sb.run('big.py')
+  check(out == '%d\n' % nbytes * 2, 'wrong output', out, log)
+  check_events(log, out, 'big', 1, 1)
+
+def test_eviction(sb, persistent):
+  '''evicting entries to stay within budget deletes them from storage'''
+  sb.write_script('many.py', SLOW_FUNC % dict(payload_reps=40 * 1024) + '''
+for x in range(8):
+  slow(x)
+''')
+  (out, log) = sb.run('many.py')
+  check_events(log, out, 'slow', 8, 0)
+  stats = storage_stats(log)
+  check(stats['dels'] > 0, 'nothing was evicted', out, log)
+
+  # the survivors must still be readable afterwards
+  sb.write_script('many.py', SLOW_FUNC % dict(payload_reps=40 * 1024) + '''
+for x in range(8):
+  print len(slow(x)[2])
+''')
+  (out, log) = sb.run('many.py')
+  check(out == '%d\n' % (7 * 40 * 1024) * 8, 'wrong output', out, log)
+  if persistent:
+    check(count_events(log, 'SKIPPED', 'slow') > 0, 'no entries survived', out, log)
+
+def test_concurrent_processes(sb, persistent):
+  '''several processes storing entries at once don't lose any of them'''
+  sb.write_script('roundtrip.py', ROUNDTRIP_SCRIPT)
+  procs = [sb.start('roundtrip.py', str(i), str(i + 1)) for i in range(0, 8, 2)]
+  for p in procs:
+    (out, err) = p.communicate()
+    if p.returncode != 0:
+      raise TestFailure('concurrent process exited with %d:\n%s' % (p.returncode, err))
+
+  (out, log) = sb.run('roundtrip.py', *[str(i) for i in range(8)])
+  check(out == ''.join("[%d, {'double': %d}]\n" % (i, i * 2) for i in range(8)),
+        'wrong output', out, log)
+  if persistent:
+    check_events(log, out, 'slow', 0, 8)
+
+CONFORMANCE_TESTS = [
+  (test_roundtrip, ''),
+  (test_persistence, ''),
+  (test_code_versions, ''),
+  (test_global_dependencies, ''),
+  (test_big_entry, ''),
+  (test_eviction, 'func_cache_budget = 1\n'),
+  (test_concurrent_processes, ''),
+]
+
+
+# how long each call in the throughput test takes on its own (IncPy
+# throws away entries that take longer to store than that)
+WORK_SECS = 0.02
+
+THROUGHPUT_SCRIPT = '''
+import sys, time
+def work(x):
+  """incpy.memoize"""
+  time.sleep(%s)
+  return [x, 'payload' * 100]
+start = time.time()
+for x in range(int(sys.argv[1])):
+  work(x)
+print time.time() - start
+''' % WORK_SECS
+
+def measure_throughput(python, backend, num_calls):
+  '''returns (entries stored per second, not counting the time that the
+  calls themselves took, and calls per second when they all hit)'''
+  sb = Sandbox(python, backend)
+  try:
+    sb.write_script('throughput.py', THROUGHPUT_SCRIPT)
+    if backend in NON_PERSISTENT_BACKENDS:
+      # call everything twice in the same execution instead
+      sb.write_script('throughput.py', THROUGHPUT_SCRIPT.replace(
+        'print time.time() - start', '''print time.time() - start
+start = time.time()
+for x in range(int(sys.argv[1])):
+  work(x)
+print time.time() - start'''))
+      (out, log) = sb.run('throughput.py', str(num_calls))
+      (store_secs, hit_secs) = [float(l) for l in out.split()]
+    else:
+      (out, log) = sb.run('throughput.py', str(num_calls))
+      store_secs = float(out)
+      (out, log) = sb.run('throughput.py', str(num_calls))
+      hit_secs = float(out)
+
+    num_hits = storage_stats(log)['hits']
+    if num_hits != num_calls:
+      raise TestFailure('expected %d hits, but got %d' % (num_calls, num_hits))
+    store_secs = max(store_secs - (num_calls * WORK_SECS), 0.001)
+    return (num_calls / store_secs, num_calls / hit_secs)
+  finally:
+    sb.cleanup()
+
+
+def backend_available(python, backend):
+  sb = Sandbox(python, backend)
+  try:
+    sb.write_script('nothing.py', '')
+    (out, log) = sb.run('nothing.py')
+    return storage_stats(log)['backend'] == backend
+  finally:
+    sb.cleanup()
+
+
+if __name__ == "__main__":
+  parser = OptionParser()
+  parser.add_option('--python', dest='python', default=sys.executable)
+  parser.add_option('--backend', dest='backends', action='append')
+  parser.add_option('--calls', type='int', dest='num_calls', default=300)
+  (options, args) = parser.parse_args()
+
+  num_failures = 0
+  throughput = []
+  for backend in options.backends or ALL_BACKENDS:
+    if not backend_available(options.python, backend):
+      print '%s: FAIL\nIncPy fell back on the directory backend (was it built with %s?)' % \
+            (backend, backend)
+      num_failures += 1
+      continue
+
+    persistent = backend not in NON_PERSISTENT_BACKENDS
+    for (test, extra_config) in CONFORMANCE_TESTS:
+      sb = Sandbox(options.python, backend, extra_config)
+      try:
+        try:
+          test(sb, persistent)
+          print '%s: %s ... ok' % (backend, test.__name__)
+        except TestFailure, e:
+          print '%s: %s ... FAIL\n%s' % (backend, test.__name__, e)
+          num_failures += 1
+      finally:
+        sb.cleanup()
+
+    try:
+      (store_rate, hit_rate) = measure_throughput(options.python, backend, options.num_calls)
+      throughput.append((backend, store_rate, hit_rate))
+    except TestFailure, e:
+      print '%s: throughput ... FAIL\n%s' % (backend, e)
+      num_failures += 1
+
+  print
+  print '%-10s %14s %14s' % ('backend', 'stores/sec', 'hits/sec')
+  for (backend, store_rate, hit_rate) in throughput:
+    print '%-10s %14.1f %14.1f' % (backend, store_rate, hit_rate)
+
+  if num_failures:
+    print '\n%d FAILED' % num_failures
+    sys.exit(1)
@@ -1,12 +1,13 @@
 # visualize pickles produced by IncPy
 
 # pass in a directory (argv[1]) that contains an incpy-cache/ sub-directory
+# (or a cache directory set with cache_dir in incpy.config)
 # and pass in name of main module to import as argv[2]
 
 import os, sys, re
-import cPickle
 import pprint
 import hashlib
+from incpy_entries import load_entry_file
 
 def render_memo_table_entry_lst(memo_table_lst):
   for e in memo_table_lst:
@@ -83,16 +84,22 @@ def main(argv=None):
 
 
   incpy_cache_dir = os.path.join(dirname, 'incpy-cache')
+  if not os.path.isdir(incpy_cache_dir):
+    incpy_cache_dir = dirname # (a cache_dir from incpy.config)
   function_cache_dirs = [e for e in os.listdir(incpy_cache_dir) if e.endswith('.cache')]
 
   for d in function_cache_dirs:
     basename = d.split('.')[0]
     cache_dir_path = os.path.join(incpy_cache_dir, d)
     assert os.path.isdir(cache_dir_path)
-    for memo_table_entry_pickle in os.listdir(cache_dir_path):
-      p = os.path.join(cache_dir_path, memo_table_entry_pickle)
-      memo_table_entry_lst = cPickle.load(open(p))
-      render_memo_table_entry_lst(memo_table_entry_lst)
+    for version in os.listdir(cache_dir_path):
+      version_dir_path = os.path.join(cache_dir_path, version)
+      for memo_table_entry_pickle in os.listdir(version_dir_path):
+        if memo_table_entry_pickle == 'code_dependencies.pickle':
+          continue
+        p = os.path.join(version_dir_path, memo_table_entry_pickle)
+        memo_table_entry_lst = load_entry_file(p)
+        render_memo_table_entry_lst(memo_table_entry_lst)
 
   return 0
 